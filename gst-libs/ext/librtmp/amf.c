@@ -1309,3 +1309,468 @@ AMF3CD_GetProp(AMF3ClassDef *cd, int nIndex)
     return (AVal *)&AV_empty;
   return &cd->cd_props[nIndex];
 }
+
+/* AMFCursor */
+
+static void
+AMFCursor_Fail(AMFCursor *c)
+{
+  c->c_ptr = c->c_end;
+  c->c_count = 0;
+  c->c_error = TRUE;
+}
+
+/* An unsigned U29; only AMF3_INTEGER values are signed, everything else
+ * (lengths, counts, reference flags) must not go negative.
+ */
+static int
+AMFCursor_Int29(AMFCursor *c, uint32_t *valp)
+{
+  const unsigned char *p = (const unsigned char *)c->c_ptr;
+  uint32_t val = 0;
+  int i;
+
+  for (i = 0; i < 3; i++)
+    {
+      if ((const char *)p + i >= c->c_end)
+	return FALSE;
+      if (!(p[i] & 0x80))
+	break;
+      val = (val << 7) | (p[i] & 0x7f);
+    }
+  if (i == 3)
+    {
+      if ((const char *)p + 3 >= c->c_end)
+	return FALSE;
+      val = (val << 8) | p[3];
+      i = 4;
+    }
+  else
+    {
+      val = (val << 7) | p[i];
+      i++;
+    }
+  c->c_ptr += i;
+  *valp = val;
+  return TRUE;
+}
+
+static int
+AMFCursor_String3(AMFCursor *c, AVal *str)
+{
+  uint32_t ref;
+
+  if (!AMFCursor_Int29(c, &ref))
+    return FALSE;
+  str->av_val = NULL;
+  str->av_len = 0;
+  if ((ref & 0x1) == 0)
+    {
+      /* string table references are not supported, as in AMF3ReadString */
+      RTMP_Log(RTMP_LOGDEBUG, "%s, string reference %u, ignoring",
+	  __FUNCTION__, ref >> 1);
+      return TRUE;
+    }
+  ref >>= 1;
+  if (ref > (uint32_t)(c->c_end - c->c_ptr))
+    return FALSE;
+  str->av_val = (char *)c->c_ptr;
+  str->av_len = ref;
+  c->c_ptr += ref;
+  return TRUE;
+}
+
+/* Scan the body of a just-read container so that the parent cursor can
+ * continue after it.
+ */
+static int
+AMFCursor_Skip(AMFCursor *c, const AMFCursor *body)
+{
+  AMFCursor it = *body;
+  AMFValue v;
+
+  while (AMFCursor_Next(&it, &v))
+    ;
+  if (it.c_error)
+    return FALSE;
+  c->c_ptr = it.c_ptr;
+  return TRUE;
+}
+
+static int
+AMFCursor_Body(AMFCursor *c, AMFValue *v, int bNamed, int bAMF3, int nCount)
+{
+  AMFCursor *b = &v->v_body;
+
+  if (c->c_depth >= AMF_CURSOR_MAXDEPTH)
+    {
+      RTMP_Log(RTMP_LOGDEBUG, "%s, objects nested too deep", __FUNCTION__);
+      return FALSE;
+    }
+  memset(b, 0, sizeof(*b));
+  b->c_ptr = c->c_ptr;
+  b->c_end = c->c_end;
+  b->c_count = nCount;
+  b->c_named = bNamed;
+  b->c_amf3 = bAMF3;
+  b->c_depth = c->c_depth + 1;
+  return TRUE;
+}
+
+static int
+AMFCursor_Value3(AMFCursor *c, AMFValue *v)
+{
+  uint32_t ref;
+  int type;
+
+  if (c->c_ptr >= c->c_end)
+    return FALSE;
+  type = (unsigned char)*c->c_ptr++;
+  switch (type)
+    {
+    case AMF3_UNDEFINED:
+    case AMF3_NULL:
+      v->v_type = AMF_NULL;
+      break;
+    case AMF3_FALSE:
+    case AMF3_TRUE:
+      v->v_type = AMF_BOOLEAN;
+      v->v_number = type == AMF3_TRUE;
+      break;
+    case AMF3_INTEGER:
+      if (!AMFCursor_Int29(c, &ref))
+	return FALSE;
+      v->v_type = AMF_NUMBER;
+      v->v_number = ref > AMF3_INTEGER_MAX ? (int32_t)ref - (1 << 29) :
+	(int32_t)ref;
+      break;
+    case AMF3_DOUBLE:
+      if (c->c_end - c->c_ptr < 8)
+	return FALSE;
+      v->v_type = AMF_NUMBER;
+      v->v_number = AMF_DecodeNumber(c->c_ptr);
+      c->c_ptr += 8;
+      break;
+    case AMF3_STRING:
+    case AMF3_XML_DOC:
+    case AMF3_XML:
+      v->v_type = AMF_STRING;
+      if (!AMFCursor_String3(c, &v->v_aval))
+	return FALSE;
+      break;
+    case AMF3_DATE:
+      if (!AMFCursor_Int29(c, &ref))
+	return FALSE;
+      v->v_type = AMF_NULL;
+      if (ref & 0x1)
+	{
+	  if (c->c_end - c->c_ptr < 8)
+	    return FALSE;
+	  v->v_type = AMF_DATE;
+	  v->v_number = AMF_DecodeNumber(c->c_ptr);
+	  c->c_ptr += 8;
+	}
+      break;
+    case AMF3_OBJECT:
+      {
+	AVal name;
+	uint32_t i, n;
+
+	if (!AMFCursor_Int29(c, &ref))
+	  return FALSE;
+	v->v_type = AMF_OBJECT;
+	if (!AMFCursor_Body(c, v, TRUE, TRUE, -1))
+	  return FALSE;
+	if ((ref & 0x1) == 0)
+	  {
+	    /* object reference: nothing follows, leave the body empty */
+	    v->v_body.c_count = 0;
+	    break;
+	  }
+	ref >>= 1;
+	if ((ref & 0x1) == 0 || (ref & 0x2))
+	  {
+	    RTMP_Log(RTMP_LOGDEBUG,
+		"%s, AMF3 traits reference or externalizable object not supported",
+		__FUNCTION__);
+	    return FALSE;
+	  }
+	ref >>= 2;
+	n = ref >> 1;
+	if (!AMFCursor_String3(c, &name))	/* class name */
+	  return FALSE;
+	/* every sealed name takes at least a byte */
+	if (n > (uint32_t)(c->c_end - c->c_ptr))
+	  return FALSE;
+	v->v_body.c_names = c->c_ptr;
+	for (i = 0; i < n; i++)
+	  if (!AMFCursor_String3(c, &name))
+	    return FALSE;
+	v->v_body.c_ptr = c->c_ptr;
+	v->v_body.c_sealed = n;
+	v->v_body.c_dynamic = ref & 0x1;
+	return AMFCursor_Skip(c, &v->v_body);
+      }
+    default:
+      RTMP_Log(RTMP_LOGDEBUG, "%s, AMF3 unsupported datatype 0x%02x",
+	  __FUNCTION__, type);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static int
+AMFCursor_Value(AMFCursor *c, AMFValue *v)
+{
+  unsigned int n;
+
+  if (c->c_ptr >= c->c_end)
+    return FALSE;
+  v->v_type = (unsigned char)*c->c_ptr++;
+  switch (v->v_type)
+    {
+    case AMF_NUMBER:
+      if (c->c_end - c->c_ptr < 8)
+	return FALSE;
+      v->v_number = AMF_DecodeNumber(c->c_ptr);
+      c->c_ptr += 8;
+      break;
+    case AMF_BOOLEAN:
+      if (c->c_end - c->c_ptr < 1)
+	return FALSE;
+      v->v_number = AMF_DecodeBoolean(c->c_ptr);
+      c->c_ptr++;
+      break;
+    case AMF_STRING:
+      if (c->c_end - c->c_ptr < 2)
+	return FALSE;
+      n = AMF_DecodeInt16(c->c_ptr);
+      if (n > c->c_end - c->c_ptr - 2)
+	return FALSE;
+      AMF_DecodeString(c->c_ptr, &v->v_aval);
+      c->c_ptr += 2 + n;
+      break;
+    case AMF_LONG_STRING:
+    case AMF_XML_DOC:
+      if (c->c_end - c->c_ptr < 4)
+	return FALSE;
+      n = AMF_DecodeInt32(c->c_ptr);
+      if (n > (unsigned int)(c->c_end - c->c_ptr - 4))
+	return FALSE;
+      AMF_DecodeLongString(c->c_ptr, &v->v_aval);
+      c->c_ptr += 4 + n;
+      v->v_type = AMF_STRING;
+      break;
+    case AMF_NULL:
+    case AMF_UNDEFINED:
+    case AMF_UNSUPPORTED:
+      v->v_type = AMF_NULL;
+      break;
+    case AMF_DATE:
+      if (c->c_end - c->c_ptr < 10)
+	return FALSE;
+      v->v_number = AMF_DecodeNumber(c->c_ptr);
+      c->c_ptr += 10;
+      break;
+    case AMF_ECMA_ARRAY:
+      /* the count is only a hint, the members end with AMF_OBJECT_END */
+      if (c->c_end - c->c_ptr < 4)
+	return FALSE;
+      c->c_ptr += 4;
+      /* fall through */
+    case AMF_OBJECT:
+      if (!AMFCursor_Body(c, v, TRUE, FALSE, -1))
+	return FALSE;
+      return AMFCursor_Skip(c, &v->v_body);
+    case AMF_STRICT_ARRAY:
+      if (c->c_end - c->c_ptr < 4)
+	return FALSE;
+      n = AMF_DecodeInt32(c->c_ptr);
+      c->c_ptr += 4;
+      /* every value takes at least one byte */
+      if (n > (unsigned int)(c->c_end - c->c_ptr))
+	return FALSE;
+      if (!AMFCursor_Body(c, v, FALSE, FALSE, n))
+	return FALSE;
+      return AMFCursor_Skip(c, &v->v_body);
+    case AMF_AVMPLUS:
+      {
+	AMFCursor c3 = *c;
+	c3.c_amf3 = TRUE;
+	if (!AMFCursor_Value3(&c3, v))
+	  return FALSE;
+	c->c_ptr = c3.c_ptr;
+	break;
+      }
+    default:
+      RTMP_Log(RTMP_LOGDEBUG, "%s, unsupported datatype 0x%02x",
+	  __FUNCTION__, v->v_type);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+void
+AMFCursor_Init(AMFCursor *c, const char *pBuffer, int nSize)
+{
+  memset(c, 0, sizeof(*c));
+  c->c_ptr = pBuffer;
+  c->c_end = pBuffer + (nSize > 0 ? nSize : 0);
+  c->c_count = -1;
+}
+
+/* Read the next value and advance past it. Returns FALSE at the end of
+ * the object, array or buffer; c_error tells a malformed buffer apart.
+ */
+int
+AMFCursor_Next(AMFCursor *c, AMFValue *v)
+{
+  int ok;
+
+  v->v_name = AV_empty;
+  v->v_aval = AV_empty;
+  v->v_number = 0;
+  if (c->c_count == 0 || c->c_ptr >= c->c_end)
+    return FALSE;
+
+  if (c->c_amf3)
+    {
+      AMFCursor names;
+
+      if (c->c_sealed > 0)
+	{
+	  names = *c;
+	  names.c_ptr = c->c_names;
+	  if (!AMFCursor_String3(&names, &v->v_name))
+	    goto fail;
+	  c->c_names = names.c_ptr;
+	  c->c_sealed--;
+	}
+      else if (!c->c_dynamic)
+	{
+	  c->c_count = 0;
+	  return FALSE;
+	}
+      else
+	{
+	  if (!AMFCursor_String3(c, &v->v_name))
+	    goto fail;
+	  if (!v->v_name.av_len)
+	    {
+	      c->c_count = 0;
+	      return FALSE;
+	    }
+	}
+      ok = AMFCursor_Value3(c, v);
+    }
+  else
+    {
+      if (c->c_named)
+	{
+	  unsigned int n;
+
+	  if (c->c_end - c->c_ptr >= 3
+	      && AMF_DecodeInt24(c->c_ptr) == AMF_OBJECT_END)
+	    {
+	      c->c_ptr += 3;
+	      c->c_count = 0;
+	      return FALSE;
+	    }
+	  if (c->c_end - c->c_ptr < 2)
+	    goto fail;
+	  n = AMF_DecodeInt16(c->c_ptr);
+	  if (n > c->c_end - c->c_ptr - 2)
+	    goto fail;
+	  AMF_DecodeString(c->c_ptr, &v->v_name);
+	  c->c_ptr += 2 + n;
+	}
+      ok = AMFCursor_Value(c, v);
+    }
+  if (!ok)
+    goto fail;
+  if (c->c_count > 0)
+    c->c_count--;
+  return TRUE;
+
+fail:
+  AMFCursor_Fail(c);
+  return FALSE;
+}
+
+/* The nIndex'th value after the cursor, which itself does not move */
+int
+AMFCursor_Get(const AMFCursor *c, int nIndex, AMFValue *v)
+{
+  AMFCursor it = *c;
+
+  while (AMFCursor_Next(&it, v))
+    if (nIndex-- == 0)
+      return TRUE;
+  v->v_type = AMF_INVALID;
+  return FALSE;
+}
+
+/* Fill vals[i] with the first member named names[i], in a single pass
+ * over the members. Missing members get type AMF_INVALID and empty
+ * strings. Returns how many were found.
+ */
+int
+AMFCursor_Lookup(const AMFCursor *c, const AVal *names, AMFValue *vals,
+		 int nNames)
+{
+  AMFCursor it = *c;
+  AMFValue v;
+  int i, found = 0;
+
+  for (i = 0; i < nNames; i++)
+    {
+      memset(&vals[i], 0, sizeof(vals[i]));
+      vals[i].v_type = AMF_INVALID;
+    }
+  while (found < nNames && AMFCursor_Next(&it, &v))
+    {
+      for (i = 0; i < nNames; i++)
+	{
+	  if (vals[i].v_type == AMF_INVALID && AVMATCH(&v.v_name, &names[i]))
+	    {
+	      vals[i] = v;
+	      found++;
+	      break;
+	    }
+	}
+    }
+  return found;
+}
+
+int
+AMFCursor_Find(const AMFCursor *c, const AVal *name, AMFValue *v)
+{
+  return AMFCursor_Lookup(c, name, v, 1);
+}
+
+/* Depth-first search through nested objects and ECMA arrays, like
+ * RTMP_FindFirstMatchingProperty. With bPrefix, match any longer name
+ * that starts with name, like RTMP_FindPrefixProperty.
+ */
+int
+AMFCursor_Search(const AMFCursor *c, const AVal *name, int bPrefix,
+		 AMFValue *v)
+{
+  AMFCursor it = *c;
+
+  while (AMFCursor_Next(&it, v))
+    {
+      if (bPrefix ? (v->v_name.av_len > name->av_len &&
+		     !memcmp(v->v_name.av_val, name->av_val, name->av_len))
+	  : AVMATCH(&v->v_name, name))
+	return TRUE;
+      if (v->v_type == AMF_OBJECT || v->v_type == AMF_ECMA_ARRAY)
+	{
+	  AMFCursor body = v->v_body;
+	  if (AMFCursor_Search(&body, name, bPrefix, v))
+	    return TRUE;
+	}
+    }
+  v->v_type = AMF_INVALID;
+  return FALSE;
+}
@@ -157,6 +157,46 @@ extern "C"
   void AMF3CD_AddProp(AMF3ClassDef * cd, AVal * prop);
   AVal *AMF3CD_GetProp(AMF3ClassDef * cd, int idx);
 
+  /* In-place reader. An AMFCursor walks encoded values directly in the
+   * buffer without building an AMFObject: names, strings and nested
+   * object bodies are returned as pointers into the buffer, so the
+   * buffer must outlive every AMFValue read from it. Nothing is
+   * allocated; nested objects are skipped by scanning.
+   */
+#define AMF_CURSOR_MAXDEPTH	32
+
+  typedef struct AMFCursor
+  {
+    const char *c_ptr;
+    const char *c_end;
+    const char *c_names;	/* AMF3 sealed member names, in the traits */
+    int c_count;		/* values left, -1 if ended by a marker or the buffer */
+    int c_sealed;		/* AMF3 sealed members left */
+    char c_named;		/* members carry names */
+    char c_amf3;
+    char c_dynamic;		/* AMF3 dynamic members follow the sealed ones */
+    char c_depth;
+    char c_error;
+  } AMFCursor;
+
+  typedef struct AMFValue
+  {
+    AVal v_name;
+    AMFDataType v_type;	/* AMF3 types are mapped to their AMF0 equivalent */
+    double v_number;	/* AMF_NUMBER, AMF_BOOLEAN, AMF_DATE */
+    AVal v_aval;		/* AMF_STRING */
+    AMFCursor v_body;	/* members of AMF_OBJECT, AMF_ECMA_ARRAY, AMF_STRICT_ARRAY */
+  } AMFValue;
+
+  void AMFCursor_Init(AMFCursor * c, const char *pBuffer, int nSize);
+  int AMFCursor_Next(AMFCursor * c, AMFValue * v);
+  int AMFCursor_Get(const AMFCursor * c, int nIndex, AMFValue * v);
+  int AMFCursor_Lookup(const AMFCursor * c, const AVal * names,
+		       AMFValue * vals, int nNames);
+  int AMFCursor_Find(const AMFCursor * c, const AVal * name, AMFValue * v);
+  int AMFCursor_Search(const AMFCursor * c, const AVal * name, int bPrefix,
+		       AMFValue * v);
+
 #ifdef __cplusplus
 }
 #endif
@@ -692,6 +692,80 @@ static void rtmpe9_sig(uint8_t *in, uint8_t *out, int keyid)
   out[7] = (d[1] >> 24) & 0xff;
 }
 
+/* Key pairs made ahead of the handshakes by RTMP_PrepareKeys(), so a
+ * connect only pays for the shared secret */
+static MDH *dhPool[RTMP_KEYS_MAX];
+static int dhPoolCount;
+static RTMP_LOCK_T dhPoolLock = RTMP_LOCK_INIT;
+#ifdef USE_POLARSSL
+/* the havege state of RTMP_TLS_ctx is not thread safe */
+static RTMP_LOCK_T dhGenLock = RTMP_LOCK_INIT;
+#endif
+
+static MDH *
+DHNewKey(void)
+{
+  MDH *dh;
+
+#ifdef USE_POLARSSL
+  RTMP_Lock(&dhGenLock);
+#endif
+  dh = DHInit(1024);
+  if (dh && !DHGenerateKey(dh))
+    {
+      MDH_free(dh);
+      dh = NULL;
+    }
+#ifdef USE_POLARSSL
+  RTMP_Unlock(&dhGenLock);
+#endif
+  return dh;
+}
+
+/* a prepared key pair, or one made now if none is left */
+static MDH *
+DHTakeKey(void)
+{
+  MDH *dh = NULL;
+
+  RTMP_Lock(&dhPoolLock);
+  if (dhPoolCount)
+    dh = dhPool[--dhPoolCount];
+  RTMP_Unlock(&dhPoolLock);
+  return dh ? dh : DHNewKey();
+}
+
+static int
+DHPrepareKeys(int count)
+{
+  MDH *dh;
+  int n;
+
+  if (count > RTMP_KEYS_MAX)
+    count = RTMP_KEYS_MAX;
+  for (;;)
+    {
+      RTMP_Lock(&dhPoolLock);
+      n = dhPoolCount;
+      RTMP_Unlock(&dhPoolLock);
+      if (n >= count)
+	return n;
+
+      /* the lock is not held while generating, handshakes go on */
+      if (!(dh = DHNewKey()))
+	return n;
+      RTMP_Lock(&dhPoolLock);
+      if (dhPoolCount < RTMP_KEYS_MAX)
+	{
+	  dhPool[dhPoolCount++] = dh;
+	  dh = NULL;
+	}
+      RTMP_Unlock(&dhPoolLock);
+      if (dh)
+	MDH_free(dh);
+    }
+}
+
 static int
 HandShake(RTMP * r, int FP9HandShake)
 {
@@ -768,11 +842,11 @@ HandShake(RTMP * r, int FP9HandShake)
     {
       if (encrypted)
 	{
-	  /* generate Diffie-Hellmann parameters */
-	  r->Link.dh = DHInit(1024);
+	  /* Diffie-Hellmann key pair, prepared ahead if possible */
+	  r->Link.dh = DHTakeKey();
 	  if (!r->Link.dh)
 	    {
-	      RTMP_Log(RTMP_LOGERROR, "%s: Couldn't initialize Diffie-Hellmann!",
+	      RTMP_Log(RTMP_LOGERROR, "%s: Couldn't generate Diffie-Hellmann key pair!",
 		  __FUNCTION__);
 	      return FALSE;
 	    }
@@ -780,13 +854,6 @@ HandShake(RTMP * r, int FP9HandShake)
 	  dhposClient = getdh(clientsig, RTMP_SIG_SIZE);
 	  RTMP_Log(RTMP_LOGDEBUG, "%s: DH pubkey position: %d", __FUNCTION__, dhposClient);
 
-	  if (!DHGenerateKey(r->Link.dh))
-	    {
-	      RTMP_Log(RTMP_LOGERROR, "%s: Couldn't generate Diffie-Hellmann public key!",
-		  __FUNCTION__);
-	      return FALSE;
-	    }
-
 	  if (!DHGetPublicKey(r->Link.dh, &clientsig[dhposClient], 128))
 	    {
 	      RTMP_Log(RTMP_LOGERROR, "%s: Couldn't write public key!", __FUNCTION__);
@@ -1053,6 +1120,8 @@ HandShake(RTMP * r, int FP9HandShake)
 	    {
 	      RC4_encrypt(r->Link.rc4keyOut, RTMP_SIG_SIZE, (uint8_t *) buff);
 	    }
+	  /* anything read past the handshake is already encrypted */
+	  DecryptBuffered(r, r->m_sb.sb_size);
 	}
     }
   else
@@ -1156,11 +1225,11 @@ SHandShake(RTMP * r)
     {
       if (encrypted)
 	{
-	  /* generate Diffie-Hellmann parameters */
-	  r->Link.dh = DHInit(1024);
+	  /* Diffie-Hellmann key pair, prepared ahead if possible */
+	  r->Link.dh = DHTakeKey();
 	  if (!r->Link.dh)
 	    {
-	      RTMP_Log(RTMP_LOGERROR, "%s: Couldn't initialize Diffie-Hellmann!",
+	      RTMP_Log(RTMP_LOGERROR, "%s: Couldn't generate Diffie-Hellmann key pair!",
 		  __FUNCTION__);
 	      return FALSE;
 	    }
@@ -1168,13 +1237,6 @@ SHandShake(RTMP * r)
 	  dhposServer = getdh(serversig, RTMP_SIG_SIZE);
 	  RTMP_Log(RTMP_LOGDEBUG, "%s: DH pubkey position: %d", __FUNCTION__, dhposServer);
 
-	  if (!DHGenerateKey(r->Link.dh))
-	    {
-	      RTMP_Log(RTMP_LOGERROR, "%s: Couldn't generate Diffie-Hellmann public key!",
-		  __FUNCTION__);
-	      return FALSE;
-	    }
-
 	  if (!DHGetPublicKey
 	      (r->Link.dh, (uint8_t *) &serversig[dhposServer], 128))
 	    {
@@ -1403,6 +1465,8 @@ SHandShake(RTMP * r)
 	    {
 	      RC4_encrypt(r->Link.rc4keyOut, RTMP_SIG_SIZE, (uint8_t *) buff);
 	    }
+	  /* anything read past the handshake is already encrypted */
+	  DecryptBuffered(r, r->m_sb.sb_size);
 	}
     }
   else
@@ -30,6 +30,10 @@
 #include "log.h"
 #include "http.h"
 
+#ifdef _WIN32
+#include <process.h>
+#endif
+
 #ifdef CRYPTO
 #ifdef USE_POLARSSL
 #include <polarssl/sha2.h>
@@ -136,6 +140,8 @@ HTTP_get(struct HTTP_ctx *http, const char *url, HTTP_read_callback *cb)
       sa.sin_addr = *(struct in_addr *)hp->h_addr;
     }
   sa.sin_port = htons(port);
+  sb.sb_buf = sb.sb_cache;
+  sb.sb_bufSize = sizeof(sb.sb_cache);
   sb.sb_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
   if (sb.sb_socket == -1)
     return HTTPRES_LOST_CONNECTION;
@@ -448,9 +454,12 @@ strtime(time_t * t, char *s)
 
 #define HEX2BIN(a)      (((a)&0x40)?((a)&0xf)+9:((a)&0xf))
 
-int
-RTMP_HashSWF(const char *url, unsigned int *size, unsigned char *hash,
-	     int age)
+/* one lookup through the cache file, fetching the SWF if the entry is
+ * missing or older than age days. checked is set to when it was last
+ * verified against the server */
+static int
+HashSWFFile(const char *url, unsigned int *size, unsigned char *hash,
+	    int age, time_t *checked)
 {
   FILE *f = NULL;
   char *path, date[64], cctim[64];
@@ -575,6 +584,7 @@ RTMP_HashSWF(const char *url, unsigned int *size, unsigned char *hash,
   /* If we got a cache time, see if it's young enough to use directly */
   if (age && ctim > 0)
     {
+      *checked = ctim;
       ctim = cnow - ctim;
       ctim /= 3600 * 24;	/* seconds to days */
       if (ctim < age)		/* ok, it's new enough */
@@ -634,6 +644,7 @@ RTMP_HashSWF(const char *url, unsigned int *size, unsigned char *hash,
 	}
       strtime(&cnow, cctim);
       fprintf(f, "ctim: %s\n", cctim);
+      *checked = cnow;
 
       if (!in.first)
 	{
@@ -655,6 +666,193 @@ out:
     fclose(f);
   return ret;
 }
+
+/* Hashes of the SWFs used so far, for the life of the process, so the
+ * RTMP instances of a player URL share one download. Only a URL seen for
+ * the first time is looked up while the caller waits; once an entry is
+ * older than swfAge it is still used, and refreshed in the background.
+ */
+typedef struct SWFEntry
+{
+  struct SWFEntry *next;
+  char *url;
+  int age;			/* of the refresh request, in days */
+  unsigned int size;
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  time_t checked;		/* last verified against the server */
+  time_t failed;		/* of the last lookup that failed */
+  int valid;
+  int refreshing;
+} SWFEntry;
+
+static SWFEntry *swfEntries;
+/* protects the entries */
+static RTMP_LOCK_T swfLock = RTMP_LOCK_INIT;
+/* held around HashSWFFile(), the cache file has a single writer */
+static RTMP_LOCK_T swfFileLock = RTMP_LOCK_INIT;
+
+static SWFEntry *
+SWFGetEntry(const char *url)
+{
+  SWFEntry *e;
+
+  for (e = swfEntries; e; e = e->next)
+    if (!strcmp(e->url, url))
+      return e;
+
+  e = calloc(1, sizeof(SWFEntry));
+  if (!e)
+    return NULL;
+  e->url = strdup(url);
+  if (!e->url)
+    {
+      free(e);
+      return NULL;
+    }
+  e->next = swfEntries;
+  swfEntries = e;
+  return e;
+}
+
+static void
+SWFRefresh(SWFEntry *e)
+{
+  unsigned int size;
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  time_t checked = 0;
+  int age, ret;
+
+  RTMP_Lock(&swfLock);
+  size = e->size;
+  memcpy(hash, e->hash, sizeof(hash));
+  age = e->age;
+  RTMP_Unlock(&swfLock);
+
+  RTMP_Lock(&swfFileLock);
+  ret = HashSWFFile(e->url, &size, hash, age, &checked);
+  RTMP_Unlock(&swfFileLock);
+
+  RTMP_Lock(&swfLock);
+  if (ret == 0)
+    {
+      e->size = size;
+      memcpy(e->hash, hash, sizeof(hash));
+      e->checked = checked;
+    }
+  else
+    {
+      /* keep what we have, try again at the next use */
+      RTMP_Log(RTMP_LOGWARNING, "%s: keeping the hash of %s", __FUNCTION__,
+	  e->url);
+    }
+  e->refreshing = FALSE;
+  RTMP_Unlock(&swfLock);
+}
+
+#ifdef _WIN32
+static unsigned __stdcall
+SWFRefreshThread(void *arg)
+#else
+static void *
+SWFRefreshThread(void *arg)
+#endif
+{
+  SWFRefresh(arg);
+  return 0;
+}
+
+static int
+SWFRefreshStart(SWFEntry *e)
+{
+#ifdef _WIN32
+  HANDLE th = (HANDLE)_beginthreadex(NULL, 0, SWFRefreshThread, e, 0, NULL);
+
+  if (!th)
+    return FALSE;
+  CloseHandle(th);
+#else
+  pthread_t th;
+
+  if (pthread_create(&th, NULL, SWFRefreshThread, e))
+    return FALSE;
+  pthread_detach(th);
+#endif
+  return TRUE;
+}
+
+int
+RTMP_HashSWF(const char *url, unsigned int *size, unsigned char *hash,
+	     int age)
+{
+  time_t start = time(NULL), checked = 0;
+  SWFEntry *e;
+  int ret = 0, refresh = FALSE;
+
+  RTMP_Lock(&swfLock);
+  e = SWFGetEntry(url);
+  if (e && e->valid)
+    goto hit;
+  RTMP_Unlock(&swfLock);
+
+  /* the first caller looks it up, the others wait for its answer */
+  RTMP_Lock(&swfFileLock);
+  RTMP_Lock(&swfLock);
+  if (e && (e->valid || e->failed >= start))
+    {
+      RTMP_Unlock(&swfFileLock);
+      if (!e->valid)
+	{
+	  RTMP_Unlock(&swfLock);
+	  return -1;
+	}
+      goto hit;
+    }
+  RTMP_Unlock(&swfLock);
+
+  ret = HashSWFFile(url, size, hash, age, &checked);
+  RTMP_Unlock(&swfFileLock);
+  if (!e)
+    return ret;
+
+  RTMP_Lock(&swfLock);
+  if (ret == 0)
+    {
+      e->size = *size;
+      memcpy(e->hash, hash, SHA256_DIGEST_LENGTH);
+      e->checked = checked;
+      e->valid = TRUE;
+    }
+  else
+    e->failed = time(NULL);
+  RTMP_Unlock(&swfLock);
+  return ret;
+
+hit:
+  *size = e->size;
+  memcpy(hash, e->hash, SHA256_DIGEST_LENGTH);
+  /* age 0 checks at every use, but not more than once a second */
+  if (!e->refreshing &&
+      start - e->checked >= (age > 0 ? (time_t)age * 3600 * 24 : 1))
+    {
+      e->refreshing = TRUE;
+      e->age = age;
+      refresh = TRUE;
+    }
+  RTMP_Unlock(&swfLock);
+
+  if (refresh)
+    {
+      RTMP_Log(RTMP_LOGDEBUG, "%s: refreshing the hash of %s", __FUNCTION__,
+	  url);
+      if (!SWFRefreshStart(e))
+	{
+	  RTMP_Lock(&swfLock);
+	  e->refreshing = FALSE;
+	  RTMP_Unlock(&swfLock);
+	}
+    }
+  return 0;
+}
 #else
 int
 RTMP_HashSWF(const char *url, unsigned int *size, unsigned char *hash,
@@ -89,7 +89,10 @@ RTMP_LogLevel RTMP_LogGetLevel()
 	return RTMP_debuglevel;
 }
 
-void RTMP_Log(int level, const char *format, ...)
+/* The names are in parentheses so the gating macros of log.h do not
+ * expand here */
+
+void (RTMP_Log)(int level, const char *format, ...)
 {
 	va_list args;
 
@@ -103,7 +106,7 @@ void RTMP_Log(int level, const char *format, ...)
 
 static const char hexdig[] = "0123456789abcdef";
 
-void RTMP_LogHex(int level, const uint8_t *data, unsigned long len)
+void (RTMP_LogHex)(int level, const uint8_t *data, unsigned long len)
 {
 	unsigned long i;
 	char line[50], *ptr;
@@ -130,7 +133,7 @@ void RTMP_LogHex(int level, const uint8_t *data, unsigned long len)
 	}
 }
 
-void RTMP_LogHexString(int level, const uint8_t *data, unsigned long len)
+void (RTMP_LogHexString)(int level, const uint8_t *data, unsigned long len)
 {
 #define BP_OFFSET 9
 #define BP_GRAPH 60
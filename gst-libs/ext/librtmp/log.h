@@ -62,6 +62,18 @@ void RTMP_LogHexString(int level, const uint8_t *data, unsigned long len);
 void RTMP_LogSetLevel(RTMP_LogLevel lvl);
 RTMP_LogLevel RTMP_LogGetLevel(void);
 
+/* Check the level before the call, so a disabled line costs a compare:
+ * the arguments are not evaluated and nothing is called. The functions
+ * above stay for callers that take their address. level is evaluated
+ * twice. */
+#define RTMP_LogEnabled(level)	((level) <= RTMP_debuglevel)
+#define RTMP_Log(level, ...) \
+  (RTMP_LogEnabled(level) ? RTMP_Log(level, __VA_ARGS__) : (void)0)
+#define RTMP_LogHex(level, data, len) \
+  (RTMP_LogEnabled(level) ? RTMP_LogHex(level, data, len) : (void)0)
+#define RTMP_LogHexString(level, data, len) \
+  (RTMP_LogEnabled(level) ? RTMP_LogHexString(level, data, len) : (void)0)
+
 #ifdef __cplusplus
 }
 #endif
@@ -108,7 +108,7 @@ typedef enum {
   RTMPT_OPEN=0, RTMPT_SEND, RTMPT_IDLE, RTMPT_CLOSE
 } RTMPTCmd;
 
-static int DumpMetaData(AMFObject *obj);
+static int DumpMetaData(const AMFCursor *c);
 static int HandShake(RTMP *r, int FP9HandShake);
 static int SocksNegotiate(RTMP *r);
 
@@ -116,6 +116,11 @@ static int SendConnectPacket(RTMP *r, RTMPPacket *cp);
 static int SendCheckBW(RTMP *r);
 static int SendCheckBWResult(RTMP *r, double txn);
 static int SendDeleteStream(RTMP *r, double dStreamId);
+static int SendReleaseStream(RTMP *r, const AVal *playpath);
+static int SendFCPublish(RTMP *r, const AVal *playpath);
+static int SendFCUnpublish(RTMP *r, const AVal *playpath);
+static int SendPublish(RTMP *r, const AVal *playpath, int streamId,
+		       int channel);
 static int SendFCSubscribe(RTMP *r, AVal *subscribepath);
 static int SendPlay(RTMP *r);
 static int SendBytesReceived(RTMP *r);
@@ -125,8 +130,10 @@ static int SendUsherToken(RTMP *r, AVal *usherToken);
 static int SendBGHasStream(RTMP *r, double dId, AVal *playpath);
 #endif
 
-static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize);
+static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize,
+			int streamId);
 static int HandleMetadata(RTMP *r, char *body, unsigned int len);
+static void KeyframesReset(RTMP *r);
 static void HandleChangeChunkSize(RTMP *r, const RTMPPacket *packet);
 static void HandleAudio(RTMP *r, const RTMPPacket *packet);
 static void HandleVideo(RTMP *r, const RTMPPacket *packet);
@@ -136,13 +143,23 @@ static void HandleClientBW(RTMP *r, const RTMPPacket *packet);
 
 static int ReadN(RTMP *r, char *buffer, int n);
 static int WriteN(RTMP *r, const char *buffer, int n);
+static int WriteV(RTMP *r, struct iovec *iov, int iovcnt);
+static int SendPacket(RTMP *r, RTMPPacket *packet, int queue,
+		      const struct iovec *body, int nbody);
 
 static void DecodeTEA(AVal *key, AVal *text);
 
 static int HTTP_Post(RTMP *r, RTMPTCmd cmd, const char *buf, int len);
+static int HTTP_PostV(RTMP *r, RTMPTCmd cmd, const struct iovec *body,
+    int nbody);
 static int HTTP_read(RTMP *r, int fill);
+static void HTTP_IdleWait(RTMP *r);
 
 static void CloseInternal(RTMP *r, int reconnect);
+static uint64_t PaceNow(void);
+#ifdef CRYPTO
+static void DecryptBuffered(RTMP *r, int n);
+#endif
 
 #ifndef _WIN32
 static int clk_tck;
@@ -185,13 +202,194 @@ RTMPPacket_Reset(RTMPPacket *p)
   p->m_nBytesRead = 0;
 }
 
+/* Every body allocation, pooled or not, is preceded by one of these so
+ * RTMPPacket_Free can tell where it has to go back to.
+ */
+typedef struct RTMPPoolBlock
+{
+  struct RTMPPool *pb_pool;	/* NULL for unpooled allocations */
+  struct RTMPPoolBlock *pb_next;	/* free list link */
+  int pb_class;			/* -1 if too large to recycle */
+  uint32_t pb_size;		/* usable bytes following the block */
+} RTMPPoolBlock;
+
+typedef struct RTMPPool
+{
+  RTMPPoolBlock *rp_free[RTMP_POOL_CLASSES];
+  int rp_live;			/* blocks handed out, not yet returned */
+  int rp_orphan;		/* owner closed; free once rp_live drops to 0 */
+  RTMPPoolStats rp_stats;
+} RTMPPool;
+
+static char *
+PoolGet(RTMP *r, uint32_t size)
+{
+  RTMPPool *pool = r->m_pool;
+  RTMPPoolBlock *b;
+  uint32_t cap = 1 << RTMP_POOL_MIN_SHIFT;
+  int cls = 0;
+
+  if (size > SIZE_MAX - sizeof(RTMPPoolBlock))
+    return NULL;
+  if (!pool)
+    {
+      pool = calloc(1, sizeof(RTMPPool));
+      if (!pool)
+	return NULL;
+      r->m_pool = pool;
+    }
+
+  pool->rp_stats.ps_allocs++;
+  if (size > pool->rp_stats.ps_largest)
+    pool->rp_stats.ps_largest = size;
+
+  while (cls < RTMP_POOL_CLASSES && cap < size)
+    {
+      cls++;
+      cap <<= 1;
+    }
+  if (cls == RTMP_POOL_CLASSES)
+    {
+      cls = -1;
+      cap = size;
+    }
+  else if (pool->rp_free[cls])
+    {
+      b = pool->rp_free[cls];
+      pool->rp_free[cls] = b->pb_next;
+      pool->rp_stats.ps_cached -= cap;
+      pool->rp_stats.ps_hits++;
+      goto out;
+    }
+
+  b = malloc(sizeof(RTMPPoolBlock) + cap);
+  if (!b)
+    return NULL;
+  b->pb_pool = pool;
+  b->pb_class = cls;
+  b->pb_size = cap;
+
+out:
+  b->pb_next = NULL;
+  pool->rp_live++;
+  pool->rp_stats.ps_inUse += cap;
+  if (pool->rp_stats.ps_inUse > pool->rp_stats.ps_inUseMax)
+    pool->rp_stats.ps_inUseMax = pool->rp_stats.ps_inUse;
+  return (char *)(b + 1);
+}
+
+static void
+PoolPut(char *ptr)
+{
+  RTMPPoolBlock *b;
+  RTMPPool *pool;
+
+  if (!ptr)
+    return;
+  b = (RTMPPoolBlock *)ptr - 1;
+  pool = b->pb_pool;
+  if (!pool)
+    {
+      free(b);
+      return;
+    }
+
+  pool->rp_live--;
+  pool->rp_stats.ps_inUse -= b->pb_size;
+  if (pool->rp_orphan || b->pb_class < 0 ||
+      pool->rp_stats.ps_cached + b->pb_size > RTMP_POOL_MAX_CACHED)
+    {
+      free(b);
+      if (pool->rp_orphan && !pool->rp_live)
+	free(pool);
+      return;
+    }
+
+  b->pb_next = pool->rp_free[b->pb_class];
+  pool->rp_free[b->pb_class] = b;
+  pool->rp_stats.ps_cached += b->pb_size;
+  if (pool->rp_stats.ps_cached > pool->rp_stats.ps_cachedMax)
+    pool->rp_stats.ps_cachedMax = pool->rp_stats.ps_cached;
+}
+
+/* Take a block out of its pool for good, so it can be freed from another
+ * thread; the pool itself isn't locked.
+ */
+static void *
+PoolDetach(char *ptr)
+{
+  RTMPPoolBlock *b = (RTMPPoolBlock *)ptr - 1;
+  RTMPPool *pool = b->pb_pool;
+
+  if (pool)
+    {
+      pool->rp_live--;
+      pool->rp_stats.ps_inUse -= b->pb_size;
+      b->pb_pool = NULL;
+      if (pool->rp_orphan && !pool->rp_live)
+	free(pool);
+    }
+  return b;
+}
+
+/* Drop the cached blocks. Bodies still held by the caller keep the pool
+ * alive until they are freed.
+ */
+static void
+PoolRelease(RTMP *r)
+{
+  RTMPPool *pool = r->m_pool;
+  RTMPPoolBlock *b;
+  int i;
+
+  if (!pool)
+    return;
+  r->m_pool = NULL;
+
+  RTMP_Log(RTMP_LOGDEBUG, "%s, %.0f allocs, %.0f recycled, peak %u bytes in use, "
+      "peak %u cached, largest %u", __FUNCTION__,
+      (double)pool->rp_stats.ps_allocs, (double)pool->rp_stats.ps_hits,
+      pool->rp_stats.ps_inUseMax, pool->rp_stats.ps_cachedMax,
+      pool->rp_stats.ps_largest);
+
+  for (i = 0; i < RTMP_POOL_CLASSES; i++)
+    {
+      while ((b = pool->rp_free[i]))
+	{
+	  pool->rp_free[i] = b->pb_next;
+	  free(b);
+	}
+    }
+  if (pool->rp_live)
+    pool->rp_orphan = TRUE;
+  else
+    free(pool);
+}
+
 int
 RTMPPacket_Alloc(RTMPPacket *p, uint32_t nSize)
+{
+  RTMPPoolBlock *b;
+  if (nSize > SIZE_MAX - RTMP_MAX_HEADER_SIZE - sizeof(RTMPPoolBlock))
+    return FALSE;
+  b = calloc(1, sizeof(RTMPPoolBlock) + nSize + RTMP_MAX_HEADER_SIZE);
+  if (!b)
+    return FALSE;
+  b->pb_class = -1;
+  b->pb_size = nSize + RTMP_MAX_HEADER_SIZE;
+  p->m_body = (char *)(b + 1) + RTMP_MAX_HEADER_SIZE;
+  p->m_nBytesRead = 0;
+  return TRUE;
+}
+
+int
+RTMP_AllocPacket(RTMP *r, RTMPPacket *p, uint32_t nSize)
 {
   char *ptr;
-  if (nSize > SIZE_MAX - RTMP_MAX_HEADER_SIZE)
+  /* the 4 spare bytes at the end take RTMP_ReadTag's FLV tag size */
+  if (nSize > UINT32_MAX - RTMP_MAX_HEADER_SIZE - 4)
     return FALSE;
-  ptr = calloc(1, nSize + RTMP_MAX_HEADER_SIZE);
+  ptr = PoolGet(r, nSize + RTMP_MAX_HEADER_SIZE + 4);
   if (!ptr)
     return FALSE;
   p->m_body = ptr + RTMP_MAX_HEADER_SIZE;
@@ -204,11 +402,178 @@ RTMPPacket_Free(RTMPPacket *p)
 {
   if (p->m_body)
     {
-      free(p->m_body - RTMP_MAX_HEADER_SIZE);
+      PoolPut(p->m_body - RTMP_MAX_HEADER_SIZE);
       p->m_body = NULL;
     }
 }
 
+/* Slot for chunk stream ch. The high channels are found in a table that
+ * is grown on first use, NULL only if that fails. */
+static RTMPChannelIn *
+ChannelIn(RTMP *r, int ch)
+{
+  if (ch < RTMP_FAST_CHANNELS)
+    return &r->m_channelsIn[ch];
+  ch -= RTMP_FAST_CHANNELS;
+  if (ch >= r->m_channelsAllocatedIn)
+    {
+      int n = ch + 10;
+      RTMPChannelIn *slots = realloc(r->m_vecChannelsIn, sizeof(*slots) * n);
+      if (!slots)
+	return NULL;
+      memset(slots + r->m_channelsAllocatedIn, 0,
+	     sizeof(*slots) * (n - r->m_channelsAllocatedIn));
+      r->m_vecChannelsIn = slots;
+      r->m_channelsAllocatedIn = n;
+    }
+  return &r->m_vecChannelsIn[ch];
+}
+
+static RTMPChannelOut *
+ChannelOut(RTMP *r, int ch)
+{
+  RTMPChannelOut *co;
+
+  if (ch < RTMP_FAST_CHANNELS)
+    co = &r->m_channelsOut[ch];
+  else
+    {
+      int i = ch - RTMP_FAST_CHANNELS;
+      if (i >= r->m_channelsAllocatedOut)
+	{
+	  int n = i + 10;
+	  RTMPChannelOut *slots = realloc(r->m_vecChannelsOut, sizeof(*slots) * n);
+	  if (!slots)
+	    return NULL;
+	  memset(slots + r->m_channelsAllocatedOut, 0,
+		 sizeof(*slots) * (n - r->m_channelsAllocatedOut));
+	  r->m_vecChannelsOut = slots;
+	  r->m_channelsAllocatedOut = n;
+	}
+      co = &r->m_vecChannelsOut[i];
+    }
+
+  if (!co->co_basicSize)
+    {
+      /* encode the basic header once, as a type 3 header */
+      co->co_cont[0] = 0xc0;
+      if (ch > 319)
+	{
+	  co->co_cont[0] |= 1;
+	  co->co_cont[1] = (ch - 64) & 0xff;
+	  co->co_cont[2] = (ch - 64) >> 8;
+	  co->co_basicSize = 3;
+	}
+      else if (ch > 63)
+	{
+	  co->co_cont[1] = ch - 64;
+	  co->co_basicSize = 2;
+	}
+      else
+	{
+	  co->co_cont[0] |= ch;
+	  co->co_basicSize = 1;
+	}
+      co->co_contSize = co->co_basicSize;
+      co->co_contTime = 0;
+    }
+  return co;
+}
+
+/* absolute timestamp of the last message read on channel ch */
+static uint32_t
+ChannelStamp(RTMP *r, int ch)
+{
+  if (ch < RTMP_FAST_CHANNELS)
+    return r->m_channelsIn[ch].ci_timestamp;
+  ch -= RTMP_FAST_CHANNELS;
+  return ch < r->m_channelsAllocatedIn ? r->m_vecChannelsIn[ch].ci_timestamp : 0;
+}
+
+static void
+ChannelsReset(RTMP *r)
+{
+  int i;
+
+  for (i = 0; i < RTMP_FAST_CHANNELS; i++)
+    RTMPPacket_Free(&r->m_channelsIn[i].ci_packet);
+  for (i = 0; i < r->m_channelsAllocatedIn; i++)
+    RTMPPacket_Free(&r->m_vecChannelsIn[i].ci_packet);
+  memset(r->m_channelsIn, 0, sizeof(r->m_channelsIn));
+  memset(r->m_channelsOut, 0, sizeof(r->m_channelsOut));
+  free(r->m_vecChannelsIn);
+  r->m_vecChannelsIn = NULL;
+  r->m_channelsAllocatedIn = 0;
+  free(r->m_vecChannelsOut);
+  r->m_vecChannelsOut = NULL;
+  r->m_channelsAllocatedOut = 0;
+}
+
+void
+RTMP_GetPoolStats(RTMP *r, RTMPPoolStats *stats)
+{
+  if (r->m_pool)
+    *stats = r->m_pool->rp_stats;
+  else
+    memset(stats, 0, sizeof(*stats));
+}
+
+/* The connection the calling thread is working on, for log callbacks.
+ * The public calls that do I/O set it and put the previous one back on
+ * return, so it is NULL outside librtmp and never outlives the call. */
+static RTMP_THREAD_LOCAL RTMP *log_ctx;
+
+static RTMP *
+LogEnter(RTMP *r)
+{
+  RTMP *prev = log_ctx;
+
+  log_ctx = r;
+  return prev;
+}
+
+#define LogLeave(prev)	(log_ctx = (prev))
+
+RTMP *
+RTMP_LogContext(void)
+{
+  return log_ctx;
+}
+
+void
+RTMP_GetStats(RTMP *r, RTMPStats *stats)
+{
+  *stats = r->m_stats;
+  stats->rs_unsent = -1;
+#if defined(__linux__) && defined(SIOCOUTQ)
+  if (r->m_sb.sb_socket != -1)
+    {
+      int unsent;
+
+      if (ioctl(r->m_sb.sb_socket, SIOCOUTQ, &unsent) == 0)
+	stats->rs_unsent = unsent;
+    }
+#endif
+}
+
+int
+RTMP_SendPing(RTMP *r)
+{
+  uint32_t stamp = RTMP_GetTime();
+
+  r->m_pingStamp = stamp;
+  r->m_pingSent = PaceNow();
+  if (!RTMP_SendCtrl(r, 0x06, stamp, 0))
+    {
+      r->m_pingSent = 0;
+      return FALSE;
+    }
+  /* the round trip should not include the coalescing delay */
+  if (r->m_coalesce.co_len)
+    return RTMP_Flush(r);
+  return TRUE;
+}
+
 void
 RTMPPacket_Dump(RTMPPacket *p)
 {
@@ -250,6 +615,9 @@ RTMP_TLS_Init()
   OpenSSL_add_all_digests();
   RTMP_TLS_ctx = SSL_CTX_new(SSLv23_method());
   SSL_CTX_set_options(RTMP_TLS_ctx, SSL_OP_ALL);
+#ifdef SSL_OP_ENABLE_KTLS
+  SSL_CTX_set_options(RTMP_TLS_ctx, SSL_OP_ENABLE_KTLS);
+#endif
   SSL_CTX_set_default_verify_paths(RTMP_TLS_ctx);
 #endif
 #endif
@@ -322,6 +690,12 @@ RTMP_Alloc()
 void
 RTMP_Free(RTMP *r)
 {
+  PoolRelease(r);
+  KeyframesReset(r);
+  free(r->m_coalesce.co_buf);
+  free(r->m_encBuf);
+  if (r->m_sb.sb_buf != r->m_sb.sb_cache)
+    free(r->m_sb.sb_buf);
   free(r);
 }
 
@@ -335,6 +709,8 @@ RTMP_Init(RTMP *r)
 
   memset(r, 0, sizeof(RTMP));
   r->m_sb.sb_socket = -1;
+  r->m_sb.sb_buf = r->m_sb.sb_cache;
+  r->m_sb.sb_bufSize = sizeof(r->m_sb.sb_cache);
   r->m_inChunkSize = RTMP_DEFAULT_CHUNKSIZE;
   r->m_outChunkSize = RTMP_DEFAULT_CHUNKSIZE;
   r->m_nBufferMS = 30000;
@@ -359,6 +735,23 @@ RTMP_GetDuration(RTMP *r)
   return r->m_fDuration;
 }
 
+const RTMPKeyframes *
+RTMP_GetKeyframes(RTMP *r)
+{
+  return &r->m_keyframes;
+}
+
+static void
+KeyframesReset(RTMP *r)
+{
+  free(r->m_keyframes.kf_times);
+  free(r->m_keyframes.kf_positions);
+  r->m_keyframes.kf_times = NULL;
+  r->m_keyframes.kf_positions = NULL;
+  r->m_keyframes.kf_count = 0;
+  r->m_keyframes.kf_serial++;
+}
+
 int
 RTMP_IsConnected(RTMP *r)
 {
@@ -754,7 +1147,8 @@ int RTMP_SetOpt(RTMP *r, const AVal *opt, AVal *arg)
   return TRUE;
 }
 
-int RTMP_SetupURL(RTMP *r, char *url)
+static int
+SetupURL(RTMP *r, char *url)
 {
   AVal opt, arg;
   char *p1, *p2, *ptr = strchr(url, ' ');
@@ -866,120 +1260,467 @@ int RTMP_SetupURL(RTMP *r, char *url)
   return TRUE;
 }
 
+int
+RTMP_SetupURL(RTMP *r, char *url)
+{
+  RTMP *ctx = LogEnter(r);
+  int ret = SetupURL(r, url);
+
+  LogLeave(ctx);
+  return ret;
+}
+
+/* Resolved addresses are shared by all RTMP instances, so a reconnect
+ * doesn't wait for DNS again. getaddrinfo() doesn't tell the record TTL,
+ * entries live for a fixed dnsTTL seconds instead. If a refresh fails,
+ * the expired addresses are used for up to as long again.
+ */
+typedef struct RTMPAddr
+{
+  struct sockaddr_storage ra_addr;
+  socklen_t ra_len;
+} RTMPAddr;
+
+typedef struct RTMPDNSEntry
+{
+  char de_host[256];
+  RTMPAddr de_addrs[RTMP_MAX_ADDRS];
+  int de_count;
+  uint64_t de_time;		/* PaceNow() of the lookup */
+} RTMPDNSEntry;
+
+static RTMPDNSEntry dnsCache[RTMP_DNS_SLOTS];
+static int dnsTTL = RTMP_DNS_TTL;
+static RTMP_LOCK_T dnsLock = RTMP_LOCK_INIT;
+
+void
+RTMP_SetDNSCacheTTL(int seconds)
+{
+  RTMP_Lock(&dnsLock);
+  dnsTTL = seconds > 0 ? seconds : 0;
+  if (!dnsTTL)
+    memset(dnsCache, 0, sizeof(dnsCache));
+  RTMP_Unlock(&dnsLock);
+}
+
+/* Copy the cached addresses of hostname if they are younger than maxAge */
 static int
-add_addr_info(struct sockaddr_in *service, AVal *host, int port)
+DNSLookup(const char *hostname, RTMPAddr *addrs, uint64_t maxAge)
 {
-  char *hostname;
-  int ret = TRUE;
-  if (host->av_val[host->av_len])
-    {
-      hostname = malloc(host->av_len+1);
-      memcpy(hostname, host->av_val, host->av_len);
-      hostname[host->av_len] = '\0';
-    }
-  else
+  uint64_t now = PaceNow();
+  int i, n = 0;
+
+  RTMP_Lock(&dnsLock);
+  for (i = 0; i < RTMP_DNS_SLOTS; i++)
     {
-      hostname = host->av_val;
+      RTMPDNSEntry *de = &dnsCache[i];
+      if (de->de_count && !strcmp(de->de_host, hostname))
+	{
+	  if (now - de->de_time < maxAge)
+	    {
+	      n = de->de_count;
+	      memcpy(addrs, de->de_addrs, n * sizeof(RTMPAddr));
+	    }
+	  break;
+	}
     }
+  RTMP_Unlock(&dnsLock);
+  return n;
+}
+
+static void
+DNSStore(const char *hostname, const RTMPAddr *addrs, int n)
+{
+  RTMPDNSEntry *de = &dnsCache[0];
+  int i;
 
-  service->sin_addr.s_addr = inet_addr(hostname);
-  if (service->sin_addr.s_addr == INADDR_NONE)
+  if (strlen(hostname) >= sizeof(de->de_host))
+    return;
+  RTMP_Lock(&dnsLock);
+  if (dnsTTL)
     {
-      struct hostent *host = gethostbyname(hostname);
-      if (host == NULL || host->h_addr == NULL)
+      /* replace the same host or else the oldest entry */
+      for (i = 0; i < RTMP_DNS_SLOTS; i++)
 	{
-	  RTMP_Log(RTMP_LOGERROR, "Problem accessing the DNS. (addr: %s)", hostname);
-	  ret = FALSE;
-	  goto finish;
+	  if (dnsCache[i].de_count && !strcmp(dnsCache[i].de_host, hostname))
+	    {
+	      de = &dnsCache[i];
+	      break;
+	    }
+	  if (dnsCache[i].de_time < de->de_time)
+	    de = &dnsCache[i];
 	}
-      service->sin_addr = *(struct in_addr *)host->h_addr;
+      strcpy(de->de_host, hostname);
+      memcpy(de->de_addrs, addrs, n * sizeof(RTMPAddr));
+      de->de_count = n;
+      de->de_time = PaceNow();
     }
-
-  service->sin_port = htons(port);
-finish:
-  if (hostname != host->av_val)
-    free(hostname);
-  return ret;
+  RTMP_Unlock(&dnsLock);
 }
 
-int
-RTMP_Connect0(RTMP *r, struct sockaddr * service)
+/* Resolve host into up to RTMP_MAX_ADDRS addresses, alternating between
+ * address families in getaddrinfo()'s order of preference (RFC 8305).
+ */
+static int
+Resolve(AVal *host, int port, RTMPAddr *addrs)
 {
-  int on = 1;
-  r->m_sb.sb_timedout = FALSE;
-  r->m_pausing = 0;
-  r->m_fDuration = 0.0;
+  struct addrinfo hints, *res = NULL, *ai;
+  struct addrinfo *fam[2][RTMP_MAX_ADDRS];
+  int nfam[2] = { 0, 0 }, first = -1;
+  char *hostname;
+  uint64_t ttl;
+  int i, n = 0, err;
 
-  r->m_sb.sb_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (r->m_sb.sb_socket != -1)
+  hostname = malloc(host->av_len + 1);
+  if (!hostname)
+    return 0;
+  memcpy(hostname, host->av_val, host->av_len);
+  hostname[host->av_len] = '\0';
+
+  RTMP_Lock(&dnsLock);
+  ttl = (uint64_t)dnsTTL * 1000000;
+  RTMP_Unlock(&dnsLock);
+
+  if (ttl && (n = DNSLookup(hostname, addrs, ttl)))
+    goto done;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+#ifdef AI_ADDRCONFIG
+  hints.ai_flags = AI_ADDRCONFIG;
+#endif
+  err = getaddrinfo(hostname, NULL, &hints, &res);
+  if (err)
     {
-	  /* set timeout */
-      {
-        SET_RCVTIMEO(tv, r->Link.timeout);
-        if (setsockopt(r->m_sb.sb_socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(tv))) {
-          RTMP_Log(RTMP_LOGERROR, "%s, Setting socket receive timeout to %ds failed!",
-          __FUNCTION__, r->Link.timeout);
-        }
-        if (setsockopt(r->m_sb.sb_socket, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv))) {
-          RTMP_Log(RTMP_LOGERROR, "%s, Setting socket send timeout to %ds failed!",
-          __FUNCTION__, r->Link.timeout);
-        }
-      }
-      setsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
-      if (connect(r->m_sb.sb_socket, service, sizeof(struct sockaddr)) < 0)
+      if (ttl && (n = DNSLookup(hostname, addrs, ttl * 2)))
 	{
-	  int err = GetSockError();
-	  RTMP_Log(RTMP_LOGERROR, "%s, failed to connect socket. %d (%s)",
-	      __FUNCTION__, err, strerror(err));
-	  RTMP_Close(r);
-	  return FALSE;
+	  RTMP_Log(RTMP_LOGWARNING, "%s, lookup of %s failed (%s), using "
+	      "expired addresses", __FUNCTION__, hostname, gai_strerror(err));
+	  goto done;
 	}
+      RTMP_Log(RTMP_LOGERROR, "Problem accessing the DNS. (addr: %s: %s)",
+	  hostname, gai_strerror(err));
+      goto done;
+    }
 
-      if (r->Link.socksport)
+  for (ai = res; ai; ai = ai->ai_next)
+    {
+      int f = ai->ai_family == AF_INET6;
+      if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6) ||
+	  ai->ai_addrlen > sizeof(struct sockaddr_storage) ||
+	  nfam[f] == RTMP_MAX_ADDRS)
+	continue;
+      if (first < 0)
+	first = f;
+      fam[f][nfam[f]++] = ai;
+    }
+  for (i = 0; n < RTMP_MAX_ADDRS && (i < nfam[0] || i < nfam[1]); i++)
+    {
+      int k;
+      for (k = 0; k < 2 && n < RTMP_MAX_ADDRS; k++)
 	{
-	  RTMP_Log(RTMP_LOGDEBUG, "%s ... SOCKS negotiation", __FUNCTION__);
-	  if (!SocksNegotiate(r))
-	    {
-	      RTMP_Log(RTMP_LOGERROR, "%s, SOCKS negotiation failed.", __FUNCTION__);
-	      RTMP_Close(r);
-	      return FALSE;
-	    }
+	  int f = k ? !first : first;
+	  if (i >= nfam[f])
+	    continue;
+	  memset(&addrs[n], 0, sizeof(RTMPAddr));
+	  memcpy(&addrs[n].ra_addr, fam[f][i]->ai_addr, fam[f][i]->ai_addrlen);
+	  addrs[n].ra_len = fam[f][i]->ai_addrlen;
+	  n++;
 	}
     }
+  freeaddrinfo(res);
+  if (n)
+    DNSStore(hostname, addrs, n);
   else
+    RTMP_Log(RTMP_LOGERROR, "%s, no usable address for %s", __FUNCTION__,
+	hostname);
+
+done:
+  for (i = 0; i < n; i++)
     {
-      RTMP_Log(RTMP_LOGERROR, "%s, failed to create socket. Error: %d", __FUNCTION__,
-	  GetSockError());
-      return FALSE;
+      if (addrs[i].ra_addr.ss_family == AF_INET6)
+	((struct sockaddr_in6 *)&addrs[i].ra_addr)->sin6_port = htons(port);
+      else
+	((struct sockaddr_in *)&addrs[i].ra_addr)->sin_port = htons(port);
     }
-
-  return TRUE;
+  free(hostname);
+  return n;
 }
 
-int
-RTMP_TLS_Accept(RTMP *r, void *ctx)
+/* Options every connection socket gets before connect() */
+static void
+SocketOptions(RTMP *r, int sock)
 {
-#if defined(CRYPTO) && !defined(NO_SSL)
-  TLS_server(ctx, r->m_sb.sb_ssl);
-  TLS_setfd(r->m_sb.sb_ssl, r->m_sb.sb_socket);
-  if (TLS_accept(r->m_sb.sb_ssl) < 0)
-    {
-      RTMP_Log(RTMP_LOGERROR, "%s, TLS_Connect failed", __FUNCTION__);
-      return FALSE;
+  int on = 1;
+
+  {
+    SET_RCVTIMEO(tv, r->Link.timeout);
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(tv))) {
+      RTMP_Log(RTMP_LOGERROR, "%s, Setting socket receive timeout to %ds failed!",
+      __FUNCTION__, r->Link.timeout);
     }
-  return TRUE;
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv))) {
+      RTMP_Log(RTMP_LOGERROR, "%s, Setting socket send timeout to %ds failed!",
+      __FUNCTION__, r->Link.timeout);
+    }
+  }
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+  /* before connect() so the window scale can reflect it */
+  if (r->m_rcvBuf && setsockopt(sock, SOL_SOCKET, SO_RCVBUF,
+	  (char *)&r->m_rcvBuf, sizeof(r->m_rcvBuf)))
+    RTMP_Log(RTMP_LOGWARNING, "%s, Setting SO_RCVBUF to %d failed",
+	__FUNCTION__, r->m_rcvBuf);
+}
+
+static int
+SetNonBlocking(int sock, int on)
+{
+#ifdef _WIN32
+  u_long arg = on;
+  return ioctlsocket(sock, FIONBIO, &arg) == 0;
 #else
-  return FALSE;
+  int flags = fcntl(sock, F_GETFL, 0);
+  if (flags == -1)
+    return FALSE;
+  flags = on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+  return fcntl(sock, F_SETFL, flags) == 0;
 #endif
 }
 
-int
-RTMP_Connect1(RTMP *r, RTMPPacket *cp)
+static void
+LogAddr(int level, const char *what, const RTMPAddr *addr)
 {
-  if (r->Link.protocol & RTMP_FEATURE_SSL)
-    {
-#if defined(CRYPTO) && !defined(NO_SSL)
-      TLS_client(RTMP_TLS_ctx, r->m_sb.sb_ssl);
+  char host[64];
+
+  if (getnameinfo((const struct sockaddr *)&addr->ra_addr, addr->ra_len,
+	  host, sizeof(host), NULL, 0, NI_NUMERICHOST))
+    strcpy(host, "?");
+  RTMP_Log(level, "%s %s", what, host);
+}
+
+/* Start a non-blocking connect. Returns the socket, -1 on failure; *done
+ * is set when it connected right away.
+ */
+static int
+StartConnect(RTMP *r, const RTMPAddr *addr, int *done)
+{
+  int sock, err;
+
+  *done = FALSE;
+  sock = socket(addr->ra_addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+  if (sock == -1)
+    {
+      RTMP_Log(RTMP_LOGDEBUG, "%s, failed to create socket. Error: %d",
+	  __FUNCTION__, GetSockError());
+      return -1;
+    }
+  SocketOptions(r, sock);
+  if (!SetNonBlocking(sock, TRUE))
+    {
+      closesocket(sock);
+      return -1;
+    }
+  LogAddr(RTMP_LOGDEBUG, "Connecting to", addr);
+  if (connect(sock, (const struct sockaddr *)&addr->ra_addr, addr->ra_len) == 0)
+    {
+      *done = TRUE;
+      return sock;
+    }
+  err = GetSockError();
+#ifdef _WIN32
+  if (err == WSAEWOULDBLOCK)
+#else
+  if (err == EINPROGRESS)
+#endif
+    return sock;
+  RTMP_Log(RTMP_LOGDEBUG, "%s, connect failed. %d (%s)", __FUNCTION__, err,
+      strerror(err));
+  closesocket(sock);
+  return -1;
+}
+
+/* Happy Eyeballs: start a connect to the next address every
+ * RTMP_CONNECT_STAGGER ms, or as soon as the previous attempt failed,
+ * and keep the first one to complete.
+ */
+static int
+ConnectAny(RTMP *r, const RTMPAddr *addrs, int n)
+{
+  int socks[RTMP_MAX_ADDRS];
+  int started = 0, pending = 0, winner = -1, done, i, j;
+  uint64_t now, begin = PaceNow(), next = begin;
+  uint64_t limit = (uint64_t)r->Link.timeout * 1000000;
+
+  while (winner < 0)
+    {
+      struct pollfd pfds[RTMP_MAX_ADDRS];
+      int idx[RTMP_MAX_ADDRS];
+      uint64_t wait;
+      int nfds = 0;
+
+      now = PaceNow();
+      if (started < n && (!pending || now >= next))
+	{
+	  socks[started] = StartConnect(r, &addrs[started], &done);
+	  if (socks[started] != -1)
+	    {
+	      pending++;
+	      if (done)
+		winner = started;
+	    }
+	  started++;
+	  next = now + RTMP_CONNECT_STAGGER * 1000;
+	  continue;
+	}
+      if (!pending || now - begin >= limit)
+	break;
+
+      wait = begin + limit - now;
+      if (started < n && next - now < wait)
+	wait = next - now;
+      for (i = 0; i < started; i++)
+	{
+	  if (socks[i] == -1)
+	    continue;
+	  pfds[nfds].fd = socks[i];
+	  pfds[nfds].events = POLLOUT;
+	  pfds[nfds].revents = 0;
+	  idx[nfds++] = i;
+	}
+      /* round up, a wait of a few us must not turn into a busy loop */
+      if (poll(pfds, nfds, (int)((wait + 999) / 1000)) < 0)
+	{
+	  if (GetSockError() == EINTR && !RTMP_ctrlC)
+	    continue;
+	  break;
+	}
+      for (j = 0; j < nfds && winner < 0; j++)
+	{
+	  int err = 0;
+	  socklen_t len = sizeof(err);
+
+	  if (!(pfds[j].revents & (POLLOUT | POLLERR | POLLHUP)))
+	    continue;
+	  i = idx[j];
+	  if (getsockopt(socks[i], SOL_SOCKET, SO_ERROR, (char *)&err, &len))
+	    err = GetSockError();
+	  if (!err && !(pfds[j].revents & (POLLERR | POLLHUP)))
+	    {
+	      winner = i;
+	      break;
+	    }
+	  LogAddr(RTMP_LOGDEBUG, "Connect failed to", &addrs[i]);
+	  closesocket(socks[i]);
+	  socks[i] = -1;
+	  pending--;
+	  next = now;
+	}
+    }
+
+  for (i = 0; i < started; i++)
+    if (socks[i] != -1 && i != winner)
+      closesocket(socks[i]);
+  if (winner < 0)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, failed to connect socket to any of %d "
+	  "addresses", __FUNCTION__, n);
+      return FALSE;
+    }
+  LogAddr(RTMP_LOGDEBUG, "Connected to", &addrs[winner]);
+  SetNonBlocking(socks[winner], FALSE);
+  r->m_sb.sb_socket = socks[winner];
+  return TRUE;
+}
+
+/* What has to happen once the TCP connection is up */
+static int
+Connected(RTMP *r)
+{
+  if (r->Link.socksport)
+    {
+      RTMP_Log(RTMP_LOGDEBUG, "%s ... SOCKS negotiation", __FUNCTION__);
+      if (!SocksNegotiate(r))
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, SOCKS negotiation failed.", __FUNCTION__);
+	  RTMP_Close(r);
+	  return FALSE;
+	}
+    }
+  return TRUE;
+}
+
+int
+RTMP_Connect0(RTMP *r, struct sockaddr * service)
+{
+  socklen_t len = service->sa_family == AF_INET6 ?
+    sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+  r->m_sb.sb_timedout = FALSE;
+  r->m_pausing = 0;
+  r->m_fDuration = 0.0;
+  KeyframesReset(r);
+
+  r->m_sb.sb_socket = socket(service->sa_family, SOCK_STREAM, IPPROTO_TCP);
+  if (r->m_sb.sb_socket != -1)
+    {
+      SocketOptions(r, r->m_sb.sb_socket);
+      if (connect(r->m_sb.sb_socket, service, len) < 0)
+	{
+	  int err = GetSockError();
+	  RTMP_Log(RTMP_LOGERROR, "%s, failed to connect socket. %d (%s)",
+	      __FUNCTION__, err, strerror(err));
+	  RTMP_Close(r);
+	  return FALSE;
+	}
+      return Connected(r);
+    }
+  else
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, failed to create socket. Error: %d", __FUNCTION__,
+	  GetSockError());
+      return FALSE;
+    }
+}
+
+#if defined(CRYPTO) && !defined(NO_SSL)
+/* Once the kernel took over the record layer sends bypass the library,
+ * which lets them use sendmsg() and MSG_MORE like plain TCP */
+static void
+KernelTLS(RTMP *r)
+{
+  r->m_sb.sb_ktls = TLS_ktls_send(r->m_sb.sb_ssl) ? TRUE : FALSE;
+  RTMP_Log(RTMP_LOGDEBUG, "%s, kernel TLS %s", __FUNCTION__,
+      r->m_sb.sb_ktls ? "on" : "off");
+}
+#endif
+
+int
+RTMP_TLS_Accept(RTMP *r, void *ctx)
+{
+#if defined(CRYPTO) && !defined(NO_SSL)
+  TLS_server(ctx, r->m_sb.sb_ssl);
+  TLS_setfd(r->m_sb.sb_ssl, r->m_sb.sb_socket);
+  if (TLS_accept(r->m_sb.sb_ssl) < 0)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, TLS_Connect failed", __FUNCTION__);
+      return FALSE;
+    }
+  KernelTLS(r);
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+static int
+ClientHandShake(RTMP *r)
+{
+  if (r->Link.protocol & RTMP_FEATURE_SSL)
+    {
+#if defined(CRYPTO) && !defined(NO_SSL)
+      TLS_client(RTMP_TLS_ctx, r->m_sb.sb_ssl);
       TLS_setfd(r->m_sb.sb_ssl, r->m_sb.sb_socket);
       if (TLS_connect(r->m_sb.sb_ssl) < 0)
 	{
@@ -987,6 +1728,7 @@ RTMP_Connect1(RTMP *r, RTMPPacket *cp)
 	  RTMP_Close(r);
 	  return FALSE;
 	}
+      KernelTLS(r);
 #else
       RTMP_Log(RTMP_LOGERROR, "%s, no SSL/TLS support", __FUNCTION__);
       RTMP_Close(r);
@@ -1017,7 +1759,12 @@ RTMP_Connect1(RTMP *r, RTMPPacket *cp)
       return FALSE;
     }
   RTMP_Log(RTMP_LOGDEBUG, "%s, handshaked", __FUNCTION__);
+  return TRUE;
+}
 
+static int
+SendConnect(RTMP *r, RTMPPacket *cp)
+{
   if (!SendConnectPacket(r, cp))
     {
       RTMP_Log(RTMP_LOGERROR, "%s, RTMP connect failed.", __FUNCTION__);
@@ -1028,29 +1775,220 @@ RTMP_Connect1(RTMP *r, RTMPPacket *cp)
 }
 
 int
-RTMP_Connect(RTMP *r, RTMPPacket *cp)
+RTMP_Connect1(RTMP *r, RTMPPacket *cp)
 {
-  struct sockaddr_in service;
-  if (!r->Link.hostname.av_len)
+  return ClientHandShake(r) && SendConnect(r, cp);
+}
+
+/* Connections parked by RTMP_WarmUp() right after the handshake, the
+ * server is then waiting for our connect() call. Only plain RTMP is kept:
+ * RTMPE, TLS and RTMPT carry per-connection state beyond the socket and
+ * SWF verification needs the server digest of the handshake.
+ */
+typedef struct RTMPWarmConn
+{
+  char wc_key[300];
+  int wc_socket;
+  uint32_t wc_bytesIn;		/* handshake bytes, for the read reports */
+  uint64_t wc_time;		/* PaceNow() when parked */
+} RTMPWarmConn;
+
+static RTMPWarmConn warmConns[RTMP_WARM_MAX];
+static int warmCount;
+static RTMP_LOCK_T warmLock = RTMP_LOCK_INIT;
+
+static int
+WarmPoolable(RTMP *r)
+{
+  if (r->Link.protocol & (RTMP_FEATURE_HTTP | RTMP_FEATURE_ENC |
+	RTMP_FEATURE_SSL))
+    return FALSE;
+#ifdef CRYPTO
+  if (r->Link.SWFSize)
     return FALSE;
+#endif
+  return r->Link.hostname.av_len > 0;
+}
 
-  memset(&service, 0, sizeof(struct sockaddr_in));
-  service.sin_family = AF_INET;
+static void
+WarmKey(RTMP *r, char *key, size_t len)
+{
+  snprintf(key, len, "%.*s:%d/%.*s:%d", r->Link.hostname.av_len,
+      r->Link.hostname.av_val, r->Link.port, r->Link.sockshost.av_len,
+      r->Link.sockshost.av_val, r->Link.socksport);
+}
+
+/* A parked connection must be silent: the server sends nothing before
+ * connect(), so data, EOF or an error all mean it is gone */
+static int
+WarmAlive(int sock)
+{
+  struct pollfd pfd;
+
+  pfd.fd = sock;
+  pfd.events = POLLIN | POLLHUP;
+  pfd.revents = 0;
+  return poll(&pfd, 1, 0) == 0;
+}
+
+static void
+WarmDrop(int i)
+{
+  closesocket(warmConns[i].wc_socket);
+  warmConns[i] = warmConns[--warmCount];
+}
+
+static int
+WarmTake(RTMP *r)
+{
+  char key[sizeof(warmConns[0].wc_key)];
+  int i, sock = -1;
+  uint32_t bytesIn = 0;
+
+  WarmKey(r, key, sizeof(key));
+  RTMP_Lock(&warmLock);
+  /* newest first, those are the least likely to have timed out */
+  for (i = warmCount - 1; i >= 0 && sock == -1; i--)
+    {
+      if (strcmp(warmConns[i].wc_key, key))
+	continue;
+      if (WarmAlive(warmConns[i].wc_socket))
+	{
+	  sock = warmConns[i].wc_socket;
+	  bytesIn = warmConns[i].wc_bytesIn;
+	  warmConns[i] = warmConns[--warmCount];
+	}
+      else
+	WarmDrop(i);
+    }
+  RTMP_Unlock(&warmLock);
+  if (sock == -1)
+    return FALSE;
+
+  RTMP_Log(RTMP_LOGDEBUG, "%s, using warm connection to %s", __FUNCTION__,
+      key);
+  SocketOptions(r, sock);
+  r->m_sb.sb_socket = sock;
+  r->m_nBytesIn = bytesIn;
+  return TRUE;
+}
+
+static int
+WarmUp(RTMP *r)
+{
+  RTMPAddr addrs[RTMP_MAX_ADDRS];
+  RTMPWarmConn wc;
+  int n, parked = FALSE;
+
+  if (!WarmPoolable(r))
+    return FALSE;
 
   if (r->Link.socksport)
+    n = Resolve(&r->Link.sockshost, r->Link.socksport, addrs);
+  else
+    n = Resolve(&r->Link.hostname, r->Link.port, addrs);
+  if (!n)
+    return FALSE;
+
+  r->m_sb.sb_timedout = FALSE;
+  if (!ConnectAny(r, addrs, n) || !Connected(r))
+    return FALSE;
+  r->m_bSendCounter = TRUE;
+  if (!ClientHandShake(r))
+    return FALSE;
+
+  WarmKey(r, wc.wc_key, sizeof(wc.wc_key));
+  wc.wc_socket = r->m_sb.sb_socket;
+  wc.wc_bytesIn = r->m_nBytesIn;
+  wc.wc_time = PaceNow();
+
+  RTMP_Lock(&warmLock);
+  if (warmCount < RTMP_WARM_MAX)
     {
-      /* Connect via SOCKS */
-      if (!add_addr_info(&service, &r->Link.sockshost, r->Link.socksport))
-	return FALSE;
+      warmConns[warmCount++] = wc;
+      r->m_sb.sb_socket = -1;
+      parked = TRUE;
     }
-  else
+  RTMP_Unlock(&warmLock);
+
+  /* with the socket handed over this only resets r */
+  RTMP_Close(r);
+  return parked;
+}
+
+int
+RTMP_WarmUp(RTMP *r)
+{
+  RTMP *ctx = LogEnter(r);
+  int ret = WarmUp(r);
+
+  LogLeave(ctx);
+  return ret;
+}
+
+int
+RTMP_WarmCheck(RTMP *r, int maxIdle)
+{
+  char key[sizeof(warmConns[0].wc_key)];
+  uint64_t now = PaceNow();
+  int i, n = 0;
+
+  WarmKey(r, key, sizeof(key));
+  RTMP_Lock(&warmLock);
+  for (i = warmCount - 1; i >= 0; i--)
+    {
+      if (strcmp(warmConns[i].wc_key, key))
+	continue;
+      if (now - warmConns[i].wc_time >= (uint64_t)maxIdle * 1000000 ||
+	  !WarmAlive(warmConns[i].wc_socket))
+	WarmDrop(i);
+      else
+	n++;
+    }
+  RTMP_Unlock(&warmLock);
+  return n;
+}
+
+int
+RTMP_PrepareKeys(int count)
+{
+#ifdef CRYPTO
+  return DHPrepareKeys(count);
+#else
+  return 0;
+#endif
+}
+
+static int
+Connect(RTMP *r, RTMPPacket *cp)
+{
+  RTMPAddr addrs[RTMP_MAX_ADDRS];
+  int n;
+
+  if (!r->Link.hostname.av_len)
+    return FALSE;
+
+  r->m_sb.sb_timedout = FALSE;
+  r->m_pausing = 0;
+  r->m_fDuration = 0.0;
+  KeyframesReset(r);
+
+  if (WarmPoolable(r) && WarmTake(r))
     {
-      /* Connect directly */
-      if (!add_addr_info(&service, &r->Link.hostname, r->Link.port))
-	return FALSE;
+      r->m_bSendCounter = TRUE;
+      return SendConnect(r, cp);
     }
 
-  if (!RTMP_Connect0(r, (struct sockaddr *)&service))
+  if (r->Link.socksport)
+    /* Connect via SOCKS */
+    n = Resolve(&r->Link.sockshost, r->Link.socksport, addrs);
+  else
+    /* Connect directly */
+    n = Resolve(&r->Link.hostname, r->Link.port, addrs);
+  if (!n)
+    return FALSE;
+
+  if (!ConnectAny(r, addrs, n) || !Connected(r))
     return FALSE;
 
   r->m_bSendCounter = TRUE;
@@ -1058,15 +1996,35 @@ RTMP_Connect(RTMP *r, RTMPPacket *cp)
   return RTMP_Connect1(r, cp);
 }
 
+int
+RTMP_Connect(RTMP *r, RTMPPacket *cp)
+{
+  RTMP *ctx = LogEnter(r);
+  int ret = Connect(r, cp);
+
+  LogLeave(ctx);
+  return ret;
+}
+
 static int
 SocksNegotiate(RTMP *r)
 {
-  unsigned long addr;
-  struct sockaddr_in service;
-  memset(&service, 0, sizeof(struct sockaddr_in));
+  unsigned long addr = 0;
+  RTMPAddr addrs[RTMP_MAX_ADDRS];
+  int i, n;
 
-  add_addr_info(&service, &r->Link.hostname, r->Link.port);
-  addr = htonl(service.sin_addr.s_addr);
+  /* SOCKS 4 only takes IPv4 destinations */
+  n = Resolve(&r->Link.hostname, r->Link.port, addrs);
+  for (i = 0; i < n; i++)
+    if (addrs[i].ra_addr.ss_family == AF_INET)
+      break;
+  if (i == n)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, no IPv4 address for the SOCKS server "
+	  "to connect to", __FUNCTION__);
+      return FALSE;
+    }
+  addr = ntohl(((struct sockaddr_in *)&addrs[i].ra_addr)->sin_addr.s_addr);
 
   {
     char packet[] = {
@@ -1095,8 +2053,8 @@ SocksNegotiate(RTMP *r)
   }
 }
 
-int
-RTMP_ConnectStream(RTMP *r, int seekTime)
+static int
+ConnectStream(RTMP *r, int seekTime)
 {
   RTMPPacket packet = { 0 };
 
@@ -1128,7 +2086,128 @@ RTMP_ConnectStream(RTMP *r, int seekTime)
 	}
     }
 
-  return r->m_bPlaying;
+  return r->m_bPlaying;
+}
+
+int
+RTMP_ConnectStream(RTMP *r, int seekTime)
+{
+  RTMP *ctx = LogEnter(r);
+  int ret = ConnectStream(r, seekTime);
+
+  LogLeave(ctx);
+  return ret;
+}
+
+/* Handle what the server sends until *status leaves pending */
+static void
+WaitStatus(RTMP *r, const int *status, int pending)
+{
+  RTMPPacket packet = { 0 };
+
+  while (*status == pending && RTMP_IsConnected(r)
+	 && RTMP_ReadPacket(r, &packet))
+    {
+      if (RTMPPacket_IsReady(&packet))
+	{
+	  RTMP_ClientPacket(r, &packet);
+	  RTMPPacket_Free(&packet);
+	}
+    }
+}
+
+/* Remember a stream of an RTMP_LF_MULTI connection the server ended */
+static void
+StreamFailed(RTMP *r, int streamId)
+{
+  int *ids;
+
+  if (streamId <= 0 || RTMP_StreamFailed(r, streamId))
+    return;
+  ids = realloc(r->m_failedStreams, (r->m_numFailed + 1) * sizeof(int));
+  if (!ids)
+    return;
+  ids[r->m_numFailed++] = streamId;
+  r->m_failedStreams = ids;
+}
+
+int
+RTMP_StreamFailed(RTMP *r, int streamId)
+{
+  int i;
+
+  for (i = 0; i < r->m_numFailed; i++)
+    if (r->m_failedStreams[i] == streamId)
+      return TRUE;
+  return FALSE;
+}
+
+static int
+PublishStream(RTMP *r, AVal *playpath, int channel)
+{
+  int id;
+
+  if (!(r->Link.lFlags & RTMP_LF_MULTI) || channel <= 8 ||
+      !RTMP_IsConnected(r))
+    return 0;
+
+  r->m_newStream = -1;
+  r->m_publishStatus = 0;
+  if (!SendReleaseStream(r, playpath) || !SendFCPublish(r, playpath) ||
+      !RTMP_SendCreateStream(r))
+    {
+      r->m_newStream = 0;
+      return 0;
+    }
+  WaitStatus(r, &r->m_newStream, -1);
+  if (r->m_newStream <= 0)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, no stream for %.*s", __FUNCTION__,
+	  playpath->av_len, playpath->av_val);
+      r->m_newStream = 0;
+      return 0;
+    }
+
+  id = r->m_newStream;
+  if (SendPublish(r, playpath, id, channel))
+    WaitStatus(r, &r->m_publishStatus, 0);
+  r->m_newStream = 0;
+  if (r->m_publishStatus <= 0)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, publishing %.*s failed", __FUNCTION__,
+	  playpath->av_len, playpath->av_val);
+      if (RTMP_IsConnected(r))
+	SendDeleteStream(r, id);
+      return 0;
+    }
+  RTMP_Log(RTMP_LOGDEBUG, "%s, publishing %.*s on stream %d", __FUNCTION__,
+      playpath->av_len, playpath->av_val, id);
+  return id;
+}
+
+int
+RTMP_PublishStream(RTMP *r, AVal *playpath, int channel)
+{
+  RTMP *ctx = LogEnter(r);
+  int ret = PublishStream(r, playpath, channel);
+
+  LogLeave(ctx);
+  return ret;
+}
+
+int
+RTMP_UnpublishStream(RTMP *r, int streamId, AVal *playpath)
+{
+  RTMP *ctx = LogEnter(r);
+  int ret, i;
+
+  for (i = 0; i < r->m_numFailed; i++)
+    if (r->m_failedStreams[i] == streamId)
+      r->m_failedStreams[i--] = r->m_failedStreams[--r->m_numFailed];
+  ret = SendFCUnpublish(r, playpath) && SendDeleteStream(r, streamId);
+
+  LogLeave(ctx);
+  return ret;
 }
 
 int
@@ -1216,14 +2295,13 @@ RTMP_GetNextMediaPacket(RTMP *r, RTMPPacket *packet)
   if (bHasMediaPacket)
     r->m_bPlaying = TRUE;
   else if (r->m_sb.sb_timedout && !r->m_pausing)
-    r->m_pauseStamp = r->m_mediaChannel < r->m_channelsAllocatedIn ?
-                      r->m_channelTimestamp[r->m_mediaChannel] : 0;
+    r->m_pauseStamp = ChannelStamp(r, r->m_mediaChannel);
 
   return bHasMediaPacket;
 }
 
-int
-RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
+static int
+ClientPacket(RTMP *r, RTMPPacket *packet)
 {
   int bHasMediaPacket = 0;
   switch (packet->m_packetType)
@@ -1236,6 +2314,17 @@ RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
     case RTMP_PACKET_TYPE_BYTES_READ_REPORT:
       /* bytes read report */
       RTMP_Log(RTMP_LOGDEBUG, "%s, received: bytes read report", __FUNCTION__);
+      if (packet->m_nBodySize >= 4)
+	{
+	  /* the peer's count is 32 bits and wraps */
+	  uint64_t acked = r->m_stats.rs_bytesAcked;
+	  uint64_t now = (acked & ~(uint64_t)0xffffffff)
+	    | AMF_DecodeInt32(packet->m_body);
+
+	  if (now < acked)
+	    now += (uint64_t)1 << 32;
+	  r->m_stats.rs_bytesAcked = now;
+	}
       break;
 
     case RTMP_PACKET_TYPE_CONTROL:
@@ -1309,7 +2398,8 @@ RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
 	   obj.Dump();
 #endif
 
-	if (HandleInvoke(r, packet->m_body + 1, packet->m_nBodySize - 1) == 1)
+	if (HandleInvoke(r, packet->m_body + 1, packet->m_nBodySize - 1,
+			 packet->m_nInfoField2) == 1)
 	  bHasMediaPacket = 2;
 	break;
       }
@@ -1332,7 +2422,8 @@ RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
 	  packet->m_nBodySize);
       /*RTMP_LogHex(packet.m_body, packet.m_nBodySize); */
 
-      if (HandleInvoke(r, packet->m_body, packet->m_nBodySize) == 1)
+      if (HandleInvoke(r, packet->m_body, packet->m_nBodySize,
+		       packet->m_nInfoField2) == 1)
 	bHasMediaPacket = 2;
       break;
 
@@ -1381,6 +2472,16 @@ RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
   return bHasMediaPacket;
 }
 
+int
+RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
+{
+  RTMP *ctx = LogEnter(r);
+  int ret = ClientPacket(r, packet);
+
+  LogLeave(ctx);
+  return ret;
+}
+
 #ifdef _DEBUG
 extern FILE *netstackdump;
 extern FILE *netstackdump_read;
@@ -1393,6 +2494,10 @@ ReadN(RTMP *r, char *buffer, int n)
   int avail;
   char *ptr;
 
+  /* the peer may be waiting for what we hold back */
+  if (r->m_coalesce.co_len)
+    RTMP_Flush(r);
+
   r->m_sb.sb_timedout = FALSE;
 
 #ifdef _DEBUG
@@ -1412,7 +2517,10 @@ ReadN(RTMP *r, char *buffer, int n)
 	      if (r->m_sb.sb_size < 13 || refill)
 	        {
 		  if (!r->m_unackd)
-		    HTTP_Post(r, RTMPT_IDLE, "", 1);
+		    {
+		      HTTP_IdleWait(r);
+		      HTTP_Post(r, RTMPT_IDLE, "", 1);
+		    }
 		  if (RTMPSockBuf_Fill(&r->m_sb) < 1)
 		    {
 		      if (!r->m_sb.sb_timedout)
@@ -1446,12 +2554,15 @@ ReadN(RTMP *r, char *buffer, int n)
           avail = r->m_sb.sb_size;
 	  if (avail == 0)
 	    {
-	      if (RTMPSockBuf_Fill(&r->m_sb) < 1)
+	      if ((nRead = RTMPSockBuf_Fill(&r->m_sb)) < 1)
 	        {
 	          if (!r->m_sb.sb_timedout)
 	            RTMP_Close(r);
 	          return 0;
 		}
+#ifdef CRYPTO
+	      DecryptBuffered(r, nRead);
+#endif
 	      avail = r->m_sb.sb_size;
 	    }
 	}
@@ -1463,6 +2574,7 @@ ReadN(RTMP *r, char *buffer, int n)
 	  r->m_sb.sb_size -= nRead;
 	  nBytes = nRead;
 	  r->m_nBytesIn += nRead;
+	  r->m_stats.rs_bytesIn += nRead;
 	  if (r->m_bSendCounter
 	      && r->m_nBytesIn > ( r->m_nBytesInSent + r->m_nClientBW / 10))
 	    if (!SendBytesReceived(r))
@@ -1481,79 +2593,598 @@ ReadN(RTMP *r, char *buffer, int n)
 	  break;
 	}
 
-      if (r->Link.protocol & RTMP_FEATURE_HTTP)
-	r->m_resplen -= nBytes;
+      if (r->Link.protocol & RTMP_FEATURE_HTTP)
+	r->m_resplen -= nBytes;
+
+#ifdef CRYPTO
+      /* RTMPT bodies share the buffer with the plain HTTP responses */
+      if (r->Link.rc4keyIn && (r->Link.protocol & RTMP_FEATURE_HTTP))
+	{
+	  RC4_encrypt(r->Link.rc4keyIn, nBytes, ptr);
+	}
+#endif
+
+      n -= nBytes;
+      ptr += nBytes;
+    }
+
+  return nOriginalSize - n;
+}
+
+static uint64_t
+PaceNow(void)
+{
+#ifdef _WIN32
+  return (uint64_t)timeGetTime() * 1000;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/* Account one send call that started at start and returned nBytes */
+static void
+StatsSend(RTMP *r, uint64_t start, int nBytes)
+{
+  RTMPStats *st = &r->m_stats;
+  uint64_t now = PaceNow();
+  uint64_t us = now > start ? now - start : 0;
+  int i = 0;
+
+  while (i < RTMP_STATS_BUCKETS - 1 && us >= (16U << (2 * i)))
+    i++;
+  st->rs_sendLatency[i]++;
+  st->rs_sendCalls++;
+  if (nBytes > 0)
+    st->rs_bytesOut += nBytes;
+}
+
+static void
+PaceRefill(RTMPPacer *pc)
+{
+  uint64_t now = PaceNow();
+
+  if (now > pc->pc_last)
+    pc->pc_tokens += (double)(now - pc->pc_last) * pc->pc_rate / 1000000;
+  if (pc->pc_tokens > pc->pc_burst)
+    pc->pc_tokens = pc->pc_burst;
+  pc->pc_last = now;
+}
+
+/* How many of n bytes may be sent now, waiting for the bucket to refill
+ * if it cannot cover them. At most one burst goes out at a time.
+ */
+static int
+PaceBytes(RTMP *r, int n)
+{
+  RTMPPacer *pc = &r->m_pacer;
+
+  if (!pc->pc_rate || pc->pc_kernel)
+    return n;
+
+  if (n > pc->pc_burst)
+    n = pc->pc_burst;
+  PaceRefill(pc);
+  if (pc->pc_tokens < n)
+    {
+      uint64_t start = PaceNow(), waited;
+      uint32_t wait = (uint32_t)((n - pc->pc_tokens) * 1000000 / pc->pc_rate);
+
+#ifdef _WIN32
+      Sleep((wait + 999) / 1000);
+#else
+      usleep(wait);
+#endif
+      PaceRefill(pc);
+      waited = pc->pc_last - start;
+      pc->pc_delay += waited;
+      pc->pc_waits++;
+      if (waited > pc->pc_delayMax)
+	pc->pc_delayMax = (uint32_t)waited;
+    }
+  /* a short sleep leaves a small debt for the next call */
+  pc->pc_tokens -= n;
+  return n;
+}
+
+int
+RTMP_SetPacing(RTMP *r, int rate, int burst, int kernel)
+{
+  RTMPPacer *pc = &r->m_pacer;
+
+  if (rate < 0)
+    rate = 0;
+  if (burst < 1)
+    burst = 1;
+
+#ifdef SO_MAX_PACING_RATE
+  if (pc->pc_kernel || (kernel && rate))
+    {
+      unsigned int v = rate && kernel ? (unsigned int)rate : ~0U;
+
+      if (setsockopt(r->m_sb.sb_socket, SOL_SOCKET, SO_MAX_PACING_RATE,
+	      &v, sizeof(v)) == 0)
+	pc->pc_kernel = rate && kernel;
+      else
+	{
+	  RTMP_Log(RTMP_LOGWARNING, "%s, SO_MAX_PACING_RATE failed (%d)",
+	      __FUNCTION__, GetSockError());
+	  pc->pc_kernel = FALSE;
+	}
+    }
+#endif
+
+  if (rate && !pc->pc_rate)
+    {
+      pc->pc_tokens = burst;
+      pc->pc_last = PaceNow();
+    }
+  pc->pc_rate = rate;
+  pc->pc_burst = burst;
+  RTMP_Log(RTMP_LOGDEBUG, "%s, %d bytes/s, burst %d%s", __FUNCTION__, rate,
+      burst, pc->pc_kernel ? " (kernel)" : "");
+  return TRUE;
+}
+
+int
+RTMP_SetReceiveBuffer(RTMP *r, int size, int sockbuf)
+{
+  RTMPSockBuf *sb = &r->m_sb;
+  char *buf;
+
+  if (size < 0 || sockbuf < 0)
+    return FALSE;
+
+  if (size && size != sb->sb_bufSize &&
+      (size > RTMP_BUFFER_CACHE_SIZE || sb->sb_buf != sb->sb_cache))
+    {
+      if (size <= RTMP_BUFFER_CACHE_SIZE)
+	{
+	  buf = sb->sb_cache;
+	  size = sizeof(sb->sb_cache);
+	}
+      else if (!(buf = malloc(size)))
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, failed to allocate %d bytes",
+	      __FUNCTION__, size);
+	  return FALSE;
+	}
+      /* the unprocessed bytes have to fit the new buffer */
+      if (sb->sb_size >= size - 1)
+	{
+	  if (buf != sb->sb_cache)
+	    free(buf);
+	  return FALSE;
+	}
+      if (sb->sb_size)
+	memmove(buf, sb->sb_start, sb->sb_size);
+      if (sb->sb_buf && sb->sb_buf != sb->sb_cache)
+	free(sb->sb_buf);
+      sb->sb_buf = sb->sb_start = buf;
+      sb->sb_bufSize = size;
+    }
+
+  if (sockbuf)
+    {
+      r->m_rcvBuf = sockbuf;
+      if (sb->sb_socket != -1 && setsockopt(sb->sb_socket, SOL_SOCKET,
+	      SO_RCVBUF, (char *)&sockbuf, sizeof(sockbuf)))
+	RTMP_Log(RTMP_LOGWARNING, "%s, Setting SO_RCVBUF to %d failed",
+	    __FUNCTION__, sockbuf);
+    }
+  RTMP_Log(RTMP_LOGDEBUG, "%s, %d byte buffer, SO_RCVBUF %d", __FUNCTION__,
+      sb->sb_bufSize, r->m_rcvBuf);
+  return TRUE;
+}
+
+/* The socket half of WriteN, ptr is already encrypted. more hints that
+ * another write follows at once.
+ */
+static int
+SendN(RTMP *r, const char *ptr, int n, int more)
+{
+  while (n > 0)
+    {
+      int nBytes, len = PaceBytes(r, n);
+      uint64_t start = PaceNow();
+
+      if (r->Link.protocol & RTMP_FEATURE_HTTP)
+        nBytes = HTTP_Post(r, RTMPT_SEND, ptr, len);
+#ifdef MSG_MORE
+      else if (more && (!r->m_sb.sb_ssl || r->m_sb.sb_ktls))
+	nBytes = send(r->m_sb.sb_socket, ptr, len, MSG_MORE);
+#endif
+      else
+        nBytes = RTMPSockBuf_Send(&r->m_sb, ptr, len, r->Link.timeout);
+      StatsSend(r, start, nBytes);
+      /*RTMP_Log(RTMP_LOGDEBUG, "%s: %d\n", __FUNCTION__, nBytes); */
+
+      if (nBytes < 0)
+	{
+	  int sockerr = GetSockError();
+	  RTMP_Log(RTMP_LOGERROR, "%s, RTMP send error %d (%d bytes)", __FUNCTION__,
+	      sockerr, n);
+
+	  if (sockerr == EINTR && !RTMP_ctrlC)
+	    continue;
+
+	  RTMP_Close(r);
+	  n = 1;
+	  break;
+	}
+
+      if (nBytes == 0)
+	break;
+
+      n -= nBytes;
+      ptr += nBytes;
+    }
+
+  return n == 0;
+}
+
+static int
+FlushPending(RTMP *r, int more)
+{
+  RTMPCoalesce *co = &r->m_coalesce;
+  int len = co->co_len;
+
+  /* reset first: a failed send closes the connection, which flushes */
+  co->co_len = 0;
+  if (!len)
+    return TRUE;
+  return SendN(r, co->co_buf, len, more);
+}
+
+/* Queue n bytes, sending what is pending first if they do not fit */
+static int
+CoalesceAppend(RTMP *r, const char *buf, int n)
+{
+  RTMPCoalesce *co = &r->m_coalesce;
+
+  if (co->co_len + n > co->co_size)
+    {
+      /* a large write goes out right behind what is pending */
+      if (!FlushPending(r, n >= co->co_size))
+	return FALSE;
+      if (n >= co->co_size)
+	return SendN(r, buf, n, FALSE);
+    }
+
+  if (!co->co_len)
+    co->co_since = RTMP_GetTime();
+  memcpy(co->co_buf + co->co_len, buf, n);
+  co->co_len += n;
+  return TRUE;
+}
+
+/* Send the queue once it is full or its oldest byte waited long enough */
+static int
+CoalesceDone(RTMP *r)
+{
+  RTMPCoalesce *co = &r->m_coalesce;
+
+  if (co->co_len && (co->co_len == co->co_size || RTMP_FlushDelay(r) == 0))
+    return FlushPending(r, FALSE);
+  return TRUE;
+}
+
+static int
+CoalesceWrite(RTMP *r, const char *buf, int n)
+{
+  return CoalesceAppend(r, buf, n) && CoalesceDone(r);
+}
+
+int
+RTMP_SetCoalescing(RTMP *r, int size, int delayMs)
+{
+  RTMPCoalesce *co = &r->m_coalesce;
+  char *buf;
+  int ret = FlushPending(r, FALSE);
+
+  if (size <= 0)
+    {
+      free(co->co_buf);
+      co->co_buf = NULL;
+      co->co_size = 0;
+      return ret;
+    }
+
+  buf = realloc(co->co_buf, size);
+  if (!buf)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, failed to allocate %d bytes", __FUNCTION__,
+	  size);
+      return FALSE;
+    }
+  co->co_buf = buf;
+  co->co_size = size;
+  co->co_delay = delayMs < 0 ? 0 : delayMs;
+  return ret;
+}
+
+int
+RTMP_Flush(RTMP *r)
+{
+  RTMP *ctx = LogEnter(r);
+  int ret = FlushPending(r, FALSE);
+
+  LogLeave(ctx);
+  return ret;
+}
+
+int
+RTMP_FlushDelay(RTMP *r)
+{
+  RTMPCoalesce *co = &r->m_coalesce;
+  uint32_t age;
+
+  if (!co->co_len)
+    return -1;
+  age = RTMP_GetTime() - co->co_since;
+  return age >= (uint32_t)co->co_delay ? 0 : co->co_delay - (int)age;
+}
+
+#ifdef CRYPTO
+/* With RTMPE what lands in the socket buffer is decrypted right away, in
+ * one pass per recv(), rather than piece by piece as ReadN() hands it out.
+ * The buffer then only holds plaintext and allows in-place parsing. */
+static void
+DecryptBuffered(RTMP *r, int n)
+{
+  if (r->Link.rc4keyIn && !(r->Link.protocol & RTMP_FEATURE_HTTP) && n > 0)
+    RC4_encrypt(r->Link.rc4keyIn, n,
+	r->m_sb.sb_start + r->m_sb.sb_size - n);
+}
+
+static char *
+EncryptBuffer(RTMP *r, int n)
+{
+  if (n > r->m_encBufSize)
+    {
+      char *buf = realloc(r->m_encBuf, n);
+
+      if (!buf)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, failed to allocate %d bytes",
+	      __FUNCTION__, n);
+	  return NULL;
+	}
+      r->m_encBuf = buf;
+      r->m_encBufSize = n;
+    }
+  return r->m_encBuf;
+}
+#endif
+
+#if defined(CRYPTO) && !defined(NO_SSL)
+/* The TLS library seals every write into its own record, MAC and all, so
+ * gather the vector into full records instead of one per chunk. Returns
+ * the bytes sent or -1.
+ */
+static int
+TLSWriteV(RTMP *r, const struct iovec *iov, int iovcnt)
+{
+  char *rec = EncryptBuffer(r, RTMP_TLS_RECORD);
+  int i = 0, len = 0, total = 0, n;
+  size_t off = 0;
+
+  if (!rec)
+    return -1;
+  while (i < iovcnt)
+    {
+      n = iov[i].iov_len - off;
+      if (n > RTMP_TLS_RECORD - len)
+	n = RTMP_TLS_RECORD - len;
+      memcpy(rec + len, (char *)iov[i].iov_base + off, n);
+      len += n;
+      off += n;
+      if (off == iov[i].iov_len)
+	{
+	  i++;
+	  off = 0;
+	}
+      if (len == RTMP_TLS_RECORD || (i == iovcnt && len))
+	{
+	  char *ptr = rec;
+
+	  while (len > 0)
+	    {
+	      uint64_t start = PaceNow();
+
+	      n = RTMPSockBuf_Send(&r->m_sb, ptr, len, 0);
+	      StatsSend(r, start, n);
+	      if (n < 0 && GetSockError() == EINTR && !RTMP_ctrlC)
+		continue;
+	      if (n <= 0)
+		return -1;
+	      ptr += n;
+	      len -= n;
+	      total += n;
+	    }
+	}
+    }
+  return total;
+}
+#endif
+
+static int
+WriteN(RTMP *r, const char *buffer, int n)
+{
+  const char *ptr = buffer;
+
+#ifdef CRYPTO
+  if (r->Link.rc4keyOut)
+    {
+      char *encrypted = EncryptBuffer(r, n);
+
+      if (!encrypted)
+	return FALSE;
+      RC4_encrypt2(r->Link.rc4keyOut, n, buffer, encrypted);
+      ptr = encrypted;
+    }
+#endif
+
+  /* over RTMPT this batches several packets into one POST */
+  if (r->m_coalesce.co_size)
+    return CoalesceWrite(r, ptr, n);
+  return SendN(r, ptr, n, FALSE);
+}
+
+/* One RTMPT send request carrying all of iov */
+static int
+PostV(RTMP *r, struct iovec *iov, int iovcnt)
+{
+  int i, total = 0, left;
+
+  for (i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+  /* the request cannot be split once its header is out */
+  for (left = total; left > 0; left -= PaceBytes(r, left))
+    ;
+  if (HTTP_PostV(r, RTMPT_SEND, iov, iovcnt) != total)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, RTMPT send error %d (%d bytes)",
+	  __FUNCTION__, GetSockError(), total);
+      RTMP_Close(r);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static int
+WriteV(RTMP *r, struct iovec *iov, int iovcnt)
+{
+  RTMPCoalesce *co = &r->m_coalesce;
 
 #ifdef CRYPTO
-      if (r->Link.rc4keyIn)
+  if (r->Link.rc4keyOut)
+    {
+      int i, total = 0;
+      char *enc;
+
+      for (i = 0; i < iovcnt; i++)
+	total += iov[i].iov_len;
+      if (!(enc = EncryptBuffer(r, total)))
+	return FALSE;
+      /* gather first, the template headers are only a byte or two and
+       * one RC4 pass over the packet beats a call per entry */
+      for (i = 0, total = 0; i < iovcnt; i++)
 	{
-	  RC4_encrypt(r->Link.rc4keyIn, nBytes, ptr);
+	  memcpy(enc + total, iov[i].iov_base, iov[i].iov_len);
+	  total += iov[i].iov_len;
 	}
+      RC4_encrypt(r->Link.rc4keyOut, total, enc);
+      if (co->co_size)
+	return CoalesceWrite(r, enc, total);
+      return SendN(r, enc, total, FALSE);
+    }
 #endif
 
-      n -= nBytes;
-      ptr += nBytes;
-    }
+  if (co->co_size)
+    {
+      int i, total = 0;
 
-  return nOriginalSize - n;
-}
+      for (i = 0; i < iovcnt; i++)
+	total += iov[i].iov_len;
+      if (total < co->co_size)
+	{
+	  for (i = 0; i < iovcnt; i++)
+	    if (!CoalesceAppend(r, iov[i].iov_base, iov[i].iov_len))
+	      return FALSE;
+	  return CoalesceDone(r);
+	}
+      if (!FlushPending(r, TRUE))
+	return FALSE;
+    }
 
-static int
-WriteN(RTMP *r, const char *buffer, int n)
-{
-  const char *ptr = buffer;
-#ifdef CRYPTO
-  char *encrypted = 0;
-  char buf[RTMP_BUFFER_CACHE_SIZE];
+  if (r->Link.protocol & RTMP_FEATURE_HTTP)
+    return PostV(r, iov, iovcnt);
 
-  if (r->Link.rc4keyOut)
+#if defined(CRYPTO) && !defined(NO_SSL)
+  if (r->m_sb.sb_ssl && !r->m_sb.sb_ktls)
     {
-      if (n > sizeof(buf))
-	encrypted = (char *)malloc(n);
-      else
-	encrypted = (char *)buf;
-      ptr = encrypted;
-      RC4_encrypt2(r->Link.rc4keyOut, n, buffer, ptr);
+      int i, total = 0, left;
+
+      for (i = 0; i < iovcnt; i++)
+	total += iov[i].iov_len;
+      for (left = total; left > 0; left -= PaceBytes(r, left))
+	;
+      if (TLSWriteV(r, iov, iovcnt) != total)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, TLS send error %d (%d bytes)",
+	      __FUNCTION__, GetSockError(), total);
+	  RTMP_Close(r);
+	  return FALSE;
+	}
+      return TRUE;
     }
 #endif
 
-  while (n > 0)
+  while (iovcnt > 0)
     {
-      int nBytes;
+      int i, nBytes, total = 0, cnt = iovcnt, allowed;
+      size_t saved = 0;
+      uint64_t start;
 
-      if (r->Link.protocol & RTMP_FEATURE_HTTP)
-        nBytes = HTTP_Post(r, RTMPT_SEND, ptr, n);
-      else
-        nBytes = RTMPSockBuf_Send(&r->m_sb, ptr, n, r->Link.timeout);
-      /*RTMP_Log(RTMP_LOGDEBUG, "%s: %d\n", __FUNCTION__, nBytes); */
+      /* hand the socket no more than the pacer allows */
+      if (r->m_pacer.pc_rate && !r->m_pacer.pc_kernel)
+	{
+	  for (i = 0; i < iovcnt && total < r->m_pacer.pc_burst; i++)
+	    total += iov[i].iov_len;
+	  allowed = PaceBytes(r, total);
+	  for (cnt = 0, total = 0; cnt < iovcnt; cnt++)
+	    {
+	      if (total + (int)iov[cnt].iov_len > allowed)
+		{
+		  saved = iov[cnt].iov_len;
+		  iov[cnt].iov_len = allowed - total;
+		  cnt++;
+		  break;
+		}
+	      total += iov[cnt].iov_len;
+	    }
+	}
+
+      start = PaceNow();
+      nBytes = RTMPSockBuf_SendV(&r->m_sb, iov, cnt, r->Link.timeout);
+      StatsSend(r, start, nBytes);
+      if (saved)
+	iov[cnt - 1].iov_len = saved;
 
       if (nBytes < 0)
 	{
 	  int sockerr = GetSockError();
-	  RTMP_Log(RTMP_LOGERROR, "%s, RTMP send error %d (%d bytes)", __FUNCTION__,
-	      sockerr, n);
+	  RTMP_Log(RTMP_LOGERROR, "%s, RTMP send error %d (%d iovecs)", __FUNCTION__,
+	      sockerr, iovcnt);
 
 	  if (sockerr == EINTR && !RTMP_ctrlC)
 	    continue;
 
 	  RTMP_Close(r);
-	  n = 1;
-	  break;
+	  return FALSE;
 	}
 
       if (nBytes == 0)
-	break;
+	return FALSE;
 
-      n -= nBytes;
-      ptr += nBytes;
+      /* skip whatever went out, resume a partially sent entry */
+      while (iovcnt > 0 && nBytes >= (int)iov->iov_len)
+	{
+	  nBytes -= iov->iov_len;
+	  iov++;
+	  iovcnt--;
+	}
+      if (iovcnt > 0 && nBytes > 0)
+	{
+	  iov->iov_base = (char *)iov->iov_base + nBytes;
+	  iov->iov_len -= nBytes;
+	}
     }
 
-#ifdef CRYPTO
-  if (encrypted && encrypted != buf)
-    free(encrypted);
-#endif
-
-  return n == 0;
+  return TRUE;
 }
 
 #define SAVC(x)	static const AVal av_##x = AVC(#x)
@@ -1813,7 +3444,7 @@ SendUsherToken(RTMP *r, AVal *usherToken)
 SAVC(releaseStream);
 
 static int
-SendReleaseStream(RTMP *r)
+SendReleaseStream(RTMP *r, const AVal *playpath)
 {
   RTMPPacket packet;
   char pbuf[1024], *pend = pbuf + sizeof(pbuf);
@@ -1831,7 +3462,7 @@ SendReleaseStream(RTMP *r)
   enc = AMF_EncodeString(enc, pend, &av_releaseStream);
   enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
   *enc++ = AMF_NULL;
-  enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
+  enc = AMF_EncodeString(enc, pend, playpath);
   if (!enc)
     return FALSE;
 
@@ -1843,7 +3474,7 @@ SendReleaseStream(RTMP *r)
 SAVC(FCPublish);
 
 static int
-SendFCPublish(RTMP *r)
+SendFCPublish(RTMP *r, const AVal *playpath)
 {
   RTMPPacket packet;
   char pbuf[1024], *pend = pbuf + sizeof(pbuf);
@@ -1861,7 +3492,7 @@ SendFCPublish(RTMP *r)
   enc = AMF_EncodeString(enc, pend, &av_FCPublish);
   enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
   *enc++ = AMF_NULL;
-  enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
+  enc = AMF_EncodeString(enc, pend, playpath);
   if (!enc)
     return FALSE;
 
@@ -1873,7 +3504,7 @@ SendFCPublish(RTMP *r)
 SAVC(FCUnpublish);
 
 static int
-SendFCUnpublish(RTMP *r)
+SendFCUnpublish(RTMP *r, const AVal *playpath)
 {
   RTMPPacket packet;
   char pbuf[1024], *pend = pbuf + sizeof(pbuf);
@@ -1891,7 +3522,7 @@ SendFCUnpublish(RTMP *r)
   enc = AMF_EncodeString(enc, pend, &av_FCUnpublish);
   enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
   *enc++ = AMF_NULL;
-  enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
+  enc = AMF_EncodeString(enc, pend, playpath);
   if (!enc)
     return FALSE;
 
@@ -1905,17 +3536,17 @@ SAVC(live);
 SAVC(record);
 
 static int
-SendPublish(RTMP *r)
+SendPublish(RTMP *r, const AVal *playpath, int streamId, int channel)
 {
   RTMPPacket packet;
   char pbuf[1024], *pend = pbuf + sizeof(pbuf);
   char *enc;
 
-  packet.m_nChannel = 0x04;	/* source channel (invoke) */
+  packet.m_nChannel = channel;	/* source channel (invoke) */
   packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
   packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
   packet.m_nTimeStamp = 0;
-  packet.m_nInfoField2 = r->m_stream_id;
+  packet.m_nInfoField2 = streamId;
   packet.m_hasAbsTimestamp = 0;
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
@@ -1923,7 +3554,7 @@ SendPublish(RTMP *r)
   enc = AMF_EncodeString(enc, pend, &av_publish);
   enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
   *enc++ = AMF_NULL;
-  enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
+  enc = AMF_EncodeString(enc, pend, playpath);
   if (!enc)
     return FALSE;
 
@@ -1999,8 +3630,7 @@ RTMP_SendPause(RTMP *r, int DoPause, int iTime)
 int RTMP_Pause(RTMP *r, int DoPause)
 {
   if (DoPause)
-    r->m_pauseStamp = r->m_mediaChannel < r->m_channelsAllocatedIn ?
-                      r->m_channelTimestamp[r->m_mediaChannel] : 0;
+    r->m_pauseStamp = ChannelStamp(r, r->m_mediaChannel);
   return RTMP_SendPause(r, DoPause, r->m_pauseStamp);
 }
 
@@ -2076,6 +3706,41 @@ RTMP_SendClientBW(RTMP *r)
   return RTMP_SendPacket(r, &packet, FALSE);
 }
 
+/* Tell the peer how big our chunks are and use that size from now on.
+ * Larger chunks mean fewer headers and sends for big messages.
+ */
+int
+RTMP_SendChunkSize(RTMP *r, int size)
+{
+  RTMPPacket packet;
+  char pbuf[256], *pend = pbuf + sizeof(pbuf);
+
+  if (size < 1 || size > 0xffffff)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, invalid chunk size %d", __FUNCTION__,
+	  size);
+      return FALSE;
+    }
+
+  packet.m_nChannel = 0x02;	/* control channel (invoke) */
+  packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+  packet.m_packetType = RTMP_PACKET_TYPE_CHUNK_SIZE;
+  packet.m_nTimeStamp = 0;
+  packet.m_nInfoField2 = 0;
+  packet.m_hasAbsTimestamp = 0;
+  packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
+
+  packet.m_nBodySize = 4;
+
+  AMF_EncodeInt32(packet.m_body, pend, size);
+  if (!RTMP_SendPacket(r, &packet, FALSE))
+    return FALSE;
+
+  RTMP_Log(RTMP_LOGDEBUG, "%s, chunk size change to %d", __FUNCTION__, size);
+  r->m_outChunkSize = size;
+  return TRUE;
+}
+
 static int
 SendBytesReceived(RTMP *r)
 {
@@ -2883,9 +4548,6 @@ SAVC(_onbwcheck);
 SAVC(_onbwdone);
 SAVC(_error);
 SAVC(close);
-SAVC(code);
-SAVC(level);
-SAVC(description);
 SAVC(onStatus);
 SAVC(playlist_ready);
 static const AVal av_NetStream_Failed = AVC("NetStream.Failed");
@@ -2904,17 +4566,49 @@ AVC("NetStream.Play.PublishNotify");
 static const AVal av_NetStream_Play_UnpublishNotify =
 AVC("NetStream.Play.UnpublishNotify");
 static const AVal av_NetStream_Publish_Start = AVC("NetStream.Publish.Start");
+static const AVal av_NetStream_Publish_BadName =
+AVC("NetStream.Publish.BadName");
 static const AVal av_NetConnection_Connect_Rejected =
 AVC("NetConnection.Connect.Rejected");
 
-/* Returns 0 for OK/Failed/error, 1 for 'Stop or Complete' */
+/* Pick code, level and description out of the info object that onStatus
+ * and _error carry as their fourth argument, in one pass over it. */
+static void
+InvokeInfo(const AMFCursor *args, AVal *code, AVal *level, AVal *description)
+{
+  static const AVal names[3] = { AVC("code"), AVC("level"), AVC("description") };
+  AVal *out[3];
+  AMFValue info, vals[3];
+  int i;
+
+  out[0] = code;
+  out[1] = level;
+  out[2] = description;
+  for (i = 0; i < 3; i++)
+    vals[i].v_type = AMF_INVALID;
+  if (AMFCursor_Get(args, 3, &info) && info.v_type == AMF_OBJECT)
+    AMFCursor_Lookup(&info.v_body, names, vals, 3);
+  for (i = 0; i < 3; i++)
+    {
+      if (!out[i])
+	continue;
+      out[i]->av_val = NULL;
+      out[i]->av_len = 0;
+      if (vals[i].v_type == AMF_STRING)
+	*out[i] = vals[i].v_aval;
+    }
+}
+
+/* Returns 0 for OK/Failed/error, 1 for 'Stop or Complete'. streamId is
+ * the message stream the invoke came in on */
 static int
-HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
+HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize, int streamId)
 {
-  AMFObject obj;
+  AMFCursor args;
+  AMFValue v;
   AVal method;
   double txn;
-  int ret = 0, nRes;
+  int ret = 0;
   if (body[0] != 0x02)		/* make sure it is a string method name we start with */
     {
       RTMP_Log(RTMP_LOGWARNING, "%s, Sanity failed. no string method in invoke packet",
@@ -2922,17 +4616,26 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
       return 0;
     }
 
-  nRes = AMF_Decode(&obj, body, nBodySize, FALSE);
-  if (nRes < 0)
+  /* Read the arguments in place; only build the tree to dump it */
+  AMFCursor_Init(&args, body, nBodySize);
+  if (!AMFCursor_Next(&args, &v) || v.v_type != AMF_STRING)
     {
       RTMP_Log(RTMP_LOGERROR, "%s, error decoding invoke packet", __FUNCTION__);
       return 0;
     }
+  method = v.v_aval;
+  txn = AMFCursor_Next(&args, &v) && v.v_type == AMF_NUMBER ? v.v_number : 0;
+  AMFCursor_Init(&args, body, nBodySize);
 
-  AMF_Dump(&obj);
-  AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &method);
-  txn = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 1));
-  RTMP_Log(RTMP_LOGDEBUG, "%s, server invoking <%s>", __FUNCTION__, method.av_val);
+  if (RTMP_debuglevel >= RTMP_LOGDEBUG)
+    {
+      AMFObject obj;
+      if (AMF_Decode(&obj, body, nBodySize, FALSE) >= 0)
+	AMF_Dump(&obj);
+      AMF_Reset(&obj);
+    }
+  RTMP_Log(RTMP_LOGDEBUG, "%s, server invoking <%.*s>", __FUNCTION__,
+      method.av_len, method.av_val);
 
   if (AVMATCH(&method, &av__result))
     {
@@ -2959,27 +4662,30 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 	{
 	  if (r->Link.token.av_len)
 	    {
-	      AMFObjectProperty p;
-	      if (RTMP_FindFirstMatchingProperty(&obj, &av_secureToken, &p))
+	      if (AMFCursor_Search(&args, &av_secureToken, FALSE, &v)
+		  && v.v_type == AMF_STRING)
 		{
-		  DecodeTEA(&r->Link.token, &p.p_vu.p_aval);
-		  SendSecureTokenResponse(r, &p.p_vu.p_aval);
+		  DecodeTEA(&r->Link.token, &v.v_aval);
+		  SendSecureTokenResponse(r, &v.v_aval);
 		}
 	    }
-	  if (r->Link.protocol & RTMP_FEATURE_WRITE)
+	  if (r->Link.lFlags & RTMP_LF_MULTI)
 	    {
-	      SendReleaseStream(r);
-	      SendFCPublish(r);
+	      /* the streams come from RTMP_PublishStream() */
+	      r->m_bPlaying = TRUE;
+	    }
+	  else if (r->Link.protocol & RTMP_FEATURE_WRITE)
+	    {
+	      SendReleaseStream(r, &r->Link.playpath);
+	      SendFCPublish(r, &r->Link.playpath);
+	      RTMP_SendCreateStream(r);
 	    }
 	  else
 	    {
 	      RTMP_SendServerBW(r);
 	      RTMP_SendCtrl(r, 3, 0, 300);
-	    }
-	  RTMP_SendCreateStream(r);
+	      RTMP_SendCreateStream(r);
 
-	  if (!(r->Link.protocol & RTMP_FEATURE_WRITE))
-	    {
 	      /* Authenticate on Justin.tv legacy servers before sending FCSubscribe */
 	      if (r->Link.usherToken.av_len)
 	        SendUsherToken(r, &r->Link.usherToken);
@@ -2990,13 +4696,21 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 	        SendFCSubscribe(r, &r->Link.playpath);
 	    }
 	}
+      else if (AVMATCH(&methodInvoked, &av_createStream) &&
+	       r->m_newStream < 0)
+	{
+	  /* RTMP_PublishStream() takes it from here */
+	  r->m_newStream = AMFCursor_Get(&args, 3, &v) &&
+	    v.v_type == AMF_NUMBER && v.v_number > 0 ? (int)v.v_number : 0;
+	}
       else if (AVMATCH(&methodInvoked, &av_createStream))
 	{
-	  r->m_stream_id = (int)AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 3));
+	  AMFCursor_Get(&args, 3, &v);
+	  r->m_stream_id = (int)v.v_number;
 
 	  if (r->Link.protocol & RTMP_FEATURE_WRITE)
 	    {
-	      SendPublish(r);
+	      SendPublish(r, &r->Link.playpath, r->m_stream_id, 0x04);
 	    }
 	  else
 	    {
@@ -3074,15 +4788,12 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 
           if (AVMATCH(&methodInvoked, &av_connect))
             {
-              AMFObject obj2;
-              AVal code, level, description;
-              AMFProp_GetObject(AMF_GetProp(&obj, NULL, 3), &obj2);
-              AMFProp_GetString(AMF_GetProp(&obj2, &av_code, -1), &code);
-              AMFProp_GetString(AMF_GetProp(&obj2, &av_level, -1), &level);
-              AMFProp_GetString(AMF_GetProp(&obj2, &av_description, -1), &description);
-              RTMP_Log(RTMP_LOGDEBUG, "%s, error description: %s", __FUNCTION__, description.av_val);
+              AVal description;
+              InvokeInfo(&args, NULL, NULL, &description);
+              RTMP_Log(RTMP_LOGDEBUG, "%s, error description: %.*s", __FUNCTION__,
+                  description.av_len, description.av_val);
               /* if PublisherAuth returns 1, then reconnect */
-              if (PublisherAuth(r, &description) == 1)
+              if (description.av_len && PublisherAuth(r, &description) == 1)
               {
                 CloseInternal(r, 1);
                 if (!RTMP_Connect(r, NULL) || !RTMP_ConnectStream(r, 0))
@@ -3106,21 +4817,38 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
     }
   else if (AVMATCH(&method, &av_onStatus))
     {
-      AMFObject obj2;
-      AVal code, level;
-      AMFProp_GetObject(AMF_GetProp(&obj, NULL, 3), &obj2);
-      AMFProp_GetString(AMF_GetProp(&obj2, &av_code, -1), &code);
-      AMFProp_GetString(AMF_GetProp(&obj2, &av_level, -1), &level);
+      AVal code;
+      InvokeInfo(&args, &code, NULL, NULL);
+
+      RTMP_Log(RTMP_LOGDEBUG, "%s, onStatus: %.*s", __FUNCTION__,
+	  code.av_len, code.av_val);
+      if ((r->Link.lFlags & RTMP_LF_MULTI)
+	  && (AVMATCH(&code, &av_NetStream_Failed)
+	      || AVMATCH(&code, &av_NetStream_Publish_BadName)
+	      || AVMATCH(&code, &av_NetStream_Play_Failed)
+	      || AVMATCH(&code, &av_NetStream_Play_StreamNotFound)
+	      || AVMATCH(&code, &av_NetStream_Play_Complete)
+	      || AVMATCH(&code, &av_NetStream_Play_Stop)
+	      || AVMATCH(&code, &av_NetStream_Play_UnpublishNotify)))
+	{
+	  /* only one of the streams ended, the others carry on */
+	  if (r->m_newStream > 0 && streamId == r->m_newStream)
+	    r->m_publishStatus = -1;
+	  else
+	    StreamFailed(r, streamId);
+	  RTMP_Log(RTMP_LOGERROR, "Stream %d failed: %.*s", streamId,
+	      code.av_len, code.av_val);
+	}
 
-      RTMP_Log(RTMP_LOGDEBUG, "%s, onStatus: %s", __FUNCTION__, code.av_val);
-      if (AVMATCH(&code, &av_NetStream_Failed)
+      else if (AVMATCH(&code, &av_NetStream_Failed)
 	  || AVMATCH(&code, &av_NetStream_Play_Failed)
 	  || AVMATCH(&code, &av_NetStream_Play_StreamNotFound)
 	  || AVMATCH(&code, &av_NetConnection_Connect_InvalidApp))
 	{
 	  r->m_stream_id = -1;
 	  RTMP_Close(r);
-	  RTMP_Log(RTMP_LOGERROR, "Closing connection: %s", code.av_val);
+	  RTMP_Log(RTMP_LOGERROR, "Closing connection: %.*s", code.av_len,
+	      code.av_val);
 	}
 
       else if (AVMATCH(&code, &av_NetStream_Play_Start)
@@ -3142,6 +4870,8 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 	{
 	  int i;
 	  r->m_bPlaying = TRUE;
+	  if (r->m_newStream > 0 && streamId == r->m_newStream)
+	    r->m_publishStatus = 1;
 	  for (i = 0; i < r->m_numCalls; i++)
 	    {
 	      if (AVMATCH(&r->m_methodCalls[i].name, &av_publish))
@@ -3192,7 +4922,6 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 
     }
 leave:
-  AMF_Reset(&obj);
   return ret;
 }
 
@@ -3248,47 +4977,47 @@ RTMP_FindPrefixProperty(AMFObject *obj, const AVal *name,
 }
 
 static int
-DumpMetaData(AMFObject *obj)
+DumpMetaData(const AMFCursor *c)
 {
-  AMFObjectProperty *prop;
-  int n, len;
-  for (n = 0; n < obj->o_num; n++)
+  AMFCursor it = *c;
+  AMFValue v;
+  int len;
+  while (AMFCursor_Next(&it, &v))
     {
       char str[256] = "";
-      prop = AMF_GetProp(obj, NULL, n);
-      switch (prop->p_type)
+      switch (v.v_type)
 	{
 	case AMF_OBJECT:
 	case AMF_ECMA_ARRAY:
 	case AMF_STRICT_ARRAY:
-	  if (prop->p_name.av_len)
-	    RTMP_Log(RTMP_LOGINFO, "%.*s:", prop->p_name.av_len, prop->p_name.av_val);
-	  DumpMetaData(&prop->p_vu.p_object);
+	  if (v.v_name.av_len)
+	    RTMP_Log(RTMP_LOGINFO, "%.*s:", v.v_name.av_len, v.v_name.av_val);
+	  DumpMetaData(&v.v_body);
 	  break;
 	case AMF_NUMBER:
-	  snprintf(str, 255, "%.2f", prop->p_vu.p_number);
+	  snprintf(str, 255, "%.2f", v.v_number);
 	  break;
 	case AMF_BOOLEAN:
 	  snprintf(str, 255, "%s",
-		   prop->p_vu.p_number != 0. ? "TRUE" : "FALSE");
+		   v.v_number != 0. ? "TRUE" : "FALSE");
 	  break;
 	case AMF_STRING:
-	  len = snprintf(str, 255, "%.*s", prop->p_vu.p_aval.av_len,
-		   prop->p_vu.p_aval.av_val);
+	  len = snprintf(str, 255, "%.*s", v.v_aval.av_len,
+		   v.v_aval.av_val);
 	  if (len >= 1 && str[len-1] == '\n')
 	    str[len-1] = '\0';
 	  break;
 	case AMF_DATE:
-	  snprintf(str, 255, "timestamp:%.2f", prop->p_vu.p_number);
+	  snprintf(str, 255, "timestamp:%.2f", v.v_number);
 	  break;
 	default:
 	  snprintf(str, 255, "INVALID TYPE 0x%02x",
-		   (unsigned char)prop->p_type);
+		   (unsigned char)v.v_type);
 	}
-      if (str[0] && prop->p_name.av_len)
+      if (str[0] && v.v_name.av_len)
 	{
-	  RTMP_Log(RTMP_LOGINFO, "  %-22.*s%s", prop->p_name.av_len,
-		    prop->p_name.av_val, str);
+	  RTMP_Log(RTMP_LOGINFO, "  %-22.*s%s", v.v_name.av_len,
+		    v.v_name.av_val, str);
 	}
     }
   return FALSE;
@@ -3298,6 +5027,38 @@ SAVC(onMetaData);
 SAVC(duration);
 SAVC(video);
 SAVC(audio);
+SAVC(keyframes);
+SAVC(times);
+SAVC(filepositions);
+
+/* Copy out a strict array of numbers, NULL if it holds anything else */
+static double *
+KeyframesArray(const AMFCursor *c, const AVal *name, int *count)
+{
+  AMFValue v;
+  AMFCursor array, it;
+  double *vals;
+  int n = 0;
+
+  if (!AMFCursor_Find(c, name, &v) || v.v_type != AMF_STRICT_ARRAY)
+    return NULL;
+  array = it = v.v_body;
+  while (AMFCursor_Next(&it, &v))
+    {
+      if (v.v_type != AMF_NUMBER)
+	return NULL;
+      n++;
+    }
+  if (!n || it.c_error || !(vals = malloc(n * sizeof(double))))
+    return NULL;
+
+  it = array;
+  n = 0;
+  while (AMFCursor_Next(&it, &v))
+    vals[n++] = v.v_number;
+  *count = n;
+  return vals;
+}
 
 static int
 HandleMetadata(RTMP *r, char *body, unsigned int len)
@@ -3305,39 +5066,68 @@ HandleMetadata(RTMP *r, char *body, unsigned int len)
   /* allright we get some info here, so parse it and print it */
   /* also keep duration or filesize to make a nice progress bar */
 
-  AMFObject obj;
-  AVal metastring;
+  AMFCursor c;
+  AMFValue v;
   int ret = FALSE;
 
-  int nRes = AMF_Decode(&obj, body, len, FALSE);
-  if (nRes < 0)
+  AMFCursor_Init(&c, body, len);
+  if (!AMFCursor_Next(&c, &v))
     {
       RTMP_Log(RTMP_LOGERROR, "%s, error decoding meta data packet", __FUNCTION__);
       return FALSE;
     }
+  AMFCursor_Init(&c, body, len);
 
-  AMF_Dump(&obj);
-  AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &metastring);
+  if (RTMP_debuglevel >= RTMP_LOGDEBUG)
+    {
+      AMFObject obj;
+      if (AMF_Decode(&obj, body, len, FALSE) >= 0)
+	AMF_Dump(&obj);
+      AMF_Reset(&obj);
+    }
 
-  if (AVMATCH(&metastring, &av_onMetaData))
+  if (v.v_type == AMF_STRING && AVMATCH(&v.v_aval, &av_onMetaData))
     {
-      AMFObjectProperty prop;
       /* Show metadata */
-      RTMP_Log(RTMP_LOGINFO, "Metadata:");
-      DumpMetaData(&obj);
-      if (RTMP_FindFirstMatchingProperty(&obj, &av_duration, &prop))
+      if (RTMP_debuglevel >= RTMP_LOGINFO)
+	{
+	  RTMP_Log(RTMP_LOGINFO, "Metadata:");
+	  DumpMetaData(&c);
+	}
+      if (AMFCursor_Search(&c, &av_duration, FALSE, &v)
+	  && v.v_type == AMF_NUMBER)
 	{
-	  r->m_fDuration = prop.p_vu.p_number;
+	  r->m_fDuration = v.v_number;
 	  /*RTMP_Log(RTMP_LOGDEBUG, "Set duration: %.2f", m_fDuration); */
 	}
       /* Search for audio or video tags */
-      if (RTMP_FindPrefixProperty(&obj, &av_video, &prop))
+      if (AMFCursor_Search(&c, &av_video, TRUE, &v))
         r->m_read.dataType |= 1;
-      if (RTMP_FindPrefixProperty(&obj, &av_audio, &prop))
+      if (AMFCursor_Search(&c, &av_audio, TRUE, &v))
         r->m_read.dataType |= 4;
+      KeyframesReset(r);
+      if (AMFCursor_Search(&c, &av_keyframes, FALSE, &v)
+	  && v.v_type == AMF_OBJECT)
+	{
+	  RTMPKeyframes *kf = &r->m_keyframes;
+	  AMFCursor body = v.v_body;
+	  int n;
+
+	  kf->kf_times = KeyframesArray(&body, &av_times, &kf->kf_count);
+	  if (kf->kf_times)
+	    {
+	      kf->kf_positions = KeyframesArray(&body, &av_filepositions, &n);
+	      if (kf->kf_positions && n != kf->kf_count)
+		{
+		  free(kf->kf_positions);
+		  kf->kf_positions = NULL;
+		}
+	    }
+	  RTMP_Log(RTMP_LOGDEBUG, "%s, keyframe index of %d entries",
+	      __FUNCTION__, kf->kf_count);
+	}
       ret = TRUE;
     }
-  AMF_Reset(&obj);
   return ret;
 }
 
@@ -3405,6 +5195,16 @@ HandleCtrl(RTMP *r, const RTMPPacket *packet)
 	  RTMP_SendCtrl(r, 0x07, tmp, 0);
 	  break;
 
+	case 7:		/* pong, the answer to RTMP_SendPing */
+	  tmp = AMF_DecodeInt32(packet->m_body + 2);
+	  RTMP_Log(RTMP_LOGDEBUG, "%s, Pong %d", __FUNCTION__, tmp);
+	  if (r->m_pingSent && tmp == r->m_pingStamp)
+	    {
+	      r->m_stats.rs_rtt = (uint32_t)(PaceNow() - r->m_pingSent);
+	      r->m_pingSent = 0;
+	    }
+	  break;
+
 	/* FMS 3.5 servers send the following two controls to let the client
 	 * know when the server has sent a complete buffer. I.e., when the
 	 * server has sent an amount of data equal to m_nBufferMS in duration.
@@ -3448,8 +5248,7 @@ HandleCtrl(RTMP *r, const RTMPPacket *packet)
 	    break;
 	  if (!r->m_pausing)
 	    {
-	      r->m_pauseStamp = r->m_mediaChannel < r->m_channelsAllocatedIn ?
-	                        r->m_channelTimestamp[r->m_mediaChannel] : 0;
+	      r->m_pauseStamp = ChannelStamp(r, r->m_mediaChannel);
 	      RTMP_SendPause(r, TRUE, r->m_pauseStamp);
 	      r->m_pausing = 1;
 	    }
@@ -3546,48 +5345,249 @@ EncodeInt32LE(char *output, int nVal)
   return 4;
 }
 
+/* Whether the whole header of the next chunk, extended timestamp
+ * included, is already in the socket buffer so RTMP_ReadPacket can parse
+ * it in place instead of going through ReadN byte by byte.
+ */
+static int
+HeaderBuffered(RTMP *r)
+{
+  RTMPSockBuf *sb = &r->m_sb;
+  int type, channel;
+
+  if (sb->sb_size < 1 || (r->Link.protocol & RTMP_FEATURE_HTTP))
+    return FALSE;
+  type = ((uint8_t)sb->sb_start[0] & 0xc0) >> 6;
+  channel = sb->sb_start[0] & 0x3f;
+  return sb->sb_size >= (channel > 1 ? 1 : channel + 2) +
+    packetSize[type] - 1 + 4;
+}
+
+/* Consume n bytes parsed in place, with ReadN's accounting */
+static int
+SkipN(RTMP *r, int n)
+{
+#ifdef _DEBUG
+  fwrite(r->m_sb.sb_start, 1, n, netstackdump_read);
+#endif
+  r->m_sb.sb_start += n;
+  r->m_sb.sb_size -= n;
+  r->m_nBytesIn += n;
+  r->m_stats.rs_bytesIn += n;
+  if (r->m_bSendCounter
+      && r->m_nBytesIn > ( r->m_nBytesInSent + r->m_nClientBW / 10))
+    if (!SendBytesReceived(r))
+      return FALSE;
+  return TRUE;
+}
+
+/* Whether the next chunk is whole in the socket buffer. Under RTMPT its
+ * tail may come after the header of the next response */
+static int
+ChunkBuffered(RTMP *r)
+{
+  RTMPSockBuf *sb = &r->m_sb;
+  const uint8_t *p = (const uint8_t *)sb->sb_start;
+  int avail = sb->sb_size, type, channel, hSize = 1, nSize;
+  uint32_t ts = 0, bodySize = 0, bytesRead = 0, n;
+  RTMPChannelIn *ch = NULL;
+
+  if ((r->Link.protocol & RTMP_FEATURE_HTTP) && avail > r->m_resplen)
+    {
+      char *next;
+
+      avail = r->m_resplen;
+      sb->sb_start[sb->sb_size] = '\0';
+      if (sb->sb_size - avail > 13 &&
+	  (next = strstr(sb->sb_start + avail, "\r\n\r\n")))
+	avail = sb->sb_size - (next + 5 - sb->sb_start - avail);
+    }
+  if (avail < 1)
+    return FALSE;
+  type = (p[0] & 0xc0) >> 6;
+  channel = p[0] & 0x3f;
+  if (channel < 2)
+    {
+      hSize += channel + 1;
+      if (avail < hSize)
+	return FALSE;
+      channel = (channel ? p[2] << 8 : 0) + p[1] + 64;
+    }
+  nSize = packetSize[type] - 1;
+  if (avail < hSize + nSize)
+    return FALSE;
+
+  if (channel < RTMP_FAST_CHANNELS)
+    ch = &r->m_channelsIn[channel];
+  else if (channel - RTMP_FAST_CHANNELS < r->m_channelsAllocatedIn)
+    ch = &r->m_vecChannelsIn[channel - RTMP_FAST_CHANNELS];
+  if (type && ch && ch->ci_used)
+    {
+      ts = ch->ci_packet.m_nTimeStamp;
+      bodySize = ch->ci_packet.m_nBodySize;
+      bytesRead = ch->ci_packet.m_nBytesRead;
+    }
+  if (nSize >= 3)
+    ts = AMF_DecodeInt24((const char *)p + hSize);
+  if (nSize >= 6)
+    {
+      bodySize = AMF_DecodeInt24((const char *)p + hSize + 3);
+      bytesRead = 0;
+    }
+  hSize += nSize + (ts == 0xffffff ? 4 : 0);
+
+  n = bodySize > bytesRead ? bodySize - bytesRead : 0;
+  if (n > (uint32_t)r->m_inChunkSize)
+    n = r->m_inChunkSize;
+  return avail >= hSize + (int)n;
+}
+
+/* Take in what already arrived without waiting for more. FALSE if the
+ * socket is readable but gone */
+static int
+FillAvailable(RTMP *r)
+{
+  RTMPSockBuf *sb = &r->m_sb;
+  struct pollfd pfd;
+  int room, n;
+
+  if (!sb->sb_buf)
+    {
+      sb->sb_buf = sb->sb_start = sb->sb_cache;
+      sb->sb_bufSize = sizeof(sb->sb_cache);
+    }
+  /* the partial chunk has to fit, nothing points into the buffer now */
+  if (sb->sb_start != sb->sb_buf)
+    {
+      memmove(sb->sb_buf, sb->sb_start, sb->sb_size);
+      sb->sb_start = sb->sb_buf;
+    }
+  room = sb->sb_bufSize - 1 - sb->sb_size;
+  if (room <= 0)
+    return TRUE;
+
+  pfd.fd = sb->sb_socket;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+#if defined(CRYPTO) && !defined(NO_SSL)
+  if (sb->sb_ssl && TLS_pending(sb->sb_ssl) > 0)
+    pfd.revents = POLLIN;
+  else
+#endif
+  if (poll(&pfd, 1, 0) <= 0)
+    return TRUE;
+  if (!pfd.revents)
+    return TRUE;
+
+#if defined(CRYPTO) && !defined(NO_SSL)
+  if (sb->sb_ssl)
+    {
+      /* half a record must not block; the libraries keep it for the next
+       * read, which also tells a closed connection from one that would
+       * block */
+      SetNonBlocking(sb->sb_socket, TRUE);
+      n = TLS_read(sb->sb_ssl, sb->sb_start + sb->sb_size, room);
+      SetNonBlocking(sb->sb_socket, FALSE);
+      if (n > 0)
+	sb->sb_size += n;
+      return TRUE;
+    }
+#endif
+  n = recv(sb->sb_socket, sb->sb_start + sb->sb_size, room, 0);
+  if (n <= 0)
+    return n < 0 && GetSockError() == EINTR;
+  sb->sb_size += n;
+#ifdef CRYPTO
+  DecryptBuffered(r, n);
+#endif
+  return TRUE;
+}
+
+static int
+ReadReady(RTMP *r)
+{
+  int filled = FALSE, ret;
+
+  if (!RTMP_IsConnected(r))
+    return FALSE;
+  while (1)
+    {
+      if ((r->Link.protocol & RTMP_FEATURE_HTTP) && !r->m_resplen)
+	{
+	  /* ReadPacket() fails on a bad response right away */
+	  if ((ret = HTTP_read(r, 0)) == -1)
+	    return TRUE;
+	  if (ret == 0)
+	    continue;
+	}
+      else if (ChunkBuffered(r))
+	return TRUE;
+      if (filled)
+	return FALSE;
+      /* and on a closed connection */
+      if (!FillAvailable(r))
+	return TRUE;
+      filled = TRUE;
+    }
+}
+
 int
-RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
+RTMP_ReadReady(RTMP *r)
+{
+  RTMP *ctx = LogEnter(r);
+  int ret = ReadReady(r);
+
+  LogLeave(ctx);
+  return ret;
+}
+
+static int
+ReadPacket(RTMP *r, RTMPPacket *packet)
 {
-  uint8_t hbuf[RTMP_MAX_HEADER_SIZE] = { 0 };
-  char *header = (char *)hbuf;
+  uint8_t hbuf[RTMP_MAX_HEADER_SIZE] = { 0 }, *hb = hbuf;
+  char *header;
   int nSize, hSize, nToRead, nChunk;
   int didAlloc = FALSE;
   int extendedTimestamp;
+  int inPlace = HeaderBuffered(r);
+  RTMPChannelIn *ch;
 
   RTMP_Log(RTMP_LOGDEBUG2, "%s: fd=%d", __FUNCTION__, r->m_sb.sb_socket);
 
-  if (ReadN(r, (char *)hbuf, 1) == 0)
+  if (inPlace)
+    hb = (uint8_t *)r->m_sb.sb_start;
+  else if (ReadN(r, (char *)hb, 1) == 0)
     {
       RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet header", __FUNCTION__);
       return FALSE;
     }
 
-  packet->m_headerType = (hbuf[0] & 0xc0) >> 6;
-  packet->m_nChannel = (hbuf[0] & 0x3f);
+  header = (char *)hb;
+  packet->m_headerType = (hb[0] & 0xc0) >> 6;
+  packet->m_nChannel = (hb[0] & 0x3f);
   header++;
   if (packet->m_nChannel == 0)
     {
-      if (ReadN(r, (char *)&hbuf[1], 1) != 1)
+      if (!inPlace && ReadN(r, (char *)&hb[1], 1) != 1)
 	{
 	  RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet header 2nd byte",
 	      __FUNCTION__);
 	  return FALSE;
 	}
-      packet->m_nChannel = hbuf[1];
+      packet->m_nChannel = hb[1];
       packet->m_nChannel += 64;
       header++;
     }
   else if (packet->m_nChannel == 1)
     {
       int tmp;
-      if (ReadN(r, (char *)&hbuf[1], 2) != 2)
+      if (!inPlace && ReadN(r, (char *)&hb[1], 2) != 2)
 	{
 	  RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet header 3nd byte",
 	      __FUNCTION__);
 	  return FALSE;
 	}
-      tmp = (hbuf[2] << 8) + hbuf[1];
+      tmp = (hb[2] << 8) + hb[1];
       packet->m_nChannel = tmp + 64;
       RTMP_Log(RTMP_LOGDEBUG, "%s, m_nChannel: %0x", __FUNCTION__, packet->m_nChannel);
       header += 2;
@@ -3595,24 +5595,12 @@ RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
 
   nSize = packetSize[packet->m_headerType];
 
-  if (packet->m_nChannel >= r->m_channelsAllocatedIn)
-    {
-      int n = packet->m_nChannel + 10;
-      int *timestamp = realloc(r->m_channelTimestamp, sizeof(int) * n);
-      RTMPPacket **packets = realloc(r->m_vecChannelsIn, sizeof(RTMPPacket*) * n);
-      if (!timestamp)
-        free(r->m_channelTimestamp);
-      if (!packets)
-        free(r->m_vecChannelsIn);
-      r->m_channelTimestamp = timestamp;
-      r->m_vecChannelsIn = packets;
-      if (!timestamp || !packets) {
-        r->m_channelsAllocatedIn = 0;
-        return FALSE;
-      }
-      memset(r->m_channelTimestamp + r->m_channelsAllocatedIn, 0, sizeof(int) * (n - r->m_channelsAllocatedIn));
-      memset(r->m_vecChannelsIn + r->m_channelsAllocatedIn, 0, sizeof(RTMPPacket*) * (n - r->m_channelsAllocatedIn));
-      r->m_channelsAllocatedIn = n;
+  ch = ChannelIn(r, packet->m_nChannel);
+  if (!ch)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, failed to allocate channel %d", __FUNCTION__,
+	  packet->m_nChannel);
+      return FALSE;
     }
 
   if (nSize == RTMP_LARGE_HEADER_SIZE)	/* if we get a full header the timestamp is absolute */
@@ -3620,21 +5608,20 @@ RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
 
   else if (nSize < RTMP_LARGE_HEADER_SIZE)
     {				/* using values from the last message of this channel */
-      if (r->m_vecChannelsIn[packet->m_nChannel])
-	memcpy(packet, r->m_vecChannelsIn[packet->m_nChannel],
-	       sizeof(RTMPPacket));
+      if (ch->ci_used)
+	memcpy(packet, &ch->ci_packet, sizeof(RTMPPacket));
     }
 
   nSize--;
 
-  if (nSize > 0 && ReadN(r, header, nSize) != nSize)
+  if (nSize > 0 && !inPlace && ReadN(r, header, nSize) != nSize)
     {
       RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet header. type: %x",
-	  __FUNCTION__, (unsigned int)hbuf[0]);
+	  __FUNCTION__, (unsigned int)hb[0]);
       return FALSE;
     }
 
-  hSize = nSize + (header - (char *)hbuf);
+  hSize = nSize + (header - (char *)hb);
 
   if (nSize >= 3)
     {
@@ -3660,7 +5647,7 @@ RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
   extendedTimestamp = packet->m_nTimeStamp == 0xffffff;
   if (extendedTimestamp)
     {
-      if (ReadN(r, header + nSize, 4) != 4)
+      if (!inPlace && ReadN(r, header + nSize, 4) != 4)
 	{
 	  RTMP_Log(RTMP_LOGERROR, "%s, failed to read extended timestamp",
 	      __FUNCTION__);
@@ -3670,17 +5657,17 @@ RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
       hSize += 4;
     }
 
-  RTMP_LogHexString(RTMP_LOGDEBUG2, (uint8_t *)hbuf, hSize);
+  RTMP_LogHexString(RTMP_LOGDEBUG2, hb, hSize);
 
   if (packet->m_nBodySize > 0 && packet->m_body == NULL)
     {
-      if (!RTMPPacket_Alloc(packet, packet->m_nBodySize))
+      if (!RTMP_AllocPacket(r, packet, packet->m_nBodySize))
 	{
 	  RTMP_Log(RTMP_LOGDEBUG, "%s, failed to allocate packet", __FUNCTION__);
 	  return FALSE;
 	}
       didAlloc = TRUE;
-      packet->m_headerType = (hbuf[0] & 0xc0) >> 6;
+      packet->m_headerType = (hb[0] & 0xc0) >> 6;
     }
 
   nToRead = packet->m_nBodySize - packet->m_nBytesRead;
@@ -3692,11 +5679,15 @@ RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
   if (packet->m_chunk)
     {
       packet->m_chunk->c_headerSize = hSize;
-      memcpy(packet->m_chunk->c_header, hbuf, hSize);
+      memcpy(packet->m_chunk->c_header, hb, hSize);
       packet->m_chunk->c_chunk = packet->m_body + packet->m_nBytesRead;
       packet->m_chunk->c_chunkSize = nChunk;
     }
 
+  /* done with the header bytes, the body read may refill the buffer */
+  if (inPlace && !SkipN(r, hSize))
+    return FALSE;
+
   if (ReadN(r, packet->m_body + packet->m_nBytesRead, nChunk) != nChunk)
     {
       RTMP_Log(RTMP_LOGERROR, "%s, failed to read RTMP packet body. len: %u",
@@ -3707,29 +5698,33 @@ RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
   RTMP_LogHexString(RTMP_LOGDEBUG2, (uint8_t *)packet->m_body + packet->m_nBytesRead, nChunk);
 
   packet->m_nBytesRead += nChunk;
+  r->m_stats.rs_chunksIn++;
 
   /* keep the packet as ref for other packets on this channel */
-  if (!r->m_vecChannelsIn[packet->m_nChannel])
-    r->m_vecChannelsIn[packet->m_nChannel] = malloc(sizeof(RTMPPacket));
-  memcpy(r->m_vecChannelsIn[packet->m_nChannel], packet, sizeof(RTMPPacket));
+  ch->ci_packet = *packet;
+  ch->ci_used = TRUE;
   if (extendedTimestamp)
     {
-      r->m_vecChannelsIn[packet->m_nChannel]->m_nTimeStamp = 0xffffff;
+      ch->ci_packet.m_nTimeStamp = 0xffffff;
     }
 
   if (RTMPPacket_IsReady(packet))
     {
       /* make packet's timestamp absolute */
       if (!packet->m_hasAbsTimestamp)
-	packet->m_nTimeStamp += r->m_channelTimestamp[packet->m_nChannel];	/* timestamps seem to be always relative!! */
+	packet->m_nTimeStamp += ch->ci_timestamp;	/* timestamps seem to be always relative!! */
 
-      r->m_channelTimestamp[packet->m_nChannel] = packet->m_nTimeStamp;
+      ch->ci_timestamp = packet->m_nTimeStamp;
+      if (packet->m_packetType == RTMP_PACKET_TYPE_AUDIO
+	  || packet->m_packetType == RTMP_PACKET_TYPE_VIDEO
+	  || packet->m_packetType == RTMP_PACKET_TYPE_INFO)
+	r->m_stats.rs_tagsIn++;
 
       /* reset the data from the stored packet. we keep the header since we may use it later if a new packet for this channel */
       /* arrives and requests to re-use some info (small packet header) */
-      r->m_vecChannelsIn[packet->m_nChannel]->m_body = NULL;
-      r->m_vecChannelsIn[packet->m_nChannel]->m_nBytesRead = 0;
-      r->m_vecChannelsIn[packet->m_nChannel]->m_hasAbsTimestamp = FALSE;	/* can only be false if we reuse header */
+      ch->ci_packet.m_body = NULL;
+      ch->ci_packet.m_nBytesRead = 0;
+      ch->ci_packet.m_hasAbsTimestamp = FALSE;	/* can only be false if we reuse header */
     }
   else
     {
@@ -3739,6 +5734,16 @@ RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
   return TRUE;
 }
 
+int
+RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
+{
+  RTMP *ctx = LogEnter(r);
+  int ret = ReadPacket(r, packet);
+
+  LogLeave(ctx);
+  return ret;
+}
+
 #ifndef CRYPTO
 static int
 HandShake(RTMP *r, int FP9HandShake)
@@ -3895,44 +5900,51 @@ RTMP_SendChunk(RTMP *r, RTMPChunk *chunk)
 int
 RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
 {
-  const RTMPPacket *prevPacket;
+  RTMP *ctx = LogEnter(r);
+  int ret = SendPacket(r, packet, queue, NULL, 0);
+
+  LogLeave(ctx);
+  return ret;
+}
+
+/* With body set the payload is taken from the caller's iovec instead of
+ * packet->m_body and is only read, never written: the header is built
+ * in a local buffer rather than in the body's headroom.
+ */
+static int
+SendPacket(RTMP *r, RTMPPacket *packet, int queue,
+	   const struct iovec *body, int nbody)
+{
+  RTMPChannelOut *prev;
   uint32_t last = 0;
   int nSize;
-  int hSize, cSize;
-  char *header, *hptr, *hend, hbuf[RTMP_MAX_HEADER_SIZE], c;
+  int hSize, bSize;
+  char *header, *hptr, *hend, hbuf[RTMP_MAX_HEADER_SIZE];
   uint32_t t;
-  char *buffer, *tbuf = NULL, *toff = NULL;
+  char *buffer;
   int nChunkSize;
-  int tlen;
+  struct iovec iov[RTMP_IOV_MAX];
+  int iovcnt;
 
-  if (packet->m_nChannel >= r->m_channelsAllocatedOut)
+  prev = ChannelOut(r, packet->m_nChannel);
+  if (!prev)
     {
-      int n = packet->m_nChannel + 10;
-      RTMPPacket **packets = realloc(r->m_vecChannelsOut, sizeof(RTMPPacket*) * n);
-      if (!packets) {
-        free(r->m_vecChannelsOut);
-        r->m_vecChannelsOut = NULL;
-        r->m_channelsAllocatedOut = 0;
-        return FALSE;
-      }
-      r->m_vecChannelsOut = packets;
-      memset(r->m_vecChannelsOut + r->m_channelsAllocatedOut, 0, sizeof(RTMPPacket*) * (n - r->m_channelsAllocatedOut));
-      r->m_channelsAllocatedOut = n;
+      RTMP_Log(RTMP_LOGERROR, "%s, failed to allocate channel %d", __FUNCTION__,
+	  packet->m_nChannel);
+      return FALSE;
     }
-
-  prevPacket = r->m_vecChannelsOut[packet->m_nChannel];
-  if (prevPacket && packet->m_headerType != RTMP_PACKET_SIZE_LARGE)
+  if (prev->co_used && packet->m_headerType != RTMP_PACKET_SIZE_LARGE)
     {
       /* compress a bit by using the prev packet's attributes */
-      if (prevPacket->m_nBodySize == packet->m_nBodySize
-	  && prevPacket->m_packetType == packet->m_packetType
+      if (prev->co_bodySize == packet->m_nBodySize
+	  && prev->co_packetType == packet->m_packetType
 	  && packet->m_headerType == RTMP_PACKET_SIZE_MEDIUM)
 	packet->m_headerType = RTMP_PACKET_SIZE_SMALL;
 
-      if (prevPacket->m_nTimeStamp == packet->m_nTimeStamp
+      if (prev->co_timestamp == packet->m_nTimeStamp
 	  && packet->m_headerType == RTMP_PACKET_SIZE_SMALL)
 	packet->m_headerType = RTMP_PACKET_SIZE_MINIMUM;
-      last = prevPacket->m_nTimeStamp;
+      last = prev->co_timestamp;
     }
 
   if (packet->m_headerType > 3)	/* sanity */
@@ -3943,58 +5955,43 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
     }
 
   nSize = packetSize[packet->m_headerType];
-  hSize = nSize; cSize = 0;
+  bSize = prev->co_basicSize;
+  hSize = nSize - 1 + bSize;
   t = packet->m_nTimeStamp - last;
 
-  if (packet->m_body)
+  if (packet->m_body && !body)
     {
       header = packet->m_body - nSize;
       hend = packet->m_body;
     }
   else
     {
-      header = hbuf + 6;
-      hend = hbuf + sizeof(hbuf);
-    }
-
-  if (packet->m_nChannel > 319)
-    cSize = 2;
-  else if (packet->m_nChannel > 63)
-    cSize = 1;
-  if (cSize)
-    {
-      header -= cSize;
-      hSize += cSize;
+      header = hbuf + 6;
+      hend = hbuf + sizeof(hbuf);
     }
+  header -= bSize - 1;
 
+  /* the type 3 header for the continuation chunks carries the extended
+   * timestamp too; it is only re-encoded when that changes */
   if (t >= 0xffffff)
     {
       header -= 4;
       hSize += 4;
       RTMP_Log(RTMP_LOGWARNING, "Larger timestamp than 24-bit: 0x%x", t);
+      if (prev->co_contTime != t)
+	{
+	  AMF_EncodeInt32(prev->co_cont + bSize, prev->co_cont + sizeof(prev->co_cont), t);
+	  prev->co_contTime = t;
+	}
+      prev->co_contSize = bSize + 4;
     }
+  else
+    prev->co_contSize = bSize;
 
   hptr = header;
-  c = packet->m_headerType << 6;
-  switch (cSize)
-    {
-    case 0:
-      c |= packet->m_nChannel;
-      break;
-    case 1:
-      break;
-    case 2:
-      c |= 1;
-      break;
-    }
-  *hptr++ = c;
-  if (cSize)
-    {
-      int tmp = packet->m_nChannel - 64;
-      *hptr++ = tmp & 0xff;
-      if (cSize == 2)
-	*hptr++ = tmp >> 8;
-    }
+  memcpy(hptr, prev->co_cont, bSize);
+  *hptr = (*hptr & 0x3f) | (packet->m_headerType << 6);
+  hptr += bSize;
 
   if (nSize > 1)
     {
@@ -4019,83 +6016,99 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
 
   RTMP_Log(RTMP_LOGDEBUG2, "%s: fd=%d, size=%d", __FUNCTION__, r->m_sb.sb_socket,
       nSize);
-  /* send all chunks in one HTTP request */
-  if (r->Link.protocol & RTMP_FEATURE_HTTP)
-    {
-      int chunks = (nSize+nChunkSize-1) / nChunkSize;
-      if (chunks > 1)
-        {
-	  tlen = chunks * (cSize + 1) + nSize + hSize;
-	  tbuf = malloc(tlen);
-	  if (!tbuf)
-	    return FALSE;
-	  toff = tbuf;
+  /* gather the whole packet into an iovec: every continuation header is
+   * the channel's cached type 3 header, so all of them point at it and
+   * the body is never touched. WriteV() sends it as one HTTP request
+   * over RTMPT. */
+  iov[0].iov_base = prev->co_cont;
+  iov[0].iov_len = prev->co_contSize;
+  iovcnt = 1;
+  if (body)
+    {
+      int seg = 0;
+      size_t segoff = 0;
+
+      iov[iovcnt].iov_base = header;
+      iov[iovcnt].iov_len = hSize;
+      iovcnt++;
+      while (nSize > 0)
+	{
+	  int left = nSize < nChunkSize ? nSize : nChunkSize;
+
+	  nSize -= left;
+	  while (left > 0)
+	    {
+	      size_t n;
+
+	      if (seg >= nbody)
+		{
+		  RTMP_Log(RTMP_LOGERROR, "%s, body shorter than %u bytes",
+		      __FUNCTION__, packet->m_nBodySize);
+		  return FALSE;
+		}
+	      n = body[seg].iov_len - segoff;
+	      if (n > (size_t)left)
+		n = left;
+	      if (n)
+		{
+		  if (iovcnt > RTMP_IOV_MAX - 2)
+		    {
+		      if (!WriteV(r, iov + 1, iovcnt - 1))
+			return FALSE;
+		      iovcnt = 1;
+		    }
+		  iov[iovcnt].iov_base = (char *)body[seg].iov_base + segoff;
+		  iov[iovcnt].iov_len = n;
+		  iovcnt++;
+		}
+	      segoff += n;
+	      left -= n;
+	      if (segoff == body[seg].iov_len)
+		{
+		  seg++;
+		  segoff = 0;
+		}
+	    }
+	  if (nSize > 0)
+	    iov[iovcnt++] = iov[0];
 	}
+      hSize = 0;
     }
   while (nSize + hSize)
     {
-      int wrote;
-
       if (nSize < nChunkSize)
 	nChunkSize = nSize;
 
       RTMP_LogHexString(RTMP_LOGDEBUG2, (uint8_t *)header, hSize);
       RTMP_LogHexString(RTMP_LOGDEBUG2, (uint8_t *)buffer, nChunkSize);
-      if (tbuf)
-        {
-	  memcpy(toff, header, nChunkSize + hSize);
-	  toff += nChunkSize + hSize;
-	}
-      else
-        {
-	  wrote = WriteN(r, header, nChunkSize + hSize);
-	  if (!wrote)
+      /* iov[0] is the template header, entries start at 1 */
+      if (iovcnt > RTMP_IOV_MAX - 2)
+	{
+	  if (!WriteV(r, iov + 1, iovcnt - 1))
 	    return FALSE;
+	  iovcnt = 1;
 	}
+      iov[iovcnt].iov_base = header;
+      iov[iovcnt].iov_len = nChunkSize + hSize;
+      iovcnt++;
       nSize -= nChunkSize;
       buffer += nChunkSize;
       hSize = 0;
 
       if (nSize > 0)
 	{
-	  header = buffer - 1;
-	  hSize = 1;
-	  if (cSize)
-	    {
-	      header -= cSize;
-	      hSize += cSize;
-	    }
-          if (t >= 0xffffff)
-            {
-              header -= 4;
-              hSize += 4;
-            }
-	  *header = (0xc0 | c);
-	  if (cSize)
-	    {
-	      int tmp = packet->m_nChannel - 64;
-	      header[1] = tmp & 0xff;
-	      if (cSize == 2)
-		header[2] = tmp >> 8;
-	    }
-          if (t >= 0xffffff)
-            {
-              char* extendedTimestamp = header + 1 + cSize;
-              AMF_EncodeInt32(extendedTimestamp, extendedTimestamp + 4, t);
-            }
+	  iov[iovcnt++] = iov[0];
+	  header = buffer;
 	}
     }
-  if (tbuf)
+  if (iovcnt > 1)
     {
-      int wrote = WriteN(r, tbuf, toff-tbuf);
-      free(tbuf);
-      tbuf = NULL;
-      if (!wrote)
+      if (!WriteV(r, iov + 1, iovcnt - 1))
         return FALSE;
     }
 
   /* we invoked a remote method */
-  if (packet->m_packetType == RTMP_PACKET_TYPE_INVOKE)
+  if (packet->m_packetType == RTMP_PACKET_TYPE_INVOKE && !body)
     {
       AVal method;
       char *ptr;
@@ -4111,22 +6124,44 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
       }
     }
 
-  if (!r->m_vecChannelsOut[packet->m_nChannel])
-    r->m_vecChannelsOut[packet->m_nChannel] = malloc(sizeof(RTMPPacket));
-  memcpy(r->m_vecChannelsOut[packet->m_nChannel], packet, sizeof(RTMPPacket));
+  prev->co_timestamp = packet->m_nTimeStamp;
+  prev->co_bodySize = packet->m_nBodySize;
+  prev->co_packetType = packet->m_packetType;
+  prev->co_used = TRUE;
+
+  nSize = packet->m_nBodySize;
+  r->m_stats.rs_chunksOut += nSize > r->m_outChunkSize ?
+    (nSize + r->m_outChunkSize - 1) / r->m_outChunkSize : 1;
+  if (packet->m_packetType == RTMP_PACKET_TYPE_AUDIO
+      || packet->m_packetType == RTMP_PACKET_TYPE_VIDEO
+      || packet->m_packetType == RTMP_PACKET_TYPE_INFO)
+    r->m_stats.rs_tagsOut++;
   return TRUE;
 }
 
 int
 RTMP_Serve(RTMP *r)
 {
-  return SHandShake(r);
+  RTMP *ctx = LogEnter(r);
+  int ret = SHandShake(r);
+
+  LogLeave(ctx);
+  return ret;
+}
+
+static void
+Close(RTMP *r)
+{
+  CloseInternal(r, 0);
 }
 
 void
 RTMP_Close(RTMP *r)
 {
-  CloseInternal(r, 0);
+  RTMP *ctx = LogEnter(r);
+
+  Close(r);
+  LogLeave(ctx);
 }
 
 static void
@@ -4141,9 +6176,12 @@ CloseInternal(RTMP *r, int reconnect)
 	  i = r->m_stream_id;
 	  r->m_stream_id = 0;
           if ((r->Link.protocol & RTMP_FEATURE_WRITE))
-	    SendFCUnpublish(r);
+	    SendFCUnpublish(r, &r->Link.playpath);
 	  SendDeleteStream(r, i);
 	}
+      /* what is held back goes out ahead of the close, with the client id
+       * RTMPT posts it under */
+      RTMP_Flush(r);
       if (r->m_clientID.av_val)
         {
 	  HTTP_Post(r, RTMPT_CLOSE, "", 1);
@@ -4153,15 +6191,18 @@ CloseInternal(RTMP *r, int reconnect)
 	}
       RTMPSockBuf_Close(&r->m_sb);
     }
+  r->m_coalesce.co_len = 0;
 
   r->m_stream_id = -1;
   r->m_sb.sb_socket = -1;
   r->m_nBWCheckCounter = 0;
   r->m_nBytesIn = 0;
   r->m_nBytesInSent = 0;
+  r->m_stats.rs_bytesAcked = 0;
+  r->m_pingSent = 0;
 
   if (r->m_read.flags & RTMP_READ_HEADER) {
-    free(r->m_read.buf);
+    PoolPut(r->m_read.buf);
     r->m_read.buf = NULL;
   }
   r->m_read.dataType = 0;
@@ -4174,35 +6215,14 @@ CloseInternal(RTMP *r, int reconnect)
   r->m_write.m_nBytesRead = 0;
   RTMPPacket_Free(&r->m_write);
 
-  for (i = 0; i < r->m_channelsAllocatedIn; i++)
-    {
-      if (r->m_vecChannelsIn[i])
-	{
-	  RTMPPacket_Free(r->m_vecChannelsIn[i]);
-	  free(r->m_vecChannelsIn[i]);
-	  r->m_vecChannelsIn[i] = NULL;
-	}
-    }
-  free(r->m_vecChannelsIn);
-  r->m_vecChannelsIn = NULL;
-  free(r->m_channelTimestamp);
-  r->m_channelTimestamp = NULL;
-  r->m_channelsAllocatedIn = 0;
-  for (i = 0; i < r->m_channelsAllocatedOut; i++)
-    {
-      if (r->m_vecChannelsOut[i])
-	{
-	  free(r->m_vecChannelsOut[i]);
-	  r->m_vecChannelsOut[i] = NULL;
-	}
-    }
-  free(r->m_vecChannelsOut);
-  r->m_vecChannelsOut = NULL;
-  r->m_channelsAllocatedOut = 0;
+  ChannelsReset(r);
   AV_clear(r->m_methodCalls, r->m_numCalls);
   r->m_methodCalls = NULL;
   r->m_numCalls = 0;
   r->m_numInvokes = 0;
+  free(r->m_failedStreams);
+  r->m_failedStreams = NULL;
+  r->m_numFailed = 0;
 
   r->m_bPlaying = FALSE;
   r->m_sb.sb_size = 0;
@@ -4210,6 +6230,7 @@ CloseInternal(RTMP *r, int reconnect)
   r->m_msgCounter = 0;
   r->m_resplen = 0;
   r->m_unackd = 0;
+  r->m_emptyPolls = 0;
 
   if (r->Link.lFlags & RTMP_LF_FTCU && !reconnect)
     {
@@ -4228,6 +6249,7 @@ CloseInternal(RTMP *r, int reconnect)
     {
       free(r->Link.playpath0.av_val);
       r->Link.playpath0.av_val = NULL;
+      PoolRelease(r);
     }
 #ifdef CRYPTO
   if (r->Link.dh)
@@ -4253,16 +6275,33 @@ RTMPSockBuf_Fill(RTMPSockBuf *sb)
 {
   int nBytes;
 
+  if (!sb->sb_buf)
+    {
+      sb->sb_buf = sb->sb_cache;
+      sb->sb_bufSize = sizeof(sb->sb_cache);
+    }
   if (!sb->sb_size)
     sb->sb_start = sb->sb_buf;
 
   while (1)
     {
-      nBytes = sizeof(sb->sb_buf) - 1 - sb->sb_size - (sb->sb_start - sb->sb_buf);
+      nBytes = sb->sb_bufSize - 1 - sb->sb_size - (sb->sb_start - sb->sb_buf);
 #if defined(CRYPTO) && !defined(NO_SSL)
       if (sb->sb_ssl)
 	{
-	  nBytes = TLS_read(sb->sb_ssl, sb->sb_start + sb->sb_size, nBytes);
+	  int room = nBytes;
+
+	  nBytes = TLS_read(sb->sb_ssl, sb->sb_start + sb->sb_size, room);
+	  /* a read returns at most one record, take the rest of what the
+	   * library already decrypted without another trip through ReadN */
+	  while (nBytes > 0 && nBytes < room && TLS_pending(sb->sb_ssl) > 0)
+	    {
+	      int more = TLS_read(sb->sb_ssl,
+		  sb->sb_start + sb->sb_size + nBytes, room - nBytes);
+	      if (more <= 0)
+		break;
+	      nBytes += more;
+	    }
 	}
       else
 #endif
@@ -4303,7 +6342,7 @@ RTMPSockBuf_Send(RTMPSockBuf *sb, const char *buf, int len, int timeout)
 #endif
 
 #if defined(CRYPTO) && !defined(NO_SSL)
-  if (sb->sb_ssl)
+  if (sb->sb_ssl && !sb->sb_ktls)
     {
       rc = TLS_write(sb->sb_ssl, buf, len);
     }
@@ -4322,6 +6361,41 @@ RTMPSockBuf_Send(RTMPSockBuf *sb, const char *buf, int len, int timeout)
   return rc;
 }
 
+int
+RTMPSockBuf_SendV(RTMPSockBuf *sb, struct iovec *iov, int iovcnt, int timeout)
+{
+  int rc;
+
+#ifdef _DEBUG
+  {
+    int i;
+    for (i = 0; i < iovcnt; i++)
+      fwrite(iov[i].iov_base, 1, iov[i].iov_len, netstackdump);
+  }
+#endif
+
+  if (timeout > 0) {
+    SET_RCVTIMEO(tv, timeout);
+    if (setsockopt(sb->sb_socket, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv))) {
+      RTMP_Log(RTMP_LOGERROR, "%s, Setting socket send timeout to %ds failed!",
+      __FUNCTION__, timeout);
+    }
+  }
+#ifdef _WIN32
+  /* no sendmsg, the caller loops over partial writes anyway */
+  rc = send(sb->sb_socket, iov[0].iov_base, iov[0].iov_len, 0);
+#else
+  {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    rc = sendmsg(sb->sb_socket, &msg, 0);
+  }
+#endif
+  return rc;
+}
+
 int
 RTMPSockBuf_Close(RTMPSockBuf *sb)
 {
@@ -4331,6 +6405,7 @@ RTMPSockBuf_Close(RTMPSockBuf *sb)
       TLS_shutdown(sb->sb_ssl);
       TLS_close(sb->sb_ssl);
       sb->sb_ssl = NULL;
+      sb->sb_ktls = FALSE;
     }
 #endif
   if (sb->sb_socket != -1)
@@ -4410,11 +6485,21 @@ DecodeTEA(AVal *key, AVal *text)
   free(out);
 }
 
+/* Header and body of a request go out in one vectored write. Returns the
+ * body bytes sent, or -1 with the socket error set.
+ */
 static int
-HTTP_Post(RTMP *r, RTMPTCmd cmd, const char *buf, int len)
+HTTP_PostV(RTMP *r, RTMPTCmd cmd, const struct iovec *body, int nbody)
 {
   char hbuf[512];
-  int hlen = snprintf(hbuf, sizeof(hbuf), "POST /%s%s/%d HTTP/1.1\r\n"
+  struct iovec iov[RTMP_IOV_MAX], *v = iov;
+  int i, n, hlen, len = 0, cnt = nbody + 1;
+
+  if (nbody >= RTMP_IOV_MAX)
+    return -1;
+  for (i = 0; i < nbody; i++)
+    len += body[i].iov_len;
+  hlen = snprintf(hbuf, sizeof(hbuf), "POST /%s%s/%d HTTP/1.1\r\n"
     "Host: %.*s:%d\r\n"
     "Accept: */*\r\n"
     "User-Agent: Shockwave Flash\r\n"
@@ -4425,11 +6510,72 @@ HTTP_Post(RTMP *r, RTMPTCmd cmd, const char *buf, int len)
     r->m_clientID.av_val ? r->m_clientID.av_val : "",
     r->m_msgCounter, r->Link.hostname.av_len, r->Link.hostname.av_val,
     r->Link.port, len);
-  RTMPSockBuf_Send(&r->m_sb, hbuf, hlen, r->Link.timeout);
-  hlen = RTMPSockBuf_Send(&r->m_sb, buf, len, r->Link.timeout);
+
+  iov[0].iov_base = hbuf;
+  iov[0].iov_len = hlen;
+  memcpy(iov + 1, body, nbody * sizeof(struct iovec));
+#if defined(CRYPTO) && !defined(NO_SSL)
+  if (r->m_sb.sb_ssl && !r->m_sb.sb_ktls)
+    {
+      if (TLSWriteV(r, iov, cnt) < 0)
+	return -1;
+    }
+  else
+#endif
+    {
+      while (cnt > 0)
+	{
+	  n = RTMPSockBuf_SendV(&r->m_sb, v, cnt, r->Link.timeout);
+	  if (n < 0 && GetSockError() == EINTR && !RTMP_ctrlC)
+	    continue;
+	  if (n <= 0)
+	    return -1;
+	  while (cnt > 0 && n >= (int)v->iov_len)
+	    {
+	      n -= v->iov_len;
+	      v++;
+	      cnt--;
+	    }
+	  if (cnt > 0 && n > 0)
+	    {
+	      v->iov_base = (char *)v->iov_base + n;
+	      v->iov_len -= n;
+	    }
+	}
+    }
   r->m_msgCounter++;
   r->m_unackd++;
-  return hlen;
+  return len;
+}
+
+static int
+HTTP_Post(RTMP *r, RTMPTCmd cmd, const char *buf, int len)
+{
+  struct iovec iov;
+
+  iov.iov_base = (char *)buf;
+  iov.iov_len = len;
+  return HTTP_PostV(r, cmd, &iov, 1);
+}
+
+/* The server's polling hint grows while it has nothing for us, back off
+ * by it between empty idle polls instead of polling flat out.
+ */
+static void
+HTTP_IdleWait(RTMP *r)
+{
+  int ms;
+
+  if (!r->m_emptyPolls || r->m_polling <= 0)
+    return;
+  ms = r->m_polling * RTMPT_POLL_STEP;
+  if (ms > RTMPT_POLL_MAX)
+    ms = RTMPT_POLL_MAX;
+#ifdef _WIN32
+  Sleep(ms);
+#else
+  usleep(ms * 1000);
+#endif
 }
 
 static int
@@ -4492,6 +6638,10 @@ restart:
     {
       r->m_polling = *ptr++;
       r->m_resplen = hlen - 1;
+      if (r->m_resplen)
+	r->m_emptyPolls = 0;
+      else
+	r->m_emptyPolls++;
       r->m_sb.sb_start++;
       r->m_sb.sb_size--;
     }
@@ -4573,16 +6723,13 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
 	      if (r->m_read.nMetaHeaderSize > 0
 		  && packet.m_packetType == RTMP_PACKET_TYPE_INFO)
 		{
-		  AMFObject metaObj;
-		  int nRes =
-		    AMF_Decode(&metaObj, packetBody, nPacketLen, FALSE);
-		  if (nRes >= 0)
+		  AMFCursor meta;
+		  AMFValue metastring;
+		  AMFCursor_Init(&meta, packetBody, nPacketLen);
+		  if (AMFCursor_Next(&meta, &metastring))
 		    {
-		      AVal metastring;
-		      AMFProp_GetString(AMF_GetProp(&metaObj, NULL, 0),
-					&metastring);
-
-		      if (AVMATCH(&metastring, &av_onMetaData))
+		      if (metastring.v_type == AMF_STRING
+			  && AVMATCH(&metastring.v_aval, &av_onMetaData))
 			{
 			  /* compare */
 			  if ((r->m_read.nMetaHeaderSize != nPacketLen) ||
@@ -4593,7 +6740,6 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
 			      ret = RTMP_READ_ERROR;
 			    }
 			}
-		      AMF_Reset(&metaObj);
 		      if (ret == RTMP_READ_ERROR)
 			break;
 		    }
@@ -4805,7 +6951,7 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
 	{
 	  /* the extra 4 is for the case of an FLV stream without a last
 	   * prevTagSize (we need extra 4 bytes to append it) */
-	  r->m_read.buf = malloc(size + 4);
+	  r->m_read.buf = PoolGet(r, size + 4);
 	  if (r->m_read.buf == 0)
 	    {
 	      RTMP_Log(RTMP_LOGERROR, "Couldn't allocate memory!");
@@ -4982,8 +7128,8 @@ static const char flvHeader[] = { 'F', 'L', 'V', 0x01,
 };
 
 #define HEADERBUF	(128*1024)
-int
-RTMP_Read(RTMP *r, char *buf, int size)
+static int
+Read(RTMP *r, char *buf, int size)
 {
   int nRead = 0, total = 0;
 
@@ -5005,8 +7151,13 @@ fail:
     {
       if (!(r->m_read.flags & RTMP_READ_RESUME))
 	{
-	  char *mybuf = malloc(HEADERBUF), *end = mybuf + HEADERBUF;
+	  char *mybuf = PoolGet(r, HEADERBUF), *end = mybuf + HEADERBUF;
 	  int cnt = 0;
+	  if (!mybuf)
+	    {
+	      r->m_read.status = RTMP_READ_ERROR;
+	      goto fail;
+	    }
 	  r->m_read.buf = mybuf;
 	  r->m_read.buflen = HEADERBUF;
 
@@ -5020,7 +7171,7 @@ fail:
 	      nRead = Read_1_Packet(r, r->m_read.buf, r->m_read.buflen);
 	      if (nRead < 0)
 		{
-		  free(mybuf);
+		  PoolPut(mybuf);
 		  r->m_read.buf = NULL;
 		  r->m_read.buflen = 0;
 		  r->m_read.status = nRead;
@@ -5028,9 +7179,22 @@ fail:
 		}
 	      /* buffer overflow, fix buffer and give up */
 	      if (r->m_read.buf < mybuf || r->m_read.buf > end) {
-	      	mybuf = realloc(mybuf, cnt + nRead);
-		memcpy(mybuf+cnt, r->m_read.buf, nRead);
-		free(r->m_read.buf);
+		char *grown = PoolGet(r, cnt + nRead);
+		if (grown)
+		  {
+		    memcpy(grown, mybuf, cnt);
+		    memcpy(grown+cnt, r->m_read.buf, nRead);
+		  }
+		PoolPut(r->m_read.buf);
+		PoolPut(mybuf);
+		if (!grown)
+		  {
+		    r->m_read.buf = NULL;
+		    r->m_read.buflen = 0;
+		    r->m_read.status = RTMP_READ_ERROR;
+		    goto fail;
+		  }
+		mybuf = grown;
 		r->m_read.buf = mybuf+cnt+nRead;
 	        break;
 	      }
@@ -5051,7 +7215,7 @@ fail:
   if ((r->m_read.flags & RTMP_READ_SEEKING) && r->m_read.buf)
     {
       /* drop whatever's here */
-      free(r->m_read.buf);
+      PoolPut(r->m_read.buf);
       r->m_read.buf = NULL;
       r->m_read.bufpos = NULL;
       r->m_read.buflen = 0;
@@ -5067,7 +7231,7 @@ fail:
       r->m_read.buflen -= nRead;
       if (!r->m_read.buflen)
 	{
-	  free(r->m_read.buf);
+	  PoolPut(r->m_read.buf);
 	  r->m_read.buf = NULL;
 	  r->m_read.bufpos = NULL;
 	}
@@ -5096,10 +7260,175 @@ fail:
   return total;
 }
 
-static const AVal av_setDataFrame = AVC("@setDataFrame");
+int
+RTMP_Read(RTMP *r, char *buf, int size)
+{
+  RTMP *ctx = LogEnter(r);
+  int ret = Read(r, buf, size);
+
+  LogLeave(ctx);
+  return ret;
+}
+
+static int
+ReadTag(RTMP *r, RTMPTag *tag)
+{
+  RTMPPacket packet = { 0 };
+  RTMPPoolBlock *b;
+  char *body, *end;
+  uint32_t len, size, ts;
+  int got;
+
+  switch (r->m_read.status) {
+  case RTMP_READ_EOF:
+  case RTMP_READ_COMPLETE:
+    return 0;
+  case RTMP_READ_ERROR:
+    SetSockError(EINVAL);
+    return -1;
+  default:
+    break;
+  }
+
+  while ((got = RTMP_GetNextMediaPacket(r, &packet)))
+    {
+      if (got == 2)
+	{
+	  RTMP_Log(RTMP_LOGDEBUG,
+	      "Got Play.Complete or Play.Stop from server. "
+	      "Assuming stream is complete");
+	  RTMPPacket_Free(&packet);
+	  r->m_read.status = RTMP_READ_COMPLETE;
+	  return 0;
+	}
+
+      body = packet.m_body;
+      len = packet.m_nBodySize;
+      r->m_read.dataType |= (((packet.m_packetType == RTMP_PACKET_TYPE_AUDIO) << 2) |
+			     (packet.m_packetType == RTMP_PACKET_TYPE_VIDEO));
+
+      /* same filtering as Read_1_Packet */
+      if ((packet.m_packetType == RTMP_PACKET_TYPE_VIDEO && len <= 5) ||
+	  (packet.m_packetType == RTMP_PACKET_TYPE_AUDIO && len <= 1) ||
+	  (packet.m_packetType == RTMP_PACKET_TYPE_FLASH_VIDEO && len <= 11) ||
+	  (r->m_read.flags & RTMP_READ_SEEKING))
+	{
+	  RTMP_Log(RTMP_LOGDEBUG, "%s, ignoring packet type %02X, size %u",
+	      __FUNCTION__, packet.m_packetType, len);
+	  RTMPPacket_Free(&packet);
+	  continue;
+	}
+
+      b = (RTMPPoolBlock *)(body - RTMP_MAX_HEADER_SIZE) - 1;
+      if (b->pb_size < RTMP_MAX_HEADER_SIZE + len + 4)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, no room for the tag size", __FUNCTION__);
+	  RTMPPacket_Free(&packet);
+	  r->m_read.status = RTMP_READ_ERROR;
+	  return -1;
+	}
+      end = body + len + 4;
+
+      if (packet.m_packetType == RTMP_PACKET_TYPE_FLASH_VIDEO)
+	{
+	  /* already FLV tags, only fix the timestamps and tag sizes */
+	  uint32_t pos = 0, dataSize;
+	  int delta;
+
+	  ts = AMF_DecodeInt24(body + 4);
+	  ts |= (body[7] << 24);
+	  delta = packet.m_nTimeStamp - ts;
+	  tag->tg_timestamp = ts + delta;
+
+	  size = len;
+	  while (pos + 11 < len)
+	    {
+	      dataSize = AMF_DecodeInt24(body + pos + 1);
+	      ts = AMF_DecodeInt24(body + pos + 4);
+	      ts |= (body[pos + 7] << 24);
+	      if (delta)
+		{
+		  ts += delta;
+		  AMF_EncodeInt24(body + pos + 4, end, ts);
+		  body[pos + 7] = ts >> 24;
+		}
+	      r->m_read.dataType |= (((body[pos] == 0x08) << 2) |
+				     (body[pos] == 0x09));
+
+	      if (pos + 11 + dataSize + 4 > len)
+		{
+		  if (pos + 11 + dataSize > len)
+		    {
+		      RTMP_Log(RTMP_LOGERROR,
+			  "Wrong data size (%u), stream corrupted, aborting!",
+			  dataSize);
+		      RTMPPacket_Free(&packet);
+		      r->m_read.status = RTMP_READ_ERROR;
+		      return -1;
+		    }
+		  RTMP_Log(RTMP_LOGWARNING, "No tagSize found, appending!");
+		  AMF_EncodeInt32(body + pos + 11 + dataSize, end, dataSize + 11);
+		  size = pos + 11 + dataSize + 4;
+		  break;
+		}
+	      if (AMF_DecodeInt32(body + pos + 11 + dataSize) != dataSize + 11)
+		AMF_EncodeInt32(body + pos + 11 + dataSize, end, dataSize + 11);
+	      pos += 11 + dataSize + 4;
+	    }
+	  tag->tg_data = body;
+	}
+      else
+	{
+	  /* audio, video or metadata: 11 byte tag header in the headroom */
+	  char *ptr = body - 11;
+
+	  ts = packet.m_nTimeStamp;
+	  tag->tg_timestamp = ts;
+	  ptr[0] = packet.m_packetType;
+	  AMF_EncodeInt24(ptr + 1, end, len);
+	  AMF_EncodeInt24(ptr + 4, end, ts);
+	  ptr[7] = (char)((ts & 0xFF000000) >> 24);
+	  AMF_EncodeInt24(ptr + 8, end, 0);
+	  AMF_EncodeInt32(body + len, end, len + 11);
+
+	  tag->tg_data = ptr;
+	  size = len + 11 + 4;
+	}
+
+      r->m_read.timestamp = (r->Link.lFlags & RTMP_LF_LIVE) ?
+	packet.m_nTimeStamp : ts;
+
+      tag->tg_size = size;
+      tag->tg_type = packet.m_packetType;
+      tag->tg_mem = PoolDetach(body - RTMP_MAX_HEADER_SIZE);
+      packet.m_body = NULL;
+      return size;
+    }
+
+  r->m_read.status = RTMP_READ_EOF;
+  return 0;
+}
 
 int
-RTMP_Write(RTMP *r, const char *buf, int size)
+RTMP_ReadTag(RTMP *r, RTMPTag *tag)
+{
+  RTMP *ctx = LogEnter(r);
+  int ret = ReadTag(r, tag);
+
+  LogLeave(ctx);
+  return ret;
+}
+
+void
+RTMP_FreeTag(void *mem)
+{
+  free(mem);
+}
+
+static const AVal av_setDataFrame = AVC("@setDataFrame");
+
+static int
+Write(RTMP *r, const char *buf, int size)
 {
   RTMPPacket *pkt = &r->m_write;
   char *pend, *enc;
@@ -5145,7 +7474,7 @@ RTMP_Write(RTMP *r, const char *buf, int size)
 	      pkt->m_headerType = RTMP_PACKET_SIZE_MEDIUM;
 	    }
 
-	  if (!RTMPPacket_Alloc(pkt, pkt->m_nBodySize))
+	  if (!RTMP_AllocPacket(r, pkt, pkt->m_nBodySize))
 	    {
 	      RTMP_Log(RTMP_LOGDEBUG, "%s, failed to allocate packet", __FUNCTION__);
 	      return FALSE;
@@ -5184,3 +7513,72 @@ RTMP_Write(RTMP *r, const char *buf, int size)
     }
   return size+s2;
 }
+
+int
+RTMP_Write(RTMP *r, const char *buf, int size)
+{
+  RTMP *ctx = LogEnter(r);
+  int ret = Write(r, buf, size);
+
+  LogLeave(ctx);
+  return ret;
+}
+
+static int
+WriteTag(RTMP *r, int streamId, int channel, int type, uint32_t timestamp,
+	 const char *data, uint32_t size)
+{
+  RTMPPacket packet = { 0 };
+  struct iovec body[2];
+  char sdf[32];
+  int nbody = 0;
+
+  packet.m_nChannel = channel;
+  packet.m_nInfoField2 = streamId;
+  packet.m_packetType = type;
+  packet.m_nTimeStamp = timestamp;
+  packet.m_nBodySize = size;
+
+  if (((type == RTMP_PACKET_TYPE_AUDIO || type == RTMP_PACKET_TYPE_VIDEO) &&
+       !timestamp) || type == RTMP_PACKET_TYPE_INFO)
+    packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+  else
+    packet.m_headerType = RTMP_PACKET_SIZE_MEDIUM;
+
+  if (type == RTMP_PACKET_TYPE_INFO)
+    {
+      char *enc = AMF_EncodeString(sdf, sdf + sizeof(sdf), &av_setDataFrame);
+      body[nbody].iov_base = sdf;
+      body[nbody].iov_len = enc - sdf;
+      packet.m_nBodySize += enc - sdf;
+      nbody++;
+    }
+  body[nbody].iov_base = (char *)data;
+  body[nbody].iov_len = size;
+  nbody++;
+
+  return SendPacket(r, &packet, FALSE, body, nbody);
+}
+
+int
+RTMP_WriteTag(RTMP *r, int type, uint32_t timestamp, const char *data,
+	      uint32_t size)
+{
+  RTMP *ctx = LogEnter(r);
+  /* source channel */
+  int ret = WriteTag(r, r->m_stream_id, 0x04, type, timestamp, data, size);
+
+  LogLeave(ctx);
+  return ret;
+}
+
+int
+RTMP_WriteStreamTag(RTMP *r, int streamId, int channel, int type,
+		    uint32_t timestamp, const char *data, uint32_t size)
+{
+  RTMP *ctx = LogEnter(r);
+  int ret = WriteTag(r, streamId, channel, type, timestamp, data, size);
+
+  LogLeave(ctx);
+  return ret;
+}
@@ -60,10 +60,34 @@ extern "C"
 
 #define RTMP_DEFAULT_CHUNKSIZE	128
 
-/* needs to fit largest number of bytes recv() may return */
+/* needs to fit largest number of bytes recv() may return; this is the
+ * default receive buffer, RTMP_SetReceiveBuffer() can use a larger one */
 #define RTMP_BUFFER_CACHE_SIZE (16*1024)
 
 #define	RTMP_CHANNELS	65600
+/* chunk stream IDs that fit a one-byte basic header, kept inline in the
+ * RTMP struct; higher ones go to a table grown on first use */
+#define RTMP_FAST_CHANNELS	64
+
+/* max number of iovec entries handed to a single sendmsg() */
+#define RTMP_IOV_MAX	512
+/* largest TLS record, writes are batched up to it */
+#define RTMP_TLS_RECORD	16384
+
+/* shared resolver cache, see RTMP_SetDNSCacheTTL() */
+#define RTMP_DNS_SLOTS	16
+#define RTMP_DNS_TTL	60	/* seconds */
+/* addresses tried per host, ms between staggered connect attempts */
+#define RTMP_MAX_ADDRS	8
+#define RTMP_CONNECT_STAGGER	250
+/* RTMPT: ms per step of the server's idle polling hint, and the most an
+ * idle poll is held back */
+#define RTMPT_POLL_STEP	16
+#define RTMPT_POLL_MAX	500
+/* handshaked connections kept by RTMP_WarmUp(), for all hosts */
+#define RTMP_WARM_MAX	32
+/* key pairs kept by RTMP_PrepareKeys() */
+#define RTMP_KEYS_MAX	16
 
   extern const char RTMPProtocolStringsLower[][7];
   extern const AVal RTMP_DefaultFlashVer;
@@ -124,16 +148,136 @@ extern "C"
     char *m_body;
   } RTMPPacket;
 
+  /* Incoming chunk stream state: the header of its last chunk, for
+   * decompressing the next one, and the body of a partial message */
+  typedef struct RTMPChannelIn
+  {
+    RTMPPacket ci_packet;
+    uint32_t ci_timestamp;	/* absolute timestamp of the last message */
+    uint8_t ci_used;
+  } RTMPChannelIn;
+
+  /* Outgoing chunk stream state: only what header compression compares
+   * against, plus the encoded type 3 header every continuation chunk
+   * repeats. Other header types are built from its basic header bytes. */
+  typedef struct RTMPChannelOut
+  {
+    uint32_t co_timestamp;	/* absolute timestamp of the last message */
+    uint32_t co_bodySize;
+    uint8_t co_packetType;
+    uint8_t co_used;
+    uint8_t co_basicSize;	/* basic header bytes at the start of co_cont */
+    uint8_t co_contSize;
+    uint32_t co_contTime;	/* extended timestamp in co_cont, 0 if none */
+    char co_cont[3 + 4];
+  } RTMPChannelOut;
+
   typedef struct RTMPSockBuf
   {
     int sb_socket;
     int sb_size;		/* number of unprocessed bytes in buffer */
     char *sb_start;		/* pointer into sb_pBuffer of next byte to process */
-    char sb_buf[RTMP_BUFFER_CACHE_SIZE];	/* data read from socket */
+    char *sb_buf;		/* data read from socket, sb_cache by default */
+    int sb_bufSize;
+    char sb_cache[RTMP_BUFFER_CACHE_SIZE];
     int sb_timedout;
     void *sb_ssl;
+    int sb_ktls;		/* the kernel encrypts what goes to sb_socket */
   } RTMPSockBuf;
 
+  /* Packet bodies and read slop buffers are recycled through a per-RTMP
+   * pool of power-of-two size classes. Bodies keep RTMP_MAX_HEADER_SIZE
+   * bytes of headroom so SendPacket can still prefix headers in place.
+   */
+#define RTMP_POOL_MIN_SHIFT	8	/* smallest class: 256 bytes */
+#define RTMP_POOL_CLASSES	11	/* largest class: 256KB */
+#define RTMP_POOL_MAX_CACHED	(1024*1024)	/* bytes parked on free lists */
+
+  typedef struct RTMPPoolStats
+  {
+    uint64_t ps_allocs;		/* total allocation requests */
+    uint64_t ps_hits;		/* requests served from a free list */
+    uint32_t ps_inUse;		/* bytes currently handed out */
+    uint32_t ps_inUseMax;	/* high-water mark of ps_inUse */
+    uint32_t ps_cached;		/* bytes parked on free lists */
+    uint32_t ps_cachedMax;	/* high-water mark of ps_cached */
+    uint32_t ps_largest;	/* largest single request */
+  } RTMPPoolStats;
+
+  /* Transport counters, kept for the lifetime of the RTMP object across
+   * reconnects except rs_bytesAcked, which is the peer's count for the
+   * current connection; see RTMP_GetStats(). Bucket i of rs_sendLatency counts
+   * send calls that took less than 16 << 2i us, the last one the rest.
+   */
+#define RTMP_STATS_BUCKETS	8
+
+  typedef struct RTMPStats
+  {
+    uint64_t rs_bytesOut;	/* on the wire, chunk headers included */
+    uint64_t rs_bytesIn;
+    uint64_t rs_chunksOut;
+    uint64_t rs_chunksIn;
+    uint64_t rs_tagsOut;	/* audio, video and info messages */
+    uint64_t rs_tagsIn;
+    uint64_t rs_bytesAcked;	/* from the peer's bytes read reports */
+    uint64_t rs_sendCalls;
+    uint32_t rs_sendLatency[RTMP_STATS_BUCKETS];
+    uint32_t rs_rtt;		/* us of the last ping, 0 until answered */
+    int rs_unsent;		/* bytes in the socket send queue, -1 if unknown */
+  } RTMPStats;
+
+  /* Keyframe index of a recorded stream, from the keyframes object that
+   * FLV indexers add to onMetaData. Entry i is the keyframe at
+   * kf_times[i] seconds, kf_positions[i] its byte offset in the file or
+   * kf_positions is NULL. Replaced whenever onMetaData arrives, see
+   * RTMP_GetKeyframes().
+   */
+  typedef struct RTMPKeyframes
+  {
+    double *kf_times;
+    double *kf_positions;
+    int kf_count;
+    int kf_serial;		/* changes whenever the index is replaced */
+  } RTMPKeyframes;
+
+  /* One media packet returned by RTMP_ReadTag(), laid out as FLV tags in
+   * place: the tag header goes into the body's headroom and the trailing
+   * tag size into the spare bytes after it.
+   */
+  typedef struct RTMPTag
+  {
+    char *tg_data;		/* whole FLV tags, each with its tag size */
+    uint32_t tg_size;
+    uint32_t tg_timestamp;	/* ms, of the first tag */
+    uint8_t tg_type;		/* packet type, RTMP_PACKET_TYPE_* */
+    void *tg_mem;		/* pass to RTMP_FreeTag() */
+  } RTMPTag;
+
+  struct RTMPPool;
+
+  /* Optional output coalescing, see RTMP_SetCoalescing() */
+  typedef struct RTMPCoalesce
+  {
+    char *co_buf;
+    int co_len;			/* bytes pending in co_buf */
+    int co_size;		/* flush threshold, 0 when disabled */
+    int co_delay;		/* ms the oldest pending byte may wait */
+    uint32_t co_since;		/* RTMP_GetTime() of the oldest pending byte */
+  } RTMPCoalesce;
+
+  /* Token bucket limiting the send rate, see RTMP_SetPacing() */
+  typedef struct RTMPPacer
+  {
+    int pc_rate;		/* bytes per second, 0 when disabled */
+    int pc_burst;		/* bucket depth in bytes */
+    int pc_kernel;		/* the socket paces, SO_MAX_PACING_RATE */
+    double pc_tokens;
+    uint64_t pc_last;		/* us of the last refill */
+    uint64_t pc_delay;		/* total us spent waiting for tokens */
+    uint32_t pc_delayMax;	/* longest single wait, us */
+    uint32_t pc_waits;
+  } RTMPPacer;
+
   void RTMPPacket_Reset(RTMPPacket *p);
   void RTMPPacket_Dump(RTMPPacket *p);
   int RTMPPacket_Alloc(RTMPPacket *p, uint32_t nSize);
@@ -172,6 +316,7 @@ extern "C"
 #define RTMP_LF_BUFX	0x0010	/* toggle stream on BufferEmpty msg */
 #define RTMP_LF_FTCU	0x0020	/* free tcUrl on close */
 #define RTMP_LF_FAPU	0x0040	/* free app on close */
+#define RTMP_LF_MULTI	0x0080	/* connect only, see RTMP_PublishStream() */
     int lFlags;
 
     int swfAge;
@@ -243,6 +388,11 @@ extern "C"
     int m_nBytesInSent;
     int m_nBufferMS;
     int m_stream_id;		/* returned in _result from createStream */
+    int m_newStream;		/* RTMP_PublishStream(): -1 until createStream
+				 * returns, then its id */
+    int m_publishStatus;	/* of that stream, 1 started, -1 refused */
+    int *m_failedStreams;	/* RTMP_LF_MULTI: ended by the server */
+    int m_numFailed;
     int m_mediaChannel;
     uint32_t m_mediaStamp;
     uint32_t m_pauseStamp;
@@ -258,26 +408,39 @@ extern "C"
     int m_numCalls;
     RTMP_METHOD *m_methodCalls;	/* remote method calls queue */
 
-    int m_channelsAllocatedIn;
-    int m_channelsAllocatedOut;
-    RTMPPacket **m_vecChannelsIn;
-    RTMPPacket **m_vecChannelsOut;
-    int *m_channelTimestamp;	/* abs timestamp of last packet */
+    int m_channelsAllocatedIn;	/* slots in m_vecChannelsIn */
+    int m_channelsAllocatedOut;	/* slots in m_vecChannelsOut */
+    RTMPChannelIn *m_vecChannelsIn;	/* from RTMP_FAST_CHANNELS on */
+    RTMPChannelOut *m_vecChannelsOut;
+    RTMPChannelIn m_channelsIn[RTMP_FAST_CHANNELS];
+    RTMPChannelOut m_channelsOut[RTMP_FAST_CHANNELS];
 
     double m_fAudioCodecs;	/* audioCodecs for the connect packet */
     double m_fVideoCodecs;	/* videoCodecs for the connect packet */
     double m_fEncoding;		/* AMF0 or AMF3 */
 
     double m_fDuration;		/* duration of stream in seconds */
+    RTMPKeyframes m_keyframes;
 
     int m_msgCounter;		/* RTMPT stuff */
     int m_polling;
     int m_resplen;
     int m_unackd;
+    int m_emptyPolls;		/* responses in a row that carried no data */
     AVal m_clientID;
 
     RTMP_READ m_read;
     RTMPPacket m_write;
+    struct RTMPPool *m_pool;	/* recycled packet bodies */
+    RTMPCoalesce m_coalesce;
+    char *m_encBuf;		/* RC4 output and TLS records, grown as needed */
+    int m_encBufSize;
+    RTMPPacer m_pacer;
+    int m_rcvBuf;		/* SO_RCVBUF for new sockets, 0 for the default */
+    RTMPStats m_stats;
+    void *m_logUser;		/* for the log callback, see RTMP_LogContext() */
+    uint32_t m_pingStamp;	/* value of the outstanding ping request */
+    uint64_t m_pingSent;	/* us when it was sent */
     RTMPSockBuf m_sb;
     RTMP_LNK Link;
   } RTMP;
@@ -310,6 +473,21 @@ extern "C"
 			int dStop, int bLiveStream, long int timeout);
 
   int RTMP_Connect(RTMP *r, RTMPPacket *cp);
+  /* how long RTMP_Connect() keeps resolved addresses, for all RTMP
+   * instances; 0 turns the cache off */
+  void RTMP_SetDNSCacheTTL(int seconds);
+  /* open and handshake a connection to r's host and park it, a later
+   * RTMP_Connect() to the same host takes it instead of dialing; plain
+   * rtmp:// only. RTMP_WarmCheck() closes parked connections idle for
+   * maxIdle seconds or dropped by the server and returns how many are
+   * left for r's host */
+  int RTMP_WarmUp(RTMP *r);
+  int RTMP_WarmCheck(RTMP *r, int maxIdle);
+  /* generate Diffie-Hellmann key pairs for rtmpe:// and rtmpte://
+   * handshakes until count are ready, up to RTMP_KEYS_MAX, so connecting
+   * only computes the shared secret. Blocks while generating; returns
+   * how many are ready, 0 without crypto support */
+  int RTMP_PrepareKeys(int count);
   struct sockaddr;
   int RTMP_Connect0(RTMP *r, struct sockaddr *svc);
   int RTMP_Connect1(RTMP *r, RTMPPacket *cp);
@@ -317,15 +495,36 @@ extern "C"
   int RTMP_TLS_Accept(RTMP *r, void *ctx);
 
   int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet);
+  /* TRUE when RTMP_ReadPacket() can return without waiting for the
+   * network: the next chunk has arrived or the connection is gone. Takes
+   * in what the socket holds without blocking */
+  int RTMP_ReadReady(RTMP *r);
   int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue);
   int RTMP_SendChunk(RTMP *r, RTMPChunk *chunk);
   int RTMP_IsConnected(RTMP *r);
   int RTMP_Socket(RTMP *r);
   int RTMP_IsTimedout(RTMP *r);
   double RTMP_GetDuration(RTMP *r);
+  /* valid until the next read or connect on r */
+  const RTMPKeyframes *RTMP_GetKeyframes(RTMP *r);
   int RTMP_ToggleStream(RTMP *r);
 
   int RTMP_ConnectStream(RTMP *r, int seekTime);
+
+  /* Several published streams over one connection. With RTMP_LF_MULTI
+   * set in Link.lFlags before RTMP_Connect(), RTMP_ConnectStream() only
+   * waits for the connect result and no stream of its own is created.
+   * RTMP_PublishStream() then creates one and publishes playpath on it,
+   * returning its id or 0. channel is the chunk stream its messages
+   * go out on: one per stream, above the 2 to 8 librtmp uses itself.
+   * Media is sent with RTMP_WriteStreamTag(), see RTMP_WriteTag().
+   * A stream the server ends or refuses leaves the connection up and
+   * RTMP_StreamFailed() true until RTMP_UnpublishStream() */
+  int RTMP_PublishStream(RTMP *r, AVal *playpath, int channel);
+  int RTMP_UnpublishStream(RTMP *r, int streamId, AVal *playpath);
+  int RTMP_StreamFailed(RTMP *r, int streamId);
+  int RTMP_WriteStreamTag(RTMP *r, int streamId, int channel, int type,
+			  uint32_t timestamp, const char *data, uint32_t size);
   int RTMP_ReconnectStream(RTMP *r, int seekTime);
   void RTMP_DeleteStream(RTMP *r);
   int RTMP_GetNextMediaPacket(RTMP *r, RTMPPacket *packet);
@@ -337,6 +536,39 @@ extern "C"
   void RTMP_Free(RTMP *r);
   void RTMP_EnableWrite(RTMP *r);
 
+  /* allocate a packet body from r's pool; release with RTMPPacket_Free */
+  int RTMP_AllocPacket(RTMP *r, RTMPPacket *p, uint32_t nSize);
+  void RTMP_GetPoolStats(RTMP *r, RTMPPoolStats *stats);
+  void RTMP_GetStats(RTMP *r, RTMPStats *stats);
+  /* The RTMP the calling thread is in a call on, or NULL. For a log
+   * callback to tell connections apart by socket, tcUrl or m_logUser */
+  RTMP *RTMP_LogContext(void);
+  /* Send a ping request; rs_rtt is updated when the response is read */
+  int RTMP_SendPing(RTMP *r);
+
+  /* Hold outgoing data until size bytes are pending, the oldest byte is
+   * delayMs old or RTMP_Flush() is called. Reading flushes first. size 0
+   * sends what is pending and turns coalescing off. Over RTMPT everything
+   * pending goes out in one POST.
+   */
+  int RTMP_SetCoalescing(RTMP *r, int size, int delayMs);
+  int RTMP_Flush(RTMP *r);
+  /* ms until pending data is due, 0 if overdue, -1 if nothing pending */
+  int RTMP_FlushDelay(RTMP *r);
+
+  /* Send at most rate bytes/s in bursts of up to burst bytes. With kernel
+   * set SO_MAX_PACING_RATE is tried first, the bucket is the fallback.
+   * Can be called again to change the rate; 0 turns pacing off.
+   */
+  int RTMP_SetPacing(RTMP *r, int rate, int burst, int kernel);
+
+  /* Receive into a size byte buffer instead of the built-in one and set
+   * SO_RCVBUF to sockbuf, now and on every new socket. 0 keeps the current
+   * value of either; sizes up to RTMP_BUFFER_CACHE_SIZE use the built-in
+   * buffer. Bytes already buffered are kept.
+   */
+  int RTMP_SetReceiveBuffer(RTMP *r, int size, int sockbuf);
+
   void *RTMP_TLS_AllocServerContext(const char* cert, const char* key);
   void RTMP_TLS_FreeServerContext(void *ctx);
 
@@ -357,17 +589,39 @@ extern "C"
 
   int RTMPSockBuf_Fill(RTMPSockBuf *sb);
   int RTMPSockBuf_Send(RTMPSockBuf *sb, const char *buf, int len, int timeout);
+  struct iovec;
+  int RTMPSockBuf_SendV(RTMPSockBuf *sb, struct iovec *iov, int iovcnt, int timeout);
   int RTMPSockBuf_Close(RTMPSockBuf *sb);
 
   int RTMP_SendCreateStream(RTMP *r);
   int RTMP_SendSeek(RTMP *r, int dTime);
   int RTMP_SendServerBW(RTMP *r);
   int RTMP_SendClientBW(RTMP *r);
+  int RTMP_SendChunkSize(RTMP *r, int size);
   void RTMP_DropRequest(RTMP *r, int i, int freeit);
   int RTMP_Read(RTMP *r, char *buf, int size);
+
+  /* Return the next media packet as FLV tags without copying it out of
+   * the buffer it was reassembled in. The caller owns tag->tg_mem until
+   * RTMP_FreeTag(), which may run in any thread. Returns tg_size, 0 at the
+   * end of the stream and -1 on error. No FLV file header is produced and
+   * resuming is not supported, use RTMP_Read() for either. Must not be
+   * mixed with RTMP_Read() on the same stream.
+   */
+  int RTMP_ReadTag(RTMP *r, RTMPTag *tag);
+  void RTMP_FreeTag(void *mem);
   int RTMP_Write(RTMP *r, const char *buf, int size);
 
+  /* send one already parsed FLV tag body without copying it; the body is
+   * only read. Must not be interleaved with a partial RTMP_Write() tag.
+   */
+  int RTMP_WriteTag(RTMP *r, int type, uint32_t timestamp, const char *data,
+		    uint32_t size);
+
 /* hashswf.c */
+  /* size and HMAC-SHA256 of the SWF at url for SWF verification, from a
+   * cache shared by the whole process; stale entries are returned while
+   * they are refreshed in the background. Returns 0 on success */
   int RTMP_HashSWF(const char *url, unsigned int *size, unsigned char *hash,
 		   int age);
 
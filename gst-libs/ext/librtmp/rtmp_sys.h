@@ -41,21 +41,45 @@
 #define sleep(n)	Sleep(n*1000)
 #define msleep(n)	Sleep(n)
 #define SET_RCVTIMEO(tv,s)	int tv = s*1000
+#define RTMP_LOCK_T	SRWLOCK
+#define RTMP_LOCK_INIT	SRWLOCK_INIT
+#define RTMP_Lock(l)	AcquireSRWLockExclusive(l)
+#define RTMP_Unlock(l)	ReleaseSRWLockExclusive(l)
+#define RTMP_THREAD_LOCAL	__declspec(thread)
+#define poll(f,n,t)	WSAPoll(f,n,t)
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
 #else /* !_WIN32 */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/times.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#endif
 #define GetSockError()	errno
 #define SetSockError(e)	errno = e
 #undef closesocket
 #define closesocket(s)	close(s)
 #define msleep(n)	usleep(n*1000)
 #define SET_RCVTIMEO(tv,s)	struct timeval tv = {s,0}
+#define RTMP_LOCK_T	pthread_mutex_t
+#define RTMP_LOCK_INIT	PTHREAD_MUTEX_INITIALIZER
+#define RTMP_Lock(l)	pthread_mutex_lock(l)
+#define RTMP_Unlock(l)	pthread_mutex_unlock(l)
+#define RTMP_THREAD_LOCAL	__thread
 #endif
 
 #include "rtmp.h"
@@ -105,9 +129,12 @@ typedef struct tls_server_ctx {
 #define TLS_write(s,b,l)	ssl_write(s,(unsigned char *)b,l)
 #define TLS_shutdown(s)	ssl_close_notify(s)
 #define TLS_close(s)	ssl_free(s); free(s)
+#define TLS_pending(s)	ssl_get_bytes_avail(s)
+#define TLS_ktls_send(s)	0
 
 #elif defined(USE_GNUTLS)
 #include <gnutls/gnutls.h>
+#include <gnutls/socket.h>
 typedef struct tls_ctx {
 	gnutls_certificate_credentials_t cred;
 	gnutls_priority_t prios;
@@ -122,6 +149,13 @@ typedef struct tls_ctx {
 #define TLS_write(s,b,l)	gnutls_record_send(s,b,l)
 #define TLS_shutdown(s)	gnutls_bye(s, GNUTLS_SHUT_RDWR)
 #define TLS_close(s)	gnutls_deinit(s)
+#define TLS_pending(s)	gnutls_record_check_pending(s)
+/* kernel TLS is turned on by the system wide gnutls config */
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+#define TLS_ktls_send(s)	(gnutls_transport_is_ktls_enabled(s) & GNUTLS_KTLS_SEND)
+#else
+#define TLS_ktls_send(s)	0
+#endif
 
 #else	/* USE_OPENSSL */
 #define TLS_CTX	SSL_CTX *
@@ -134,6 +168,12 @@ typedef struct tls_ctx {
 #define TLS_write(s,b,l)	SSL_write(s,b,l)
 #define TLS_shutdown(s)	SSL_shutdown(s)
 #define TLS_close(s)	SSL_free(s)
+#define TLS_pending(s)	SSL_pending(s)
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define TLS_ktls_send(s)	BIO_get_ktls_send(SSL_get_wbio(s))
+#else
+#define TLS_ktls_send(s)	0
+#endif
 
 #endif
 #endif
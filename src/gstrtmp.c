@@ -33,12 +33,15 @@
 
 #include "gstrtmpsrc.h"
 #include "gstrtmpsink.h"
+#include "gstrtmplog.h"
 
 static gboolean
 plugin_init (GstPlugin * plugin)
 {
   gboolean ret;
 
+  gst_rtmp_log_init ();
+
   ret = gst_element_register (plugin, "rtmpsrc", GST_RANK_PRIMARY,
       GST_TYPE_RTMP_SRC);
   ret &= gst_element_register (plugin, "rtmpsink", GST_RANK_PRIMARY,
@@ -0,0 +1,108 @@
+/* GStreamer
+ *
+ * gstrtmplog.c:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Sends librtmp's log to the "librtmp" debug category instead of stderr.
+ * librtmp gates its lines on a process-wide level before formatting them,
+ * so that level follows the category threshold: gst_rtmp_log_sync() maps
+ * it over, and the elements call it when they start so GST_DEBUG changes
+ * made at run time are picked up. Each line is prefixed with the socket
+ * and tcUrl of the connection it is about and logged against the element
+ * that owns it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+
+#include <librtmp/rtmp.h>
+#include <librtmp/log.h>
+
+#include "gstrtmplog.h"
+
+GST_DEBUG_CATEGORY_STATIC (rtmp_log_debug);
+#define GST_CAT_DEFAULT rtmp_log_debug
+
+/* indexed by RTMP_LogLevel */
+static const GstDebugLevel gst_rtmp_log_levels[] = {
+  GST_LEVEL_ERROR,		/* RTMP_LOGCRIT */
+  GST_LEVEL_ERROR,
+  GST_LEVEL_WARNING,
+  GST_LEVEL_INFO,
+  GST_LEVEL_DEBUG,
+  GST_LEVEL_LOG,		/* RTMP_LOGDEBUG2, packet hex dumps */
+  GST_LEVEL_MEMDUMP		/* RTMP_LOGALL */
+};
+
+static void
+gst_rtmp_log_func (int level, const char *format, va_list args)
+{
+  RTMP *r = RTMP_LogContext ();
+  GstRTMPLog *log = r ? r->m_logUser : NULL;
+  GstDebugLevel gst_level;
+  gchar *msg;
+
+  if (level < RTMP_LOGCRIT || level > RTMP_LOGALL)
+    return;
+  if (log && level > log->level)
+    return;
+  gst_level = gst_rtmp_log_levels[level];
+  if (gst_level > gst_debug_category_get_threshold (GST_CAT_DEFAULT))
+    return;
+
+  msg = g_strdup_vprintf (format, args);
+  if (r)
+    gst_debug_log (GST_CAT_DEFAULT, gst_level, "librtmp", "", 0,
+        log ? log->object : NULL, "[fd %d %.*s] %s", r->m_sb.sb_socket,
+        r->Link.tcUrl.av_len, r->Link.tcUrl.av_len ? r->Link.tcUrl.av_val :
+        "", msg);
+  else
+    gst_debug_log (GST_CAT_DEFAULT, gst_level, "librtmp", "", 0, NULL,
+        "%s", msg);
+  g_free (msg);
+}
+
+void
+gst_rtmp_log_init (void)
+{
+  GST_DEBUG_CATEGORY_INIT (rtmp_log_debug, "librtmp", 0, "librtmp");
+  RTMP_LogSetCallback (gst_rtmp_log_func);
+  gst_rtmp_log_sync ();
+}
+
+/* Let librtmp format exactly the lines the category would show */
+void
+gst_rtmp_log_sync (void)
+{
+  GstDebugLevel threshold = gst_debug_category_get_threshold (GST_CAT_DEFAULT);
+  RTMP_LogLevel level = RTMP_LOGCRIT;
+
+  while (level < RTMP_LOGALL && gst_rtmp_log_levels[level + 1] <= threshold)
+    level++;
+  RTMP_LogSetLevel (level);
+}
+
+/* Call after RTMP_Init (), which clears it */
+void
+gst_rtmp_log_attach (RTMP * r, GstRTMPLog * log)
+{
+  r->m_logUser = log;
+}
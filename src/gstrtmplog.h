@@ -0,0 +1,42 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_RTMP_LOG_H__
+#define __GST_RTMP_LOG_H__
+
+#include <gst/gst.h>
+
+#include <librtmp/rtmp.h>
+
+G_BEGIN_DECLS
+
+/* Who an RTMP's log lines belong to; kept in the element, which must
+ * outlive the RTMP objects attached to it */
+typedef struct
+{
+  GObject *object;
+  gint level;			/* librtmp lines above it are dropped */
+} GstRTMPLog;
+
+void gst_rtmp_log_init (void);
+void gst_rtmp_log_sync (void);
+void gst_rtmp_log_attach (RTMP * r, GstRTMPLog * log);
+
+G_END_DECLS
+
+#endif /* __GST_RTMP_LOG_H__ */
@@ -0,0 +1,189 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Estimates the bitrate a publishing connection can carry, so encoders
+ * upstream can adapt before the socket stalls and the session is lost.
+ * Every eighth of the reaction time a sample is taken from the
+ * connection's counters: the send calls that blocked for a millisecond
+ * or more, the kernel's buffer being full; the backlog, bytes waiting in
+ * the sink's queue and in the socket or sent but not acknowledged by the
+ * server beyond its window; and the throughput since the last sample.
+ *
+ * The backlog is turned into the time it takes to drain at that
+ * throughput. While that exceeds a quarter of the reaction time, or most
+ * sends block, the target heads for a little below the throughput. Below
+ * half of that it probes back up, in between it holds. Each sample covers only part of the
+ * distance, so the target takes about the reaction time to follow a
+ * change and a weak uplink degrades gradually instead of all at once.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstrtmpqos.h"
+
+#define QOS_MIN_INTERVAL (100 * GST_MSECOND)
+/* first rs_sendLatency bucket of blocked calls, 1024us and more */
+#define QOS_SLOW_BUCKET 4
+#define QOS_BLOCKED 0.25
+/* while congested, aim below the throughput so the backlog drains */
+#define QOS_DRAIN 0.85
+#define QOS_PROBE 1.1
+/* without max-bitrate, how far above the stream rate to probe */
+#define QOS_HEADROOM 1.25
+
+static GstClockTime
+gst_rtmp_qos_interval (GstRTMPQos * qos)
+{
+  return MAX (qos->reaction_time / 8, QOS_MIN_INTERVAL);
+}
+
+/* start of a stream, forget the estimate */
+void
+gst_rtmp_qos_reset (GstRTMPQos * qos)
+{
+  qos->bitrate = 0;
+  qos->throughput = 0;
+  qos->delay = 0;
+  qos->blocked = 0;
+  qos->congested = FALSE;
+  qos->notified_bitrate = 0;
+  qos->notified_congested = FALSE;
+  gst_rtmp_qos_restart (qos);
+}
+
+/* a new connection, keep the estimate but not the counters */
+void
+gst_rtmp_qos_restart (GstRTMPQos * qos)
+{
+  qos->time = GST_CLOCK_TIME_NONE;
+}
+
+/* cheap, so the statistics are only gathered when a sample is due */
+gboolean
+gst_rtmp_qos_due (GstRTMPQos * qos, GstClockTime now)
+{
+  if (!qos->reaction_time)
+    return FALSE;
+  return !GST_CLOCK_TIME_IS_VALID (qos->time) ||
+      now >= qos->time + gst_rtmp_qos_interval (qos);
+}
+
+static guint64
+gst_rtmp_qos_slow_calls (const RTMPStats * stats)
+{
+  guint64 calls = 0;
+  gint i;
+
+  for (i = QOS_SLOW_BUCKET; i < RTMP_STATS_BUCKETS; i++)
+    calls += stats->rs_sendLatency[i];
+  return calls;
+}
+
+static void
+gst_rtmp_qos_estimate (GstRTMPQos * qos, GstClockTime dt, guint stream_rate)
+{
+  gdouble rate = qos->bitrate, goal, ceiling;
+  gdouble alpha = (gdouble) dt / (qos->reaction_time + dt);
+
+  ceiling = qos->max_bitrate ? MAX (qos->max_bitrate, qos->min_bitrate) :
+      G_MAXUINT;
+  if (!rate) {
+    if (qos->max_bitrate)
+      rate = ceiling;
+    else if (stream_rate)
+      rate = stream_rate * 8.0;
+    else
+      rate = qos->throughput;
+  }
+
+  if (qos->congested) {
+    goal = qos->throughput * QOS_DRAIN;
+    if (goal < rate)
+      rate -= (rate - goal) * alpha;
+  } else if (qos->delay <= qos->reaction_time / 8) {
+    /* only a little past what gets through, not past what is asked */
+    goal = qos->throughput * QOS_PROBE;
+    if (!qos->max_bitrate && stream_rate)
+      goal = MIN (goal, MAX (stream_rate * 8.0 * QOS_HEADROOM, rate));
+    if (goal > rate)
+      rate += (goal - rate) * alpha;
+  }
+
+  qos->bitrate = CLAMP (rate, qos->min_bitrate, ceiling);
+}
+
+/* Take a sample of a connection's statistics. window is the server's
+ * acknowledgement window, queued what waits for the connection in front
+ * of librtmp and stream_rate what upstream produces in bytes/s, 0 if
+ * unknown. Returns TRUE when the estimate changed enough to tell
+ * upstream about it */
+gboolean
+gst_rtmp_qos_update (GstRTMPQos * qos, GstClockTime now,
+    const RTMPStats * stats, guint window, guint64 queued, guint stream_rate)
+{
+  guint64 slow = gst_rtmp_qos_slow_calls (stats);
+  guint64 bytes, calls, unacked = 0, backlog;
+  GstClockTime dt;
+
+  if (!gst_rtmp_qos_due (qos, now))
+    return FALSE;
+  /* the first sample of a connection is only a baseline */
+  if (!GST_CLOCK_TIME_IS_VALID (qos->time) || now <= qos->time ||
+      stats->rs_bytesOut < qos->bytes_out)
+    goto done;
+
+  dt = now - qos->time;
+  bytes = stats->rs_bytesOut - qos->bytes_out;
+  calls = stats->rs_sendCalls - qos->send_calls;
+  qos->throughput = MIN (gst_util_uint64_scale (bytes, 8 * GST_SECOND, dt),
+      G_MAXUINT);
+  qos->blocked = calls ? (gdouble) (slow - qos->slow_calls) / calls : 0;
+
+  /* the socket's queue is part of what was sent but not acknowledged */
+  if (stats->rs_bytesAcked && stats->rs_bytesOut >
+      stats->rs_bytesAcked + window)
+    unacked = stats->rs_bytesOut - stats->rs_bytesAcked - window;
+  backlog = queued + MAX (unacked, (guint64) MAX (stats->rs_unsent, 0));
+  if (qos->throughput)
+    qos->delay = gst_util_uint64_scale (backlog, 8 * GST_SECOND,
+        qos->throughput);
+  else
+    qos->delay = backlog ? qos->delay + dt : 0;
+
+  qos->congested = qos->delay > qos->reaction_time / 4 ||
+      qos->blocked > QOS_BLOCKED;
+  gst_rtmp_qos_estimate (qos, dt, stream_rate);
+
+done:
+  qos->time = now;
+  qos->bytes_out = stats->rs_bytesOut;
+  qos->send_calls = stats->rs_sendCalls;
+  qos->slow_calls = slow;
+
+  if (!qos->bitrate)
+    return FALSE;
+  if (qos->congested == qos->notified_congested &&
+      (guint64) ABS ((gint64) qos->bitrate - qos->notified_bitrate) * 20 <
+      qos->notified_bitrate)
+    return FALSE;
+  qos->notified_bitrate = qos->bitrate;
+  qos->notified_congested = qos->congested;
+  return TRUE;
+}
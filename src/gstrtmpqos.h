@@ -0,0 +1,63 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_RTMP_QOS_H__
+#define __GST_RTMP_QOS_H__
+
+#include <gst/gst.h>
+
+#include <librtmp/rtmp.h>
+
+G_BEGIN_DECLS
+
+#define GST_RTMP_QOS_DEFAULT_REACTION_TIME (2 * GST_SECOND)
+
+/* Congestion estimate of one publishing stream, fed with the transport
+ * statistics of its connection. The settings may be changed at any
+ * time, everything else belongs to the estimator */
+typedef struct
+{
+  GstClockTime reaction_time;	/* to follow a change, 0 = disabled */
+  guint min_bitrate;		/* bits/s */
+  guint max_bitrate;		/* bits/s, 0 = none */
+
+  /* the estimate, valid once bitrate is set */
+  guint bitrate;		/* what the encoder should aim for, bits/s */
+  guint throughput;		/* what got out over the last sample, bits/s */
+  GstClockTime delay;		/* to drain the backlog at that throughput */
+  gdouble blocked;		/* share of send calls that had to wait */
+  gboolean congested;
+
+  /* previous sample */
+  GstClockTime time;
+  guint64 bytes_out;
+  guint64 send_calls;
+  guint64 slow_calls;
+  guint notified_bitrate;
+  gboolean notified_congested;
+} GstRTMPQos;
+
+void gst_rtmp_qos_reset (GstRTMPQos * qos);
+void gst_rtmp_qos_restart (GstRTMPQos * qos);
+gboolean gst_rtmp_qos_due (GstRTMPQos * qos, GstClockTime now);
+gboolean gst_rtmp_qos_update (GstRTMPQos * qos, GstClockTime now,
+    const RTMPStats * stats, guint window, guint64 queued, guint stream_rate);
+
+G_END_DECLS
+
+#endif /* __GST_RTMP_QOS_H__ */
@@ -0,0 +1,398 @@
+/* GStreamer
+ *
+ * gstrtmpshare.c:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Publishes the streams of rtmpsinks that go to the same host and
+ * application over one connection, each with its own NetStream and chunk
+ * stream, so a process sending many renditions pays for one handshake,
+ * one socket and one set of buffers. The streaming threads take turns on
+ * the connection one message at a time: audio goes first, since its
+ * tags are small and late audio is what listeners notice, everything
+ * else is served in arrival order. Whoever holds the turn also reads
+ * what the server sent, and a broken connection is replaced by the next
+ * stream that publishes again; the streams of the old one find out the
+ * next time they write.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+
+#include <librtmp/rtmp.h>
+
+#include "gstrtmpshare.h"
+
+#include <string.h>
+
+GST_DEBUG_CATEGORY_STATIC (rtmp_share_debug);
+#define GST_CAT_DEFAULT rtmp_share_debug
+
+/* the first chunk stream past the ones librtmp uses for itself */
+#define SHARE_FIRST_CHANNEL 16
+/* between reads of what the server sent */
+#define SHARE_SERVICE_INTERVAL (100 * GST_MSECOND)
+
+struct _GstRTMPShare
+{
+  gchar *key;			/* protocol, host, port, proxy and app */
+  gchar *uri;			/* of the first stream, to connect with */
+  guint refs;			/* streams, protected by share_lock */
+
+  /* lock protects the turn, the holder alone uses everything below */
+  GMutex *lock;
+  GCond *cond;
+  gboolean busy;
+  guint audio_waiting;
+  guint next_ticket;
+  guint serving;
+
+  RTMP *rtmp;			/* NULL until the first stream publishes */
+  gchar *rtmp_uri;		/* parsed in place by rtmp */
+  guint generation;		/* bumped with every new connection */
+  GList *streams;
+  GstClockTime serviced;
+};
+
+static GStaticMutex share_lock = G_STATIC_MUTEX_INIT;
+static GList *shares;
+
+/* Names the connection a stream can go out on and copies its playpath,
+ * NULL if uri does not parse */
+static gchar *
+gst_rtmp_share_parse (const gchar * uri, gchar ** playpath)
+{
+  gchar *copy = g_strdup (uri);
+  RTMP *r = RTMP_Alloc ();
+  gchar *key = NULL;
+
+  RTMP_Init (r);
+  if (RTMP_SetupURL (r, copy) && r->Link.playpath.av_len) {
+    RTMP_LNK *link = &r->Link;
+
+    key = g_strdup_printf ("%d %.*s:%u %.*s:%u %.*s", link->protocol,
+        link->hostname.av_len, link->hostname.av_val, link->port,
+        link->sockshost.av_len, link->sockshost.av_val, link->socksport,
+        link->app.av_len, link->app.av_val);
+    *playpath = g_strndup (link->playpath.av_val, link->playpath.av_len);
+  }
+  RTMP_Close (r);
+  RTMP_Free (r);
+  g_free (copy);
+  return key;
+}
+
+static GstRTMPShare *
+gst_rtmp_share_ref (const gchar * key, const gchar * uri)
+{
+  GstRTMPShare *share = NULL;
+  GList *walk;
+
+  g_static_mutex_lock (&share_lock);
+  if (!shares)
+    GST_DEBUG_CATEGORY_INIT (rtmp_share_debug, "rtmpshare", 0,
+        "RTMP shared connections");
+  for (walk = shares; walk; walk = walk->next) {
+    if (g_str_equal (((GstRTMPShare *) walk->data)->key, key)) {
+      share = walk->data;
+      break;
+    }
+  }
+  if (!share) {
+    share = g_new0 (GstRTMPShare, 1);
+    share->key = g_strdup (key);
+    share->uri = g_strdup (uri);
+    share->lock = g_mutex_new ();
+    share->cond = g_cond_new ();
+    shares = g_list_prepend (shares, share);
+  }
+  share->refs++;
+  g_static_mutex_unlock (&share_lock);
+  return share;
+}
+
+static void
+gst_rtmp_share_unref (GstRTMPShare * share)
+{
+  g_static_mutex_lock (&share_lock);
+  if (--share->refs) {
+    g_static_mutex_unlock (&share_lock);
+    return;
+  }
+  shares = g_list_remove (shares, share);
+  g_static_mutex_unlock (&share_lock);
+
+  GST_DEBUG ("closing the shared connection to %s", share->key);
+  if (share->rtmp) {
+    RTMP_Close (share->rtmp);
+    RTMP_Free (share->rtmp);
+  }
+  g_free (share->rtmp_uri);
+  g_list_free (share->streams);
+  g_cond_free (share->cond);
+  g_mutex_free (share->lock);
+  g_free (share->uri);
+  g_free (share->key);
+  g_free (share);
+}
+
+/* Wait for the turn, audio ahead of the others */
+static void
+gst_rtmp_share_acquire (GstRTMPShare * share, gboolean audio)
+{
+  guint ticket;
+
+  g_mutex_lock (share->lock);
+  if (audio) {
+    share->audio_waiting++;
+    while (share->busy)
+      g_cond_wait (share->cond, share->lock);
+    share->audio_waiting--;
+  } else {
+    ticket = share->next_ticket++;
+    while (share->busy || share->audio_waiting || ticket != share->serving)
+      g_cond_wait (share->cond, share->lock);
+    share->serving++;
+  }
+  share->busy = TRUE;
+  g_mutex_unlock (share->lock);
+}
+
+static void
+gst_rtmp_share_release (GstRTMPShare * share)
+{
+  g_mutex_lock (share->lock);
+  share->busy = FALSE;
+  g_cond_broadcast (share->cond);
+  g_mutex_unlock (share->lock);
+}
+
+/* Answer pings and take in acknowledgements and status messages, at
+ * most every SHARE_SERVICE_INTERVAL and only what already arrived, the
+ * other streams wait for the turn. Called with the turn */
+static void
+gst_rtmp_share_service (GstRTMPShare * share)
+{
+  RTMP *r = share->rtmp;
+  GstClockTime now = gst_util_get_timestamp ();
+  RTMPPacket packet = { 0 };
+
+  if (GST_CLOCK_TIME_IS_VALID (share->serviced) &&
+      now < share->serviced + SHARE_SERVICE_INTERVAL)
+    return;
+  share->serviced = now;
+
+  while (RTMP_ReadReady (r)) {
+    if (!RTMP_ReadPacket (r, &packet)) {
+      RTMP_Close (r);
+      break;
+    }
+    if (RTMPPacket_IsReady (&packet)) {
+      RTMP_ClientPacket (r, &packet);
+      RTMPPacket_Free (&packet);
+    }
+  }
+}
+
+/* Replace a missing or broken connection. Called with the turn */
+static gboolean
+gst_rtmp_share_connect (GstRTMPShare * share, GstRTMPLog * log,
+    GstRTMPShareSetup setup, gpointer user_data)
+{
+  RTMP *r;
+
+  if (share->rtmp && RTMP_IsConnected (share->rtmp))
+    return TRUE;
+
+  if (share->rtmp) {
+    GST_DEBUG ("shared connection to %s broke", share->key);
+    RTMP_Close (share->rtmp);
+    RTMP_Free (share->rtmp);
+    share->rtmp = NULL;
+  }
+  g_free (share->rtmp_uri);
+  /* librtmp keeps pointers into the url */
+  share->rtmp_uri = g_strdup (share->uri);
+  share->generation++;
+  share->serviced = GST_CLOCK_TIME_NONE;
+
+  r = RTMP_Alloc ();
+  if (!r)
+    return FALSE;
+  RTMP_Init (r);
+  gst_rtmp_log_attach (r, log);
+  if (!RTMP_SetupURL (r, share->rtmp_uri))
+    goto error;
+  RTMP_EnableWrite (r);
+  r->Link.lFlags |= RTMP_LF_MULTI;
+  if (!setup (r, FALSE, user_data))
+    goto error;
+  if (!RTMP_Connect (r, NULL) || !RTMP_ConnectStream (r, 0) ||
+      !setup (r, TRUE, user_data))
+    goto error;
+
+  GST_DEBUG ("opened shared connection %u to %s", share->generation,
+      share->key);
+  share->rtmp = r;
+  return TRUE;
+
+error:
+  GST_DEBUG ("shared connection to %s failed", share->key);
+  RTMP_Close (r);
+  RTMP_Free (r);
+  return FALSE;
+}
+
+/* Lowest chunk stream no stream of this connection uses */
+static gint
+gst_rtmp_share_channel (GstRTMPShare * share)
+{
+  gint channel = SHARE_FIRST_CHANNEL;
+  GList *walk;
+
+again:
+  for (walk = share->streams; walk; walk = walk->next) {
+    GstRTMPShareStream *stream = walk->data;
+
+    if (stream->generation == share->generation &&
+        stream->channel == channel) {
+      channel++;
+      goto again;
+    }
+  }
+  return channel;
+}
+
+/* Publish uri's playpath on the shared connection to its host and app,
+ * connecting it first if need be with setup. Blocks until the server
+ * accepted the stream. log is attached to the connection while this
+ * stream uses it. Returns NULL if it could not be published */
+GstRTMPShareStream *
+gst_rtmp_share_publish (const gchar * uri, GstRTMPLog * log,
+    GstRTMPShareSetup setup, gpointer user_data)
+{
+  GstRTMPShareStream *stream;
+  GstRTMPShare *share;
+  gchar *key, *playpath = NULL;
+
+  if (!uri || !(key = gst_rtmp_share_parse (uri, &playpath)))
+    return NULL;
+  share = gst_rtmp_share_ref (key, uri);
+  g_free (key);
+
+  stream = g_new0 (GstRTMPShareStream, 1);
+  stream->share = share;
+  stream->playpath_val = playpath;
+  stream->playpath.av_val = playpath;
+  stream->playpath.av_len = strlen (playpath);
+  stream->log = log;
+
+  gst_rtmp_share_acquire (share, FALSE);
+  if (gst_rtmp_share_connect (share, log, setup, user_data)) {
+    gst_rtmp_log_attach (share->rtmp, log);
+    stream->generation = share->generation;
+    stream->channel = gst_rtmp_share_channel (share);
+    stream->id = RTMP_PublishStream (share->rtmp, &stream->playpath,
+        stream->channel);
+    RTMP_Flush (share->rtmp);
+  }
+  if (stream->id)
+    share->streams = g_list_prepend (share->streams, stream);
+  gst_rtmp_share_release (share);
+
+  if (!stream->id) {
+    GST_DEBUG ("could not publish %s on %s", playpath, share->key);
+    gst_rtmp_share_unref (share);
+    g_free (stream->playpath_val);
+    g_free (stream);
+    return NULL;
+  }
+  GST_DEBUG ("published %s as stream %d on channel %d of %s", playpath,
+      stream->id, stream->channel, share->key);
+  return stream;
+}
+
+/* Take the turn to write on the connection. Returns it, or NULL if the
+ * connection the stream was published on is gone or the server ended the
+ * stream. Always pair with gst_rtmp_share_unlock() */
+RTMP *
+gst_rtmp_share_lock (GstRTMPShareStream * stream, gboolean audio)
+{
+  GstRTMPShare *share = stream->share;
+  RTMP *r;
+
+  gst_rtmp_share_acquire (share, audio);
+  r = share->rtmp;
+  if (!r || share->generation != stream->generation)
+    return NULL;
+  gst_rtmp_log_attach (r, stream->log);
+  gst_rtmp_share_service (share);
+  if (RTMP_StreamFailed (r, stream->id)) {
+    GST_DEBUG ("the server ended stream %d on %s", stream->id, share->key);
+    return NULL;
+  }
+  return RTMP_IsConnected (r) ? r : NULL;
+}
+
+/* Send what the stream wrote and pass the turn on. A failed write broke
+ * the connection for every stream on it, unless only the stream was
+ * ended by the server */
+void
+gst_rtmp_share_unlock (GstRTMPShareStream * stream, gboolean failed)
+{
+  GstRTMPShare *share = stream->share;
+  RTMP *r = share->rtmp;
+
+  if (r && share->generation == stream->generation) {
+    if (failed && !RTMP_StreamFailed (r, stream->id))
+      RTMP_Close (r);
+    else
+      RTMP_Flush (r);
+  }
+  gst_rtmp_share_release (share);
+}
+
+/* Stop publishing the stream and free it, the connection goes with its
+ * last stream */
+void
+gst_rtmp_share_unpublish (GstRTMPShareStream * stream)
+{
+  GstRTMPShare *share = stream->share;
+  RTMP *r;
+
+  gst_rtmp_share_acquire (share, FALSE);
+  r = share->rtmp;
+  share->streams = g_list_remove (share->streams, stream);
+  if (r && share->generation == stream->generation && RTMP_IsConnected (r)) {
+    gst_rtmp_log_attach (r, stream->log);
+    RTMP_UnpublishStream (r, stream->id, &stream->playpath);
+    RTMP_Flush (r);
+  }
+  /* the element owning the log may go away now */
+  if (r)
+    gst_rtmp_log_attach (r, share->streams ?
+        ((GstRTMPShareStream *) share->streams->data)->log : NULL);
+  gst_rtmp_share_release (share);
+
+  GST_DEBUG ("unpublished stream %d on %s", stream->id, share->key);
+  gst_rtmp_share_unref (share);
+  g_free (stream->playpath_val);
+  g_free (stream);
+}
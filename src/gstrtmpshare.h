@@ -0,0 +1,57 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_RTMP_SHARE_H__
+#define __GST_RTMP_SHARE_H__
+
+#include <gst/gst.h>
+
+#include <librtmp/rtmp.h>
+
+#include "gstrtmplog.h"
+
+G_BEGIN_DECLS
+
+typedef struct _GstRTMPShare GstRTMPShare;
+
+/* One stream published on a shared connection, owned by its element */
+typedef struct
+{
+  GstRTMPShare *share;
+  gchar *playpath_val;
+  AVal playpath;
+  gint id;			/* NetStream id on the connection */
+  gint channel;			/* chunk stream of its messages */
+  guint generation;		/* of the connection it was published on */
+  GstRTMPLog *log;
+} GstRTMPShareStream;
+
+/* Prepares a new shared connection, called before RTMP_Connect() with
+ * connected FALSE and once it is up with connected TRUE */
+typedef gboolean (*GstRTMPShareSetup) (RTMP * r, gboolean connected,
+    gpointer user_data);
+
+GstRTMPShareStream *gst_rtmp_share_publish (const gchar * uri,
+    GstRTMPLog * log, GstRTMPShareSetup setup, gpointer user_data);
+RTMP *gst_rtmp_share_lock (GstRTMPShareStream * stream, gboolean audio);
+void gst_rtmp_share_unlock (GstRTMPShareStream * stream, gboolean failed);
+void gst_rtmp_share_unpublish (GstRTMPShareStream * stream);
+
+G_END_DECLS
+
+#endif /* __GST_RTMP_SHARE_H__ */
@@ -33,6 +33,23 @@
  * gst-launch -v videotestsrc ! ffenc_flv ! flvmux ! rtmpsink location='rtmp://localhost/path/to/stream live=1'
  * ]| Encode a test video stream to FLV video format and stream it via RTMP.
  * </refsect2>
+ *
+ * The same stream can be published to several servers at once by listing
+ * them in #GstRTMPSink:locations. Every extra location is served by its
+ * own thread and reconnects on its own; when it falls behind it drops
+ * whole GOPs rather than slowing down the main location.
+ *
+ * Applications starting many short publishing sessions can set
+ * #GstRTMPSink:warm-connections: connections to the host are then opened
+ * and handshaked in the background, and the next session starts with the
+ * connect call.
+ *
+ * #GstRTMPSink:stats reports the transport of the main location: bytes,
+ * tags and chunks sent, the time send calls take, bytes still in the
+ * socket and acknowledged by the server, the round trip time of a ping,
+ * reconnections and the time spent without a connection. With
+ * #GstRTMPSink:stats-interval set the same structure is also posted as
+ * an "rtmpsink-stats" element message while data flows.
  */
 
 
@@ -43,10 +60,7 @@
 #include <gst/gst.h>
 
 #include "gstrtmpsink.h"
-
-#ifdef G_OS_WIN32
-#include <winsock2.h>
-#endif
+#include "gstrtmpwarm.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -54,6 +68,16 @@
 GST_DEBUG_CATEGORY_STATIC (gst_rtmp_sink_debug);
 #define GST_CAT_DEFAULT gst_rtmp_sink_debug
 #define MAX_TCP_TIMEOUT 30
+#define DEFAULT_MAX_QUEUE_BYTES (4 * 1024 * 1024)
+#define DEFAULT_MAX_QUEUE_TIME (2 * GST_SECOND)
+#define DEFAULT_OUT_CHUNK_SIZE RTMP_DEFAULT_CHUNKSIZE
+#define AUTO_CHUNK_SIZE_MIN 4096
+#define AUTO_CHUNK_SIZE_MAX 65536
+#define DEFAULT_COALESCE_LATENCY (5 * GST_MSECOND)
+#define DEFAULT_PACING_HEADROOM 50
+#define DEFAULT_MAX_BURST 16384
+/* how often the statistics are refreshed without stats-interval */
+#define STATS_REFRESH GST_SECOND
 #define STR2AVAL(av, str)        av.av_val = str; av.av_len = strlen(av.av_val)
 
 /* Filter signals and args */
@@ -72,8 +96,59 @@ enum
   PROP_TCP_TIMEOUT,
   ARG_LOG_LEVEL,
   PROP_FLASHVER,
+  PROP_ZERO_COPY,
+  PROP_ASYNC,
+  PROP_MAX_QUEUE_BYTES,
+  PROP_MAX_QUEUE_TIME,
+  PROP_OVERFLOW_POLICY,
+  PROP_GOP_CACHE_SIZE,
+  PROP_MAX_REPLAY_DURATION,
+  PROP_HOT_STANDBY,
+  PROP_LOCATIONS,
+  PROP_OUT_CHUNK_SIZE,
+  PROP_COALESCE_BYTES,
+  PROP_COALESCE_LATENCY,
+  PROP_PACING,
+  PROP_PACING_BITRATE,
+  PROP_PACING_HEADROOM,
+  PROP_MAX_BURST,
+  PROP_PACING_KERNEL,
+  PROP_PACING_DELAY,
+  PROP_PACING_DELAY_MAX,
+  PROP_WARM_CONNECTIONS,
+  PROP_WARM_IDLE_TIMEOUT,
+  PROP_SHARED_CONNECTION,
+  PROP_STATS,
+  PROP_STATS_INTERVAL,
+  PROP_REACTION_TIME,
+  PROP_MIN_BITRATE,
+  PROP_MAX_BITRATE,
+  PROP_BITRATE_MESSAGES,
+  PROP_TARGET_BITRATE,
 };
 
+#define GST_TYPE_RTMP_SINK_OVERFLOW_POLICY \
+  (gst_rtmp_sink_overflow_policy_get_type ())
+static GType
+gst_rtmp_sink_overflow_policy_get_type (void)
+{
+  static GType policy_type = 0;
+  static const GEnumValue policies[] = {
+    {GST_RTMP_SINK_OVERFLOW_BLOCK, "Block upstream until there is room",
+        "block"},
+    {GST_RTMP_SINK_OVERFLOW_DROP_GOP, "Drop the oldest queued GOP",
+        "drop-gop"},
+    {GST_RTMP_SINK_OVERFLOW_DROP_UNTIL_KEYFRAME,
+        "Drop new data until the next keyframe", "drop-until-keyframe"},
+    {0, NULL, NULL}
+  };
+
+  if (!policy_type)
+    policy_type = g_enum_register_static ("GstRTMPSinkOverflowPolicy",
+        policies);
+  return policy_type;
+}
+
 static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE ("sink",
     GST_PAD_SINK,
     GST_PAD_ALWAYS,
@@ -92,6 +167,13 @@ static gboolean gst_rtmp_sink_start (GstBaseSink * sink);
 static gboolean gst_rtmp_sink_event (GstBaseSink * sink, GstEvent * event);
 static gboolean gst_rtmp_sink_setcaps (GstBaseSink * sink, GstCaps * caps);
 static GstFlowReturn gst_rtmp_sink_render (GstBaseSink * sink, GstBuffer * buf);
+static GstStateChangeReturn gst_rtmp_sink_change_state (GstElement * element,
+    GstStateChange transition);
+static void gst_rtmp_sink_start_dests (GstRTMPSink * sink);
+static void gst_rtmp_sink_stop_dests (GstRTMPSink * sink);
+static void gst_rtmp_sink_update_stats (GstRTMPSink * sink);
+static void gst_rtmp_sink_update_qos (GstRTMPSink * sink, GstBuffer * buf);
+static void gst_rtmp_sink_free_streamheader (GList * streamheader);
 
 static void
 _do_init (GType gtype)
@@ -139,6 +221,9 @@ gst_rtmp_sink_class_init (GstRTMPSinkClass * klass)
   gobject_class->set_property = gst_rtmp_sink_set_property;
   gobject_class->get_property = gst_rtmp_sink_get_property;
 
+  GST_ELEMENT_CLASS (klass)->change_state =
+      GST_DEBUG_FUNCPTR (gst_rtmp_sink_change_state);
+
   gstbasesink_class->start = GST_DEBUG_FUNCPTR (gst_rtmp_sink_start);
   gstbasesink_class->stop = GST_DEBUG_FUNCPTR (gst_rtmp_sink_stop);
   gstbasesink_class->render = GST_DEBUG_FUNCPTR (gst_rtmp_sink_render);
@@ -155,7 +240,9 @@ gst_rtmp_sink_class_init (GstRTMPSinkClass * klass)
 
   g_object_class_install_property (gobject_class, ARG_LOG_LEVEL,
     g_param_spec_int ("log-level", "Log level",
-        "librtmp log level", RTMP_LOGCRIT, RTMP_LOGALL, RTMP_LOGERROR,
+        "Highest librtmp log level shown for this element's connections, "
+        "within what GST_DEBUG enables for the librtmp category",
+        RTMP_LOGCRIT, RTMP_LOGALL, RTMP_LOGALL,
         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
   g_object_class_install_property (G_OBJECT_CLASS (klass),
@@ -173,6 +260,185 @@ gst_rtmp_sink_class_init (GstRTMPSinkClass * klass)
   g_object_class_install_property (gobject_class, PROP_FLASHVER,
     g_param_spec_string ("flashver", "Flashver", "Version of the Flash plugin used to run the SWF player. The default is gstreamer0.10-rtmp-ubicast", 
       NULL, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_ZERO_COPY,
+      g_param_spec_boolean ("zero-copy", "Zero copy",
+          "Parse FLV tags in the sink and hand buffer memory to librtmp "
+          "directly instead of copying every tag",
+          FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ASYNC,
+      g_param_spec_boolean ("async-send", "Async send",
+          "Send from a dedicated thread so network stalls do not block "
+          "upstream; render only queues the data",
+          FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_QUEUE_BYTES,
+      g_param_spec_uint ("max-queue-bytes", "Max queue bytes",
+          "Maximum bytes queued for sending in async mode (0 = unlimited)",
+          0, G_MAXUINT, DEFAULT_MAX_QUEUE_BYTES,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_QUEUE_TIME,
+      g_param_spec_uint64 ("max-queue-time", "Max queue time",
+          "Maximum duration in ns queued for sending in async mode "
+          "(0 = unlimited)", 0, G_MAXUINT64, DEFAULT_MAX_QUEUE_TIME,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_OVERFLOW_POLICY,
+      g_param_spec_enum ("overflow-policy", "Overflow policy",
+          "What to do when the async send queue is full",
+          GST_TYPE_RTMP_SINK_OVERFLOW_POLICY, GST_RTMP_SINK_OVERFLOW_BLOCK,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_GOP_CACHE_SIZE,
+      g_param_spec_uint ("gop-cache-size", "GOP cache size",
+          "Maximum bytes of the current GOP kept for replay after a "
+          "reconnect (0 = disabled)", 0, G_MAXUINT, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_REPLAY_DURATION,
+      g_param_spec_uint64 ("max-replay-duration", "Max replay duration",
+          "Do not replay the cached GOP after a reconnect if it is longer "
+          "than this, in ns (0 = unlimited)", 0, G_MAXUINT64, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_HOT_STANDBY,
+      g_param_spec_boolean ("hot-standby", "Hot standby",
+          "Keep a second connection published to the location not in use "
+          "(backup_location or location) so failover is immediate",
+          FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_LOCATIONS,
+      g_param_spec_value_array ("locations", "Locations",
+          "Additional RTMP URIs the stream is published to at the same time. "
+          "Each has its own connection and queue, one failing does not "
+          "affect the others",
+          g_param_spec_string ("location", "Location", "RTMP URI", NULL,
+              G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS),
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_OUT_CHUNK_SIZE,
+      g_param_spec_uint ("out-chunk-size", "Outgoing chunk size",
+          "RTMP chunk size announced to the server on every connection. "
+          "Larger chunks cut header and send overhead at high bitrates "
+          "(0 = auto, sized from the average video frame)", 0, 0xffffff,
+          DEFAULT_OUT_CHUNK_SIZE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_COALESCE_BYTES,
+      g_param_spec_uint ("coalesce-bytes", "Coalesce bytes",
+          "Gather small chunks and send them together once this many bytes "
+          "are pending, cutting packets per second (0 = disabled). Data is "
+          "only held across buffers with async-send and for locations. "
+          "Over rtmpt:// each send is one HTTP request",
+          0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_COALESCE_LATENCY,
+      g_param_spec_uint64 ("coalesce-latency", "Coalesce latency",
+          "Longest time gathered data is held back, in ns", 0, G_MAXUINT64,
+          DEFAULT_COALESCE_LATENCY, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PACING,
+      g_param_spec_boolean ("pacing", "Pacing",
+          "Spread large tags out at the stream bitrate instead of sending "
+          "them at line rate. Best combined with async-send", FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PACING_BITRATE,
+      g_param_spec_uint ("pacing-bitrate", "Pacing bitrate",
+          "Bitrate to pace at, in bits/s (0 = measure it from the stream)",
+          0, G_MAXUINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PACING_HEADROOM,
+      g_param_spec_uint ("pacing-headroom", "Pacing headroom",
+          "How much faster than the bitrate to send, in percent", 0, 1000,
+          DEFAULT_PACING_HEADROOM, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_BURST,
+      g_param_spec_uint ("max-burst", "Max burst",
+          "Most bytes sent back to back while pacing", 1, G_MAXINT,
+          DEFAULT_MAX_BURST, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PACING_KERNEL,
+      g_param_spec_boolean ("pacing-kernel", "Kernel pacing",
+          "Let the socket pace with SO_MAX_PACING_RATE where supported", FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PACING_DELAY,
+      g_param_spec_uint64 ("pacing-delay", "Pacing delay",
+          "Time spent waiting for the pacer on the current connection, in ns",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PACING_DELAY_MAX,
+      g_param_spec_uint64 ("pacing-delay-max", "Max pacing delay",
+          "Longest single wait for the pacer on the current connection, in ns",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_WARM_CONNECTIONS,
+      g_param_spec_uint ("warm-connections", "Warm connections",
+          "Handshaked connections to keep ready for the location's host, "
+          "shared by all elements of the process (0 = off). For rtmpe:// "
+          "and rtmpte:// the handshake's key pairs are prepared instead",
+          0, RTMP_WARM_MAX, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_WARM_IDLE_TIMEOUT,
+      g_param_spec_uint ("warm-idle-timeout", "Warm idle timeout",
+          "Seconds a warm connection is kept unused, and the warm "
+          "connections kept after the last start", 1, G_MAXUINT,
+          GST_RTMP_WARM_DEFAULT_IDLE_TIMEOUT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_SHARED_CONNECTION,
+      g_param_spec_boolean ("shared-connection", "Shared connection",
+          "Publish over one connection with the other elements of the "
+          "process that set it for the same host and application. Statistics "
+          "and bitrate estimates, pacing, backup_location and hot-standby "
+          "do not apply to the main location then",
+          FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics",
+          "Transport statistics of the main location. send-latency counts "
+          "send calls by duration, under 16us, 64us, 256us and so on, the "
+          "last entry the rest", GST_TYPE_STRUCTURE,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_STATS_INTERVAL,
+      g_param_spec_uint64 ("stats-interval", "Statistics interval",
+          "Post the statistics as an element message this often, in ns "
+          "(0 = never)", 0, G_MAXUINT64, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_REACTION_TIME,
+      g_param_spec_uint64 ("reaction-time", "Reaction time",
+          "How fast the target bitrate follows congestion on the main "
+          "location, in ns (0 = no estimation). Reported upstream as QoS "
+          "events when qos is enabled and with bitrate-messages",
+          0, G_MAXUINT64, GST_RTMP_QOS_DEFAULT_REACTION_TIME,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MIN_BITRATE,
+      g_param_spec_uint ("min-bitrate", "Min bitrate",
+          "Lowest target bitrate, in bits/s", 0, G_MAXUINT, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_BITRATE,
+      g_param_spec_uint ("max-bitrate", "Max bitrate",
+          "Highest target bitrate, in bits/s (0 = a little above the "
+          "stream bitrate)", 0, G_MAXUINT, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_BITRATE_MESSAGES,
+      g_param_spec_boolean ("bitrate-messages", "Bitrate messages",
+          "Post a target-bitrate element message when the target bitrate "
+          "or congestion state changes, for the application to set on the "
+          "encoders", FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_TARGET_BITRATE,
+      g_param_spec_uint ("target-bitrate", "Target bitrate",
+          "Bitrate the main location can carry now, in bits/s (0 = not "
+          "estimated yet)", 0, G_MAXUINT, 0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
 }
 
 static void
@@ -183,6 +449,14 @@ gst_rtmp_sink_finalize (GstRTMPSink * sink)
 #endif
   g_free (sink->backup_uri);
   g_free (sink->uri);
+  if (sink->locations)
+    g_value_array_free (sink->locations);
+  gst_rtmp_sink_free_streamheader (sink->streamheader);
+  g_cond_free (sink->qcond);
+  g_mutex_free (sink->qlock);
+  g_cond_free (sink->rcond);
+  g_mutex_free (sink->rlock);
+  g_mutex_free (sink->slock);
   GST_DEBUG_OBJECT (sink, "free all variables stored in memory");
   G_OBJECT_CLASS (parent_class)->finalize (G_OBJECT (sink));
 }
@@ -200,15 +474,50 @@ gst_rtmp_sink_init (GstRTMPSink * sink, GstRTMPSinkClass * klass)
   sink->connection_status = 0;
   sink->reconnection_delay = 10000000000;
   sink->tcp_timeout = 3;
-  sink->stream_meta_saved = FALSE;
-  sink->video_meta_saved = FALSE;
-  sink->audio_meta_saved = FALSE;
-  sink->try_now_connection = TRUE;
   sink->send_error_count = 0;
   sink->disconnection_notified = 1;
   sink->is_backup = FALSE;
   sink->backup_uri = NULL;
   sink->flashver = "gstreamer0.10-rtmp-ubicast";
+  sink->log.object = G_OBJECT (sink);
+  sink->log.level = RTMP_LOGALL;
+  sink->zero_copy = FALSE;
+  sink->out_chunk_size = DEFAULT_OUT_CHUNK_SIZE;
+  sink->coalesce_bytes = 0;
+  sink->coalesce_latency = DEFAULT_COALESCE_LATENCY;
+  sink->pacing = FALSE;
+  sink->pacing_kernel = FALSE;
+  sink->pacing_bitrate = 0;
+  sink->pacing_headroom = DEFAULT_PACING_HEADROOM;
+  sink->max_burst = DEFAULT_MAX_BURST;
+  sink->qos.reaction_time = GST_RTMP_QOS_DEFAULT_REACTION_TIME;
+  sink->warm_connections = 0;
+  sink->warm_idle_timeout = GST_RTMP_WARM_DEFAULT_IDLE_TIMEOUT;
+  sink->shared_connection = FALSE;
+  sink->shared = NULL;
+
+  sink->qlock = g_mutex_new ();
+  sink->qcond = g_cond_new ();
+  g_queue_init (&sink->queue.buffers);
+  sink->srcresult = GST_FLOW_OK;
+  sink->async = FALSE;
+  sink->max_queue_bytes = DEFAULT_MAX_QUEUE_BYTES;
+  sink->max_queue_time = DEFAULT_MAX_QUEUE_TIME;
+  sink->overflow_policy = GST_RTMP_SINK_OVERFLOW_BLOCK;
+
+  g_queue_init (&sink->gop_cache);
+  sink->gop_cache_size = 0;
+  sink->max_replay_duration = 0;
+  sink->ts_offset = 0;
+
+  sink->rlock = g_mutex_new ();
+  sink->rcond = g_cond_new ();
+  sink->hot_standby = FALSE;
+
+  sink->slock = g_mutex_new ();
+  sink->stats_interval = 0;
+  sink->stats_time = GST_CLOCK_TIME_NONE;
+  sink->down_since = GST_CLOCK_TIME_NONE;
 }
 
 static gboolean
@@ -234,6 +543,15 @@ gst_rtmp_sink_start (GstBaseSink * basesink)
   	sink->rtmp_uri = g_strdup (sink->uri);
   else
   	sink->rtmp_uri = g_strdup (sink->backup_uri);
+  /* before RTMP_SetupURL() takes rtmp_uri apart */
+  gst_rtmp_warm_want (sink->rtmp_uri, sink->warm_connections,
+      sink->warm_idle_timeout);
+  if (sink->shared_connection) {
+    /* gstrtmpshare connects on the first buffer */
+    gst_rtmp_log_sync ();
+    sink->shared_retry = GST_CLOCK_TIME_NONE;
+    goto ready;
+  }
   sink->rtmp = RTMP_Alloc ();
 
   if (!sink->rtmp) {
@@ -242,6 +560,8 @@ gst_rtmp_sink_start (GstBaseSink * basesink)
   }
 
   RTMP_Init (sink->rtmp);
+  gst_rtmp_log_sync ();
+  gst_rtmp_log_attach (sink->rtmp, &sink->log);
   if (!sink->is_backup) {
     if (!RTMP_SetupURL (sink->rtmp, sink->rtmp_uri)) {
       GST_ELEMENT_ERROR (sink, RESOURCE, OPEN_WRITE, (NULL),
@@ -263,9 +583,30 @@ gst_rtmp_sink_start (GstBaseSink * basesink)
   /* Mark this as an output connection */
   RTMP_EnableWrite (sink->rtmp);
 
+ready:
   sink->first = TRUE;
   sink->have_write_error = FALSE;
   sink->first = TRUE;
+
+  g_mutex_lock (sink->slock);
+  memset (&sink->stats_base, 0, sizeof (sink->stats_base));
+  if (sink->rtmp) {
+    RTMP_GetStats (sink->rtmp, &sink->stats);
+  } else {
+    sink->stats = sink->stats_base;
+    sink->stats.rs_unsent = -1;
+  }
+  sink->conn_stats = sink->stats;
+  sink->stats_time = GST_CLOCK_TIME_NONE;
+  sink->stats_chunks = 0;
+  sink->chunk_rate = 0;
+  sink->reconnections = 0;
+  sink->downtime = 0;
+  sink->down_since = GST_CLOCK_TIME_NONE;
+  g_mutex_unlock (sink->slock);
+  gst_rtmp_qos_reset (&sink->qos);
+
+  gst_rtmp_sink_start_dests (sink);
   return TRUE;
 error:
   if (sink->rtmp) {
@@ -281,11 +622,14 @@ static gboolean
 gst_rtmp_sink_stop (GstBaseSink * basesink)
 {
   GstRTMPSink *sink = GST_RTMP_SINK (basesink);
+  gint i;
 
-  //gst_buffer_replace (&sink->header, NULL);
-  if (sink->header) {
-    gst_buffer_unref (sink->header);
-    sink->header = NULL;
+  gst_rtmp_sink_stop_dests (sink);
+  for (i = 0; i < G_N_ELEMENTS (sink->config); i++)
+    gst_buffer_replace (&sink->config[i], NULL);
+  if (sink->shared) {
+    gst_rtmp_share_unpublish (sink->shared);
+    sink->shared = NULL;
   }
   if (sink->rtmp) {
     RTMP_Close (sink->rtmp);
@@ -296,187 +640,1097 @@ gst_rtmp_sink_stop (GstBaseSink * basesink)
     g_free (sink->rtmp_uri);
     sink->rtmp_uri = NULL;
   }
+  /* handed over after the reconnection thread was stopped */
+  if (sink->closing) {
+    RTMP_Close (sink->closing);
+    RTMP_Free (sink->closing);
+    sink->closing = NULL;
+  }
+  g_free (sink->closing_uri);
+  sink->closing_uri = NULL;
   return TRUE;
 }
 
-static
-gboolean    copy_metadata(GstBuffer **meta_buf, GstBuffer *buf)
-{
-    *meta_buf = gst_buffer_new_and_alloc(GST_BUFFER_SIZE (buf));
-    *meta_buf = gst_buffer_copy(buf);
-    return TRUE;
-}
-
-static gboolean gst_rtmp_sink_option(GstRTMPSink *sink) {
+static gboolean gst_rtmp_sink_option(GstRTMPSink *sink, RTMP *r) {
 
   AVal flashver; 
   AVal timeout;
   AVal flashveropt;
   AVal timeoutopt;
-  gchar *str;
+  gchar str[16];
 
   STR2AVAL(flashveropt, "flashver");
   STR2AVAL(timeoutopt, "timeout");
   STR2AVAL(flashver, sink->flashver);
-  str = malloc(5 * sizeof(char*));
-  snprintf(str, 5, "%d", sink->tcp_timeout);
+  snprintf(str, sizeof (str), "%d", sink->tcp_timeout);
   STR2AVAL(timeout, str);
 
-  if (!RTMP_SetOpt(sink->rtmp, &flashveropt, &flashver)) {
+  if (!RTMP_SetOpt(r, &flashveropt, &flashver)) {
     GST_ELEMENT_ERROR (sink, RESOURCE, OPEN_READ, (NULL),
            ("Failed to set flashver"));
-    goto error;
+    return FALSE;
   }
 
-  if (!RTMP_SetOpt(sink->rtmp, &timeoutopt, &timeout)) {
+  if (!RTMP_SetOpt(r, &timeoutopt, &timeout)) {
     GST_ELEMENT_ERROR (sink, RESOURCE, OPEN_READ, (NULL),
            ("Failed to set flashver"));
-    goto error;
+    return FALSE;
   }
 
   return TRUE;
+}
+
+/* FLV video tag whose frame type is keyframe */
+static gboolean
+gst_rtmp_sink_is_keyframe (GstBuffer * buf)
+{
+  const guint8 *data = GST_BUFFER_DATA (buf);
+
+  return GST_BUFFER_SIZE (buf) > 11 && data[0] == 9
+      && (data[11] & 0xf0) == 0x10;
+}
+
+/* Headers, metadata and codec config must never be dropped: the stream
+ * cannot be decoded without them */
+static gboolean
+gst_rtmp_sink_is_config (GstBuffer * buf)
+{
+  const guint8 *data = GST_BUFFER_DATA (buf);
+  guint size = GST_BUFFER_SIZE (buf);
+
+  if (GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_IN_CAPS))
+    return TRUE;
+  if (size < 13 || data[0] == 'F' || data[0] == 18)
+    return TRUE;
+  /* AVC sequence header */
+  if (data[0] == 9 && (data[11] & 0x0f) == 7 && data[12] == 0)
+    return TRUE;
+  /* AAC sequence header */
+  if (data[0] == 8 && (data[11] >> 4) == 10 && data[12] == 0)
+    return TRUE;
+  return FALSE;
+}
+
+/* slot of a config buffer in config[] */
+static gint
+gst_rtmp_sink_config_index (GstBuffer * buf)
+{
+  if (GST_BUFFER_SIZE (buf) < 13)
+    return -1;
+  switch (GST_BUFFER_DATA (buf)[0]) {
+    case 18:
+      return 0;
+    case 9:
+      return 1;
+    case 8:
+      return 2;
+    default:
+      return -1;
+  }
+}
+
+/* Stream bitrate from the FLV timestamps, over windows of at least a
+ * second */
+static void
+gst_rtmp_sink_observe_rate (GstRTMPSink * sink, GstBuffer * buf)
+{
+  const guint8 *data = GST_BUFFER_DATA (buf);
+  guint32 ts, span;
+  guint rate;
+
+  if (GST_BUFFER_SIZE (buf) < 11 || (data[0] != 8 && data[0] != 9))
+    return;
+
+  ts = AMF_DecodeInt24 ((const char *) data + 4) | (data[7] << 24);
+  if (!sink->rate_bytes || ts < sink->rate_start) {
+    sink->rate_start = ts;
+    sink->rate_bytes = GST_BUFFER_SIZE (buf);
+    return;
+  }
+  sink->rate_bytes += GST_BUFFER_SIZE (buf);
+  span = ts - sink->rate_start;
+  if (span < 1000)
+    return;
+
+  rate = sink->rate_bytes * 1000 / span;
+  sink->observed_rate = sink->observed_rate ?
+      (sink->observed_rate * 3 + rate) / 4 : rate;
+  sink->rate_bytes = 0;
+  GST_LOG_OBJECT (sink, "stream bitrate %u bytes/s", sink->observed_rate);
+}
+
+/* Follow the bitrate as it changes, librtmp keeps the bucket's tokens */
+static void
+gst_rtmp_sink_update_pacing (GstRTMPSink * sink, RTMP * r)
+{
+  guint64 rate = 0;
+
+  if (sink->pacing) {
+    rate = sink->pacing_bitrate ? sink->pacing_bitrate / 8 :
+        sink->observed_rate;
+    rate = MIN (rate * (100 + sink->pacing_headroom) / 100, G_MAXINT);
+  }
+  if (rate == r->m_pacer.pc_rate && sink->max_burst == r->m_pacer.pc_burst)
+    return;
+
+  GST_DEBUG_OBJECT (sink, "pacing at %" G_GUINT64_FORMAT " bytes/s", rate);
+  RTMP_SetPacing (r, rate, sink->max_burst, sink->pacing_kernel);
+}
+
+/* Same return convention as RTMP_Write: bytes consumed, -1 on send
+ * failure and 0 when the data is not FLV. With shared, the tags go out on
+ * its stream, which takes whole tags only */
+static gint
+gst_rtmp_sink_write_tags (GstRTMPSink * sink, RTMP * r,
+    const GstRTMPShareStream * shared, guint32 ts_offset,
+    const guint8 * data, gint size)
+{
+  const guint8 *start = data;
+
+  /* librtmp holds a partial tag from a previous buffer, let it finish */
+  if (!shared && r->m_write.m_nBytesRead)
+    return RTMP_Write (r, (const char *) data, size);
+
+  if (size >= 13 && data[0] == 'F' && data[1] == 'L' && data[2] == 'V') {
+    data += 13;
+    size -= 13;
+  }
+
+  while (size > 0) {
+    guint32 body_size, timestamp;
+
+    if (size < 11)
+      break;
+    body_size = AMF_DecodeInt24 ((const char *) data + 1);
+    timestamp = AMF_DecodeInt24 ((const char *) data + 4) | (data[7] << 24);
+    if (11 + body_size > size)
+      break;
+
+    timestamp = timestamp > ts_offset ? timestamp - ts_offset : 0;
+    if (shared ? !RTMP_WriteStreamTag (r, shared->id, shared->channel,
+            data[0], timestamp, (const char *) data + 11, body_size) :
+        !RTMP_WriteTag (r, data[0], timestamp, (const char *) data + 11,
+            body_size))
+      return -1;
+
+    data += 11 + body_size;
+    size -= 11 + body_size;
+    /* previous tag size */
+    data += MIN (size, 4);
+    size -= MIN (size, 4);
+  }
+
+  if (size > 0 && shared) {
+    GST_WARNING_OBJECT (sink, "%d bytes of an incomplete tag, a shared "
+        "connection needs whole tags in each buffer", size);
+    return 0;
+  }
+  if (size > 0) {
+    gint ret;
+
+    /* tag split across buffers, librtmp reassembles the rest */
+    GST_LOG_OBJECT (sink, "%d trailing bytes, falling back to copy", size);
+    if (ts_offset && size >= 11) {
+      guint8 hdr[11];
+      guint32 timestamp;
+
+      memcpy (hdr, data, 11);
+      timestamp = AMF_DecodeInt24 ((const char *) data + 4) | (data[7] << 24);
+      timestamp = timestamp > ts_offset ? timestamp - ts_offset : 0;
+      AMF_EncodeInt24 ((char *) hdr + 4, (char *) hdr + 7, timestamp);
+      hdr[7] = timestamp >> 24;
+      if (RTMP_Write (r, (const char *) hdr, 11) < 0)
+        return -1;
+      data += 11;
+      size -= 11;
+      if (!size)
+        return data - start;
+    }
+    ret = RTMP_Write (r, (const char *) data, size);
+    if (ret < 0 || (ret == 0 && data == start))
+      return ret;
+  }
+
+  return data + size - start;
+}
+
+/* The turn on the shared connection is taken for each buffer, audio
+ * ahead of the rest */
+static gint
+gst_rtmp_sink_shared_write (GstRTMPSink * sink, GstBuffer * buf)
+{
+  gboolean audio = GST_BUFFER_SIZE (buf) > 0 &&
+      GST_BUFFER_DATA (buf)[0] == RTMP_PACKET_TYPE_AUDIO;
+  gint ret = -1;
+  RTMP *r;
+
+  if ((r = gst_rtmp_share_lock (sink->shared, audio)))
+    ret = gst_rtmp_sink_write_tags (sink, r, sink->shared, sink->ts_offset,
+        GST_BUFFER_DATA (buf), GST_BUFFER_SIZE (buf));
+  gst_rtmp_share_unlock (sink->shared, ret < 0);
+  return ret;
+}
+
+static gint
+gst_rtmp_sink_write (GstRTMPSink * sink, GstBuffer * buf)
+{
+  gint ret;
+
+  if (sink->shared_connection)
+    return gst_rtmp_sink_shared_write (sink, buf);
+
+  gst_rtmp_sink_update_pacing (sink, sink->rtmp);
+  if (sink->zero_copy || sink->ts_offset)
+    ret = gst_rtmp_sink_write_tags (sink, sink->rtmp, NULL, sink->ts_offset,
+        GST_BUFFER_DATA (buf), GST_BUFFER_SIZE (buf));
+  else
+    ret = RTMP_Write (sink->rtmp, (char *) GST_BUFFER_DATA (buf),
+        GST_BUFFER_SIZE (buf));
+
+  /* the connection may go away under get_property */
+  sink->pacing_delay = sink->rtmp->m_pacer.pc_delay * GST_USECOND;
+  sink->pacing_delay_max = sink->rtmp->m_pacer.pc_delayMax * GST_USECOND;
+  if (ret > 0) {
+    gst_rtmp_sink_update_stats (sink);
+    gst_rtmp_sink_update_qos (sink, buf);
+  }
+  return ret;
+}
+
+static void
+gst_rtmp_sink_gop_cache_clear (GstRTMPSink * sink)
+{
+  GstBuffer *buf;
+
+  while ((buf = g_queue_pop_head (&sink->gop_cache)))
+    gst_buffer_unref (buf);
+  sink->gop_cache_bytes = 0;
+}
+
+/* Keep every media tag since the last keyframe. The cache is restarted on
+ * each keyframe and given up until the next one if the GOP outgrows
+ * gop-cache-size */
+static void
+gst_rtmp_sink_gop_cache_add (GstRTMPSink * sink, GstBuffer * buf)
+{
+  if (!sink->gop_cache_size || gst_rtmp_sink_is_config (buf))
+    return;
+
+  if (gst_rtmp_sink_is_keyframe (buf))
+    gst_rtmp_sink_gop_cache_clear (sink);
+  else if (g_queue_is_empty (&sink->gop_cache))
+    return;
+
+  if (sink->gop_cache_bytes + GST_BUFFER_SIZE (buf) > sink->gop_cache_size) {
+    GST_DEBUG_OBJECT (sink, "GOP larger than %u bytes, not caching it",
+        sink->gop_cache_size);
+    gst_rtmp_sink_gop_cache_clear (sink);
+    return;
+  }
+
+  g_queue_push_tail (&sink->gop_cache, gst_buffer_ref (buf));
+  sink->gop_cache_bytes += GST_BUFFER_SIZE (buf);
+}
+
+/* Send the cached GOP on a fresh connection. The new session's timeline
+ * starts at the cached keyframe so the server does not see the outage as
+ * a timestamp gap. Returns the number of buffers sent, -1 on send
+ * failure */
+static gint
+gst_rtmp_sink_gop_cache_replay (GstRTMPSink * sink)
+{
+  GstBuffer *first, *last;
+  const guint8 *data;
+  GList *item;
+  gint ret = 0;
+
+  sink->ts_offset = 0;
+  first = g_queue_peek_head (&sink->gop_cache);
+  last = g_queue_peek_tail (&sink->gop_cache);
+  if (!first)
+    return 0;
+
+  if (sink->max_replay_duration &&
+      GST_BUFFER_TIMESTAMP_IS_VALID (first) &&
+      GST_BUFFER_TIMESTAMP_IS_VALID (last) &&
+      GST_BUFFER_TIMESTAMP (last) - GST_BUFFER_TIMESTAMP (first) >
+      sink->max_replay_duration) {
+    GST_DEBUG_OBJECT (sink, "cached GOP spans %" GST_TIME_FORMAT
+        ", not replaying it",
+        GST_TIME_ARGS (GST_BUFFER_TIMESTAMP (last) -
+            GST_BUFFER_TIMESTAMP (first)));
+    return 0;
+  }
+
+  data = GST_BUFFER_DATA (first);
+  sink->ts_offset = AMF_DecodeInt24 ((const char *) data + 4) | (data[7] << 24);
+  GST_DEBUG_OBJECT (sink, "replaying %u cached buffers, %" G_GUINT64_FORMAT
+      " bytes, rebased by %u ms", g_queue_get_length (&sink->gop_cache),
+      sink->gop_cache_bytes, sink->ts_offset);
+
+  for (item = sink->gop_cache.head; item; item = item->next) {
+    if (gst_rtmp_sink_write (sink, item->data) < 0)
+      return -1;
+    ret++;
+  }
+
+  return ret;
+}
+
+/* Keep a ref on the latest metadata and codec config of each kind, so a
+ * new session starts with what the stream uses now, not what it started
+ * with. New streamheader caps supersede what was seen before them */
+static void
+gst_rtmp_sink_track_config (GstRTMPSink * sink, GstBuffer * buf)
+{
+  gint i;
+
+  GST_OBJECT_LOCK (sink);
+  if (sink->streamheader_changed) {
+    for (i = 0; i < G_N_ELEMENTS (sink->config); i++)
+      gst_buffer_replace (&sink->config[i], NULL);
+    sink->streamheader_changed = FALSE;
+  }
+  GST_OBJECT_UNLOCK (sink);
+
+  if (gst_rtmp_sink_is_config (buf) &&
+      (i = gst_rtmp_sink_config_index (buf)) >= 0) {
+    GST_LOG_OBJECT (sink, "tracking config tag %d, size %d",
+        GST_BUFFER_DATA (buf)[0], GST_BUFFER_SIZE (buf));
+    gst_buffer_replace (&sink->config[i], buf);
+  }
+}
+
+/* Metadata and codec config ahead of the media on a new session, from
+ * the stream or else from the caps streamheader. Each buffer is written
+ * on its own, nothing is joined. Returns the last write result, 1 when
+ * there was nothing to send */
+static gint
+gst_rtmp_sink_send_config (GstRTMPSink * sink)
+{
+  GstBuffer *config[G_N_ELEMENTS (sink->config)] = { NULL, };
+  GList *l;
+  gint i, ret = 1;
+
+  GST_OBJECT_LOCK (sink);
+  for (l = sink->streamheader; l; l = l->next) {
+    if ((i = gst_rtmp_sink_config_index (l->data)) >= 0)
+      gst_buffer_replace (&config[i], l->data);
+  }
+  GST_OBJECT_UNLOCK (sink);
+
+  for (i = 0; i < G_N_ELEMENTS (config); i++) {
+    if (sink->config[i])
+      gst_buffer_replace (&config[i], sink->config[i]);
+    if (!config[i])
+      continue;
+    if (ret >= 0)
+      ret = gst_rtmp_sink_write (sink, config[i]);
+    gst_buffer_unref (config[i]);
+  }
+
+  return ret;
+}
+
+/* In auto mode a typical video frame goes out as a single chunk, within
+ * limits that keep audio from waiting too long behind a keyframe */
+static gint
+gst_rtmp_sink_chunk_size (GstRTMPSink * sink)
+{
+  guint size = AUTO_CHUNK_SIZE_MIN;
+
+  if (sink->out_chunk_size)
+    return sink->out_chunk_size;
+  while (size < sink->avg_frame_size && size < AUTO_CHUNK_SIZE_MAX)
+    size <<= 1;
+  return size;
+}
+
+/* Every new connection starts at the protocol defaults, so the chunk size
+ * has to be announced again */
+static gboolean
+gst_rtmp_sink_setup_connection (GstRTMPSink * sink, RTMP * r)
+{
+  gint size = gst_rtmp_sink_chunk_size (sink);
+
+  if (size != r->m_outChunkSize) {
+    GST_DEBUG_OBJECT (sink, "Setting outgoing chunk size to %d", size);
+    if (!RTMP_SendChunkSize (r, size))
+      return FALSE;
+  }
+  /* makes the server acknowledge what it read, see acked-bytes */
+  if (!RTMP_SendServerBW (r))
+    return FALSE;
+  gst_rtmp_sink_update_pacing (sink, r);
+  if (sink->coalesce_bytes)
+    return RTMP_SetCoalescing (r, sink->coalesce_bytes,
+        sink->coalesce_latency / GST_MSECOND);
+  return TRUE;
+}
+
+/* Open a new publishing connection without touching sink->rtmp, so it
+ * can run on the reconnection thread */
+static RTMP *
+gst_rtmp_sink_connect (GstRTMPSink * sink, const gchar * uri,
+    gchar ** rtmp_uri)
+{
+  RTMP *r;
+  gchar *url;
+
+  if (!uri)
+    return NULL;
+  r = RTMP_Alloc ();
+  if (!r)
+    return NULL;
+
+  /* librtmp keeps pointers into the url */
+  url = g_strdup (uri);
+  RTMP_Init (r);
+  gst_rtmp_log_attach (r, &sink->log);
+  if (!RTMP_SetupURL (r, url))
+    goto error;
+  RTMP_EnableWrite (r);
+  if (!gst_rtmp_sink_option (sink, r))
+    goto error;
+  if (!RTMP_Connect (r, NULL) || !RTMP_ConnectStream (r, 0) ||
+      !gst_rtmp_sink_setup_connection (sink, r))
+    goto error;
+
+  GST_DEBUG_OBJECT (sink, "Opened connection to %s", url);
+  *rtmp_uri = url;
+  return r;
+
 error:
-  if (sink->rtmp) {
-    RTMP_Free(sink->rtmp);
-    sink->rtmp = NULL;
+  GST_DEBUG_OBJECT (sink, "Connection to %s failed", uri);
+  RTMP_Close (r);
+  RTMP_Free (r);
+  g_free (url);
+  return NULL;
+}
+
+static void
+gst_rtmp_sink_disconnect (RTMP * r, gchar * rtmp_uri)
+{
+  if (r) {
+    RTMP_Close (r);
+    RTMP_Free (r);
   }
-  if (sink->rtmp_uri) {
-    g_free(sink->rtmp_uri);
-    sink->rtmp_uri = NULL;
+  g_free (rtmp_uri);
+}
+
+/* called with rlock */
+static void
+gst_rtmp_sink_notify_disconnected (GstRTMPSink * sink)
+{
+  GstStructure *s;
+
+  if (sink->disconnection_notified != 1)
+    return;
+
+  GST_DEBUG_OBJECT (sink, "Emitting disconnected message");
+  s = gst_structure_new ("disconnected",
+      "timestamp", G_TYPE_UINT64, sink->begin_time_disc, NULL);
+  gst_element_post_message (GST_ELEMENT (sink),
+      gst_message_new_element (GST_OBJECT (sink), s));
+  sink->disconnection_notified = 0;
+}
+
+/* Answer pings and drain control messages so the server keeps a standby
+ * publish alive. On the connection in use it also picks up pongs and
+ * acknowledgements for the statistics. Only whole chunks are read, so
+ * this never waits for the network */
+static void
+gst_rtmp_sink_service (RTMP * r)
+{
+  RTMPPacket packet = { 0 };
+
+  while (RTMP_ReadReady (r)) {
+    if (!RTMP_ReadPacket (r, &packet)) {
+      RTMP_Close (r);
+      break;
+    }
+    if (RTMPPacket_IsReady (&packet)) {
+      RTMP_ClientPacket (r, &packet);
+      RTMPPacket_Free (&packet);
+    }
   }
-  return FALSE;
 }
 
-static GstFlowReturn
-gst_rtmp_sink_render (GstBaseSink * bsink, GstBuffer * buf)
+/* The counters that add up over connections */
+static void
+gst_rtmp_sink_stats_add (RTMPStats * to, const RTMPStats * from)
+{
+  gint i;
+
+  to->rs_bytesOut += from->rs_bytesOut;
+  to->rs_bytesIn += from->rs_bytesIn;
+  to->rs_chunksOut += from->rs_chunksOut;
+  to->rs_chunksIn += from->rs_chunksIn;
+  to->rs_tagsOut += from->rs_tagsOut;
+  to->rs_tagsIn += from->rs_tagsIn;
+  to->rs_sendCalls += from->rs_sendCalls;
+  for (i = 0; i < RTMP_STATS_BUCKETS; i++)
+    to->rs_sendLatency[i] += from->rs_sendLatency[i];
+}
+
+/* Keep the counters of a connection about to be dropped and start
+ * counting the outage */
+static void
+gst_rtmp_sink_stats_fold (GstRTMPSink * sink, RTMP * r)
+{
+  RTMPStats cur;
+
+  RTMP_GetStats (r, &cur);
+  g_mutex_lock (sink->slock);
+  gst_rtmp_sink_stats_add (&sink->stats_base, &cur);
+  sink->stats = sink->stats_base;
+  memset (&sink->conn_stats, 0, sizeof (sink->conn_stats));
+  sink->conn_stats.rs_unsent = -1;
+  if (!GST_CLOCK_TIME_IS_VALID (sink->down_since))
+    sink->down_since = gst_util_get_timestamp ();
+  g_mutex_unlock (sink->slock);
+}
+
+static GstStructure *
+gst_rtmp_sink_stats_structure (GstRTMPSink * sink)
 {
-  GstRTMPSink *sink = GST_RTMP_SINK (bsink);
-  gboolean need_unref = FALSE;
-  gboolean result = TRUE;
-  GstBuffer *reffed_buf = NULL;
   GstStructure *s;
+  GValue hist = { 0 };
+  GValue v = { 0 };
+  GstClockTime downtime;
+  guint64 queue_bytes;
+  guint queue_buffers;
+  gint i;
 
-  if (sink->connection_status) {
-    if (!sink->stream_meta_saved && buf->data[0] == 18) {
-        GST_LOG_OBJECT (sink, "save stream metadata, size : %d", GST_BUFFER_SIZE (buf));
-        sink->stream_meta_saved = copy_metadata(&sink->stream_metadata, buf);
+  g_mutex_lock (sink->qlock);
+  queue_bytes = sink->queue.bytes;
+  queue_buffers = g_queue_get_length (&sink->queue.buffers);
+  g_mutex_unlock (sink->qlock);
+
+  g_value_init (&hist, GST_TYPE_ARRAY);
+  g_value_init (&v, G_TYPE_UINT64);
+  g_mutex_lock (sink->slock);
+  for (i = 0; i < RTMP_STATS_BUCKETS; i++) {
+    g_value_set_uint64 (&v, sink->stats.rs_sendLatency[i]);
+    gst_value_array_append_value (&hist, &v);
+  }
+  downtime = sink->downtime;
+  if (GST_CLOCK_TIME_IS_VALID (sink->down_since))
+    downtime += gst_util_get_timestamp () - sink->down_since;
+
+  s = gst_structure_new ("rtmpsink-stats",
+      "bytes-sent", G_TYPE_UINT64, sink->stats.rs_bytesOut,
+      "tags-sent", G_TYPE_UINT64, sink->stats.rs_tagsOut,
+      "chunks-sent", G_TYPE_UINT64, sink->stats.rs_chunksOut,
+      "chunks-per-second", G_TYPE_DOUBLE, sink->chunk_rate,
+      "send-calls", G_TYPE_UINT64, sink->stats.rs_sendCalls,
+      "connection-bytes-sent", G_TYPE_UINT64, sink->conn_stats.rs_bytesOut,
+      "acked-bytes", G_TYPE_UINT64, sink->conn_stats.rs_bytesAcked,
+      "in-flight-bytes", G_TYPE_INT, sink->conn_stats.rs_unsent,
+      "rtt", G_TYPE_UINT64, sink->conn_stats.rs_rtt ?
+      (guint64) sink->conn_stats.rs_rtt * GST_USECOND : GST_CLOCK_TIME_NONE,
+      "reconnections", G_TYPE_UINT, sink->reconnections,
+      "downtime", G_TYPE_UINT64, downtime,
+      "queue-bytes", G_TYPE_UINT64, queue_bytes,
+      "queue-buffers", G_TYPE_UINT, queue_buffers, NULL);
+  g_mutex_unlock (sink->slock);
+
+  gst_structure_set_value (s, "send-latency", &hist);
+  g_value_unset (&v);
+  g_value_unset (&hist);
+  return s;
+}
+
+/* Called after each write on the thread that owns sink->rtmp. Once per
+ * interval the pongs and acknowledgements that already arrived are read,
+ * the connection pinged again and its counters copied for get_property.
+ * On the write path, so nothing here may wait for the server */
+static void
+gst_rtmp_sink_update_stats (GstRTMPSink * sink)
+{
+  GstClockTime now = gst_util_get_timestamp ();
+  GstClockTime interval;
+  RTMPStats cur;
+
+  interval = sink->stats_interval ? sink->stats_interval : STATS_REFRESH;
+  if (GST_CLOCK_TIME_IS_VALID (sink->stats_time) &&
+      now < sink->stats_time + interval)
+    return;
+
+  gst_rtmp_sink_service (sink->rtmp);
+  if (RTMP_IsConnected (sink->rtmp))
+    RTMP_SendPing (sink->rtmp);
+  RTMP_GetStats (sink->rtmp, &cur);
+
+  g_mutex_lock (sink->slock);
+  sink->conn_stats = cur;
+  sink->stats = sink->stats_base;
+  gst_rtmp_sink_stats_add (&sink->stats, &cur);
+  if (GST_CLOCK_TIME_IS_VALID (sink->stats_time) && now > sink->stats_time)
+    sink->chunk_rate = (gdouble) (sink->stats.rs_chunksOut -
+        sink->stats_chunks) * GST_SECOND / (now - sink->stats_time);
+  sink->stats_chunks = sink->stats.rs_chunksOut;
+  sink->stats_time = now;
+  g_mutex_unlock (sink->slock);
+
+  if (sink->stats_interval)
+    gst_element_post_message (GST_ELEMENT (sink),
+        gst_message_new_element (GST_OBJECT (sink),
+            gst_rtmp_sink_stats_structure (sink)));
+}
+
+/* Feed the congestion estimate a sample when one is due and tell
+ * upstream when the target moved. The extra locations are left out:
+ * the encoders can only follow one of them */
+static void
+gst_rtmp_sink_update_qos (GstRTMPSink * sink, GstBuffer * buf)
+{
+  GstRTMPQos *qos = &sink->qos;
+  GstClockTime now = gst_util_get_timestamp ();
+  gboolean qos_events = gst_base_sink_is_qos_enabled (GST_BASE_SINK (sink));
+  guint64 queued = 0;
+  gdouble proportion = 1.0;
+  RTMPStats cur;
+
+  if ((!qos_events && !sink->bitrate_messages) || !gst_rtmp_qos_due (qos,
+          now))
+    return;
+
+  /* picks up the acknowledgements that arrived, never waits for one */
+  gst_rtmp_sink_service (sink->rtmp);
+  RTMP_GetStats (sink->rtmp, &cur);
+  if (sink->async) {
+    g_mutex_lock (sink->qlock);
+    queued = sink->queue.bytes;
+    g_mutex_unlock (sink->qlock);
+  }
+  if (!gst_rtmp_qos_update (qos, now, &cur, sink->rtmp->m_nServerBW, queued,
+          sink->observed_rate))
+    return;
+
+  if (sink->observed_rate)
+    proportion = sink->observed_rate * 8.0 / qos->bitrate;
+  GST_DEBUG_OBJECT (sink, "target bitrate %u, throughput %u, delay %"
+      GST_TIME_FORMAT ", %.0f%% of sends blocked%s", qos->bitrate,
+      qos->throughput, GST_TIME_ARGS (qos->delay), qos->blocked * 100,
+      qos->congested ? ", congested" : "");
+
+  if (qos_events)
+    gst_pad_push_event (GST_BASE_SINK_PAD (sink),
+        gst_event_new_qos (proportion, qos->delay, GST_BUFFER_TIMESTAMP (buf)));
+  if (sink->bitrate_messages)
+    gst_element_post_message (GST_ELEMENT (sink),
+        gst_message_new_element (GST_OBJECT (sink),
+            gst_structure_new ("target-bitrate",
+                "bitrate", G_TYPE_UINT, qos->bitrate,
+                "throughput", G_TYPE_UINT, qos->throughput,
+                "delay", G_TYPE_UINT64, qos->delay,
+                "proportion", G_TYPE_DOUBLE, proportion,
+                "congested", G_TYPE_BOOLEAN, qos->congested, NULL)));
+}
+
+static gpointer
+gst_rtmp_sink_reconnect_loop (GstRTMPSink * sink)
+{
+  GTimeVal tv;
+  RTMP *r;
+  gchar *uri = NULL;
+  gboolean backup, for_standby;
+
+  g_mutex_lock (sink->rlock);
+  while (!sink->reconnect_stop) {
+    if (sink->closing) {
+      /* may block on a stalled socket, which is why it is done here */
+      r = sink->closing;
+      uri = sink->closing_uri;
+      sink->closing = NULL;
+      sink->closing_uri = NULL;
+      g_mutex_unlock (sink->rlock);
+      gst_rtmp_sink_disconnect (r, uri);
+      g_mutex_lock (sink->rlock);
+      continue;
+    }
+    if (sink->reconnect_wanted && !sink->pending_rtmp) {
+      /* alternate between the locations on every attempt */
+      if (sink->backup_uri)
+        sink->target_is_backup = !sink->target_is_backup;
+      backup = sink->target_is_backup;
+      for_standby = FALSE;
+    } else if (sink->hot_standby && sink->backup_uri && !sink->standby) {
+      backup = !sink->is_backup;
+      for_standby = TRUE;
+    } else {
+      r = sink->standby;
+      if (r) {
+        sink->standby_busy = TRUE;
+        g_mutex_unlock (sink->rlock);
+        gst_rtmp_sink_service (r);
+        g_mutex_lock (sink->rlock);
+        sink->standby_busy = FALSE;
+        if (!RTMP_IsConnected (r)) {
+          GST_DEBUG_OBJECT (sink, "Lost standby connection to %s",
+              sink->standby_uri);
+          gst_rtmp_sink_disconnect (r, sink->standby_uri);
+          sink->standby = NULL;
+          sink->standby_uri = NULL;
+        }
+        g_cond_broadcast (sink->rcond);
+      }
+      g_get_current_time (&tv);
+      g_time_val_add (&tv, G_USEC_PER_SEC / 2);
+      g_cond_timed_wait (sink->rcond, sink->rlock, &tv);
+      continue;
     }
-    // Check if first packet is video type (video = 9) contain video type
-    else if (!sink->video_meta_saved && buf->data[0] == 9) {
-        GST_LOG_OBJECT (sink, "save video metada, size : %d", GST_BUFFER_SIZE (buf));
-        sink->video_meta_saved = copy_metadata(&sink->video_metadata, buf);
+
+    GST_DEBUG_OBJECT (sink, "Connecting to %s URI%s", backup ? "backup" :
+        "main", for_standby ? " for standby" : "");
+    g_mutex_unlock (sink->rlock);
+    r = gst_rtmp_sink_connect (sink, backup ? sink->backup_uri : sink->uri,
+        &uri);
+    g_mutex_lock (sink->rlock);
+
+    if (r) {
+      if (sink->reconnect_stop) {
+        gst_rtmp_sink_disconnect (r, uri);
+      } else if (sink->reconnect_wanted && !sink->pending_rtmp) {
+        sink->pending_rtmp = r;
+        sink->pending_uri = uri;
+        sink->pending_is_backup = backup;
+        sink->reconnect_wanted = FALSE;
+      } else if (sink->hot_standby && !sink->standby &&
+          backup != sink->is_backup) {
+        sink->standby = r;
+        sink->standby_uri = uri;
+        sink->standby_is_backup = backup;
+      } else {
+        /* superseded while connecting */
+        gst_rtmp_sink_disconnect (r, uri);
+      }
+      continue;
     }
-    // Check if first packet is audio type (audio = 8) contain video type
-    else if (!sink->audio_meta_saved && buf->data[0] == 8) {
-        GST_LOG_OBJECT (sink, "save audio metada, size : %d", GST_BUFFER_SIZE (buf));
-        sink->audio_meta_saved = copy_metadata(&sink->audio_metadata, buf);
+
+    if (!for_standby) {
+      /* superseded while connecting, the standby took over */
+      if (!sink->reconnect_wanted)
+        continue;
+      gst_rtmp_sink_notify_disconnected (sink);
+      if (!sink->reconnection_delay) {
+        sink->reconnect_failed = TRUE;
+        sink->reconnect_wanted = FALSE;
+        continue;
+      }
     }
+    g_get_current_time (&tv);
+    g_time_val_add (&tv, sink->reconnection_delay / GST_USECOND);
+    g_cond_timed_wait (sink->rcond, sink->rlock, &tv);
+  }
+  g_mutex_unlock (sink->rlock);
+
+  return NULL;
+}
+
+/* called with rlock */
+static void
+gst_rtmp_sink_wake_reconnect (GstRTMPSink * sink)
+{
+  if (!sink->reconnect_thread && !sink->reconnect_stop) {
+    GError *err = NULL;
+
+    sink->reconnect_thread = g_thread_create ((GThreadFunc)
+        gst_rtmp_sink_reconnect_loop, sink, TRUE, &err);
+    if (!sink->reconnect_thread) {
+      GST_WARNING_OBJECT (sink, "Could not create reconnection thread: %s",
+          err->message);
+      g_error_free (err);
+      sink->reconnect_failed = TRUE;
+    }
+  }
+  g_cond_broadcast (sink->rcond);
+}
+
+/* Drop the broken connection and let the reconnection thread find a new
+ * one while we keep accepting data */
+static void
+gst_rtmp_sink_request_reconnect (GstRTMPSink * sink, GstClockTime timestamp)
+{
+  RTMP *old;
+  gchar *old_uri;
+
+  if (sink->shared_connection) {
+    /* the next buffer publishes again, on a new connection if need be */
+    if (sink->shared)
+      gst_rtmp_share_unpublish (sink->shared);
+    sink->shared = NULL;
+    g_mutex_lock (sink->rlock);
+    if (sink->disconnection_notified == 1)
+      sink->begin_time_disc = timestamp;
+    gst_rtmp_sink_notify_disconnected (sink);
+    g_mutex_unlock (sink->rlock);
+    return;
+  }
+  if (sink->rtmp)
+    gst_rtmp_sink_stats_fold (sink, sink->rtmp);
+
+  g_mutex_lock (sink->rlock);
+  old = sink->closing;
+  old_uri = sink->closing_uri;
+  sink->closing = sink->rtmp;
+  sink->closing_uri = sink->rtmp_uri;
+  sink->rtmp = NULL;
+  sink->rtmp_uri = NULL;
+
+  sink->begin_time_disc = timestamp;
+  sink->target_is_backup = sink->is_backup;
+  sink->reconnect_wanted = TRUE;
+  sink->reconnect_failed = FALSE;
+  gst_rtmp_sink_wake_reconnect (sink);
+  g_mutex_unlock (sink->rlock);
+
+  /* the thread did not get to the previous one yet */
+  gst_rtmp_sink_disconnect (old, old_uri);
+}
+
+/* Install the connection the reconnection thread prepared, or the hot
+ * standby one. Returns FALSE if neither is ready yet */
+static gboolean
+gst_rtmp_sink_take_connection (GstRTMPSink * sink)
+{
+  RTMP *r = NULL;
+  gchar *uri = NULL;
+
+  g_mutex_lock (sink->rlock);
+  while (sink->standby_busy)
+    g_cond_wait (sink->rcond, sink->rlock);
+
+  if (sink->pending_rtmp) {
+    r = sink->pending_rtmp;
+    uri = sink->pending_uri;
+    sink->is_backup = sink->pending_is_backup;
+    sink->pending_rtmp = NULL;
+    sink->pending_uri = NULL;
+  } else if (sink->standby && RTMP_IsConnected (sink->standby)) {
+    GST_DEBUG_OBJECT (sink, "Switching to standby connection %s",
+        sink->standby_uri);
+    r = sink->standby;
+    uri = sink->standby_uri;
+    sink->is_backup = sink->standby_is_backup;
+    sink->standby = NULL;
+    sink->standby_uri = NULL;
+    sink->reconnect_wanted = FALSE;
+  }
+  /* bring up a new standby for the location we just left */
+  if (r)
+    g_cond_broadcast (sink->rcond);
+  g_mutex_unlock (sink->rlock);
+
+  if (!r)
+    return FALSE;
+
+  sink->rtmp = r;
+  sink->rtmp_uri = uri;
+
+  g_mutex_lock (sink->slock);
+  if (GST_CLOCK_TIME_IS_VALID (sink->down_since)) {
+    sink->downtime += gst_util_get_timestamp () - sink->down_since;
+    sink->down_since = GST_CLOCK_TIME_NONE;
+    sink->reconnections++;
+  }
+  g_mutex_unlock (sink->slock);
+  return TRUE;
+}
+
+static void
+gst_rtmp_sink_stop_reconnect (GstRTMPSink * sink)
+{
+  GThread *thread;
+
+  g_mutex_lock (sink->rlock);
+  thread = sink->reconnect_thread;
+  sink->reconnect_thread = NULL;
+  sink->reconnect_stop = TRUE;
+  g_cond_broadcast (sink->rcond);
+  g_mutex_unlock (sink->rlock);
+
+  if (thread)
+    g_thread_join (thread);
+
+  gst_rtmp_sink_disconnect (sink->pending_rtmp, sink->pending_uri);
+  sink->pending_rtmp = NULL;
+  sink->pending_uri = NULL;
+  gst_rtmp_sink_disconnect (sink->standby, sink->standby_uri);
+  sink->standby = NULL;
+  sink->standby_uri = NULL;
+  gst_rtmp_sink_disconnect (sink->closing, sink->closing_uri);
+  sink->closing = NULL;
+  sink->closing_uri = NULL;
+}
+
+static gboolean
+gst_rtmp_sink_shared_setup (RTMP * r, gboolean connected, gpointer user_data)
+{
+  GstRTMPSink *sink = user_data;
+  gint size = gst_rtmp_sink_chunk_size (sink);
+
+  if (!connected)
+    return gst_rtmp_sink_option (sink, r);
+  /* the first stream picks the chunk size for all of them */
+  if (size != r->m_outChunkSize && !RTMP_SendChunkSize (r, size))
+    return FALSE;
+  if (!RTMP_SendServerBW (r))
+    return FALSE;
+  if (sink->coalesce_bytes)
+    return RTMP_SetCoalescing (r, sink->coalesce_bytes,
+        sink->coalesce_latency / GST_MSECOND);
+  return TRUE;
+}
+
+/* Publish on the shared connection. While that fails it is tried again
+ * every reconnection-delay, from the streaming thread */
+static gboolean
+gst_rtmp_sink_shared_open (GstRTMPSink * sink, GstBuffer * buf)
+{
+  GstClockTime now = gst_util_get_timestamp ();
+
+  if (sink->shared)
+    return TRUE;
+  if (GST_CLOCK_TIME_IS_VALID (sink->shared_retry) &&
+      now < sink->shared_retry)
+    return FALSE;
+
+  sink->shared = gst_rtmp_share_publish (sink->rtmp_uri, &sink->log,
+      gst_rtmp_sink_shared_setup, sink);
+  if (sink->shared) {
+    GST_DEBUG_OBJECT (sink, "Publishing on stream %d of the shared "
+        "connection", sink->shared->id);
+    sink->shared_retry = GST_CLOCK_TIME_NONE;
+    return TRUE;
+  }
+
+  GST_DEBUG_OBJECT (sink, "Publishing on the shared connection failed");
+  sink->connection_status = -1;
+  if (sink->reconnection_delay <= 0) {
+    GST_ELEMENT_ERROR (sink, RESOURCE, OPEN_WRITE, (NULL),
+        ("Could not publish %s on a shared connection", sink->rtmp_uri));
+    sink->have_write_error = TRUE;
+    return FALSE;
   }
+  sink->shared_retry = now + sink->reconnection_delay;
+  g_mutex_lock (sink->rlock);
+  if (sink->disconnection_notified == 1)
+    sink->begin_time_disc = GST_BUFFER_TIMESTAMP (buf);
+  gst_rtmp_sink_notify_disconnected (sink);
+  g_mutex_unlock (sink->rlock);
+  return FALSE;
+}
+
+static GstFlowReturn
+gst_rtmp_sink_process (GstRTMPSink * sink, GstBuffer * buf)
+{
+  gboolean result = TRUE;
+  gboolean reconnected;
+  gboolean sent;
+  gint replayed = 0;
+  GstStructure *s;
+
+  gst_rtmp_sink_track_config (sink, buf);
+  if (GST_BUFFER_SIZE (buf) > 11 && buf->data[0] == 9 &&
+      !gst_rtmp_sink_is_config (buf))
+    sink->avg_frame_size = (sink->avg_frame_size * 15 +
+        GST_BUFFER_SIZE (buf) - 11) / 16;
+  gst_rtmp_sink_observe_rate (sink, buf);
+  /* keep caching while disconnected, the replay must end at the live edge */
+  gst_rtmp_sink_gop_cache_add (sink, buf);
   if (sink->first) {
-    if ((sink->sent_status == -1 || sink->connection_status == -1))
-      sink->end_time_disc = GST_BUFFER_TIMESTAMP (buf);
-    if ((sink->end_time_disc - sink->begin_time_disc > sink->reconnection_delay) || sink->try_now_connection) {
-      GST_DEBUG_OBJECT (sink, "Maybe disconnected from RTMP server, reconnecting to be sure");
-      if (sink->connection_status == -1 || sink->sent_status == -1) {
-        GST_DEBUG_OBJECT (sink, "Reinitializing RTMP object");
-        gst_rtmp_sink_stop (bsink);
-        if (sink->backup_uri) {
-        	sink->is_backup = !sink->is_backup;
-        	if (!sink->is_backup) {
-	          GST_LOG_OBJECT (sink, "Backup URI is not accessible, will switch on main URI : %s",
-          		sink->backup_uri);
-	         }
-        	else {
-	          GST_LOG_OBJECT (sink, "Main URI is not accessible, will switch on backup URI : %s",
-          		sink->backup_uri);
-	         }
-        }
-        else{
-        	GST_LOG_OBJECT (sink, "No backup URI defined, try to reconnect on main URI");
-        }
-        gst_rtmp_sink_start (bsink);
-        sink->begin_time_disc = sink->end_time_disc;
-      }
-      if (!RTMP_IsConnected (sink->rtmp)) {
-        GST_DEBUG_OBJECT (sink, "Trying to connect");
-        result = gst_rtmp_sink_option(sink);
-        if (!result) {
-          GST_ELEMENT_ERROR (sink, RESOURCE, OPEN_WRITE, (NULL),
-            ("Could not set options, please check them"));
+    if (sink->shared_connection) {
+      if (!gst_rtmp_sink_shared_open (sink, buf))
+        return sink->have_write_error ? GST_FLOW_ERROR : GST_FLOW_OK;
+    } else if (!sink->rtmp || sink->connection_status == -1 ||
+        sink->sent_status == -1) {
+      /* the reconnection thread is on it, keep feeding the GOP cache */
+      if (!gst_rtmp_sink_take_connection (sink)) {
+        if (sink->reconnect_failed)
           goto init_failed;
-        }
-        if (!RTMP_Connect (sink->rtmp, NULL)
-            || !RTMP_ConnectStream (sink->rtmp, 0)) {
-          GST_DEBUG_OBJECT (sink, "Connection failed, freeing RTMP buffers");
-          RTMP_Free (sink->rtmp);
-          sink->rtmp = NULL;
-          g_free (sink->rtmp_uri);
-          sink->try_now_connection = FALSE;
-          sink->rtmp_uri = NULL;
-          sink->connection_status = -1;
-          sink->send_error_count = 0;
-          if (sink->reconnection_delay <= 0)
-            goto init_failed;
-          else {
-            sink->begin_time_disc = GST_BUFFER_TIMESTAMP (buf);
-            if (sink->disconnection_notified == 1) {
-                GST_DEBUG_OBJECT (sink, "Emitting disconnected message");
-                s = gst_structure_new ("disconnected",
-                    "timestamp", G_TYPE_UINT64, sink->begin_time_disc, NULL);
-                gst_element_post_message (GST_ELEMENT (sink),
-                    gst_message_new_element (GST_OBJECT (sink), s));
-                sink->connection_status = -1;
-                sink->sent_status = 0;
-                sink->disconnection_notified = 0;
-            }
-            return GST_FLOW_OK;
-          }
-        }
-        GST_DEBUG_OBJECT (sink, "Opened connection to %s", sink->rtmp_uri);
+        return GST_FLOW_OK;
       }
-
-      GST_LOG_OBJECT (sink, "Caching first buffer of size %d for concatenation",
-          GST_BUFFER_SIZE (buf));
-      gst_buffer_replace (&sink->header, buf);   
-      if (!sink->disconnection_notified) {
-        GST_DEBUG_OBJECT (sink, "Success to reconnect to server, emitting reconnected message");
-        s = gst_structure_new ("reconnected",
-          "timestamp", G_TYPE_UINT64, sink->begin_time_disc, NULL);
-          gst_element_post_message (GST_ELEMENT (sink),
-        gst_message_new_element (GST_OBJECT (sink), s));
-        sink->disconnection_notified = 1;
+      GST_DEBUG_OBJECT (sink, "Switched to connection %s", sink->rtmp_uri);
+    } else if (!RTMP_IsConnected (sink->rtmp)) {
+      GST_DEBUG_OBJECT (sink, "Trying to connect");
+      result = gst_rtmp_sink_option(sink, sink->rtmp);
+      if (!result) {
+        GST_ELEMENT_ERROR (sink, RESOURCE, OPEN_WRITE, (NULL),
+          ("Could not set options, please check them"));
+        goto init_failed;
       }
-      else if (sink->sent_status == -1 && sink->send_error_count >= 2) {
-        GST_DEBUG_OBJECT (sink, "Insufficient bandwidth", sink->uri);
-        s = gst_structure_new ("bandwidth",
-            "timestamp", G_TYPE_UINT64, GST_BUFFER_TIMESTAMP (buf), NULL);
-        gst_element_post_message (GST_ELEMENT (sink),
-            gst_message_new_element (GST_OBJECT (sink), s));
+      if (!RTMP_Connect (sink->rtmp, NULL)
+          || !RTMP_ConnectStream (sink->rtmp, 0)
+          || !gst_rtmp_sink_setup_connection (sink, sink->rtmp)) {
+        GST_DEBUG_OBJECT (sink, "Connection failed, freeing RTMP buffers");
+        sink->connection_status = -1;
         sink->send_error_count = 0;
-       }
-       sink->connection_status = 1;
-       GST_DEBUG_OBJECT (sink, "Send back stream metadata to the server, dropping video/audio buffer");
-       if (sink->stream_meta_saved)
-         sink->connection_status = RTMP_Write (sink->rtmp,
-           (char *) GST_BUFFER_DATA (sink->stream_metadata), GST_BUFFER_SIZE (sink->stream_metadata));
-       if (sink->video_meta_saved)
-         sink->connection_status = RTMP_Write (sink->rtmp,
-           (char *) GST_BUFFER_DATA (sink->video_metadata), GST_BUFFER_SIZE (sink->video_metadata));
-       if (sink->audio_meta_saved)
-         sink->connection_status = RTMP_Write (sink->rtmp,
-           (char *) GST_BUFFER_DATA (sink->audio_metadata), GST_BUFFER_SIZE (sink->audio_metadata));
+        if (sink->reconnection_delay <= 0)
+          goto init_failed;
+        gst_rtmp_sink_request_reconnect (sink, GST_BUFFER_TIMESTAMP (buf));
+        g_mutex_lock (sink->rlock);
+        gst_rtmp_sink_notify_disconnected (sink);
+        g_mutex_unlock (sink->rlock);
+        return GST_FLOW_OK;
+      }
+      GST_DEBUG_OBJECT (sink, "Opened connection to %s", sink->rtmp_uri);
+      if (sink->hot_standby && sink->backup_uri) {
+        g_mutex_lock (sink->rlock);
+        gst_rtmp_sink_wake_reconnect (sink);
+        g_mutex_unlock (sink->rlock);
+      }
     }
-    else
-      return GST_FLOW_OK;
-    if (sink->header) {
 
-      reffed_buf = buf = gst_buffer_join(gst_buffer_ref (sink->header),
-          gst_buffer_ref (buf));
-      need_unref = TRUE;
+    /* the reconnection thread notifies disconnections too */
+    g_mutex_lock (sink->rlock);
+    reconnected = !sink->disconnection_notified;
+    if (reconnected) {
+      GST_DEBUG_OBJECT (sink, "Success to reconnect to server, emitting reconnected message");
+      s = gst_structure_new ("reconnected",
+          "timestamp", G_TYPE_UINT64, sink->begin_time_disc, NULL);
+      gst_element_post_message (GST_ELEMENT (sink),
+          gst_message_new_element (GST_OBJECT (sink), s));
+      sink->disconnection_notified = 1;
+    }
+    g_mutex_unlock (sink->rlock);
+    if (!reconnected && sink->sent_status == -1 &&
+        sink->send_error_count >= 2) {
+      GST_DEBUG_OBJECT (sink, "Insufficient bandwidth", sink->uri);
+      s = gst_structure_new ("bandwidth",
+          "timestamp", G_TYPE_UINT64, GST_BUFFER_TIMESTAMP (buf), NULL);
+      gst_element_post_message (GST_ELEMENT (sink),
+          gst_message_new_element (GST_OBJECT (sink), s));
+      sink->send_error_count = 0;
+    }
+    sink->connection_status = 1;
+    gst_rtmp_qos_restart (&sink->qos);
+    if (GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_IN_CAPS)) {
+      /* upstream is sending its headers in-band right now, they follow
+       * as they are. The bare FLV file header has no use on RTMP */
+      sink->ts_offset = 0;
+      sent = gst_rtmp_sink_config_index (buf) < 0;
+    } else {
+      GST_DEBUG_OBJECT (sink, "Sending stream metadata and codec config");
+      sink->connection_status = gst_rtmp_sink_send_config (sink);
+      if (sink->connection_status < 0 ||
+          (replayed = gst_rtmp_sink_gop_cache_replay (sink)) < 0) {
+        GST_DEBUG_OBJECT (sink, "RTMP send error while resending the "
+            "stream start");
+        sink->sent_status = -1;
+        sink->send_error_count++;
+        gst_rtmp_sink_request_reconnect (sink, GST_BUFFER_TIMESTAMP (buf));
+        return GST_FLOW_OK;
+      }
+      /* config went out above, the GOP replay ends with this buffer */
+      sent = gst_rtmp_sink_is_config (buf) || (replayed > 0 &&
+          g_queue_peek_tail (&sink->gop_cache) == buf);
     }
 
     sink->first = FALSE;
-    return GST_FLOW_OK;
+    if (sent)
+      return GST_FLOW_OK;
   }
 
   if (sink->have_write_error)
@@ -485,12 +1739,9 @@ gst_rtmp_sink_render (GstBaseSink * bsink, GstBuffer * buf)
   if (sink->connection_status > 0) {
     GST_LOG_OBJECT (sink, "Sending %d bytes to RTMP server",
         GST_BUFFER_SIZE (buf)); 
-      if (!(sink->sent_status = RTMP_Write (sink->rtmp,
-                  (char *) GST_BUFFER_DATA (buf), GST_BUFFER_SIZE (buf)))) {
+      if (!(sink->sent_status = gst_rtmp_sink_write (sink, buf))) {
         GST_ELEMENT_ERROR (sink, RESOURCE, WRITE, (NULL),
             ("Allocation or flv packet too small error"));
-        if (reffed_buf)
-          gst_buffer_unref (reffed_buf);
         return GST_FLOW_ERROR;
       }
   }
@@ -499,13 +1750,9 @@ gst_rtmp_sink_render (GstBaseSink * bsink, GstBuffer * buf)
     GST_DEBUG_OBJECT (sink, "RTMP send error");
     sink->send_error_count++;
     sink->first = TRUE;
-    sink->begin_time_disc = GST_BUFFER_TIMESTAMP (buf);
-    sink->try_now_connection = TRUE;
+    gst_rtmp_sink_request_reconnect (sink, GST_BUFFER_TIMESTAMP (buf));
   }
 
-  if (reffed_buf)
-    gst_buffer_unref (reffed_buf);
-
   return GST_FLOW_OK;
 
 init_failed:
@@ -526,13 +1773,541 @@ write_failed:
   {
     GST_ELEMENT_ERROR (sink, RESOURCE, WRITE, (NULL), ("Failed to write data"));
     //gst_buffer_unmap (buf, &map);
-    if (need_unref)
-      gst_buffer_unref (buf);
     sink->have_write_error = TRUE;
     return GST_FLOW_ERROR;
   }
 }
 
+static void
+gst_rtmp_sink_queue_drop (GstRTMPSinkQueue * q, GList * item)
+{
+  GstBuffer *buf = item->data;
+
+  q->bytes -= GST_BUFFER_SIZE (buf);
+  g_queue_delete_link (&q->buffers, item);
+  gst_buffer_unref (buf);
+}
+
+static void
+gst_rtmp_sink_queue_clear (GstRTMPSinkQueue * q)
+{
+  GstBuffer *buf;
+
+  while ((buf = g_queue_pop_head (&q->buffers)))
+    gst_buffer_unref (buf);
+  q->bytes = 0;
+}
+
+/* called with the queue's lock */
+static gboolean
+gst_rtmp_sink_queue_full (GstRTMPSink * sink, GstRTMPSinkQueue * q,
+    GstBuffer * buf)
+{
+  GstBuffer *head;
+
+  if (g_queue_is_empty (&q->buffers))
+    return FALSE;
+  if (sink->max_queue_bytes &&
+      q->bytes + GST_BUFFER_SIZE (buf) > sink->max_queue_bytes)
+    return TRUE;
+
+  head = g_queue_peek_head (&q->buffers);
+  if (sink->max_queue_time && GST_BUFFER_TIMESTAMP_IS_VALID (head) &&
+      GST_BUFFER_TIMESTAMP_IS_VALID (buf) &&
+      GST_BUFFER_TIMESTAMP (buf) > GST_BUFFER_TIMESTAMP (head) &&
+      GST_BUFFER_TIMESTAMP (buf) - GST_BUFFER_TIMESTAMP (head) >
+      sink->max_queue_time)
+    return TRUE;
+  return FALSE;
+}
+
+/* Drop queued media from the head up to the next keyframe, keeping
+ * config tags. Returns FALSE if there was nothing left to drop. Called
+ * with the queue's lock */
+static gboolean
+gst_rtmp_sink_queue_drop_gop (GstRTMPSinkQueue * q)
+{
+  GList *item = q->buffers.head;
+  gboolean dropped = FALSE;
+
+  while (item) {
+    GList *next = item->next;
+    GstBuffer *buf = item->data;
+
+    if (dropped && gst_rtmp_sink_is_keyframe (buf))
+      break;
+    if (!gst_rtmp_sink_is_config (buf)) {
+      gst_rtmp_sink_queue_drop (q, item);
+      dropped = TRUE;
+    }
+    item = next;
+  }
+
+  /* no keyframe left to resume from, the next deltas are useless */
+  if (dropped && !item)
+    q->drop_until_keyframe = TRUE;
+
+  return dropped;
+}
+
+/* Queue buf, making room according to policy. Blocking is up to the
+ * caller, a full queue with the block policy is pushed to anyway.
+ * Returns FALSE if buf was dropped. Called with the queue's lock */
+static gboolean
+gst_rtmp_sink_queue_push (GstRTMPSink * sink, GstRTMPSinkQueue * q,
+    GstBuffer * buf, GstRTMPSinkOverflowPolicy policy)
+{
+  gboolean config = gst_rtmp_sink_is_config (buf);
+
+  if (q->drop_until_keyframe && !config) {
+    if (!gst_rtmp_sink_is_keyframe (buf))
+      goto drop;
+    GST_DEBUG_OBJECT (sink, "got keyframe, resuming");
+    q->drop_until_keyframe = FALSE;
+  }
+
+  while (!config && gst_rtmp_sink_queue_full (sink, q, buf)) {
+    if (policy == GST_RTMP_SINK_OVERFLOW_DROP_GOP) {
+      GST_DEBUG_OBJECT (sink, "send queue full, dropping oldest GOP");
+      if (!gst_rtmp_sink_queue_drop_gop (q))
+        break;
+      /* the queue had no keyframe, this delta has no reference anymore */
+      if (q->drop_until_keyframe && !gst_rtmp_sink_is_keyframe (buf))
+        goto drop;
+      q->drop_until_keyframe = FALSE;
+    } else if (policy == GST_RTMP_SINK_OVERFLOW_DROP_UNTIL_KEYFRAME) {
+      GST_DEBUG_OBJECT (sink, "send queue full, dropping until keyframe");
+      q->drop_until_keyframe = TRUE;
+      goto drop;
+    } else {
+      break;
+    }
+  }
+
+  g_queue_push_tail (&q->buffers, gst_buffer_ref (buf));
+  q->bytes += GST_BUFFER_SIZE (buf);
+  return TRUE;
+
+drop:
+  GST_LOG_OBJECT (sink, "dropping buffer of size %d", GST_BUFFER_SIZE (buf));
+  return FALSE;
+}
+
+static gpointer
+gst_rtmp_sink_send_loop (GstRTMPSink * sink)
+{
+  GstBuffer *buf;
+  GstFlowReturn ret;
+  GTimeVal tv;
+  gint delay;
+
+  g_mutex_lock (sink->qlock);
+  while (!sink->send_stop) {
+    buf = g_queue_pop_head (&sink->queue.buffers);
+    if (!buf) {
+      /* only this thread touches the connection in async mode */
+      delay = sink->rtmp ? RTMP_FlushDelay (sink->rtmp) : -1;
+      if (delay > 0) {
+        g_get_current_time (&tv);
+        g_time_val_add (&tv, delay * 1000);
+        g_cond_timed_wait (sink->qcond, sink->qlock, &tv);
+      } else if (delay == 0) {
+        g_mutex_unlock (sink->qlock);
+        RTMP_Flush (sink->rtmp);
+        g_mutex_lock (sink->qlock);
+      } else {
+        g_cond_wait (sink->qcond, sink->qlock);
+      }
+      continue;
+    }
+    sink->queue.bytes -= GST_BUFFER_SIZE (buf);
+    sink->sending = TRUE;
+    g_cond_broadcast (sink->qcond);
+    g_mutex_unlock (sink->qlock);
+
+    ret = gst_rtmp_sink_process (sink, buf);
+    gst_buffer_unref (buf);
+
+    g_mutex_lock (sink->qlock);
+    sink->sending = FALSE;
+    if (ret != GST_FLOW_OK) {
+      GST_DEBUG_OBJECT (sink, "send thread got %d, dropping queue", ret);
+      sink->srcresult = ret;
+      gst_rtmp_sink_queue_clear (&sink->queue);
+    }
+    g_cond_broadcast (sink->qcond);
+  }
+  g_mutex_unlock (sink->qlock);
+
+  return NULL;
+}
+
+static void
+gst_rtmp_sink_stop_sender (GstRTMPSink * sink)
+{
+  GThread *thread;
+
+  g_mutex_lock (sink->qlock);
+  thread = sink->send_thread;
+  sink->send_thread = NULL;
+  sink->send_stop = TRUE;
+  sink->flushing = TRUE;
+  g_cond_broadcast (sink->qcond);
+  g_mutex_unlock (sink->qlock);
+
+  if (thread)
+    g_thread_join (thread);
+
+  g_mutex_lock (sink->qlock);
+  gst_rtmp_sink_queue_clear (&sink->queue);
+  g_mutex_unlock (sink->qlock);
+}
+
+static GstFlowReturn
+gst_rtmp_sink_enqueue (GstRTMPSink * sink, GstBuffer * buf)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  gboolean config = gst_rtmp_sink_is_config (buf);
+
+  g_mutex_lock (sink->qlock);
+  if (sink->flushing)
+    goto flushing;
+  if (sink->srcresult != GST_FLOW_OK)
+    goto error;
+
+  if (!sink->send_thread) {
+    GError *err = NULL;
+
+    sink->send_stop = FALSE;
+    sink->send_thread = g_thread_create ((GThreadFunc)
+        gst_rtmp_sink_send_loop, sink, TRUE, &err);
+    if (!sink->send_thread) {
+      GST_ELEMENT_ERROR (sink, RESOURCE, FAILED, (NULL),
+          ("Could not create send thread: %s", err->message));
+      g_error_free (err);
+      ret = GST_FLOW_ERROR;
+      goto done;
+    }
+  }
+
+  while (!config && sink->overflow_policy == GST_RTMP_SINK_OVERFLOW_BLOCK &&
+      gst_rtmp_sink_queue_full (sink, &sink->queue, buf)) {
+    g_cond_wait (sink->qcond, sink->qlock);
+    if (sink->flushing)
+      goto flushing;
+    if (sink->srcresult != GST_FLOW_OK)
+      goto error;
+  }
+
+  if (gst_rtmp_sink_queue_push (sink, &sink->queue, buf,
+          sink->overflow_policy))
+    g_cond_broadcast (sink->qcond);
+  goto done;
+
+flushing:
+  ret = GST_FLOW_WRONG_STATE;
+  goto done;
+error:
+  ret = sink->srcresult;
+done:
+  g_mutex_unlock (sink->qlock);
+  return ret;
+}
+
+/* One of the extra locations. Each has its own connection, queue and
+ * thread, so a slow or dead server only loses its own data. Buffers are
+ * shared by reference with the main location and sent with RTMP_WriteTag,
+ * which only builds chunk headers around the tag bodies */
+typedef struct
+{
+  GstRTMPSink *sink;
+  gchar *uri;
+  GMutex *lock;
+  GCond *cond;
+  GThread *thread;
+  gboolean stop;
+  gboolean failed;
+  gboolean connected;
+  gboolean sending;
+  gboolean resync;		/* new session, wait for a keyframe */
+  guint connections;
+  GstRTMPSinkQueue queue;
+  GstBuffer *config[3];		/* latest metadata, video and audio config */
+} GstRTMPSinkDest;
+
+static gint
+gst_rtmp_sink_dest_write (GstRTMPSinkDest * dest, RTMP * r, GstBuffer * buf)
+{
+  gst_rtmp_sink_update_pacing (dest->sink, r);
+  return gst_rtmp_sink_write_tags (dest->sink, r, NULL, 0,
+      GST_BUFFER_DATA (buf), GST_BUFFER_SIZE (buf));
+}
+
+/* The server starts a new stream on every connection, send it the codec
+ * config first and skip deltas until the next keyframe. Called with
+ * dest->lock */
+static gint
+gst_rtmp_sink_dest_resend_config (GstRTMPSinkDest * dest, RTMP * r)
+{
+  GstBuffer *config[G_N_ELEMENTS (dest->config)];
+  gint i, ret = 0;
+
+  for (i = 0; i < G_N_ELEMENTS (config); i++)
+    config[i] = dest->config[i] ? gst_buffer_ref (dest->config[i]) : NULL;
+  dest->resync = TRUE;
+  g_mutex_unlock (dest->lock);
+
+  for (i = 0; i < G_N_ELEMENTS (config); i++) {
+    if (!config[i])
+      continue;
+    if (ret >= 0)
+      ret = gst_rtmp_sink_dest_write (dest, r, config[i]);
+    gst_buffer_unref (config[i]);
+  }
+
+  g_mutex_lock (dest->lock);
+  return ret;
+}
+
+static gpointer
+gst_rtmp_sink_dest_loop (GstRTMPSinkDest * dest)
+{
+  GstRTMPSink *sink = dest->sink;
+  RTMP *r = NULL;
+  gchar *rtmp_uri = NULL;
+  GstBuffer *buf;
+  GTimeVal tv;
+  gint ret, delay;
+
+  g_mutex_lock (dest->lock);
+  while (!dest->stop) {
+    ret = 0;
+    if (!r) {
+      g_mutex_unlock (dest->lock);
+      r = gst_rtmp_sink_connect (sink, dest->uri, &rtmp_uri);
+      g_mutex_lock (dest->lock);
+      if (!r) {
+        if (!sink->reconnection_delay) {
+          GST_ELEMENT_WARNING (sink, RESOURCE, OPEN_WRITE, (NULL),
+              ("Could not connect to %s, giving up on it", dest->uri));
+          dest->failed = TRUE;
+          gst_rtmp_sink_queue_clear (&dest->queue);
+          break;
+        }
+        g_get_current_time (&tv);
+        g_time_val_add (&tv, sink->reconnection_delay / GST_USECOND);
+        g_cond_timed_wait (dest->cond, dest->lock, &tv);
+        continue;
+      }
+      dest->connected = TRUE;
+      /* the first session gets the header from the queue */
+      if (dest->connections++)
+        ret = gst_rtmp_sink_dest_resend_config (dest, r);
+    } else if ((buf = g_queue_pop_head (&dest->queue.buffers))) {
+      dest->queue.bytes -= GST_BUFFER_SIZE (buf);
+      if (dest->resync && !gst_rtmp_sink_is_config (buf)) {
+        if (!gst_rtmp_sink_is_keyframe (buf)) {
+          gst_buffer_unref (buf);
+          continue;
+        }
+        dest->resync = FALSE;
+      }
+      dest->sending = TRUE;
+      g_mutex_unlock (dest->lock);
+      ret = gst_rtmp_sink_dest_write (dest, r, buf);
+      gst_buffer_unref (buf);
+      g_mutex_lock (dest->lock);
+      dest->sending = FALSE;
+      g_cond_broadcast (dest->cond);
+    } else if ((delay = RTMP_FlushDelay (r)) > 0) {
+      g_get_current_time (&tv);
+      g_time_val_add (&tv, delay * 1000);
+      g_cond_timed_wait (dest->cond, dest->lock, &tv);
+    } else if (delay == 0) {
+      g_mutex_unlock (dest->lock);
+      ret = RTMP_Flush (r) ? 0 : -1;
+      g_mutex_lock (dest->lock);
+    } else {
+      g_cond_wait (dest->cond, dest->lock);
+    }
+
+    if (ret < 0) {
+      GST_WARNING_OBJECT (sink, "Lost connection to %s, reconnecting",
+          dest->uri);
+      dest->connected = FALSE;
+      g_cond_broadcast (dest->cond);
+      g_mutex_unlock (dest->lock);
+      gst_rtmp_sink_disconnect (r, rtmp_uri);
+      g_mutex_lock (dest->lock);
+      r = NULL;
+      rtmp_uri = NULL;
+    }
+  }
+  dest->connected = FALSE;
+  g_cond_broadcast (dest->cond);
+  g_mutex_unlock (dest->lock);
+
+  gst_rtmp_sink_disconnect (r, rtmp_uri);
+  return NULL;
+}
+
+/* Never holds up the streaming thread: a destination that cannot keep
+ * up loses whole GOPs instead of stalling the others */
+static void
+gst_rtmp_sink_dest_push (GstRTMPSinkDest * dest, GstBuffer * buf)
+{
+  GstRTMPSink *sink = dest->sink;
+  GstRTMPSinkOverflowPolicy policy = sink->overflow_policy;
+  gint i;
+
+  if (policy == GST_RTMP_SINK_OVERFLOW_BLOCK)
+    policy = GST_RTMP_SINK_OVERFLOW_DROP_GOP;
+
+  g_mutex_lock (dest->lock);
+  if (!dest->failed) {
+    if (gst_rtmp_sink_is_config (buf) &&
+        (i = gst_rtmp_sink_config_index (buf)) >= 0)
+      gst_buffer_replace (&dest->config[i], buf);
+    if (gst_rtmp_sink_queue_push (sink, &dest->queue, buf, policy))
+      g_cond_broadcast (dest->cond);
+  }
+  g_mutex_unlock (dest->lock);
+}
+
+static void
+gst_rtmp_sink_start_dests (GstRTMPSink * sink)
+{
+  GstRTMPSinkDest *dest;
+  GError *err = NULL;
+  guint i;
+
+  if (!sink->locations)
+    return;
+
+  for (i = 0; i < sink->locations->n_values; i++) {
+    const gchar *uri =
+        g_value_get_string (g_value_array_get_nth (sink->locations, i));
+
+    if (!uri || !*uri)
+      continue;
+
+    gst_rtmp_warm_want (uri, sink->warm_connections, sink->warm_idle_timeout);
+    dest = g_new0 (GstRTMPSinkDest, 1);
+    dest->sink = sink;
+    dest->uri = g_strdup (uri);
+    dest->lock = g_mutex_new ();
+    dest->cond = g_cond_new ();
+    g_queue_init (&dest->queue.buffers);
+    dest->thread = g_thread_create ((GThreadFunc) gst_rtmp_sink_dest_loop,
+        dest, TRUE, &err);
+    if (!dest->thread) {
+      GST_ELEMENT_WARNING (sink, RESOURCE, FAILED, (NULL),
+          ("Could not create thread for %s: %s", uri, err->message));
+      g_clear_error (&err);
+      dest->failed = TRUE;
+    }
+    GST_DEBUG_OBJECT (sink, "Also publishing to %s", uri);
+    sink->dests = g_list_append (sink->dests, dest);
+  }
+}
+
+static void
+gst_rtmp_sink_stop_dests (GstRTMPSink * sink)
+{
+  GList *l;
+  gint i;
+
+  for (l = sink->dests; l; l = l->next) {
+    GstRTMPSinkDest *dest = l->data;
+
+    g_mutex_lock (dest->lock);
+    dest->stop = TRUE;
+    g_cond_broadcast (dest->cond);
+    g_mutex_unlock (dest->lock);
+  }
+
+  for (l = sink->dests; l; l = l->next) {
+    GstRTMPSinkDest *dest = l->data;
+
+    if (dest->thread)
+      g_thread_join (dest->thread);
+    gst_rtmp_sink_queue_clear (&dest->queue);
+    for (i = 0; i < G_N_ELEMENTS (dest->config); i++)
+      gst_buffer_replace (&dest->config[i], NULL);
+    g_cond_free (dest->cond);
+    g_mutex_free (dest->lock);
+    g_free (dest->uri);
+    g_free (dest);
+  }
+  g_list_free (sink->dests);
+  sink->dests = NULL;
+}
+
+static GstFlowReturn
+gst_rtmp_sink_render (GstBaseSink * bsink, GstBuffer * buf)
+{
+  GstRTMPSink *sink = GST_RTMP_SINK (bsink);
+  GstFlowReturn ret;
+  GList *l;
+
+  for (l = sink->dests; l; l = l->next)
+    gst_rtmp_sink_dest_push (l->data, buf);
+
+  if (sink->async || sink->send_thread)
+    return gst_rtmp_sink_enqueue (sink, buf);
+
+  ret = gst_rtmp_sink_process (sink, buf);
+  /* nothing else would send it before the next buffer */
+  if (sink->rtmp)
+    RTMP_Flush (sink->rtmp);
+  return ret;
+}
+
+static GstStateChangeReturn
+gst_rtmp_sink_change_state (GstElement * element, GstStateChange transition)
+{
+  GstRTMPSink *sink = GST_RTMP_SINK (element);
+  GstStateChangeReturn ret;
+
+  switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      g_mutex_lock (sink->qlock);
+      sink->flushing = FALSE;
+      sink->srcresult = GST_FLOW_OK;
+      sink->queue.drop_until_keyframe = FALSE;
+      g_mutex_unlock (sink->qlock);
+      g_mutex_lock (sink->rlock);
+      sink->reconnect_stop = FALSE;
+      sink->reconnect_wanted = FALSE;
+      sink->reconnect_failed = FALSE;
+      g_mutex_unlock (sink->rlock);
+      break;
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      /* the send thread still uses the RTMP context that stop() frees */
+      gst_rtmp_sink_stop_sender (sink);
+      gst_rtmp_sink_stop_reconnect (sink);
+      break;
+    default:
+      break;
+  }
+
+  ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+
+  switch (transition) {
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      gst_rtmp_sink_gop_cache_clear (sink);
+      sink->ts_offset = 0;
+      sink->avg_frame_size = 0;
+      sink->observed_rate = 0;
+      sink->rate_bytes = 0;
+      break;
+    default:
+      break;
+  }
+
+  return ret;
+}
+
 /*
  * URI interface support.
  */
@@ -636,11 +2411,100 @@ gst_rtmp_sink_set_property (GObject * object, guint prop_id,
       sink->tcp_timeout = g_value_get_uint (value);
       break;
     case ARG_LOG_LEVEL:
-	    RTMP_debuglevel = g_value_get_int(value);
-	    break;
+      sink->log.level = g_value_get_int (value);
+      break;
     case PROP_FLASHVER:
       sink->flashver = g_value_dup_string (value);
       break;
+    case PROP_ZERO_COPY:
+      sink->zero_copy = g_value_get_boolean (value);
+      break;
+    case PROP_ASYNC:
+      sink->async = g_value_get_boolean (value);
+      break;
+    case PROP_MAX_QUEUE_BYTES:
+      g_mutex_lock (sink->qlock);
+      sink->max_queue_bytes = g_value_get_uint (value);
+      g_cond_broadcast (sink->qcond);
+      g_mutex_unlock (sink->qlock);
+      break;
+    case PROP_MAX_QUEUE_TIME:
+      g_mutex_lock (sink->qlock);
+      sink->max_queue_time = g_value_get_uint64 (value);
+      g_cond_broadcast (sink->qcond);
+      g_mutex_unlock (sink->qlock);
+      break;
+    case PROP_OVERFLOW_POLICY:
+      g_mutex_lock (sink->qlock);
+      sink->overflow_policy = g_value_get_enum (value);
+      g_cond_broadcast (sink->qcond);
+      g_mutex_unlock (sink->qlock);
+      break;
+    case PROP_GOP_CACHE_SIZE:
+      sink->gop_cache_size = g_value_get_uint (value);
+      break;
+    case PROP_MAX_REPLAY_DURATION:
+      sink->max_replay_duration = g_value_get_uint64 (value);
+      break;
+    case PROP_HOT_STANDBY:
+      g_mutex_lock (sink->rlock);
+      sink->hot_standby = g_value_get_boolean (value);
+      g_cond_broadcast (sink->rcond);
+      g_mutex_unlock (sink->rlock);
+      break;
+    case PROP_OUT_CHUNK_SIZE:
+      sink->out_chunk_size = g_value_get_uint (value);
+      break;
+    case PROP_COALESCE_BYTES:
+      sink->coalesce_bytes = g_value_get_uint (value);
+      break;
+    case PROP_COALESCE_LATENCY:
+      sink->coalesce_latency = g_value_get_uint64 (value);
+      break;
+    case PROP_PACING:
+      sink->pacing = g_value_get_boolean (value);
+      break;
+    case PROP_PACING_BITRATE:
+      sink->pacing_bitrate = g_value_get_uint (value);
+      break;
+    case PROP_PACING_HEADROOM:
+      sink->pacing_headroom = g_value_get_uint (value);
+      break;
+    case PROP_MAX_BURST:
+      sink->max_burst = g_value_get_uint (value);
+      break;
+    case PROP_PACING_KERNEL:
+      sink->pacing_kernel = g_value_get_boolean (value);
+      break;
+    case PROP_WARM_CONNECTIONS:
+      sink->warm_connections = g_value_get_uint (value);
+      break;
+    case PROP_WARM_IDLE_TIMEOUT:
+      sink->warm_idle_timeout = g_value_get_uint (value);
+      break;
+    case PROP_SHARED_CONNECTION:
+      sink->shared_connection = g_value_get_boolean (value);
+      break;
+    case PROP_LOCATIONS:
+      if (sink->locations)
+        g_value_array_free (sink->locations);
+      sink->locations = g_value_dup_boxed (value);
+      break;
+    case PROP_STATS_INTERVAL:
+      sink->stats_interval = g_value_get_uint64 (value);
+      break;
+    case PROP_REACTION_TIME:
+      sink->qos.reaction_time = g_value_get_uint64 (value);
+      break;
+    case PROP_MIN_BITRATE:
+      sink->qos.min_bitrate = g_value_get_uint (value);
+      break;
+    case PROP_MAX_BITRATE:
+      sink->qos.max_bitrate = g_value_get_uint (value);
+      break;
+    case PROP_BITRATE_MESSAGES:
+      sink->bitrate_messages = g_value_get_boolean (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -667,55 +2531,150 @@ gst_rtmp_sink_get_property (GObject * object, guint prop_id,
       g_value_set_uint (value, sink->tcp_timeout);
       break;
     case ARG_LOG_LEVEL:
-      g_value_set_int(value, RTMP_debuglevel);
+      g_value_set_int (value, sink->log.level);
       break;
     case PROP_FLASHVER:
        g_value_set_string (value, sink->flashver);
       break;
+    case PROP_ZERO_COPY:
+      g_value_set_boolean (value, sink->zero_copy);
+      break;
+    case PROP_ASYNC:
+      g_value_set_boolean (value, sink->async);
+      break;
+    case PROP_MAX_QUEUE_BYTES:
+      g_value_set_uint (value, sink->max_queue_bytes);
+      break;
+    case PROP_MAX_QUEUE_TIME:
+      g_value_set_uint64 (value, sink->max_queue_time);
+      break;
+    case PROP_OVERFLOW_POLICY:
+      g_value_set_enum (value, sink->overflow_policy);
+      break;
+    case PROP_GOP_CACHE_SIZE:
+      g_value_set_uint (value, sink->gop_cache_size);
+      break;
+    case PROP_MAX_REPLAY_DURATION:
+      g_value_set_uint64 (value, sink->max_replay_duration);
+      break;
+    case PROP_HOT_STANDBY:
+      g_value_set_boolean (value, sink->hot_standby);
+      break;
+    case PROP_LOCATIONS:
+      g_value_set_boxed (value, sink->locations);
+      break;
+    case PROP_OUT_CHUNK_SIZE:
+      g_value_set_uint (value, sink->out_chunk_size);
+      break;
+    case PROP_COALESCE_BYTES:
+      g_value_set_uint (value, sink->coalesce_bytes);
+      break;
+    case PROP_COALESCE_LATENCY:
+      g_value_set_uint64 (value, sink->coalesce_latency);
+      break;
+    case PROP_PACING:
+      g_value_set_boolean (value, sink->pacing);
+      break;
+    case PROP_PACING_BITRATE:
+      g_value_set_uint (value, sink->pacing_bitrate);
+      break;
+    case PROP_PACING_HEADROOM:
+      g_value_set_uint (value, sink->pacing_headroom);
+      break;
+    case PROP_MAX_BURST:
+      g_value_set_uint (value, sink->max_burst);
+      break;
+    case PROP_PACING_KERNEL:
+      g_value_set_boolean (value, sink->pacing_kernel);
+      break;
+    case PROP_WARM_CONNECTIONS:
+      g_value_set_uint (value, sink->warm_connections);
+      break;
+    case PROP_WARM_IDLE_TIMEOUT:
+      g_value_set_uint (value, sink->warm_idle_timeout);
+      break;
+    case PROP_SHARED_CONNECTION:
+      g_value_set_boolean (value, sink->shared_connection);
+      break;
+    case PROP_PACING_DELAY:
+      g_value_set_uint64 (value, sink->pacing_delay);
+      break;
+    case PROP_PACING_DELAY_MAX:
+      g_value_set_uint64 (value, sink->pacing_delay_max);
+      break;
+    case PROP_STATS:
+      g_value_take_boxed (value, gst_rtmp_sink_stats_structure (sink));
+      break;
+    case PROP_STATS_INTERVAL:
+      g_value_set_uint64 (value, sink->stats_interval);
+      break;
+    case PROP_REACTION_TIME:
+      g_value_set_uint64 (value, sink->qos.reaction_time);
+      break;
+    case PROP_MIN_BITRATE:
+      g_value_set_uint (value, sink->qos.min_bitrate);
+      break;
+    case PROP_MAX_BITRATE:
+      g_value_set_uint (value, sink->qos.max_bitrate);
+      break;
+    case PROP_BITRATE_MESSAGES:
+      g_value_set_boolean (value, sink->bitrate_messages);
+      break;
+    case PROP_TARGET_BITRATE:
+      g_value_set_uint (value, sink->qos.bitrate);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
   }
 }
 
+static void
+gst_rtmp_sink_free_streamheader (GList * streamheader)
+{
+  g_list_foreach (streamheader, (GFunc) gst_mini_object_unref, NULL);
+  g_list_free (streamheader);
+}
+
+/* The streamheader buffers are only reffed, send_config writes them one
+ * by one on each new session */
 static gboolean
 gst_rtmp_sink_setcaps (GstBaseSink * sink, GstCaps * caps)
 {
   GstRTMPSink *rtmpsink = GST_RTMP_SINK (sink);
   GstStructure *s;
   const GValue *sh;
-  GArray *buffers;
-  gint i;
+  GList *streamheader = NULL;
+  gsize size = 0;
+  guint i;
 
   GST_DEBUG_OBJECT (sink, "caps set to %" GST_PTR_FORMAT, caps);
 
-
-  if (rtmpsink->header) {
-    gst_buffer_unref (rtmpsink->header);
-    rtmpsink->header = NULL;
-  }
-
-  rtmpsink->header = gst_buffer_new ();
-
   s = gst_caps_get_structure (caps, 0);
 
   sh = gst_structure_get_value (s, "streamheader");
-  buffers = g_value_peek_pointer (sh);
-
-  for (i = 0; i < buffers->len; ++i) {
-    GValue *val;
-    GstBuffer *buf;
-
-    val = &g_array_index (buffers, GValue, i);
-    buf = g_value_peek_pointer (val);
-
-    gst_buffer_ref (buf);
-
-    rtmpsink->header = gst_buffer_join (rtmpsink->header, buf);
+  if (sh && GST_VALUE_HOLDS_ARRAY (sh)) {
+    for (i = 0; i < gst_value_array_get_size (sh); ++i) {
+      const GValue *val = gst_value_array_get_value (sh, i);
+      GstBuffer *buf;
+
+      if (!GST_VALUE_HOLDS_BUFFER (val))
+        continue;
+      buf = gst_value_get_buffer (val);
+      streamheader = g_list_append (streamheader, gst_buffer_ref (buf));
+      size += GST_BUFFER_SIZE (buf);
+    }
   }
 
-  GST_DEBUG_OBJECT (rtmpsink, "have %" G_GSIZE_FORMAT " bytes of header data",
-      GST_BUFFER_SIZE (rtmpsink->header));
+  GST_DEBUG_OBJECT (rtmpsink, "have %u buffers, %" G_GSIZE_FORMAT
+      " bytes of header data", g_list_length (streamheader), size);
+
+  GST_OBJECT_LOCK (rtmpsink);
+  gst_rtmp_sink_free_streamheader (rtmpsink->streamheader);
+  rtmpsink->streamheader = streamheader;
+  if (streamheader)
+    rtmpsink->streamheader_changed = TRUE;
+  GST_OBJECT_UNLOCK (rtmpsink);
 
   return TRUE;
 }
@@ -724,10 +2683,49 @@ static gboolean
 gst_rtmp_sink_event (GstBaseSink * sink, GstEvent * event)
 {
   GstRTMPSink *rtmpsink = GST_RTMP_SINK (sink);
+  GList *l;
 
   switch (event->type) {
+    case GST_EVENT_FLUSH_START:
+      g_mutex_lock (rtmpsink->qlock);
+      rtmpsink->flushing = TRUE;
+      gst_rtmp_sink_queue_clear (&rtmpsink->queue);
+      g_cond_broadcast (rtmpsink->qcond);
+      g_mutex_unlock (rtmpsink->qlock);
+      for (l = rtmpsink->dests; l; l = l->next) {
+        GstRTMPSinkDest *dest = l->data;
+
+        g_mutex_lock (dest->lock);
+        gst_rtmp_sink_queue_clear (&dest->queue);
+        g_mutex_unlock (dest->lock);
+      }
+      break;
     case GST_EVENT_FLUSH_STOP:
       rtmpsink->have_write_error = FALSE;
+      g_mutex_lock (rtmpsink->qlock);
+      rtmpsink->flushing = FALSE;
+      rtmpsink->srcresult = GST_FLOW_OK;
+      rtmpsink->queue.drop_until_keyframe = FALSE;
+      g_mutex_unlock (rtmpsink->qlock);
+      break;
+    case GST_EVENT_EOS:
+      /* let the send thread push out what is still queued */
+      g_mutex_lock (rtmpsink->qlock);
+      while (rtmpsink->send_thread && !rtmpsink->flushing &&
+          rtmpsink->srcresult == GST_FLOW_OK &&
+          (rtmpsink->sending || !g_queue_is_empty (&rtmpsink->queue.buffers)))
+        g_cond_wait (rtmpsink->qcond, rtmpsink->qlock);
+      g_mutex_unlock (rtmpsink->qlock);
+      /* same for the other locations while they are still up */
+      for (l = rtmpsink->dests; l; l = l->next) {
+        GstRTMPSinkDest *dest = l->data;
+
+        g_mutex_lock (dest->lock);
+        while (dest->connected &&
+            (dest->sending || !g_queue_is_empty (&dest->queue.buffers)))
+          g_cond_wait (dest->cond, dest->lock);
+        g_mutex_unlock (dest->lock);
+      }
       break;
     default:
       break;
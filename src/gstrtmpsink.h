@@ -28,6 +28,10 @@
 #include <librtmp/log.h>
 #include <librtmp/amf.h>
 
+#include "gstrtmplog.h"
+#include "gstrtmpqos.h"
+#include "gstrtmpshare.h"
+
 G_BEGIN_DECLS
 
 #define GST_TYPE_RTMP_SINK \
@@ -44,6 +48,20 @@ G_BEGIN_DECLS
 typedef struct _GstRTMPSink      GstRTMPSink;
 typedef struct _GstRTMPSinkClass GstRTMPSinkClass;
 
+/* what render does when the send queue is full in async mode */
+typedef enum {
+  GST_RTMP_SINK_OVERFLOW_BLOCK,
+  GST_RTMP_SINK_OVERFLOW_DROP_GOP,
+  GST_RTMP_SINK_OVERFLOW_DROP_UNTIL_KEYFRAME
+} GstRTMPSinkOverflowPolicy;
+
+/* bounded send queue, filled by gst_rtmp_sink_queue_push () */
+typedef struct {
+  GQueue buffers;
+  guint64 bytes;
+  gboolean drop_until_keyframe;
+} GstRTMPSinkQueue;
+
 struct _GstRTMPSink {
   GstBaseSink parent;
 
@@ -63,23 +81,110 @@ GstPad *sinkpad;
   gint disconnection_notified;
   gint sent_status;
   GstClockTime begin_time_disc;
-  GstClockTime end_time_disc;
   GstClockTime reconnection_delay;
   gchar *flashver;
+  GstRTMPLog log;
 
   gboolean first;
-  GstBuffer *header;
   gboolean have_write_error;
 
-  GstBuffer *video_metadata;
-  GstBuffer *audio_metadata;
-  GstBuffer *stream_metadata;
-  gboolean stream_meta_saved;
-  gboolean video_meta_saved;
-  gboolean audio_meta_saved;
+  /* streamheader buffers of the caps, reffed. The object lock protects
+   * them, setcaps and the sending thread may differ */
+  GList *streamheader;
+  gboolean streamheader_changed;
+  /* latest metadata, video and audio config seen in the stream */
+  GstBuffer *config[3];
   gint send_error_count;
   gint tcp_timeout;
-  gboolean try_now_connection;
+  gboolean zero_copy;
+  guint out_chunk_size;		/* 0 = auto */
+  guint avg_frame_size;		/* running average of video tags */
+  guint coalesce_bytes;		/* 0 = send every chunk at once */
+  GstClockTime coalesce_latency;
+
+  /* pacing: a token bucket at the stream bitrate plus headroom */
+  gboolean pacing;
+  gboolean pacing_kernel;
+  guint pacing_bitrate;		/* bits/s, 0 = measured */
+  guint pacing_headroom;	/* percent */
+  guint max_burst;
+  guint observed_rate;		/* bytes/s from the FLV timestamps */
+  guint64 rate_bytes;
+  guint32 rate_start;
+  GstClockTime pacing_delay;	/* copied from the current connection */
+  GstClockTime pacing_delay_max;
+
+  guint warm_connections;	/* kept ready by gstrtmpwarm, 0 = off */
+  guint warm_idle_timeout;	/* seconds */
+
+  /* publishing through gstrtmpshare instead of rtmp, which stays NULL */
+  gboolean shared_connection;
+  GstRTMPShareStream *shared;
+  GstClockTime shared_retry;	/* no new attempt before that */
+
+  /* transport statistics of the main location, refreshed from the
+   * connection in use at most every stats_interval. slock protects the
+   * snapshot below, read by get_property */
+  GMutex *slock;
+  GstClockTime stats_interval;	/* between stats messages, 0 = none */
+  GstClockTime stats_time;	/* of the last refresh */
+  RTMPStats stats_base;		/* sum of the connections closed so far */
+  RTMPStats stats;		/* totals, the current connection included */
+  RTMPStats conn_stats;		/* the current connection alone */
+  guint64 stats_chunks;		/* chunks at the last refresh */
+  gdouble chunk_rate;
+  guint reconnections;
+  GstClockTime downtime;	/* without a connection, ongoing outage excluded */
+  GstClockTime down_since;	/* NONE while connected */
+
+  /* congestion estimate of the main location, reported upstream as QoS
+   * events when qos is enabled and as target-bitrate messages */
+  GstRTMPQos qos;
+  gboolean bitrate_messages;
+
+  /* async sending: render queues, send_thread writes. qlock protects
+   * everything below and srcresult */
+  gboolean async;
+  GCond *qcond;
+  GThread *send_thread;
+  GstRTMPSinkQueue queue;
+  guint max_queue_bytes;
+  GstClockTime max_queue_time;
+  GstRTMPSinkOverflowPolicy overflow_policy;
+  gboolean flushing;
+  gboolean sending;
+  gboolean send_stop;
+
+  /* tags since the last keyframe, replayed on reconnect */
+  GQueue gop_cache;
+  guint64 gop_cache_bytes;
+  guint gop_cache_size;
+  GstClockTime max_replay_duration;
+  guint32 ts_offset;		/* subtracted from every tag timestamp */
+
+  /* reconnection thread. rlock protects everything below as well as
+   * is_backup and disconnection_notified once the thread exists */
+  GMutex *rlock;
+  GCond *rcond;
+  GThread *reconnect_thread;
+  gboolean reconnect_stop;
+  gboolean reconnect_wanted;
+  gboolean reconnect_failed;
+  gboolean target_is_backup;
+  RTMP *pending_rtmp;		/* connected, waiting for render to take it */
+  gchar *pending_uri;
+  gboolean pending_is_backup;
+  gboolean hot_standby;
+  RTMP *standby;		/* published to the location not in use */
+  gchar *standby_uri;
+  gboolean standby_is_backup;
+  gboolean standby_busy;
+  RTMP *closing;		/* broken, closed off the streaming thread */
+  gchar *closing_uri;
+
+  /* extra publishing points, each with its own connection and thread */
+  GValueArray *locations;
+  GList *dests;
 };
 
 struct _GstRTMPSinkClass {
@@ -36,7 +36,19 @@
  * |[
  * gst-launch -v rtmpsrc location=rtmp://somehost/someurl ! fakesink
  * ]| Open an RTMP location and pass its content to fakesink.
+ * |[
+ * gst-launch -v rtmpsrc location=rtmp://somehost/someurl tag-aligned=true ! flvdemux ! fakesink
+ * ]| Push every FLV tag in its own buffer, timestamped with the tag's time.
+ * The buffers wrap the memory the tags were received in, without a copy.
+ * |[
+ * gst-launch -v rtmpsrc location=rtmp://somehost/someurl live=true prefetch=true buffer-time=500000000 ! flvdemux ! fakesink
+ * ]| Read a live stream ahead in a thread, keeping half a second of media
+ * buffered and reporting it as latency.
  * </refsect2>
+ *
+ * #GstRTMPSrc:stats reports the bytes, tags and chunks received and the
+ * round trip time of a ping, and #GstRTMPSrc:stats-interval posts them
+ * as an "rtmpsrc-stats" element message while data flows.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -44,6 +56,7 @@
 #endif
 
 #include "gstrtmpsrc.h"
+#include "gstrtmpwarm.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -51,10 +64,24 @@
 
 #include <gst/gst.h>
 
+#ifdef G_OS_WIN32
+#include <winsock2.h>
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
+
 GST_DEBUG_CATEGORY_STATIC (rtmpsrc_debug);
 #define GST_CAT_DEFAULT rtmpsrc_debug
 #define MAX_TCP_TIMEOUT 3000000000LL
 
+#define DEFAULT_PREFETCH FALSE
+#define DEFAULT_BUFFER_TIME 0
+/* read ahead limit when timestamps don't tell how much media is queued */
+#define PREFETCH_MAX_BUFFERS 1024
+/* how often the statistics are refreshed without stats-interval */
+#define STATS_REFRESH GST_SECOND
+
 static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
     GST_PAD_ALWAYS,
@@ -66,7 +93,17 @@ enum
   PROP_LOCATION,
   PROP_SWF_URL,
   PROP_PAGE_URL,
-  PROP_LIVE
+  PROP_LIVE,
+  PROP_TAG_ALIGNED,
+  PROP_TAGS_PER_BUFFER,
+  PROP_RECEIVE_BUFFER,
+  PROP_SOCKET_RECEIVE_BUFFER,
+  PROP_PREFETCH,
+  PROP_BUFFER_TIME,
+  PROP_WARM_CONNECTIONS,
+  PROP_WARM_IDLE_TIMEOUT,
+  PROP_STATS,
+  PROP_STATS_INTERVAL
 };
 
 static void gst_rtmp_src_uri_handler_init (gpointer g_iface,
@@ -87,6 +124,9 @@ static gboolean gst_rtmp_src_do_seek (GstBaseSrc * src, GstSegment * segment);
 static GstFlowReturn gst_rtmp_src_create (GstPushSrc * pushsrc,
     GstBuffer ** buffer);
 static gboolean gst_rtmp_src_query (GstBaseSrc * src, GstQuery * query);
+static gboolean gst_rtmp_src_unlock (GstBaseSrc * src);
+static gboolean gst_rtmp_src_unlock_stop (GstBaseSrc * src);
+static GstStructure *gst_rtmp_src_stats_structure (GstRTMPSrc * src);
 
 static void
 _do_init (GType gtype)
@@ -144,6 +184,68 @@ gst_rtmp_src_class_init (GstRTMPSrcClass * klass)
       g_param_spec_boolean ("live", "to  allow read stream rtmp", 
       "to  allow read stream rtmp", FALSE, G_PARAM_READWRITE));
 
+  g_object_class_install_property (gobject_class, PROP_TAG_ALIGNED,
+      g_param_spec_boolean ("tag-aligned", "Tag aligned",
+          "Output whole FLV tags timestamped with the tag time instead of "
+          "blocksize buffers", FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_TAGS_PER_BUFFER,
+      g_param_spec_uint ("tags-per-buffer", "Tags per buffer",
+          "Number of whole FLV tags in each buffer in tag-aligned mode",
+          1, G_MAXUINT, 1, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_RECEIVE_BUFFER,
+      g_param_spec_int ("receive-buffer", "Receive buffer",
+          "Size in bytes of the buffer RTMP data is received into, larger "
+          "buffers need fewer reads at high bitrates", RTMP_BUFFER_CACHE_SIZE,
+          G_MAXINT, RTMP_BUFFER_CACHE_SIZE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_SOCKET_RECEIVE_BUFFER,
+      g_param_spec_int ("socket-receive-buffer", "Socket receive buffer",
+          "SO_RCVBUF of the connection in bytes (0 = system default)",
+          0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PREFETCH,
+      g_param_spec_boolean ("prefetch", "Prefetch",
+          "Read from the server in a separate thread, ahead of downstream, "
+          "holding up to buffer-time of media", DEFAULT_PREFETCH,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_BUFFER_TIME,
+      g_param_spec_uint64 ("buffer-time", "Buffer time",
+          "Media the server is asked to buffer for us and, when prefetching, "
+          "collected before the first buffer is pushed, in ns. Reported as "
+          "latency for live streams (0 = librtmp's default, no prefetch delay)",
+          0, G_MAXUINT64, DEFAULT_BUFFER_TIME,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_WARM_CONNECTIONS,
+      g_param_spec_uint ("warm-connections", "Warm connections",
+          "Handshaked connections to keep ready for the location's host, "
+          "shared by all elements of the process (0 = off). For rtmpe:// "
+          "and rtmpte:// the handshake's key pairs are prepared instead",
+          0, RTMP_WARM_MAX, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_WARM_IDLE_TIMEOUT,
+      g_param_spec_uint ("warm-idle-timeout", "Warm idle timeout",
+          "Seconds a warm connection is kept unused, and the warm "
+          "connections kept after the last start", 1, G_MAXUINT,
+          GST_RTMP_WARM_DEFAULT_IDLE_TIMEOUT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics",
+          "Transport statistics of the connection", GST_TYPE_STRUCTURE,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_STATS_INTERVAL,
+      g_param_spec_uint64 ("stats-interval", "Statistics interval",
+          "Post the statistics as an element message this often, in ns "
+          "(0 = never)", 0, G_MAXUINT64, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   gstbasesrc_class->start = GST_DEBUG_FUNCPTR (gst_rtmp_src_start);
   gstbasesrc_class->stop = GST_DEBUG_FUNCPTR (gst_rtmp_src_stop);
   gstbasesrc_class->is_seekable = GST_DEBUG_FUNCPTR (gst_rtmp_src_is_seekable);
@@ -152,6 +254,8 @@ gst_rtmp_src_class_init (GstRTMPSrcClass * klass)
   gstbasesrc_class->do_seek = GST_DEBUG_FUNCPTR (gst_rtmp_src_do_seek);
   gstpushsrc_class->create = GST_DEBUG_FUNCPTR (gst_rtmp_src_create);
   gstbasesrc_class->query = GST_DEBUG_FUNCPTR (gst_rtmp_src_query);
+  gstbasesrc_class->unlock = GST_DEBUG_FUNCPTR (gst_rtmp_src_unlock);
+  gstbasesrc_class->unlock_stop = GST_DEBUG_FUNCPTR (gst_rtmp_src_unlock_stop);
 }
 
 static void
@@ -161,6 +265,24 @@ gst_rtmp_src_init (GstRTMPSrc * rtmpsrc, GstRTMPSrcClass * klass)
   rtmpsrc->last_timestamp = 0;
   rtmpsrc->live = 0;
   rtmpsrc->tcp_timeout = MAX_TCP_TIMEOUT;
+  rtmpsrc->tag_aligned = FALSE;
+  rtmpsrc->tags_per_buffer = 1;
+  rtmpsrc->receive_buffer = RTMP_BUFFER_CACHE_SIZE;
+  rtmpsrc->socket_receive_buffer = 0;
+  rtmpsrc->prefetch = DEFAULT_PREFETCH;
+  rtmpsrc->buffer_time = DEFAULT_BUFFER_TIME;
+  rtmpsrc->warm_connections = 0;
+  rtmpsrc->warm_idle_timeout = GST_RTMP_WARM_DEFAULT_IDLE_TIMEOUT;
+  rtmpsrc->log.object = G_OBJECT (rtmpsrc);
+  rtmpsrc->log.level = RTMP_LOGALL;
+  rtmpsrc->plock = g_mutex_new ();
+  rtmpsrc->pcond = g_cond_new ();
+  rtmpsrc->slock = g_mutex_new ();
+  rtmpsrc->stats_interval = 0;
+  rtmpsrc->stats_time = GST_CLOCK_TIME_NONE;
+  g_queue_init (&rtmpsrc->prefetched);
+  g_queue_init (&rtmpsrc->held_tags);
+  rtmpsrc->keyframes = g_array_new (FALSE, FALSE, sizeof (GstClockTime));
   gst_base_src_set_format (GST_BASE_SRC (rtmpsrc), GST_FORMAT_TIME);
 }
 
@@ -171,6 +293,10 @@ gst_rtmp_src_finalize (GObject * object)
 
   g_free (rtmpsrc->uri);
   rtmpsrc->uri = NULL;
+  g_mutex_free (rtmpsrc->plock);
+  g_cond_free (rtmpsrc->pcond);
+  g_mutex_free (rtmpsrc->slock);
+  g_array_free (rtmpsrc->keyframes, TRUE);
 
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
@@ -261,6 +387,37 @@ gst_rtmp_src_set_property (GObject * object, guint prop_id,
     case PROP_LIVE:
       src->live = g_value_get_boolean (value);
       break;
+    case PROP_TAG_ALIGNED:
+      src->tag_aligned = g_value_get_boolean (value);
+      break;
+    case PROP_TAGS_PER_BUFFER:
+      src->tags_per_buffer = g_value_get_uint (value);
+      break;
+    case PROP_RECEIVE_BUFFER:
+      src->receive_buffer = g_value_get_int (value);
+      break;
+    case PROP_SOCKET_RECEIVE_BUFFER:
+      src->socket_receive_buffer = g_value_get_int (value);
+      break;
+    case PROP_PREFETCH:
+      src->prefetch = g_value_get_boolean (value);
+      break;
+    case PROP_BUFFER_TIME:
+      g_mutex_lock (src->plock);
+      src->buffer_time = g_value_get_uint64 (value);
+      src->buffer_time_changed = TRUE;
+      g_cond_broadcast (src->pcond);
+      g_mutex_unlock (src->plock);
+      break;
+    case PROP_WARM_CONNECTIONS:
+      src->warm_connections = g_value_get_uint (value);
+      break;
+    case PROP_WARM_IDLE_TIMEOUT:
+      src->warm_idle_timeout = g_value_get_uint (value);
+      break;
+    case PROP_STATS_INTERVAL:
+      src->stats_interval = g_value_get_uint64 (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -282,31 +439,391 @@ gst_rtmp_src_get_property (GObject * object, guint prop_id, GValue * value,
     case PROP_LIVE:
       g_value_set_boolean (value, src->live);
       break;
+    case PROP_TAG_ALIGNED:
+      g_value_set_boolean (value, src->tag_aligned);
+      break;
+    case PROP_TAGS_PER_BUFFER:
+      g_value_set_uint (value, src->tags_per_buffer);
+      break;
+    case PROP_RECEIVE_BUFFER:
+      g_value_set_int (value, src->receive_buffer);
+      break;
+    case PROP_SOCKET_RECEIVE_BUFFER:
+      g_value_set_int (value, src->socket_receive_buffer);
+      break;
+    case PROP_PREFETCH:
+      g_value_set_boolean (value, src->prefetch);
+      break;
+    case PROP_BUFFER_TIME:
+      g_value_set_uint64 (value, src->buffer_time);
+      break;
+    case PROP_WARM_CONNECTIONS:
+      g_value_set_uint (value, src->warm_connections);
+      break;
+    case PROP_WARM_IDLE_TIMEOUT:
+      g_value_set_uint (value, src->warm_idle_timeout);
+      break;
+    case PROP_STATS:
+      g_value_take_boxed (value, gst_rtmp_src_stats_structure (src));
+      break;
+    case PROP_STATS_INTERVAL:
+      g_value_set_uint64 (value, src->stats_interval);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
   }
 }
 
+/* Whether a tag only leads up to where a seek went. Codec configuration
+ * is always let through, the decoder needs it whatever the position */
+static gboolean
+gst_rtmp_src_drop_tag (GstRTMPSrc * src, const RTMPTag * tag)
+{
+  const guint8 *body = (const guint8 *) tag->tg_data + 11;
+  GstClockTime *until;
+  gboolean config;
+
+  if (tag->tg_size < 13)
+    return FALSE;
+  if (tag->tg_type == RTMP_PACKET_TYPE_VIDEO) {
+    until = &src->drop_video_until;
+    config = (body[0] & 0x0f) == 7 && body[1] == 0;
+  } else if (tag->tg_type == RTMP_PACKET_TYPE_AUDIO) {
+    until = &src->drop_audio_until;
+    config = (body[0] >> 4) == 10 && body[1] == 0;
+  } else {
+    return FALSE;
+  }
+
+  if (!*until)
+    return FALSE;
+  if (tag->tg_timestamp * GST_MSECOND >= *until) {
+    *until = 0;
+    return FALSE;
+  }
+  return !config;
+}
+
+/* Next tag, the ones held back while writing the header first */
+static gint
+gst_rtmp_src_next_tag (GstRTMPSrc * src, RTMPTag * tag)
+{
+  RTMPTag *held;
+  gint read;
+
+  do {
+    if ((held = g_queue_pop_head (&src->held_tags))) {
+      *tag = *held;
+      g_free (held);
+      read = tag->tg_size;
+    } else {
+      read = RTMP_ReadTag (src->rtmp, tag);
+    }
+    if (read <= 0 || !gst_rtmp_src_drop_tag (src, tag))
+      return read;
+
+    GST_LOG_OBJECT (src, "Dropping tag at %u ms before the seek position",
+        tag->tg_timestamp);
+    RTMP_FreeTag (tag->tg_mem);
+  } while (TRUE);
+}
+
+static void
+gst_rtmp_src_clear_held_tags (GstRTMPSrc * src)
+{
+  RTMPTag *held;
+
+  while ((held = g_queue_pop_head (&src->held_tags))) {
+    RTMP_FreeTag (held->tg_mem);
+    g_free (held);
+  }
+}
+
+/* Hand the memory librtmp reassembled the tag in over to a buffer */
+static GstBuffer *
+gst_rtmp_src_wrap_tag (RTMPTag * tag)
+{
+  GstBuffer *buf = gst_buffer_new ();
+
+#if GST_CHECK_VERSION (0, 10, 22)
+  GST_BUFFER_MALLOCDATA (buf) = tag->tg_mem;
+  GST_BUFFER_FREE_FUNC (buf) = RTMP_FreeTag;
+  GST_BUFFER_DATA (buf) = (guint8 *) tag->tg_data;
+#else
+  GST_BUFFER_MALLOCDATA (buf) = GST_BUFFER_DATA (buf) =
+      g_memdup (tag->tg_data, tag->tg_size);
+  RTMP_FreeTag (tag->tg_mem);
+#endif
+  GST_BUFFER_SIZE (buf) = tag->tg_size;
+
+  return buf;
+}
+
+/* Like create, but every buffer holds the FLV header or whole tags and is
+ * stamped with the time of its first tag. A single tag is pushed without
+ * being copied */
+static GstFlowReturn
+gst_rtmp_src_create_tags (GstRTMPSrc * src, GstBuffer ** buffer)
+{
+  static const guint8 flv_header[13] = {
+    'F', 'L', 'V', 0x01, 0x00, 0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x00
+  };
+  GstBuffer *buf = NULL;
+  GstClockTime timestamp = 0;
+  RTMPTag tag;
+  guint8 *data = NULL;
+  guint size = 0, alloc = 0, tags = 0;
+  gint read;
+
+  if (!src->header_done) {
+    guint held = 0;
+
+    /* like RTMP_Read, look at the first tags to fill in the audio and
+     * video flags */
+    while (src->rtmp->m_read.dataType != 5 && held < 128 * 1024) {
+      read = RTMP_ReadTag (src->rtmp, &tag);
+      if (read < 0)
+        goto read_failed;
+      if (read == 0)
+        break;
+      g_queue_push_tail (&src->held_tags, g_memdup (&tag, sizeof (tag)));
+      held += read;
+      if (tag.tg_timestamp)
+        break;
+    }
+    if (!held)
+      goto eos;
+
+    size = sizeof (flv_header);
+    data = g_memdup (flv_header, size);
+    data[4] = src->rtmp->m_read.dataType;
+    src->header_done = TRUE;
+    goto done;
+  }
+
+  while (tags < src->tags_per_buffer) {
+    read = gst_rtmp_src_next_tag (src, &tag);
+    if (read < 0)
+      goto read_failed;
+    if (read == 0)
+      break;
+
+    if (!tags)
+      timestamp = tag.tg_timestamp * GST_MSECOND;
+    tags++;
+
+    if (src->tags_per_buffer == 1) {
+      buf = gst_rtmp_src_wrap_tag (&tag);
+      size = read;
+      break;
+    }
+
+    if (size + read > alloc) {
+      alloc = MAX (alloc * 2, size + read);
+      data = g_realloc (data, alloc);
+    }
+    memcpy (data + size, tag.tg_data, read);
+    size += read;
+    RTMP_FreeTag (tag.tg_mem);
+  }
+  if (!tags)
+    goto eos;
+
+done:
+  if (!buf) {
+    buf = gst_buffer_new ();
+    GST_BUFFER_MALLOCDATA (buf) = GST_BUFFER_DATA (buf) = data;
+    GST_BUFFER_SIZE (buf) = size;
+  }
+
+  if (src->discont) {
+    GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_DISCONT);
+    src->discont = FALSE;
+  }
+  GST_BUFFER_TIMESTAMP (buf) = timestamp;
+  GST_BUFFER_OFFSET (buf) = src->cur_offset;
+  src->cur_offset += size;
+  if (src->last_timestamp == GST_CLOCK_TIME_NONE)
+    src->last_timestamp = timestamp;
+  else
+    src->last_timestamp = MAX (src->last_timestamp, timestamp);
+
+  GST_LOG_OBJECT (src, "Created buffer of %u tags, size %u with timestamp %"
+      GST_TIME_FORMAT, tags, size, GST_TIME_ARGS (timestamp));
+
+  *buffer = buf;
+  return GST_FLOW_OK;
+
+read_failed:
+  {
+    g_free (data);
+    GST_ELEMENT_ERROR (src, RESOURCE, READ, (NULL), ("Failed to read data"));
+    return GST_FLOW_ERROR;
+  }
+eos:
+  {
+    g_free (data);
+    GST_DEBUG_OBJECT (src, "Reading data gave EOS");
+    return GST_FLOW_UNEXPECTED;
+  }
+}
+
+static GstStructure *
+gst_rtmp_src_stats_structure (GstRTMPSrc * src)
+{
+  GstStructure *s;
+  guint prefetched;
+
+  g_mutex_lock (src->plock);
+  prefetched = g_queue_get_length (&src->prefetched);
+  g_mutex_unlock (src->plock);
+
+  g_mutex_lock (src->slock);
+  s = gst_structure_new ("rtmpsrc-stats",
+      "bytes-received", G_TYPE_UINT64, src->stats.rs_bytesIn,
+      "tags-received", G_TYPE_UINT64, src->stats.rs_tagsIn,
+      "chunks-received", G_TYPE_UINT64, src->stats.rs_chunksIn,
+      "chunks-per-second", G_TYPE_DOUBLE, src->chunk_rate,
+      "rtt", G_TYPE_UINT64, src->stats.rs_rtt ?
+      (guint64) src->stats.rs_rtt * GST_USECOND : GST_CLOCK_TIME_NONE,
+      "prefetched-buffers", G_TYPE_UINT, prefetched, NULL);
+  g_mutex_unlock (src->slock);
+  return s;
+}
+
+/* Copy the counters for get_property once per interval, from the thread
+ * reading. The pong to the ping sent here is read along with the media */
+static void
+gst_rtmp_src_update_stats (GstRTMPSrc * src)
+{
+  GstClockTime now = gst_util_get_timestamp ();
+  GstClockTime interval;
+  RTMPStats cur;
+
+  interval = src->stats_interval ? src->stats_interval : STATS_REFRESH;
+  if (GST_CLOCK_TIME_IS_VALID (src->stats_time) &&
+      now < src->stats_time + interval)
+    return;
+
+  if (RTMP_IsConnected (src->rtmp) && src->rtmp->m_bPlaying)
+    RTMP_SendPing (src->rtmp);
+  RTMP_GetStats (src->rtmp, &cur);
+
+  g_mutex_lock (src->slock);
+  src->stats = cur;
+  if (GST_CLOCK_TIME_IS_VALID (src->stats_time) && now > src->stats_time)
+    src->chunk_rate = (gdouble) (cur.rs_chunksIn - src->stats_chunks) *
+        GST_SECOND / (now - src->stats_time);
+  src->stats_chunks = cur.rs_chunksIn;
+  src->stats_time = now;
+  g_mutex_unlock (src->slock);
+
+  if (src->stats_interval)
+    gst_element_post_message (GST_ELEMENT (src),
+        gst_message_new_element (GST_OBJECT (src),
+            gst_rtmp_src_stats_structure (src)));
+}
+
+/* Pass a changed buffer-time on to librtmp, from the thread reading */
+static void
+gst_rtmp_src_update_buffer_time (GstRTMPSrc * src)
+{
+  gint ms;
+
+  g_mutex_lock (src->plock);
+  ms = src->buffer_time_changed ? src->buffer_time / GST_MSECOND : 0;
+  src->buffer_time_changed = FALSE;
+  g_mutex_unlock (src->plock);
+
+  if (ms <= 0)
+    return;
+  GST_DEBUG_OBJECT (src, "Asking for %d ms of server side buffer", ms);
+  RTMP_SetBufferMS (src->rtmp, ms);
+  if (src->rtmp->m_bPlaying)
+    RTMP_UpdateBufferMS (src->rtmp);
+}
+
+/* Take over the keyframe index when librtmp received a new one */
+static void
+gst_rtmp_src_update_index (GstRTMPSrc * src)
+{
+  const RTMPKeyframes *kf = RTMP_GetKeyframes (src->rtmp);
+  GArray *index, *old;
+  GstClockTime time;
+  gint i;
+
+  if (kf->kf_serial == src->index_serial)
+    return;
+  src->index_serial = kf->kf_serial;
+
+  index = g_array_sized_new (FALSE, FALSE, sizeof (GstClockTime),
+      kf->kf_count);
+  for (i = 0; i < kf->kf_count; i++) {
+    if (kf->kf_times[i] < 0)
+      continue;
+    time = (GstClockTime) (kf->kf_times[i] * 1000 + 0.5) * GST_MSECOND;
+    if (index->len && time <= g_array_index (index, GstClockTime,
+            index->len - 1))
+      continue;
+    g_array_append_val (index, time);
+  }
+  GST_DEBUG_OBJECT (src, "Keyframe index of %u entries", index->len);
+
+  GST_OBJECT_LOCK (src);
+  old = src->keyframes;
+  src->keyframes = index;
+  GST_OBJECT_UNLOCK (src);
+  g_array_free (old, TRUE);
+}
+
+/* The last keyframe at or before time, the first one if there is none.
+ * With nearest, whichever of it and the next one is closer. Call with
+ * the object lock held and a non-empty index */
+static GstClockTime
+gst_rtmp_src_find_keyframe (GstRTMPSrc * src, GstClockTime time,
+    gboolean nearest)
+{
+  GArray *index = src->keyframes;
+  guint lo = 0, hi = index->len, mid;
+  GstClockTime before, after;
+
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (g_array_index (index, GstClockTime, mid) <= time)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  before = g_array_index (index, GstClockTime, lo);
+  if (!nearest || lo + 1 >= index->len || time <= before)
+    return before;
+  after = g_array_index (index, GstClockTime, lo + 1);
+  return after - time < time - before ? after : before;
+}
+
 /*
  * Read a new buffer from src->reqoffset, takes care of events
  * and seeking and such.
  */
 static GstFlowReturn
-gst_rtmp_src_create (GstPushSrc * pushsrc, GstBuffer ** buffer)
+gst_rtmp_src_fill (GstRTMPSrc * src, GstBuffer ** buffer)
 {
-  GstRTMPSrc *src;
   GstBuffer *buf;
   guint8 *data;
   guint todo;
   int read;
   int size;
 
-  src = GST_RTMP_SRC (pushsrc);
+  if (src->buffer_time_changed)
+    gst_rtmp_src_update_buffer_time (src);
+  gst_rtmp_src_update_stats (src);
+  gst_rtmp_src_update_index (src);
 
-  g_return_val_if_fail (src->rtmp != NULL, GST_FLOW_ERROR);
+  if (src->tag_aligned)
+    return gst_rtmp_src_create_tags (src, buffer);
 
-  size = GST_BASE_SRC_CAST (pushsrc)->blocksize;
+  size = GST_BASE_SRC_CAST (src)->blocksize;
 
   GST_DEBUG ("reading from %" G_GUINT64_FORMAT
       ", size %u", src->cur_offset, size);
@@ -382,6 +899,185 @@ eos:
   }
 }
 
+/* Timestamp span of the prefetched buffers */
+static GstClockTime
+gst_rtmp_src_prefetched_time (GstRTMPSrc * src)
+{
+  GstBuffer *head = g_queue_peek_head (&src->prefetched);
+  GstBuffer *tail = g_queue_peek_tail (&src->prefetched);
+
+  if (!head || !GST_BUFFER_TIMESTAMP_IS_VALID (head) ||
+      !GST_BUFFER_TIMESTAMP_IS_VALID (tail) ||
+      GST_BUFFER_TIMESTAMP (tail) < GST_BUFFER_TIMESTAMP (head))
+    return 0;
+  return GST_BUFFER_TIMESTAMP (tail) - GST_BUFFER_TIMESTAMP (head);
+}
+
+static gboolean
+gst_rtmp_src_prefetch_full (GstRTMPSrc * src)
+{
+  if (g_queue_get_length (&src->prefetched) >= PREFETCH_MAX_BUFFERS)
+    return TRUE;
+  return src->buffer_time &&
+      gst_rtmp_src_prefetched_time (src) >= src->buffer_time;
+}
+
+/* Wait up to 100ms for data so a stop request is noticed even when the
+ * server sends nothing. RTMPT has to poll the server, so it can't wait on
+ * the socket */
+static gboolean
+gst_rtmp_src_wait_readable (GstRTMPSrc * src)
+{
+  RTMP *r = src->rtmp;
+  struct pollfd pfd;
+
+  if (!RTMP_IsConnected (r) || r->m_sb.sb_size > 0 || r->m_read.buf ||
+      g_queue_get_length (&src->held_tags) ||
+      (r->Link.protocol & RTMP_FEATURE_HTTP))
+    return TRUE;
+
+  pfd.fd = RTMP_Socket (r);
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  return poll (&pfd, 1, 100) != 0;
+}
+
+static gpointer
+gst_rtmp_src_prefetch_loop (GstRTMPSrc * src)
+{
+  GstBuffer *buf;
+  GstFlowReturn ret;
+
+  g_mutex_lock (src->plock);
+  while (!src->prefetch_stop) {
+    if (gst_rtmp_src_prefetch_full (src)) {
+      src->prefetch_primed = TRUE;
+      g_cond_broadcast (src->pcond);
+      g_cond_wait (src->pcond, src->plock);
+      continue;
+    }
+    g_mutex_unlock (src->plock);
+
+    buf = NULL;
+    ret = GST_FLOW_OK;
+    if (gst_rtmp_src_wait_readable (src))
+      ret = gst_rtmp_src_fill (src, &buf);
+
+    g_mutex_lock (src->plock);
+    if (buf)
+      g_queue_push_tail (&src->prefetched, buf);
+    if (ret != GST_FLOW_OK) {
+      GST_DEBUG_OBJECT (src, "prefetch thread got %d", ret);
+      src->prefetch_ret = ret;
+      g_cond_broadcast (src->pcond);
+      break;
+    }
+    if (buf)
+      g_cond_broadcast (src->pcond);
+  }
+  g_mutex_unlock (src->plock);
+
+  return NULL;
+}
+
+static void
+gst_rtmp_src_stop_prefetch (GstRTMPSrc * src)
+{
+  GThread *thread;
+  GstBuffer *buf;
+
+  g_mutex_lock (src->plock);
+  thread = src->prefetch_thread;
+  src->prefetch_thread = NULL;
+  src->prefetch_stop = TRUE;
+  g_cond_broadcast (src->pcond);
+  g_mutex_unlock (src->plock);
+
+  if (thread)
+    g_thread_join (thread);
+
+  g_mutex_lock (src->plock);
+  while ((buf = g_queue_pop_head (&src->prefetched)))
+    gst_buffer_unref (buf);
+  src->prefetch_ret = GST_FLOW_OK;
+  src->prefetch_primed = FALSE;
+  g_mutex_unlock (src->plock);
+}
+
+static GstFlowReturn
+gst_rtmp_src_create (GstPushSrc * pushsrc, GstBuffer ** buffer)
+{
+  GstRTMPSrc *src = GST_RTMP_SRC (pushsrc);
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  g_return_val_if_fail (src->rtmp != NULL, GST_FLOW_ERROR);
+
+  if (!src->prefetch)
+    return gst_rtmp_src_fill (src, buffer);
+
+  g_mutex_lock (src->plock);
+  if (!src->prefetch_thread && src->prefetch_ret == GST_FLOW_OK) {
+    GError *err = NULL;
+
+    src->prefetch_stop = FALSE;
+    src->prefetch_thread = g_thread_create ((GThreadFunc)
+        gst_rtmp_src_prefetch_loop, src, TRUE, &err);
+    if (!src->prefetch_thread) {
+      GST_ELEMENT_ERROR (src, RESOURCE, FAILED, (NULL),
+          ("Could not create prefetch thread: %s", err->message));
+      g_error_free (err);
+      ret = GST_FLOW_ERROR;
+      goto done;
+    }
+  }
+
+  /* collect buffer-time of media first, that's our reported latency */
+  while (!src->flushing && src->prefetch_ret == GST_FLOW_OK) {
+    if (!src->buffer_time || gst_rtmp_src_prefetch_full (src))
+      src->prefetch_primed = TRUE;
+    if (src->prefetch_primed && !g_queue_is_empty (&src->prefetched))
+      break;
+    g_cond_wait (src->pcond, src->plock);
+  }
+
+  if (src->flushing) {
+    ret = GST_FLOW_WRONG_STATE;
+  } else if ((*buffer = g_queue_pop_head (&src->prefetched))) {
+    g_cond_broadcast (src->pcond);
+  } else {
+    ret = src->prefetch_ret;
+  }
+
+done:
+  g_mutex_unlock (src->plock);
+  return ret;
+}
+
+static gboolean
+gst_rtmp_src_unlock (GstBaseSrc * basesrc)
+{
+  GstRTMPSrc *src = GST_RTMP_SRC (basesrc);
+
+  g_mutex_lock (src->plock);
+  src->flushing = TRUE;
+  g_cond_broadcast (src->pcond);
+  g_mutex_unlock (src->plock);
+
+  return TRUE;
+}
+
+static gboolean
+gst_rtmp_src_unlock_stop (GstBaseSrc * basesrc)
+{
+  GstRTMPSrc *src = GST_RTMP_SRC (basesrc);
+
+  g_mutex_lock (src->plock);
+  src->flushing = FALSE;
+  g_mutex_unlock (src->plock);
+
+  return TRUE;
+}
+
 static gboolean
 gst_rtmp_src_query (GstBaseSrc * basesrc, GstQuery * query)
 {
@@ -403,6 +1099,20 @@ gst_rtmp_src_query (GstBaseSrc * basesrc, GstQuery * query)
       }
       break;
     }
+    case GST_QUERY_LATENCY:{
+      GstClockTime min = 0;
+
+      /* with prefetch the first buffer waits for buffer-time of media.
+       * Nothing is dropped when downstream is late, the thread, the socket
+       * and the server just hold on to more */
+      if (src->prefetch)
+        min = src->buffer_time;
+      gst_query_set_latency (query, src->live, min, GST_CLOCK_TIME_NONE);
+      GST_DEBUG_OBJECT (src, "latency: live %d, min %" GST_TIME_FORMAT,
+          src->live, GST_TIME_ARGS (min));
+      ret = TRUE;
+      break;
+    }
     case GST_QUERY_DURATION:{
       GstFormat format;
       gdouble duration;
@@ -417,6 +1127,33 @@ gst_rtmp_src_query (GstBaseSrc * basesrc, GstQuery * query)
       }
       break;
     }
+    case GST_QUERY_SEEKING:{
+      GstFormat format;
+      GstClockTime start = 0, end = GST_CLOCK_TIME_NONE;
+      gdouble duration = 0.0;
+
+      /* with an index the seekable range is known exactly */
+      gst_query_parse_seeking (query, &format, NULL, NULL, NULL);
+      if (format != GST_FORMAT_TIME || !src->rtmp)
+        break;
+      duration = RTMP_GetDuration (src->rtmp);
+      GST_OBJECT_LOCK (src);
+      if (src->keyframes->len) {
+        start = g_array_index (src->keyframes, GstClockTime, 0);
+        if (duration > 0.0)
+          end = duration * GST_SECOND;
+        else
+          end = g_array_index (src->keyframes, GstClockTime,
+              src->keyframes->len - 1);
+      }
+      GST_OBJECT_UNLOCK (src);
+      if (GST_CLOCK_TIME_IS_VALID (end)) {
+        gst_query_set_seeking (query, format, src->seekable && !src->live,
+            start, end);
+        ret = TRUE;
+      }
+      break;
+    }
     default:
       ret = FALSE;
       break;
@@ -474,6 +1211,18 @@ gst_rtmp_src_prepare_seek_segment (GstBaseSrc * basesrc, GstEvent * event,
     return FALSE;
   }
 
+  /* a key unit seek goes to the closest keyframe, when they are known */
+  if ((flags & GST_SEEK_FLAG_KEY_UNIT) && cur_type == GST_SEEK_TYPE_SET &&
+      cur >= 0) {
+    GST_OBJECT_LOCK (src);
+    if (src->keyframes->len) {
+      GST_DEBUG_OBJECT (src, "Snapping %" GST_TIME_FORMAT " to a keyframe",
+          GST_TIME_ARGS (cur));
+      cur = gst_rtmp_src_find_keyframe (src, cur, TRUE);
+    }
+    GST_OBJECT_UNLOCK (src);
+  }
+
   gst_segment_init (segment, GST_FORMAT_TIME);
   gst_segment_set_seek (segment, rate, format, flags, cur_type, cur, stop_type,
       stop, NULL);
@@ -485,6 +1234,7 @@ static gboolean
 gst_rtmp_src_do_seek (GstBaseSrc * basesrc, GstSegment * segment)
 {
   GstRTMPSrc *src;
+  GstClockTime keyframe;
 
   src = GST_RTMP_SRC (basesrc);
 
@@ -509,8 +1259,25 @@ gst_rtmp_src_do_seek (GstBaseSrc * basesrc, GstSegment * segment)
   if (src->cur_offset == 0 && segment->start == 0)
     return TRUE;
 
+  /* the prefetch thread owns the connection while it runs */
+  gst_rtmp_src_stop_prefetch (src);
   src->last_timestamp = GST_CLOCK_TIME_NONE;
-  if (!RTMP_SendSeek (src->rtmp, segment->start / GST_MSECOND)) {
+  gst_rtmp_src_clear_held_tags (src);
+
+  /* Ask for the keyframe the position depends on, so the server does not
+   * have to guess. Whatever it sends before that keyframe, and audio
+   * before the position, is dropped; the video in between is needed to
+   * decode it and gets clipped by the segment downstream */
+  keyframe = segment->start;
+  GST_OBJECT_LOCK (src);
+  if (src->keyframes->len)
+    keyframe = gst_rtmp_src_find_keyframe (src, segment->start, FALSE);
+  GST_OBJECT_UNLOCK (src);
+  keyframe = MIN (keyframe, segment->start);
+  src->drop_video_until = keyframe;
+  src->drop_audio_until = segment->start;
+
+  if (!RTMP_SendSeek (src->rtmp, keyframe / GST_MSECOND)) {
     GST_ERROR_OBJECT (src, "Seeking failed");
     src->seekable = FALSE;
     return FALSE;
@@ -545,10 +1312,25 @@ gst_rtmp_src_start (GstBaseSrc * basesrc)
   src->last_timestamp = 0;
   src->seekable = TRUE;
   src->discont = TRUE;
-
+  src->header_done = FALSE;
+  src->drop_video_until = 0;
+  src->drop_audio_until = 0;
+
+  g_mutex_lock (src->slock);
+  memset (&src->stats, 0, sizeof (src->stats));
+  src->stats.rs_unsent = -1;
+  src->stats_time = GST_CLOCK_TIME_NONE;
+  src->stats_chunks = 0;
+  src->chunk_rate = 0;
+  g_mutex_unlock (src->slock);
+
+  gst_rtmp_warm_want (src->uri, src->warm_connections,
+      src->warm_idle_timeout);
   uri_copy = g_strdup (src->uri);
   src->rtmp = RTMP_Alloc ();
   RTMP_Init (src->rtmp);
+  gst_rtmp_log_sync ();
+  gst_rtmp_log_attach (src->rtmp, &src->log);
   if (!RTMP_SetupURL (src->rtmp, uri_copy)) {
     GST_ELEMENT_ERROR (src, RESOURCE, OPEN_READ, (NULL),
         ("Failed to setup URL '%s'", src->uri));
@@ -560,6 +1342,13 @@ gst_rtmp_src_start (GstBaseSrc * basesrc)
 
   if (src->live)
     src->rtmp->Link.lFlags |= RTMP_LF_LIVE;
+  if (src->buffer_time)
+    RTMP_SetBufferMS (src->rtmp, src->buffer_time / GST_MSECOND);
+  src->buffer_time_changed = FALSE;
+  if (!RTMP_SetReceiveBuffer (src->rtmp, src->receive_buffer,
+          src->socket_receive_buffer))
+    GST_WARNING_OBJECT (src, "Could not use a %d byte receive buffer",
+        src->receive_buffer);
   /* open if required */
   if (!RTMP_IsConnected (src->rtmp)) {
     if (!RTMP_Connect (src->rtmp, NULL)) {
@@ -584,11 +1373,17 @@ gst_rtmp_src_stop (GstBaseSrc * basesrc)
 
   src = GST_RTMP_SRC (basesrc);
 
+  gst_rtmp_src_stop_prefetch (src);
   if (src->rtmp) {
     RTMP_Close (src->rtmp);
     RTMP_Free (src->rtmp);
     src->rtmp = NULL;
   }
+  gst_rtmp_src_clear_held_tags (src);
+  GST_OBJECT_LOCK (src);
+  g_array_set_size (src->keyframes, 0);
+  GST_OBJECT_UNLOCK (src);
+  src->index_serial = 0;
 
   src->cur_offset = 0;
   src->last_timestamp = 0;
@@ -33,6 +33,8 @@
 #include <librtmp/log.h>
 #include <librtmp/amf.h>
 
+#include "gstrtmplog.h"
+
 /*
 #include <librtmp/rtmp.h>
 #include <librtmp/log.h>
@@ -76,6 +78,50 @@ struct _GstRTMPSrc
   gboolean seekable;
   gboolean discont;
   gboolean live;
+
+  /* one buffer per FLV tag, or per tags_per_buffer whole tags */
+  gboolean tag_aligned;
+  guint tags_per_buffer;
+  gboolean header_done;
+  GQueue held_tags;	/* RTMPTag, read while building the header */
+
+  /* keyframe times from onMetaData, ascending, under the object lock.
+   * After a seek, tags older than these are dropped, 0 = none */
+  GArray *keyframes;
+  gint index_serial;
+  GstClockTime drop_video_until;
+  GstClockTime drop_audio_until;
+
+  /* librtmp's receive buffer and the socket's SO_RCVBUF, 0 = default */
+  gint receive_buffer;
+  gint socket_receive_buffer;
+
+  /* reading ahead in a thread, bounded by buffer_time of media */
+  gboolean prefetch;
+  GstClockTime buffer_time;
+  gboolean buffer_time_changed;
+  GMutex *plock;
+  GCond *pcond;
+  GThread *prefetch_thread;
+  gboolean prefetch_stop;
+  gboolean prefetch_primed;	/* buffer_time collected, pushing */
+  gboolean flushing;
+  GstFlowReturn prefetch_ret;
+  GQueue prefetched;
+
+  GstRTMPLog log;
+
+  guint warm_connections;	/* kept ready by gstrtmpwarm, 0 = off */
+  guint warm_idle_timeout;	/* seconds */
+
+  /* transport statistics, refreshed by the thread reading at most every
+   * stats_interval. slock protects the snapshot */
+  GMutex *slock;
+  GstClockTime stats_interval;	/* between stats messages, 0 = none */
+  GstClockTime stats_time;	/* of the last refresh */
+  RTMPStats stats;
+  guint64 stats_chunks;		/* chunks at the last refresh */
+  gdouble chunk_rate;
 };
 
 struct _GstRTMPSrcClass
@@ -0,0 +1,187 @@
+/* GStreamer
+ *
+ * gstrtmpwarm.c:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Keeps handshaked connections ready for the hosts rtmpsink and rtmpsrc
+ * asked for with warm-connections, so that RTMP_Connect() can skip straight
+ * to the connect call. The handshake of rtmpe:// and rtmpte:// cannot be
+ * done ahead, so for those hosts the Diffie-Hellman key pairs it needs are
+ * prepared instead, the slow part on small CPUs. One thread serves the
+ * whole process: once a second it closes connections that went stale,
+ * tops every host back up, and forgets hosts no element started on for
+ * warm-idle-timeout seconds.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+
+#include <librtmp/rtmp.h>
+
+#include "gstrtmpwarm.h"
+
+GST_DEBUG_CATEGORY_STATIC (rtmp_warm_debug);
+#define GST_CAT_DEFAULT rtmp_warm_debug
+
+typedef struct
+{
+  gchar *uri;
+  gchar *key_uri;               /* parsed in place by key */
+  RTMP *key;                    /* never connected, names the host */
+  guint count;
+  guint idle_timeout;
+  GTimeVal wanted;
+} GstRTMPWarmHost;
+
+static GStaticMutex warm_lock = G_STATIC_MUTEX_INIT;
+static GList *warm_hosts;
+static GThread *warm_thread;
+
+static void
+gst_rtmp_warm_host_free (GstRTMPWarmHost * host)
+{
+  /* closes whatever is still parked for it */
+  RTMP_WarmCheck (host->key, 0);
+  RTMP_Free (host->key);
+  g_free (host->key_uri);
+  g_free (host->uri);
+  g_free (host);
+}
+
+static gboolean
+gst_rtmp_warm_up_one (const gchar * uri)
+{
+  gchar *copy = g_strdup (uri);
+  RTMP *r = RTMP_Alloc ();
+  gboolean ret;
+
+  RTMP_Init (r);
+  ret = RTMP_SetupURL (r, copy) && RTMP_WarmUp (r);
+  RTMP_Free (r);
+  g_free (copy);
+  return ret;
+}
+
+static gpointer
+gst_rtmp_warm_loop (gpointer data)
+{
+  while (TRUE) {
+    GList *hosts, *walk;
+    GTimeVal now;
+
+    g_usleep (G_USEC_PER_SEC);
+    g_get_current_time (&now);
+
+    /* only this thread removes hosts, so the copied links stay valid */
+    g_static_mutex_lock (&warm_lock);
+    hosts = g_list_copy (warm_hosts);
+    g_static_mutex_unlock (&warm_lock);
+
+    for (walk = hosts; walk; walk = walk->next) {
+      GstRTMPWarmHost *host = walk->data;
+      guint count, idle_timeout;
+      gint have;
+
+      g_static_mutex_lock (&warm_lock);
+      count = host->count;
+      idle_timeout = host->idle_timeout;
+      if (now.tv_sec - host->wanted.tv_sec > idle_timeout) {
+        warm_hosts = g_list_remove (warm_hosts, host);
+        g_static_mutex_unlock (&warm_lock);
+        GST_DEBUG ("no longer keeping connections for %s", host->uri);
+        gst_rtmp_warm_host_free (host);
+        continue;
+      }
+      g_static_mutex_unlock (&warm_lock);
+
+      if (host->key->Link.protocol & RTMP_FEATURE_ENC) {
+        /* the pool is shared by the encrypted hosts */
+        have = RTMP_PrepareKeys (count);
+        GST_LOG ("%d of %u key pairs ready for %s", have, count, host->uri);
+        continue;
+      }
+      have = RTMP_WarmCheck (host->key, idle_timeout);
+      /* a failure is retried on the next round */
+      while (have < count && gst_rtmp_warm_up_one (host->uri))
+        have++;
+      GST_LOG ("%d of %u connections ready for %s", have, count, host->uri);
+    }
+    g_list_free (hosts);
+  }
+
+  return NULL;
+}
+
+/* Ask for count warm connections to the host of uri, for the next
+ * idle_timeout seconds. Calling it again renews the request. */
+void
+gst_rtmp_warm_want (const gchar * uri, guint count, guint idle_timeout)
+{
+  GstRTMPWarmHost *host = NULL;
+  GList *walk;
+
+  if (!uri || !count)
+    return;
+
+  g_static_mutex_lock (&warm_lock);
+  if (!warm_thread) {
+    GST_DEBUG_CATEGORY_INIT (rtmp_warm_debug, "rtmpwarm", 0,
+        "RTMP warm connections");
+    warm_thread = g_thread_create (gst_rtmp_warm_loop, NULL, FALSE, NULL);
+    if (!warm_thread) {
+      g_static_mutex_unlock (&warm_lock);
+      GST_WARNING ("could not start the warm connection thread");
+      return;
+    }
+  }
+
+  for (walk = warm_hosts; walk; walk = walk->next) {
+    if (g_str_equal (((GstRTMPWarmHost *) walk->data)->uri, uri)) {
+      host = walk->data;
+      break;
+    }
+  }
+  if (!host) {
+    host = g_new0 (GstRTMPWarmHost, 1);
+    host->uri = g_strdup (uri);
+    host->key_uri = g_strdup (uri);
+    host->key = RTMP_Alloc ();
+    RTMP_Init (host->key);
+    /* RTMP_WarmUp() only keeps plain rtmp:// connections, encrypted
+     * hosts get key pairs */
+    if (!RTMP_SetupURL (host->key, host->key_uri) ||
+        (host->key->Link.protocol != RTMP_PROTOCOL_RTMP &&
+            !(host->key->Link.protocol & RTMP_FEATURE_ENC))) {
+      g_static_mutex_unlock (&warm_lock);
+      GST_DEBUG ("not keeping connections for %s", uri);
+      RTMP_Free (host->key);
+      g_free (host->key_uri);
+      g_free (host->uri);
+      g_free (host);
+      return;
+    }
+    warm_hosts = g_list_prepend (warm_hosts, host);
+  }
+  host->count = MAX (host->count, count);
+  host->idle_timeout = idle_timeout;
+  g_get_current_time (&host->wanted);
+  g_static_mutex_unlock (&warm_lock);
+}
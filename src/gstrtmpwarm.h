@@ -0,0 +1,32 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_RTMP_WARM_H__
+#define __GST_RTMP_WARM_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_RTMP_WARM_DEFAULT_IDLE_TIMEOUT 60
+
+void gst_rtmp_warm_want (const gchar * uri, guint count, guint idle_timeout);
+
+G_END_DECLS
+
+#endif /* __GST_RTMP_WARM_H__ */
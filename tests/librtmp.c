@@ -0,0 +1,391 @@
+/* librtmp unit tests and microbenchmarks
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include <gst/check/gstcheck.h>
+
+#include <librtmp/rtmp.h>
+#include <librtmp/amf.h>
+
+/* Each benchmark runs the call in a loop, over a socketpair for the
+ * transport ones, and prints the time and the pool misses per call. They
+ * fail on wrong results only. */
+#define BENCH_PACKETS 20000
+#define BENCH_BODY_SIZE 4096
+#define BENCH_DECODES 100000
+
+typedef struct
+{
+  gint fd;
+  guint64 bytes;
+} DrainData;
+
+/* reads everything the benchmark writes, until the other end closes */
+static gpointer
+drain_loop (DrainData * drain)
+{
+  gchar buf[65536];
+  gssize n;
+
+  while ((n = read (drain->fd, buf, sizeof (buf))) > 0)
+    drain->bytes += n;
+  return NULL;
+}
+
+static RTMP *
+setup_rtmp (gint fd)
+{
+  RTMP *r;
+
+  r = RTMP_Alloc ();
+  RTMP_Init (r);
+  r->m_sb.sb_socket = fd;
+  r->m_outChunkSize = 4096;
+  r->m_inChunkSize = 4096;
+  return r;
+}
+
+static guint64
+get_pool_misses (RTMP * r)
+{
+  RTMPPoolStats pool;
+
+  RTMP_GetPoolStats (r, &pool);
+  return pool.ps_allocs - pool.ps_hits;
+}
+
+static void
+print_result (const gchar * name, guint ops, GstClockTime elapsed,
+    guint64 misses)
+{
+  g_print ("%s: %u calls, %.0f ns per call, %.3f pool misses per call\n",
+      name, ops, (gdouble) elapsed / ops, (gdouble) misses / ops);
+}
+
+static void
+fill_packet (RTMPPacket * packet, guint i)
+{
+  packet->m_nChannel = 0x06;
+  packet->m_headerType = i ? RTMP_PACKET_SIZE_MEDIUM : RTMP_PACKET_SIZE_LARGE;
+  packet->m_packetType = RTMP_PACKET_TYPE_VIDEO;
+  packet->m_nTimeStamp = i * 33;
+  packet->m_nInfoField2 = 1;
+  packet->m_nBodySize = BENCH_BODY_SIZE;
+  memset (packet->m_body, i & 0xff, BENCH_BODY_SIZE);
+}
+
+GST_START_TEST (test_send_packet)
+{
+  RTMPPacket packet = { 0 };
+  DrainData drain = { -1, 0 };
+  GstClockTime start, elapsed;
+  GThread *thread;
+  gint fds[2];
+  RTMP *r;
+  guint i;
+
+  fail_unless (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  drain.fd = fds[1];
+  thread = g_thread_create ((GThreadFunc) drain_loop, &drain, TRUE, NULL);
+  r = setup_rtmp (fds[0]);
+  fail_unless (RTMPPacket_Alloc (&packet, BENCH_BODY_SIZE));
+
+  start = gst_util_get_timestamp ();
+  for (i = 0; i < BENCH_PACKETS; i++) {
+    fill_packet (&packet, i);
+    fail_unless (RTMP_SendPacket (r, &packet, FALSE));
+  }
+  fail_unless (RTMP_Flush (r) >= 0);
+  elapsed = gst_util_get_timestamp () - start;
+  print_result ("RTMP_SendPacket", BENCH_PACKETS, elapsed,
+      get_pool_misses (r));
+
+  RTMPPacket_Free (&packet);
+  RTMP_Close (r);
+  RTMP_Free (r);
+  g_thread_join (thread);
+  close (fds[1]);
+  fail_unless (drain.bytes >= (guint64) BENCH_PACKETS * BENCH_BODY_SIZE);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_write)
+{
+  DrainData drain = { -1, 0 };
+  GstClockTime start, elapsed;
+  GThread *thread;
+  guint8 tag[11 + BENCH_BODY_SIZE + 4];
+  gint fds[2];
+  RTMP *r;
+  guint i;
+
+  fail_unless (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  drain.fd = fds[1];
+  thread = g_thread_create ((GThreadFunc) drain_loop, &drain, TRUE, NULL);
+  r = setup_rtmp (fds[0]);
+  r->m_stream_id = 1;
+
+  memset (tag, 0, sizeof (tag));
+  tag[0] = RTMP_PACKET_TYPE_VIDEO;
+  AMF_EncodeInt24 ((char *) tag + 1, (char *) tag + 4, BENCH_BODY_SIZE);
+  tag[11] = 0x22;
+  AMF_EncodeInt32 ((char *) tag + 11 + BENCH_BODY_SIZE, (char *) tag +
+      sizeof (tag), 11 + BENCH_BODY_SIZE);
+
+  start = gst_util_get_timestamp ();
+  for (i = 0; i < BENCH_PACKETS; i++) {
+    guint32 ts = i * 33 + 1;
+
+    AMF_EncodeInt24 ((char *) tag + 4, (char *) tag + 7, ts & 0xffffff);
+    tag[7] = ts >> 24;
+    fail_unless_equals_int (RTMP_Write (r, (const char *) tag,
+            sizeof (tag)), sizeof (tag));
+  }
+  fail_unless (RTMP_Flush (r) >= 0);
+  elapsed = gst_util_get_timestamp () - start;
+  print_result ("RTMP_Write", BENCH_PACKETS, elapsed, get_pool_misses (r));
+
+  RTMP_Close (r);
+  RTMP_Free (r);
+  g_thread_join (thread);
+  close (fds[1]);
+  fail_unless (drain.bytes >= (guint64) BENCH_PACKETS * BENCH_BODY_SIZE);
+}
+
+GST_END_TEST;
+
+/* sends the packets the read benchmark expects, then closes */
+static gpointer
+feed_loop (gpointer data)
+{
+  RTMPPacket packet = { 0 };
+  RTMP *r = setup_rtmp (GPOINTER_TO_INT (data));
+  guint i;
+
+  if (RTMPPacket_Alloc (&packet, BENCH_BODY_SIZE)) {
+    for (i = 0; i < BENCH_PACKETS; i++) {
+      fill_packet (&packet, i);
+      if (!RTMP_SendPacket (r, &packet, FALSE))
+        break;
+    }
+    RTMP_Flush (r);
+    RTMPPacket_Free (&packet);
+  }
+  RTMP_Close (r);
+  RTMP_Free (r);
+  return NULL;
+}
+
+GST_START_TEST (test_read_packet)
+{
+  RTMPPacket packet = { 0 };
+  GstClockTime start, elapsed;
+  GThread *thread;
+  gint fds[2];
+  RTMP *r;
+  guint n = 0;
+
+  fail_unless (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  thread = g_thread_create (feed_loop, GINT_TO_POINTER (fds[1]), TRUE, NULL);
+  r = setup_rtmp (fds[0]);
+
+  start = gst_util_get_timestamp ();
+  while (RTMP_ReadPacket (r, &packet)) {
+    if (!RTMPPacket_IsReady (&packet))
+      continue;
+    fail_unless_equals_int (packet.m_nBodySize, BENCH_BODY_SIZE);
+    fail_unless_equals_int ((guint8) packet.m_body[0], n & 0xff);
+    fail_unless_equals_int (packet.m_nTimeStamp, n * 33);
+    RTMPPacket_Free (&packet);
+    n++;
+  }
+  elapsed = gst_util_get_timestamp () - start;
+  fail_unless_equals_int (n, BENCH_PACKETS);
+  print_result ("RTMP_ReadPacket", n, elapsed, get_pool_misses (r));
+
+  g_thread_join (thread);
+  RTMP_Close (r);
+  RTMP_Free (r);
+}
+
+GST_END_TEST;
+
+/* an onMetaData body like flvmux writes it */
+static gint
+encode_metadata (gchar * buf, gsize size)
+{
+  static const AVal av_onMetaData = AVC ("onMetaData");
+  static const struct
+  {
+    AVal name;
+    gdouble value;
+  } numbers[] = {
+    {AVC ("duration"), 0.0},
+    {AVC ("width"), 1280.0},
+    {AVC ("height"), 720.0},
+    {AVC ("videodatarate"), 2500.0},
+    {AVC ("framerate"), 30.0},
+    {AVC ("videocodecid"), 7.0},
+    {AVC ("audiodatarate"), 128.0},
+    {AVC ("audiosamplerate"), 44100.0},
+    {AVC ("audiosamplesize"), 16.0},
+    {AVC ("audiocodecid"), 10.0},
+    {AVC ("filesize"), 0.0}
+  };
+  static const AVal av_encoder = AVC ("encoder");
+  static const AVal av_version = AVC ("GStreamer FLV muxer");
+  gchar *enc = buf, *pend = buf + size;
+  guint i;
+
+  enc = AMF_EncodeString (enc, pend, &av_onMetaData);
+  *enc++ = AMF_ECMA_ARRAY;
+  enc = AMF_EncodeInt32 (enc, pend, G_N_ELEMENTS (numbers) + 1);
+  for (i = 0; i < G_N_ELEMENTS (numbers); i++)
+    enc = AMF_EncodeNamedNumber (enc, pend, &numbers[i].name,
+        numbers[i].value);
+  enc = AMF_EncodeNamedString (enc, pend, &av_encoder, &av_version);
+  *enc++ = 0;
+  *enc++ = 0;
+  *enc++ = AMF_OBJECT_END;
+  return enc - buf;
+}
+
+GST_START_TEST (test_amf_decode)
+{
+  static const AVal av_width = AVC ("width");
+  GstClockTime start, elapsed;
+  gchar buf[512];
+  AMFObjectProperty *prop;
+  AMFObject obj;
+  AMFCursor c;
+  AMFValue name, body, width;
+  gint size;
+  guint i;
+
+  size = encode_metadata (buf, sizeof (buf));
+
+  start = gst_util_get_timestamp ();
+  for (i = 0; i < BENCH_DECODES; i++) {
+    fail_unless_equals_int (AMF_Decode (&obj, buf, size, FALSE), size);
+    /* AMFProp_GetObject () only takes AMF_OBJECT */
+    prop = AMF_GetProp (&obj, NULL, 1);
+    fail_unless_equals_int (prop->p_type, AMF_ECMA_ARRAY);
+    fail_unless_equals_int (AMFProp_GetNumber (AMF_GetProp (&prop->p_vu.
+                p_object, &av_width, -1)), 1280);
+    AMF_Reset (&obj);
+  }
+  elapsed = gst_util_get_timestamp () - start;
+  g_print ("AMF_Decode: %u calls, %.0f ns per call\n", BENCH_DECODES,
+      (gdouble) elapsed / BENCH_DECODES);
+
+  /* the same lookup in place */
+  start = gst_util_get_timestamp ();
+  for (i = 0; i < BENCH_DECODES; i++) {
+    AMFCursor_Init (&c, buf, size);
+    fail_unless (AMFCursor_Next (&c, &name));
+    fail_unless (AMFCursor_Next (&c, &body));
+    fail_unless_equals_int (body.v_type, AMF_ECMA_ARRAY);
+    fail_unless (AMFCursor_Find (&body.v_body, &av_width, &width));
+    fail_unless_equals_int (width.v_number, 1280);
+  }
+  elapsed = gst_util_get_timestamp () - start;
+  g_print ("AMFCursor_Find: %u calls, %.0f ns per call\n", BENCH_DECODES,
+      (gdouble) elapsed / BENCH_DECODES);
+}
+
+GST_END_TEST;
+
+/* Hostile AMF3 from a server has to fail cleanly: a length or a count
+ * with the top U29 bit set is not negative, and a cursor never moves
+ * back */
+GST_START_TEST (test_amf3_malformed)
+{
+  static const AVal av_duration = AVC ("duration");
+  /* a string 0x0ffffffe bytes long */
+  static const gchar string[] = { 0x11, 0x06, 0xff, 0xff, 0xff, 0xfd };
+  /* an object with 0x00ffffff sealed members */
+  static const gchar sealed[] = { 0x11, 0x0a, 0xbf, 0xff, 0xff, 0xf3, 0x01 };
+  /* onMetaData with a member whose AMF3 string is 0x0ffffff7 bytes */
+  static const gchar metadata[] = {
+    0x02, 0x00, 0x0a, 'o', 'n', 'M', 'e', 't', 'a', 'D', 'a', 't', 'a',
+    0x03, 0x00, 0x01, 'a', 0x11, 0x06, 0xff, 0xff, 0xff, 0xef,
+    0x00, 0x00, 0x09
+  };
+  /* -1 is still an AMF3 integer */
+  static const gchar integer[] = { 0x11, 0x04, 0xff, 0xff, 0xff, 0xff };
+  AMFCursor c;
+  AMFValue v;
+
+  AMFCursor_Init (&c, string, sizeof (string));
+  fail_if (AMFCursor_Next (&c, &v));
+
+  AMFCursor_Init (&c, sealed, sizeof (sealed));
+  fail_if (AMFCursor_Next (&c, &v));
+
+  AMFCursor_Init (&c, metadata, sizeof (metadata));
+  fail_if (AMFCursor_Search (&c, &av_duration, FALSE, &v));
+
+  AMFCursor_Init (&c, integer, sizeof (integer));
+  fail_unless (AMFCursor_Next (&c, &v));
+  fail_unless_equals_int (v.v_type, AMF_NUMBER);
+  fail_unless_equals_int (v.v_number, -1);
+}
+
+GST_END_TEST;
+
+static Suite *
+librtmp_suite (void)
+{
+  Suite *s = suite_create ("librtmp");
+  TCase *tc_chain = tcase_create ("general");
+  TCase *tc_bench = tcase_create ("benchmark");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_amf3_malformed);
+
+  suite_add_tcase (s, tc_bench);
+  tcase_set_timeout (tc_bench, 120);
+  tcase_add_test (tc_bench, test_send_packet);
+  tcase_add_test (tc_bench, test_write);
+  tcase_add_test (tc_bench, test_read_packet);
+  tcase_add_test (tc_bench, test_amf_decode);
+
+  return s;
+}
+
+int
+main (int argc, char **argv)
+{
+  int nf;
+
+  Suite *s = librtmp_suite ();
+  SRunner *sr = srunner_create (s);
+
+  gst_check_init (&argc, &argv);
+  signal (SIGPIPE, SIG_IGN);
+
+  srunner_run_all (sr, CK_NORMAL);
+  nf = srunner_ntests_failed (sr);
+  srunner_free (sr);
+
+  return nf;
+}
@@ -19,12 +19,120 @@
  */
 
 #include <unistd.h>
- 
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
 #include <gst/check/gstcheck.h>
 
+#include "rtmpserver.h"
+#include "gstrtmpqos.h"
+
+/* The benchmarks print their measurements with g_print () so runs can be
+ * compared; they only fail on wrong results, never on slow ones. */
+#define BENCH_TAGS 3000
+#define BENCH_TAG_SIZE 8192
+#define BENCH_TIMEOUT (30 * GST_SECOND)
+
+/* start of tag i in an rtmp_test_make_flv () file */
+#define TAG_OFFSET(i) (13 + (gsize) (i) * (11 + BENCH_TAG_SIZE + 4))
+#define TAG_SIZE (11 + BENCH_TAG_SIZE + 4)
+
+static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("video/x-flv"));
+
+/* user and system time of the whole process, the server threads included */
+static GstClockTime
+get_cpu_time (void)
+{
+  struct rusage ru;
+
+  getrusage (RUSAGE_SELF, &ru);
+  return GST_TIMEVAL_TO_TIME (ru.ru_utime) +
+      GST_TIMEVAL_TO_TIME (ru.ru_stime);
+}
+
+static gint
+compare_times (gconstpointer a, gconstpointer b)
+{
+  GstClockTime ta = *(const GstClockTime *) a;
+  GstClockTime tb = *(const GstClockTime *) b;
+
+  return ta < tb ? -1 : ta > tb;
+}
+
+static gdouble
+get_mbits (guint64 bytes)
+{
+  return bytes * 8 / 1e6;
+}
+
+static GstElement *
+setup_rtmpsink (RTMPTestServer * server, GstPad ** srcpad)
+{
+  GstElement *sink;
+  gchar *uri;
+
+  sink = gst_check_setup_element ("rtmpsink");
+  uri = rtmp_test_server_get_uri (server, "live/bench");
+  g_object_set (sink, "location", uri, "sync", FALSE, NULL);
+  g_free (uri);
+
+  *srcpad = gst_check_setup_src_pad (sink, &srctemplate, NULL);
+  gst_pad_set_active (*srcpad, TRUE);
+  return sink;
+}
+
+static void
+cleanup_rtmpsink (GstElement * sink)
+{
+  gst_element_set_state (sink, GST_STATE_NULL);
+  gst_check_teardown_src_pad (sink);
+  gst_check_teardown_element (sink);
+}
+
+/* one FLV tag, or the file header, per buffer like flvmux pushes them */
+static GstFlowReturn
+push_flv (GstPad * pad, const guint8 * data, guint size, GstClockTime ts)
+{
+  GstBuffer *buf;
+
+  buf = gst_buffer_new_and_alloc (size);
+  memcpy (GST_BUFFER_DATA (buf), data, size);
+  GST_BUFFER_TIMESTAMP (buf) = ts;
+  return gst_pad_push (pad, buf);
+}
+
+static GstFlowReturn
+push_tag (GstPad * pad, const guint8 * flv, guint i)
+{
+  return push_flv (pad, flv + TAG_OFFSET (i), TAG_SIZE,
+      gst_util_uint64_scale (i, GST_SECOND, 30));
+}
+
 GST_START_TEST (test_still_image)
 {
   GstElement *pipeline, *video_src, *video_enc, *muxer, *sink, *audio_src, *audio_enc;
+  RTMPTestServer *server;
+  gchar *uri;
+
+  video_enc = gst_element_factory_make ("x264enc", NULL);
+  audio_enc = gst_element_factory_make ("faac", NULL);
+  if (!video_enc || !audio_enc) {
+    GST_INFO ("x264enc or faac not available, skipping");
+    if (video_enc)
+      gst_object_unref (video_enc);
+    if (audio_enc)
+      gst_object_unref (audio_enc);
+    return;
+  }
+
+  server = rtmp_test_server_new (NULL, NULL);
+  fail_unless (server != NULL);
+  uri = rtmp_test_server_get_uri (server, "vod/stream");
 
   pipeline = gst_pipeline_new ("pipeline");
 
@@ -32,27 +140,625 @@ GST_START_TEST (test_still_image)
   gst_util_set_object_arg (G_OBJECT (video_src), "num-buffers", "100");
   gst_util_set_object_arg (G_OBJECT (video_src), "is-live", "true");
 
-  video_enc = gst_element_factory_make ("x264enc", NULL);
   muxer = gst_element_factory_make ("flvmux", NULL);
 
   sink = gst_element_factory_make ("rtmpsink", NULL);
-  gst_util_set_object_arg (G_OBJECT (sink), "location", "rtmp://yoururl.fr/vod/_definst_/stream/yourstream");
+  gst_util_set_object_arg (G_OBJECT (sink), "location", uri);
   gst_util_set_object_arg (G_OBJECT (sink), "sync", "true");
   gst_util_set_object_arg (G_OBJECT (sink), "reconnection-delay", "0");
   gst_util_set_object_arg (G_OBJECT (sink), "log-level", "4");
   gst_util_set_object_arg (G_OBJECT (sink), "flashver", "test");
 
   audio_src = gst_element_factory_make ("audiotestsrc", NULL);
-  audio_enc = gst_element_factory_make ("faac", NULL);
 
+  gst_bin_add_many (GST_BIN (pipeline), video_src, video_enc, muxer, sink,
+      audio_src, audio_enc, NULL);
   fail_unless ( gst_element_link_many (audio_src, audio_enc, muxer, NULL));
   fail_unless (gst_element_link_many (video_src, video_enc, muxer, sink, NULL));
 
   gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  fail_unless (rtmp_test_server_wait_tags (server, 10, BENCH_TIMEOUT));
   fail_unless_equals_int (gst_element_set_state (pipeline, GST_STATE_NULL),
       GST_STATE_CHANGE_SUCCESS);
 
   gst_object_unref (pipeline);
+  rtmp_test_server_free (server);
+  g_free (uri);
+}
+
+GST_END_TEST;
+
+/* An encoder following the estimate over a link that drops to 600 kbit/s
+ * for 25 s: the target comes down to it without collapsing, stays above
+ * the floor and climbs back once the link recovers */
+GST_START_TEST (test_qos_estimate)
+{
+  GstRTMPQos qos = { 0, };
+  RTMPStats stats = { 0, };
+  GstClockTime now = GST_SECOND;
+  guint64 backlog = 0, out;
+  guint rate = 1000000, link, previous = 0, i;
+
+  qos.reaction_time = 2 * GST_SECOND;
+  qos.min_bitrate = 100000;
+  gst_rtmp_qos_reset (&qos);
+  for (i = 0; i < 200; i++, now += GST_SECOND / 4) {
+    link = i < 20 || i >= 120 ? 3000000 : 600000;
+    /* a quarter second of bits/s, in bytes */
+    backlog += rate / 32;
+    out = MIN (backlog, link / 32);
+    backlog -= out;
+    stats.rs_bytesOut += out;
+    stats.rs_sendCalls += 10;
+    stats.rs_unsent = backlog;
+    gst_rtmp_qos_update (&qos, now, &stats, 2500000, 0, rate / 8);
+    if (!qos.bitrate)
+      continue;
+
+    fail_unless (qos.bitrate * 5 >= previous * 4,
+        "target fell from %u to %u at %u", previous, qos.bitrate, i);
+    fail_unless (qos.bitrate >= qos.min_bitrate);
+    if (i == 40)
+      fail_unless (qos.congested && qos.bitrate < 700000);
+    if (i >= 60 && i < 120)
+      fail_unless (qos.bitrate <= 660000, "target %u at %u", qos.bitrate, i);
+    rate = previous = qos.bitrate;
+  }
+  fail_unless (!qos.congested);
+  fail_unless (qos.bitrate > 1000000, "target %u", qos.bitrate);
+}
+
+GST_END_TEST;
+
+/* an AVC sequence header tag whose body is size bytes */
+static GstBuffer *
+make_avc_config (guint size)
+{
+  GstBuffer *buf;
+  guint8 *tag;
+
+  buf = gst_buffer_new_and_alloc (11 + size + 4);
+  tag = GST_BUFFER_DATA (buf);
+  memset (tag, 0, GST_BUFFER_SIZE (buf));
+  tag[0] = 9;
+  GST_WRITE_UINT24_BE (tag + 1, size);
+  tag[11] = 0x17;
+  tag[12] = 0;
+  GST_WRITE_UINT32_BE (tag + 11 + size, 11 + size);
+  GST_BUFFER_TIMESTAMP (buf) = 0;
+  return buf;
+}
+
+/* flvmux style caps, the buffers flagged as headers */
+static GstCaps *
+make_flv_caps (const guint8 * flv, GstBuffer * config)
+{
+  GstCaps *caps;
+  GValue array = { 0, };
+  GValue value = { 0, };
+  GstBuffer *header;
+
+  header = gst_buffer_new_and_alloc (13);
+  memcpy (GST_BUFFER_DATA (header), flv, 13);
+  g_value_init (&array, GST_TYPE_ARRAY);
+  g_value_init (&value, GST_TYPE_BUFFER);
+  GST_BUFFER_FLAG_SET (header, GST_BUFFER_FLAG_IN_CAPS);
+  gst_value_set_buffer (&value, header);
+  gst_value_array_append_value (&array, &value);
+  config = gst_buffer_make_metadata_writable (gst_buffer_ref (config));
+  GST_BUFFER_FLAG_SET (config, GST_BUFFER_FLAG_IN_CAPS);
+  gst_value_set_buffer (&value, config);
+  gst_value_array_append_value (&array, &value);
+  g_value_unset (&value);
+  gst_buffer_unref (header);
+  gst_buffer_unref (config);
+
+  caps = gst_caps_new_simple ("video/x-flv", NULL);
+  gst_structure_set_value (gst_caps_get_structure (caps, 0), "streamheader",
+      &array);
+  g_value_unset (&array);
+  return caps;
+}
+
+/* A new session must start with the codec config the stream uses now:
+ * the caps streamheader at first, then the one sent mid-stream */
+GST_START_TEST (test_sink_codec_config)
+{
+  RTMPTestServer *server;
+  RTMPTestServerStats stats;
+  GstElement *sink;
+  GstPad *srcpad;
+  GstBuffer *buf, *config;
+  GstCaps *caps;
+  guint8 *flv;
+  gsize size;
+  guint i;
+
+  server = rtmp_test_server_new (NULL, NULL);
+  fail_unless (server != NULL);
+  flv = rtmp_test_make_flv (BENCH_TAGS, BENCH_TAG_SIZE, &size);
+
+  sink = setup_rtmpsink (server, &srcpad);
+  g_object_set (sink, "reconnection-delay", (guint64) (10 * GST_MSECOND),
+      NULL);
+  gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (gst_pad_push_event (srcpad, gst_event_new_new_segment (FALSE,
+              1.0, GST_FORMAT_TIME, 0, -1, 0)));
+
+  /* only in the caps: sent when the session opens */
+  config = make_avc_config (16);
+  caps = make_flv_caps (flv, config);
+  gst_buffer_unref (config);
+  buf = gst_buffer_new_and_alloc (TAG_SIZE);
+  memcpy (GST_BUFFER_DATA (buf), flv + TAG_OFFSET (0), TAG_SIZE);
+  GST_BUFFER_TIMESTAMP (buf) = 0;
+  gst_buffer_set_caps (buf, caps);
+  gst_caps_unref (caps);
+  fail_unless_equals_int (gst_pad_push (srcpad, buf), GST_FLOW_OK);
+  for (i = 1; i < 30; i++)
+    fail_unless_equals_int (push_tag (srcpad, flv, i), GST_FLOW_OK);
+  fail_unless (rtmp_test_server_wait_tags (server, 31, BENCH_TIMEOUT));
+  rtmp_test_server_get_stats (server, &stats);
+  fail_unless_equals_int (stats.configs, 1);
+  fail_unless_equals_int (stats.config_size, 16);
+
+  /* a change of resolution, in-band */
+  config = make_avc_config (32);
+  GST_BUFFER_TIMESTAMP (config) = gst_util_uint64_scale (i, GST_SECOND, 30);
+  fail_unless_equals_int (gst_pad_push (srcpad, config), GST_FLOW_OK);
+  for (; i < 60; i++)
+    fail_unless_equals_int (push_tag (srcpad, flv, i), GST_FLOW_OK);
+  fail_unless (rtmp_test_server_wait_tags (server, 62, BENCH_TIMEOUT));
+
+  rtmp_test_server_drop (server);
+  for (; i < BENCH_TAGS; i++) {
+    fail_unless_equals_int (push_tag (srcpad, flv, i), GST_FLOW_OK);
+    if (rtmp_test_server_wait_publishes (server, 2, 0))
+      break;
+    g_usleep (5000);
+  }
+  fail_unless (i < BENCH_TAGS);
+
+  /* the new session got the latest config, not the one of the caps */
+  rtmp_test_server_get_stats (server, &stats);
+  for (i++; i < BENCH_TAGS && i < 300; i++)
+    fail_unless_equals_int (push_tag (srcpad, flv, i), GST_FLOW_OK);
+  fail_unless (rtmp_test_server_wait_tags (server, stats.tags + 1,
+          BENCH_TIMEOUT));
+  rtmp_test_server_get_stats (server, &stats);
+  fail_unless_equals_int (stats.configs, 3);
+  fail_unless_equals_int (stats.config_size, 32);
+
+  cleanup_rtmpsink (sink);
+  rtmp_test_server_free (server);
+  g_free (flv);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_src_keyframe_index)
+{
+  RTMPTestServer *server;
+  GstElement *pipeline, *src, *sink;
+  GstMessage *msg;
+  GstQuery *query;
+  GstBus *bus;
+  GstFormat format;
+  gboolean seekable;
+  gint64 start, end;
+  guint8 *flv;
+  gsize size;
+  gchar *uri;
+
+  server = rtmp_test_server_new (NULL, NULL);
+  fail_unless (server != NULL);
+  flv = rtmp_test_make_flv_metadata (300, 1000, FALSE, &size);
+  rtmp_test_server_set_flv (server, flv, size);
+  uri = rtmp_test_server_get_uri (server, "vod/index");
+
+  pipeline = gst_pipeline_new ("pipeline");
+  src = gst_check_setup_element ("rtmpsrc");
+  g_object_set (src, "location", uri, "tag-aligned", TRUE, NULL);
+  sink = gst_check_setup_element ("fakesink");
+  g_object_set (sink, "sync", FALSE, NULL);
+  gst_bin_add_many (GST_BIN (pipeline), src, sink, NULL);
+  fail_unless (gst_element_link (src, sink));
+
+  bus = gst_element_get_bus (pipeline);
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  msg = gst_bus_timed_pop_filtered (bus, 10 * GST_SECOND,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  fail_unless (msg != NULL);
+  fail_unless_equals_int (GST_MESSAGE_TYPE (msg), GST_MESSAGE_EOS);
+  gst_message_unref (msg);
+
+  /* ten seconds with a keyframe every second */
+  query = gst_query_new_seeking (GST_FORMAT_TIME);
+  fail_unless (gst_element_query (src, query));
+  gst_query_parse_seeking (query, &format, &seekable, &start, &end);
+  fail_unless_equals_int (format, GST_FORMAT_TIME);
+  fail_unless (seekable);
+  fail_unless_equals_uint64 (start, 0);
+  fail_unless_equals_uint64 (end, 10 * GST_SECOND);
+  gst_query_unref (query);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (bus);
+  gst_object_unref (pipeline);
+  rtmp_test_server_free (server);
+  g_free (uri);
+  g_free (flv);
+}
+
+GST_END_TEST;
+
+/* What reached the sink since the last newsegment */
+typedef struct
+{
+  gint buffers;			/* all of them, the segments before included */
+  gint64 start;
+  gint64 first_video;		/* ms, -1 before it */
+  gboolean first_keyframe;
+  gint64 first_audio;
+} SeekTags;
+
+static gboolean
+seek_tags_event (GstPad * pad, GstEvent * event, SeekTags * tags)
+{
+  if (GST_EVENT_TYPE (event) == GST_EVENT_NEWSEGMENT) {
+    gst_event_parse_new_segment (event, NULL, NULL, NULL, &tags->start, NULL,
+        NULL);
+    tags->first_video = tags->first_audio = -1;
+  }
+  return TRUE;
+}
+
+static gboolean
+seek_tags_buffer (GstPad * pad, GstBuffer * buf, SeekTags * tags)
+{
+  const guint8 *data = GST_BUFFER_DATA (buf);
+  guint size = GST_BUFFER_SIZE (buf), pos = 0;
+
+  if (size >= 13 && memcmp (data, "FLV", 3) == 0)
+    pos = 13;
+  while (pos + 12 <= size) {
+    gint64 ts = GST_READ_UINT24_BE (data + pos + 4) | (data[pos + 7] << 24);
+
+    if (data[pos] == 9 && tags->first_video < 0) {
+      tags->first_video = ts;
+      tags->first_keyframe = (data[pos + 11] >> 4) == 1;
+    } else if (data[pos] == 8 && tags->first_audio < 0) {
+      tags->first_audio = ts;
+    }
+    pos += 11 + GST_READ_UINT24_BE (data + pos + 1) + 4;
+  }
+  g_atomic_int_inc (&tags->buffers);
+  return TRUE;
+}
+
+/* Plays the file, seeks to 4.3 s once it got going and runs to the end.
+ * The server resumes a second before the keyframe asked for */
+static void
+run_seek (GstSeekFlags flags, SeekTags * tags)
+{
+  RTMPTestServer *server;
+  GstElement *pipeline, *src, *sink;
+  GstMessage *msg;
+  GstPad *pad;
+  GstBus *bus;
+  guint8 *flv;
+  gsize size;
+  gchar *uri;
+  gint i;
+
+  server = rtmp_test_server_new (NULL, NULL);
+  fail_unless (server != NULL);
+  flv = rtmp_test_make_flv_metadata (300, 1000, TRUE, &size);
+  rtmp_test_server_set_flv (server, flv, size);
+  rtmp_test_server_set_seekable (server, TRUE);
+  uri = rtmp_test_server_get_uri (server, "vod/seek");
+
+  pipeline = gst_pipeline_new ("pipeline");
+  src = gst_check_setup_element ("rtmpsrc");
+  g_object_set (src, "location", uri, "tag-aligned", TRUE, "prefetch", TRUE,
+      NULL);
+  sink = gst_check_setup_element ("fakesink");
+  g_object_set (sink, "sync", FALSE, NULL);
+  gst_bin_add_many (GST_BIN (pipeline), src, sink, NULL);
+  fail_unless (gst_element_link (src, sink));
+
+  memset (tags, 0, sizeof (*tags));
+  pad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_add_event_probe (pad, G_CALLBACK (seek_tags_event), tags);
+  gst_pad_add_buffer_probe (pad, G_CALLBACK (seek_tags_buffer), tags);
+  gst_object_unref (pad);
+
+  bus = gst_element_get_bus (pipeline);
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  /* past the header and the metadata, so the index is known */
+  for (i = 0; i < 2000 && g_atomic_int_get (&tags->buffers) < 3; i++)
+    g_usleep (5000);
+  fail_unless (g_atomic_int_get (&tags->buffers) >= 3);
+
+  fail_unless (gst_element_seek_simple (pipeline, GST_FORMAT_TIME,
+          GST_SEEK_FLAG_FLUSH | flags, 4300 * GST_MSECOND));
+  msg = gst_bus_timed_pop_filtered (bus, 10 * GST_SECOND,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  fail_unless (msg != NULL);
+  fail_unless_equals_int (GST_MESSAGE_TYPE (msg), GST_MESSAGE_EOS);
+  gst_message_unref (msg);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (bus);
+  gst_object_unref (pipeline);
+  rtmp_test_server_free (server);
+  g_free (uri);
+  g_free (flv);
+}
+
+/* A seek between two keyframes: a key unit seek moves to the nearer one,
+ * an accurate one starts decoding at the one before and pushes no audio
+ * ahead of the position */
+GST_START_TEST (test_src_seek_keyframe)
+{
+  SeekTags tags;
+
+  run_seek (GST_SEEK_FLAG_KEY_UNIT, &tags);
+  fail_unless_equals_uint64 (tags.start, 4 * GST_SECOND);
+  fail_unless_equals_int (tags.first_video, 4000);
+  fail_unless (tags.first_keyframe);
+  fail_unless (tags.first_audio >= 4000);
+
+  run_seek (GST_SEEK_FLAG_ACCURATE, &tags);
+  fail_unless_equals_uint64 (tags.start, 4300 * GST_MSECOND);
+  fail_unless_equals_int (tags.first_video, 4000);
+  fail_unless (tags.first_keyframe);
+  fail_unless (tags.first_audio >= 4300);
+}
+
+GST_END_TEST;
+
+/* Two sinks to the same application publish over one connection, and
+ * both streams get through */
+GST_START_TEST (test_sink_shared_connection)
+{
+  RTMPTestServer *server;
+  RTMPTestServerStats stats;
+  GstElement *sink[2];
+  GstPad *srcpad[2];
+  guint8 *flv;
+  gsize size;
+  gchar *uri, *path;
+  guint i, j;
+
+  server = rtmp_test_server_new (NULL, NULL);
+  fail_unless (server != NULL);
+  flv = rtmp_test_make_flv (100, BENCH_TAG_SIZE, &size);
+
+  for (j = 0; j < G_N_ELEMENTS (sink); j++) {
+    sink[j] = setup_rtmpsink (server, &srcpad[j]);
+    path = g_strdup_printf ("live/shared%u", j);
+    uri = rtmp_test_server_get_uri (server, path);
+    g_free (path);
+    g_object_set (sink[j], "location", uri, "shared-connection", TRUE, NULL);
+    g_free (uri);
+    gst_element_set_state (sink[j], GST_STATE_PLAYING);
+    fail_unless (gst_pad_push_event (srcpad[j],
+            gst_event_new_new_segment (FALSE, 1.0, GST_FORMAT_TIME, 0, -1,
+                0)));
+  }
+
+  for (i = 0; i < 100; i++) {
+    for (j = 0; j < G_N_ELEMENTS (sink); j++)
+      fail_unless_equals_int (push_tag (srcpad[j], flv, i), GST_FLOW_OK);
+  }
+  fail_unless (rtmp_test_server_wait_tags (server, 200, BENCH_TIMEOUT));
+  rtmp_test_server_get_stats (server, &stats);
+  fail_unless_equals_int (stats.sessions, 1);
+  fail_unless_equals_int (stats.publishes, 2);
+
+  for (j = 0; j < G_N_ELEMENTS (sink); j++)
+    cleanup_rtmpsink (sink[j]);
+  rtmp_test_server_free (server);
+  g_free (flv);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_sink_throughput)
+{
+  RTMPTestServer *server;
+  RTMPTestServerStats stats;
+  GstElement *sink;
+  GstPad *srcpad;
+  GstClockTime *latency, start, connect_time, elapsed, cpu;
+  guint8 *flv;
+  gsize size;
+  gdouble mbits;
+  guint i;
+
+  server = rtmp_test_server_new (NULL, NULL);
+  fail_unless (server != NULL);
+  flv = rtmp_test_make_flv (BENCH_TAGS, BENCH_TAG_SIZE, &size);
+  latency = g_new (GstClockTime, BENCH_TAGS);
+
+  sink = setup_rtmpsink (server, &srcpad);
+  gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (gst_pad_push_event (srcpad, gst_event_new_new_segment (FALSE,
+              1.0, GST_FORMAT_TIME, 0, -1, 0)));
+
+  /* the sink connects on the file header */
+  start = gst_util_get_timestamp ();
+  fail_unless_equals_int (push_flv (srcpad, flv, 13, 0), GST_FLOW_OK);
+  connect_time = gst_util_get_timestamp () - start;
+  fail_unless (rtmp_test_server_wait_publishes (server, 1, BENCH_TIMEOUT));
+
+  cpu = get_cpu_time ();
+  start = gst_util_get_timestamp ();
+  for (i = 0; i < BENCH_TAGS; i++) {
+    GstClockTime before = gst_util_get_timestamp ();
+
+    fail_unless_equals_int (push_tag (srcpad, flv, i), GST_FLOW_OK);
+    latency[i] = gst_util_get_timestamp () - before;
+  }
+  fail_unless (rtmp_test_server_wait_tags (server, BENCH_TAGS,
+          BENCH_TIMEOUT));
+  elapsed = gst_util_get_timestamp () - start;
+  cpu = get_cpu_time () - cpu;
+
+  rtmp_test_server_get_stats (server, &stats);
+  fail_unless_equals_uint64 (stats.tags, BENCH_TAGS);
+  fail_unless_equals_uint64 (stats.bytes, (guint64) BENCH_TAGS *
+      BENCH_TAG_SIZE);
+
+  qsort (latency, BENCH_TAGS, sizeof (GstClockTime), compare_times);
+  mbits = get_mbits (stats.bytes);
+  g_print ("rtmpsink: connect %" GST_TIME_FORMAT ", %u tags of %u bytes, "
+      "%.1f Mbit/s\n", GST_TIME_ARGS (connect_time), BENCH_TAGS,
+      BENCH_TAG_SIZE, mbits * GST_SECOND / elapsed);
+  g_print ("rtmpsink: push latency p50 %" GST_TIME_FORMAT " p99 %"
+      GST_TIME_FORMAT "\n", GST_TIME_ARGS (latency[BENCH_TAGS / 2]),
+      GST_TIME_ARGS (latency[BENCH_TAGS * 99 / 100]));
+  g_print ("rtmpsink: %.3f ms CPU per Mbit, %.3f server allocations per "
+      "tag\n", (gdouble) cpu / GST_MSECOND / mbits,
+      (gdouble) stats.allocs / stats.tags);
+
+  cleanup_rtmpsink (sink);
+  rtmp_test_server_free (server);
+  g_free (latency);
+  g_free (flv);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_sink_reconnect)
+{
+  RTMPTestServer *server;
+  RTMPTestServerStats stats;
+  GstElement *sink;
+  GstStructure *s;
+  GstPad *srcpad;
+  GstClockTime dropped, reconnect = GST_CLOCK_TIME_NONE, downtime = 0;
+  guint8 *flv;
+  gsize size;
+  guint i, reconnections = 0;
+
+  server = rtmp_test_server_new (NULL, NULL);
+  fail_unless (server != NULL);
+  flv = rtmp_test_make_flv (BENCH_TAGS, BENCH_TAG_SIZE, &size);
+
+  sink = setup_rtmpsink (server, &srcpad);
+  g_object_set (sink, "reconnection-delay", (guint64) (10 * GST_MSECOND),
+      NULL);
+  gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (gst_pad_push_event (srcpad, gst_event_new_new_segment (FALSE,
+              1.0, GST_FORMAT_TIME, 0, -1, 0)));
+
+  fail_unless_equals_int (push_flv (srcpad, flv, 13, 0), GST_FLOW_OK);
+  for (i = 0; i < 60; i++)
+    fail_unless_equals_int (push_tag (srcpad, flv, i), GST_FLOW_OK);
+  fail_unless (rtmp_test_server_wait_tags (server, 60, BENCH_TIMEOUT));
+
+  /* keep feeding at a live pace until the sink has published again */
+  dropped = gst_util_get_timestamp ();
+  rtmp_test_server_drop (server);
+  for (; i < BENCH_TAGS; i++) {
+    fail_unless_equals_int (push_tag (srcpad, flv, i), GST_FLOW_OK);
+    if (rtmp_test_server_wait_publishes (server, 2, 0)) {
+      reconnect = gst_util_get_timestamp () - dropped;
+      break;
+    }
+    g_usleep (5000);
+  }
+  fail_unless (GST_CLOCK_TIME_IS_VALID (reconnect));
+
+  /* and data flows on the new session */
+  rtmp_test_server_get_stats (server, &stats);
+  for (i++; i < BENCH_TAGS && i < 300; i++)
+    fail_unless_equals_int (push_tag (srcpad, flv, i), GST_FLOW_OK);
+  fail_unless (rtmp_test_server_wait_tags (server, stats.tags + 1,
+          BENCH_TIMEOUT));
+
+  g_object_get (sink, "stats", &s, NULL);
+  fail_unless (s != NULL);
+  fail_unless (gst_structure_get_uint (s, "reconnections", &reconnections));
+  fail_unless (gst_structure_get_uint64 (s, "downtime", &downtime));
+  gst_structure_free (s);
+  fail_unless (reconnections >= 1);
+
+  g_print ("rtmpsink: reconnected in %" GST_TIME_FORMAT ", %u reconnections, "
+      "downtime %" GST_TIME_FORMAT "\n", GST_TIME_ARGS (reconnect),
+      reconnections, GST_TIME_ARGS (downtime));
+
+  cleanup_rtmpsink (sink);
+  rtmp_test_server_free (server);
+  g_free (flv);
+}
+
+GST_END_TEST;
+
+static void
+count_handoff (GstElement * fakesink, GstBuffer * buf, GstPad * pad,
+    guint64 * counts)
+{
+  counts[0] += GST_BUFFER_SIZE (buf);
+  counts[1]++;
+}
+
+GST_START_TEST (test_src_throughput)
+{
+  RTMPTestServer *server;
+  GstElement *pipeline, *src, *sink;
+  GstMessage *msg;
+  GstBus *bus;
+  GstClockTime start, elapsed, cpu;
+  guint64 counts[2] = { 0, 0 };
+  guint8 *flv;
+  gsize size;
+  gchar *uri;
+  gdouble mbits;
+
+  server = rtmp_test_server_new (NULL, NULL);
+  fail_unless (server != NULL);
+  flv = rtmp_test_make_flv (BENCH_TAGS, BENCH_TAG_SIZE, &size);
+  rtmp_test_server_set_flv (server, flv, size);
+  uri = rtmp_test_server_get_uri (server, "vod/bench");
+
+  pipeline = gst_pipeline_new ("pipeline");
+  src = gst_check_setup_element ("rtmpsrc");
+  g_object_set (src, "location", uri, "tag-aligned", TRUE, NULL);
+  sink = gst_check_setup_element ("fakesink");
+  g_object_set (sink, "sync", FALSE, "signal-handoffs", TRUE, NULL);
+  g_signal_connect (sink, "handoff", G_CALLBACK (count_handoff), counts);
+  gst_bin_add_many (GST_BIN (pipeline), src, sink, NULL);
+  fail_unless (gst_element_link (src, sink));
+
+  bus = gst_element_get_bus (pipeline);
+  cpu = get_cpu_time ();
+  start = gst_util_get_timestamp ();
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  msg = gst_bus_timed_pop_filtered (bus, BENCH_TIMEOUT,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  elapsed = gst_util_get_timestamp () - start;
+  cpu = get_cpu_time () - cpu;
+  fail_unless (msg != NULL);
+  fail_unless_equals_int (GST_MESSAGE_TYPE (msg), GST_MESSAGE_EOS);
+  gst_message_unref (msg);
+
+  /* the FLV comes back byte for byte, file header included */
+  fail_unless_equals_uint64 (counts[0], size);
+
+  mbits = get_mbits (counts[0]);
+  g_print ("rtmpsrc: %" G_GUINT64_FORMAT " buffers, %.1f Mbit/s including "
+      "connect, %.3f ms CPU per Mbit\n", counts[1],
+      mbits * GST_SECOND / elapsed, (gdouble) cpu / GST_MSECOND / mbits);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (bus);
+  gst_object_unref (pipeline);
+  rtmp_test_server_free (server);
+  g_free (uri);
+  g_free (flv);
 }
 
 GST_END_TEST;
@@ -62,9 +768,26 @@ rtmp_suite (void)
 {
   Suite *s = suite_create ("rtmp");
   TCase *tc_chain = tcase_create ("general");
+  TCase *tc_server = tcase_create ("server");
+  TCase *tc_bench = tcase_create ("benchmark");
 
   suite_add_tcase (s, tc_chain);
-  tcase_add_test (tc_chain, test_still_image);
+  tcase_add_test (tc_chain, test_qos_estimate);
+
+  /* these wait on the loopback server, 10 s for EOS and the like */
+  suite_add_tcase (s, tc_server);
+  tcase_set_timeout (tc_server, 60);
+  tcase_add_test (tc_server, test_still_image);
+  tcase_add_test (tc_server, test_sink_codec_config);
+  tcase_add_test (tc_server, test_src_keyframe_index);
+  tcase_add_test (tc_server, test_src_seek_keyframe);
+  tcase_add_test (tc_server, test_sink_shared_connection);
+
+  suite_add_tcase (s, tc_bench);
+  tcase_set_timeout (tc_bench, 120);
+  tcase_add_test (tc_bench, test_sink_throughput);
+  tcase_add_test (tc_bench, test_sink_reconnect);
+  tcase_add_test (tc_bench, test_src_throughput);
 
   return s;
 }
@@ -78,6 +801,8 @@ main (int argc, char **argv)
   SRunner *sr = srunner_create (s);
 
   gst_check_init (&argc, &argv);
+  /* librtmp writes to sockets the server may have cut */
+  signal (SIGPIPE, SIG_IGN);
 
   srunner_run_all (sr, CK_NORMAL);
   nf = srunner_ntests_failed (sr);
@@ -0,0 +1,703 @@
+/* GStreamer rtmp unit test helpers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <librtmp/rtmp.h>
+#include <librtmp/amf.h>
+
+#include "rtmpserver.h"
+
+#define SERVER_CHUNK_SIZE 4096
+/* of the audio tags of rtmp_test_make_flv_metadata () */
+#define AUDIO_SIZE 64
+
+struct _RTMPTestServer
+{
+  gint fd;
+  gint port;
+  gpointer tls;			/* server context, NULL for rtmp:// */
+  GThread *thread;
+
+  /* lock protects everything below */
+  GMutex *lock;
+  GCond *cond;
+  gboolean stop;
+  GList *sessions;
+  guint8 *flv;
+  gsize flv_size;
+  gboolean seekable;
+  RTMPTestServerStats stats;
+};
+
+typedef struct
+{
+  RTMPTestServer *server;
+  GThread *thread;
+  gint fd;
+  guint64 misses;		/* pool misses already in the stats */
+  gint streams;			/* handed out by createStream */
+  gboolean done;		/* fd is about to be closed */
+  guint8 *flv;			/* a play waiting for its seek */
+  gsize flv_size;
+} RTMPTestSession;
+
+static const AVal av_connect = AVC ("connect");
+static const AVal av_createStream = AVC ("createStream");
+static const AVal av_publish = AVC ("publish");
+static const AVal av_play = AVC ("play");
+static const AVal av_seek = AVC ("seek");
+static const AVal av__result = AVC ("_result");
+static const AVal av_onStatus = AVC ("onStatus");
+static const AVal av_fmsVer = AVC ("fmsVer");
+static const AVal av_version = AVC ("FMS/3,5,7,7009");
+static const AVal av_capabilities = AVC ("capabilities");
+static const AVal av_level = AVC ("level");
+static const AVal av_status = AVC ("status");
+static const AVal av_code = AVC ("code");
+static const AVal av_description = AVC ("description");
+
+static char *
+rtmp_test_encode_end (char *enc, char *pend)
+{
+  if (enc + 3 > pend)
+    return NULL;
+  *enc++ = 0;
+  *enc++ = 0;
+  *enc++ = AMF_OBJECT_END;
+  return enc;
+}
+
+static char *
+rtmp_test_encode_status (char *enc, char *pend, const gchar * code)
+{
+  AVal av;
+
+  av.av_val = (char *) code;
+  av.av_len = strlen (code);
+  *enc++ = AMF_OBJECT;
+  enc = AMF_EncodeNamedString (enc, pend, &av_level, &av_status);
+  enc = AMF_EncodeNamedString (enc, pend, &av_code, &av);
+  enc = AMF_EncodeNamedString (enc, pend, &av_description, &av);
+  return enc ? rtmp_test_encode_end (enc, pend) : NULL;
+}
+
+/* pbuf keeps RTMP_MAX_HEADER_SIZE bytes of headroom before the body */
+static gboolean
+rtmp_test_send_invoke (RTMP * r, char *pbuf, char *enc, gint stream_id)
+{
+  RTMPPacket packet = { 0 };
+
+  if (!enc)
+    return FALSE;
+  packet.m_nChannel = 0x03;
+  packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+  packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
+  packet.m_nInfoField2 = stream_id;
+  packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
+  packet.m_nBodySize = enc - packet.m_body;
+  return RTMP_SendPacket (r, &packet, FALSE);
+}
+
+static gboolean
+rtmp_test_send_connect_result (RTMP * r, double txn)
+{
+  char pbuf[512], *pend = pbuf + sizeof (pbuf);
+  char *enc = pbuf + RTMP_MAX_HEADER_SIZE;
+
+  enc = AMF_EncodeString (enc, pend, &av__result);
+  enc = AMF_EncodeNumber (enc, pend, txn);
+  *enc++ = AMF_OBJECT;
+  enc = AMF_EncodeNamedString (enc, pend, &av_fmsVer, &av_version);
+  enc = AMF_EncodeNamedNumber (enc, pend, &av_capabilities, 31.0);
+  enc = rtmp_test_encode_end (enc, pend);
+  enc = rtmp_test_encode_status (enc, pend, "NetConnection.Connect.Success");
+  return rtmp_test_send_invoke (r, pbuf, enc, 0);
+}
+
+static gboolean
+rtmp_test_send_stream_result (RTMP * r, double txn, gint stream_id)
+{
+  char pbuf[256], *pend = pbuf + sizeof (pbuf);
+  char *enc = pbuf + RTMP_MAX_HEADER_SIZE;
+
+  enc = AMF_EncodeString (enc, pend, &av__result);
+  enc = AMF_EncodeNumber (enc, pend, txn);
+  *enc++ = AMF_NULL;
+  enc = AMF_EncodeNumber (enc, pend, stream_id);
+  return rtmp_test_send_invoke (r, pbuf, enc, 0);
+}
+
+static gboolean
+rtmp_test_send_status (RTMP * r, const gchar * code, gint stream_id)
+{
+  char pbuf[512], *pend = pbuf + sizeof (pbuf);
+  char *enc = pbuf + RTMP_MAX_HEADER_SIZE;
+
+  enc = AMF_EncodeString (enc, pend, &av_onStatus);
+  enc = AMF_EncodeNumber (enc, pend, 0.0);
+  *enc++ = AMF_NULL;
+  enc = rtmp_test_encode_status (enc, pend, code);
+  return rtmp_test_send_invoke (r, pbuf, enc, stream_id);
+}
+
+/* Send the FLV tags as fast as the socket takes them */
+static gboolean
+rtmp_test_send_flv (RTMP * r, const guint8 * data, gsize size)
+{
+  const guint8 *end = data + size;
+
+  if (size >= 13 && data[0] == 'F' && data[1] == 'L' && data[2] == 'V')
+    data += 13;
+
+  while (end - data >= 15) {
+    RTMPPacket packet = { 0 };
+    guint32 len = AMF_DecodeInt24 ((const char *) data + 1);
+    gboolean ret;
+
+    if (data + 11 + len + 4 > end)
+      break;
+    if (!RTMPPacket_Alloc (&packet, len))
+      return FALSE;
+    memcpy (packet.m_body, data + 11, len);
+    packet.m_packetType = data[0];
+    packet.m_nChannel = data[0] == RTMP_PACKET_TYPE_VIDEO ? 0x06 :
+        data[0] == RTMP_PACKET_TYPE_AUDIO ? 0x04 : 0x05;
+    packet.m_nTimeStamp = AMF_DecodeInt24 ((const char *) data + 4) |
+        (data[7] << 24);
+    packet.m_headerType = packet.m_nTimeStamp ? RTMP_PACKET_SIZE_MEDIUM :
+        RTMP_PACKET_SIZE_LARGE;
+    packet.m_nInfoField2 = 1;
+    packet.m_nBodySize = len;
+    ret = RTMP_SendPacket (r, &packet, FALSE);
+    RTMPPacket_Free (&packet);
+    if (!ret)
+      return FALSE;
+    data += 11 + len + 4;
+  }
+  return TRUE;
+}
+
+/* Offset of the first tag at or after ts ms, size if there is none */
+static gsize
+rtmp_test_flv_find (const guint8 * data, gsize size, guint32 ts)
+{
+  gsize pos = 0;
+
+  if (size >= 13 && data[0] == 'F' && data[1] == 'L' && data[2] == 'V')
+    pos = 13;
+  while (pos + 15 <= size) {
+    if ((guint32) (AMF_DecodeInt24 ((const char *) data + pos + 4) |
+            (data[pos + 7] << 24)) >= ts)
+      return pos;
+    pos += 11 + AMF_DecodeInt24 ((const char *) data + pos + 1) + 4;
+  }
+  return size;
+}
+
+static gboolean
+rtmp_test_session_play (RTMPTestSession * session, RTMP * r)
+{
+  RTMPTestServer *server = session->server;
+  guint8 *flv;
+  gsize size;
+  gboolean seekable, ret;
+
+  g_mutex_lock (server->lock);
+  flv = g_memdup (server->flv, server->flv_size);
+  size = server->flv_size;
+  seekable = server->seekable;
+  server->stats.plays++;
+  g_cond_broadcast (server->cond);
+  g_mutex_unlock (server->lock);
+
+  ret = RTMP_SendCtrl (r, 0, 1, 0) &&
+      rtmp_test_send_status (r, "NetStream.Play.Start", 1);
+  if (seekable) {
+    /* the rest once the player seeked */
+    session->flv = flv;
+    session->flv_size = size;
+    return ret && rtmp_test_send_flv (r, flv,
+        rtmp_test_flv_find (flv, size, 1000));
+  }
+  ret = ret && rtmp_test_send_flv (r, flv, size) &&
+      RTMP_SendCtrl (r, 1, 1, 0) &&
+      rtmp_test_send_status (r, "NetStream.Play.Complete", 1);
+  g_free (flv);
+  return ret;
+}
+
+/* args is past the transaction id: null, then the position in ms */
+static gboolean
+rtmp_test_session_seek (RTMPTestSession * session, RTMP * r,
+    AMFCursor * args)
+{
+  AMFValue position;
+  guint32 from = 0;
+  gsize pos;
+  gboolean ret;
+
+  /* a second early, the player has to drop what it did not ask for */
+  if (AMFCursor_Get (args, 1, &position) &&
+      position.v_type == AMF_NUMBER && position.v_number >= 1000)
+    from = ((guint32) position.v_number / 1000 - 1) * 1000;
+  pos = rtmp_test_flv_find (session->flv, session->flv_size, from);
+
+  ret = rtmp_test_send_status (r, "NetStream.Seek.Notify", 1) &&
+      rtmp_test_send_flv (r, session->flv + pos, session->flv_size - pos) &&
+      RTMP_SendCtrl (r, 1, 1, 0) &&
+      rtmp_test_send_status (r, "NetStream.Play.Complete", 1);
+  g_free (session->flv);
+  session->flv = NULL;
+  return ret;
+}
+
+static gboolean
+rtmp_test_session_invoke (RTMPTestSession * session, RTMP * r,
+    RTMPPacket * packet)
+{
+  RTMPTestServer *server = session->server;
+  AMFCursor args;
+  AMFValue method, txn;
+
+  AMFCursor_Init (&args, packet->m_body, packet->m_nBodySize);
+  if (!AMFCursor_Next (&args, &method) || method.v_type != AMF_STRING ||
+      !AMFCursor_Next (&args, &txn))
+    return TRUE;
+
+  if (AVMATCH (&method.v_aval, &av_connect)) {
+    return RTMP_SendServerBW (r) && RTMP_SendChunkSize (r, SERVER_CHUNK_SIZE)
+        && rtmp_test_send_connect_result (r, txn.v_number);
+  } else if (AVMATCH (&method.v_aval, &av_createStream)) {
+    /* one connection may carry several streams */
+    return rtmp_test_send_stream_result (r, txn.v_number, ++session->streams);
+  } else if (AVMATCH (&method.v_aval, &av_publish)) {
+    g_mutex_lock (server->lock);
+    server->stats.publishes++;
+    g_cond_broadcast (server->cond);
+    g_mutex_unlock (server->lock);
+    return rtmp_test_send_status (r, "NetStream.Publish.Start",
+        packet->m_nInfoField2);
+  } else if (AVMATCH (&method.v_aval, &av_play)) {
+    return rtmp_test_session_play (session, r);
+  } else if (AVMATCH (&method.v_aval, &av_seek) && session->flv) {
+    return rtmp_test_session_seek (session, r, &args);
+  }
+  /* releaseStream, FCPublish, deleteStream and the like need no answer */
+  return TRUE;
+}
+
+/* with the lock, fold new pool misses into the totals */
+static void
+rtmp_test_session_count_allocs (RTMPTestSession * session, RTMP * r)
+{
+  RTMPPoolStats pool;
+
+  RTMP_GetPoolStats (r, &pool);
+  session->server->stats.allocs += pool.ps_allocs - pool.ps_hits -
+      session->misses;
+  session->misses = pool.ps_allocs - pool.ps_hits;
+}
+
+static gpointer
+rtmp_test_session_loop (RTMPTestSession * session)
+{
+  RTMPTestServer *server = session->server;
+  RTMPPacket packet = { 0 };
+  RTMP *r;
+
+  r = RTMP_Alloc ();
+  RTMP_Init (r);
+  r->m_sb.sb_socket = session->fd;
+  if (server->tls && !RTMP_TLS_Accept (r, server->tls))
+    goto done;
+  if (!RTMP_Serve (r))
+    goto done;
+
+  g_mutex_lock (server->lock);
+  server->stats.sessions++;
+  g_mutex_unlock (server->lock);
+
+  while (RTMP_IsConnected (r) && RTMP_ReadPacket (r, &packet)) {
+    gboolean ok = TRUE;
+
+    if (!RTMPPacket_IsReady (&packet))
+      continue;
+
+    switch (packet.m_packetType) {
+      case RTMP_PACKET_TYPE_AUDIO:
+      case RTMP_PACKET_TYPE_VIDEO:
+      case RTMP_PACKET_TYPE_INFO:
+        g_mutex_lock (server->lock);
+        server->stats.tags++;
+        server->stats.bytes += packet.m_nBodySize;
+        if (packet.m_packetType == RTMP_PACKET_TYPE_VIDEO &&
+            packet.m_nBodySize >= 2 && (packet.m_body[0] & 0x0f) == 7 &&
+            packet.m_body[1] == 0) {
+          server->stats.configs++;
+          server->stats.config_size = packet.m_nBodySize;
+        }
+        rtmp_test_session_count_allocs (session, r);
+        g_cond_broadcast (server->cond);
+        g_mutex_unlock (server->lock);
+        break;
+      case RTMP_PACKET_TYPE_INVOKE:
+        ok = rtmp_test_session_invoke (session, r, &packet);
+        break;
+      default:
+        /* chunk size, pings and acknowledgements are handled the same on
+         * either side */
+        RTMP_ClientPacket (r, &packet);
+        break;
+    }
+    RTMPPacket_Free (&packet);
+    if (!ok)
+      break;
+  }
+
+done:
+  g_mutex_lock (server->lock);
+  rtmp_test_session_count_allocs (session, r);
+  session->done = TRUE;
+  g_mutex_unlock (server->lock);
+
+  RTMP_Close (r);
+  RTMP_Free (r);
+  g_free (session->flv);
+  session->flv = NULL;
+  return NULL;
+}
+
+static gpointer
+rtmp_test_server_loop (RTMPTestServer * server)
+{
+  RTMPTestSession *session;
+  gint fd;
+
+  for (;;) {
+    fd = accept (server->fd, NULL, NULL);
+    if (fd < 0 && errno == EINTR)
+      continue;
+    if (fd < 0)
+      break;
+
+    g_mutex_lock (server->lock);
+    if (server->stop) {
+      g_mutex_unlock (server->lock);
+      close (fd);
+      break;
+    }
+    session = g_new0 (RTMPTestSession, 1);
+    session->server = server;
+    session->fd = fd;
+    session->thread = g_thread_create ((GThreadFunc) rtmp_test_session_loop,
+        session, TRUE, NULL);
+    if (session->thread) {
+      server->sessions = g_list_prepend (server->sessions, session);
+    } else {
+      close (fd);
+      g_free (session);
+    }
+    g_mutex_unlock (server->lock);
+  }
+  return NULL;
+}
+
+RTMPTestServer *
+rtmp_test_server_new (const gchar * cert, const gchar * key)
+{
+  RTMPTestServer *server;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof (addr);
+  gint on = 1;
+
+  server = g_new0 (RTMPTestServer, 1);
+  server->fd = -1;
+  if (cert) {
+    server->tls = RTMP_TLS_AllocServerContext (cert, key);
+    if (!server->tls)
+      goto error;
+  }
+
+  server->fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (server->fd < 0)
+    goto error;
+  setsockopt (server->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if (bind (server->fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+      listen (server->fd, 8) < 0 ||
+      getsockname (server->fd, (struct sockaddr *) &addr, &len) < 0)
+    goto error;
+  server->port = ntohs (addr.sin_port);
+
+  server->lock = g_mutex_new ();
+  server->cond = g_cond_new ();
+  server->thread = g_thread_create ((GThreadFunc) rtmp_test_server_loop,
+      server, TRUE, NULL);
+  if (!server->thread) {
+    g_cond_free (server->cond);
+    g_mutex_free (server->lock);
+    goto error;
+  }
+  return server;
+
+error:
+  if (server->fd >= 0)
+    close (server->fd);
+  if (server->tls)
+    RTMP_TLS_FreeServerContext (server->tls);
+  g_free (server);
+  return NULL;
+}
+
+void
+rtmp_test_server_free (RTMPTestServer * server)
+{
+  GList *item;
+
+  g_mutex_lock (server->lock);
+  server->stop = TRUE;
+  g_mutex_unlock (server->lock);
+  /* wakes up accept () */
+  shutdown (server->fd, SHUT_RDWR);
+  g_thread_join (server->thread);
+  close (server->fd);
+
+  rtmp_test_server_drop (server);
+  for (item = server->sessions; item; item = item->next) {
+    RTMPTestSession *session = item->data;
+
+    g_thread_join (session->thread);
+    g_free (session);
+  }
+  g_list_free (server->sessions);
+
+  if (server->tls)
+    RTMP_TLS_FreeServerContext (server->tls);
+  g_cond_free (server->cond);
+  g_mutex_free (server->lock);
+  g_free (server->flv);
+  g_free (server);
+}
+
+gchar *
+rtmp_test_server_get_uri (RTMPTestServer * server, const gchar * path)
+{
+  return g_strdup_printf ("%s://127.0.0.1:%d/%s", server->tls ? "rtmps" :
+      "rtmp", server->port, path);
+}
+
+void
+rtmp_test_server_set_flv (RTMPTestServer * server, const guint8 * data,
+    gsize size)
+{
+  g_mutex_lock (server->lock);
+  g_free (server->flv);
+  server->flv = g_memdup (data, size);
+  server->flv_size = size;
+  g_mutex_unlock (server->lock);
+}
+
+void
+rtmp_test_server_set_seekable (RTMPTestServer * server, gboolean seekable)
+{
+  g_mutex_lock (server->lock);
+  server->seekable = seekable;
+  g_mutex_unlock (server->lock);
+}
+
+void
+rtmp_test_server_get_stats (RTMPTestServer * server,
+    RTMPTestServerStats * stats)
+{
+  g_mutex_lock (server->lock);
+  *stats = server->stats;
+  g_mutex_unlock (server->lock);
+}
+
+gboolean
+rtmp_test_server_wait_tags (RTMPTestServer * server, guint64 tags,
+    GstClockTime timeout)
+{
+  GTimeVal deadline;
+  gboolean ret = TRUE;
+
+  g_get_current_time (&deadline);
+  g_time_val_add (&deadline, timeout / GST_USECOND);
+  g_mutex_lock (server->lock);
+  while (ret && server->stats.tags < tags)
+    ret = g_cond_timed_wait (server->cond, server->lock, &deadline);
+  ret = server->stats.tags >= tags;
+  g_mutex_unlock (server->lock);
+  return ret;
+}
+
+gboolean
+rtmp_test_server_wait_publishes (RTMPTestServer * server, guint publishes,
+    GstClockTime timeout)
+{
+  GTimeVal deadline;
+  gboolean ret = TRUE;
+
+  g_get_current_time (&deadline);
+  g_time_val_add (&deadline, timeout / GST_USECOND);
+  g_mutex_lock (server->lock);
+  while (ret && server->stats.publishes < publishes)
+    ret = g_cond_timed_wait (server->cond, server->lock, &deadline);
+  ret = server->stats.publishes >= publishes;
+  g_mutex_unlock (server->lock);
+  return ret;
+}
+
+void
+rtmp_test_server_drop (RTMPTestServer * server)
+{
+  GList *item;
+
+  g_mutex_lock (server->lock);
+  for (item = server->sessions; item; item = item->next) {
+    RTMPTestSession *session = item->data;
+
+    if (!session->done)
+      shutdown (session->fd, SHUT_RDWR);
+  }
+  g_mutex_unlock (server->lock);
+}
+
+guint8 *
+rtmp_test_make_flv (guint n, guint size, gsize * flv_size)
+{
+  static const guint8 header[13] = {
+    'F', 'L', 'V', 0x01, 0x01, 0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x00
+  };
+  guint8 *flv, *tag;
+  guint i;
+
+  g_return_val_if_fail (size > 0, NULL);
+
+  *flv_size = sizeof (header) + (gsize) n * (11 + size + 4);
+  flv = g_malloc (*flv_size);
+  memcpy (flv, header, sizeof (header));
+  tag = flv + sizeof (header);
+  for (i = 0; i < n; i++) {
+    guint32 ts = i * 1000 / 30;
+
+    tag[0] = RTMP_PACKET_TYPE_VIDEO;
+    AMF_EncodeInt24 ((char *) tag + 1, (char *) tag + 4, size);
+    AMF_EncodeInt24 ((char *) tag + 4, (char *) tag + 7, ts & 0xffffff);
+    tag[7] = ts >> 24;
+    memset (tag + 8, 0, 3);
+    /* Sorenson H.263, so no codec config is expected */
+    tag[11] = (i % 30 ? 0x20 : 0x10) | 0x02;
+    memset (tag + 12, i & 0xff, size - 1);
+    AMF_EncodeInt32 ((char *) tag + 11 + size, (char *) tag + 15 + size,
+        11 + size);
+    tag += 11 + size + 4;
+  }
+  return flv;
+}
+
+static char *
+rtmp_test_encode_index (char *enc, char *pend, const char *name,
+    guint count, guint first, guint step)
+{
+  AVal av_name = { (char *) name, strlen (name) };
+  guint i;
+
+  enc = AMF_EncodeInt16 (enc, pend, av_name.av_len);
+  memcpy (enc, av_name.av_val, av_name.av_len);
+  enc += av_name.av_len;
+  *enc++ = AMF_STRICT_ARRAY;
+  enc = AMF_EncodeInt32 (enc, pend, count);
+  for (i = 0; i < count; i++)
+    enc = AMF_EncodeNumber (enc, pend, first + (gdouble) i * step);
+  return enc;
+}
+
+guint8 *
+rtmp_test_make_flv_metadata (guint n, guint size, gboolean audio,
+    gsize * flv_size)
+{
+  static const AVal av_onMetaData = AVC ("onMetaData");
+  static const AVal av_duration = AVC ("duration");
+  static const AVal av_keyframes = AVC ("keyframes");
+  guint keyframes = (n + 29) / 30;
+  gsize video_tag = 11 + size + 4, audio_tag = audio ? 11 + AUDIO_SIZE + 4 : 0;
+  guint8 *tags, *flv, *out;
+  char *enc, *pend, *body;
+  gsize tags_size, len, alloc;
+  guint i;
+
+  tags = rtmp_test_make_flv (n, size, &tags_size);
+  alloc = 128 + keyframes * 18;
+  flv = g_malloc (13 + 11 + alloc + 4 + n * (video_tag + audio_tag));
+  memcpy (flv, tags, 13);
+  if (audio)
+    flv[4] |= 0x04;
+
+  body = (char *) flv + 13 + 11;
+  pend = body + alloc;
+  enc = AMF_EncodeString (body, pend, &av_onMetaData);
+  *enc++ = AMF_OBJECT;
+  enc = AMF_EncodeNamedNumber (enc, pend, &av_duration, n / 30.0);
+  enc = AMF_EncodeInt16 (enc, pend, av_keyframes.av_len);
+  memcpy (enc, av_keyframes.av_val, av_keyframes.av_len);
+  enc += av_keyframes.av_len;
+  *enc++ = AMF_OBJECT;
+  /* a keyframe every second, the data tag itself is left out */
+  enc = rtmp_test_encode_index (enc, pend, "times", keyframes, 0, 1);
+  enc = rtmp_test_encode_index (enc, pend, "filepositions", keyframes,
+      13, 30 * (video_tag + audio_tag));
+  enc = AMF_EncodeInt24 (enc, pend, AMF_OBJECT_END);
+  enc = AMF_EncodeInt24 (enc, pend, AMF_OBJECT_END);
+  len = enc - body;
+
+  flv[13] = RTMP_PACKET_TYPE_INFO;
+  AMF_EncodeInt24 ((char *) flv + 14, (char *) flv + 17, len);
+  memset (flv + 17, 0, 7);
+  AMF_EncodeInt32 (enc, enc + 4, 11 + len);
+
+  out = (guint8 *) enc + 4;
+  for (i = 0; i < n; i++) {
+    memcpy (out, tags + 13 + i * video_tag, video_tag);
+    if (audio) {
+      guint8 *tag = out + video_tag;
+
+      /* MP3 at the timestamp of the video tag, no codec config */
+      memcpy (tag, out, 11);
+      tag[0] = RTMP_PACKET_TYPE_AUDIO;
+      AMF_EncodeInt24 ((char *) tag + 1, (char *) tag + 4, AUDIO_SIZE);
+      tag[11] = 0x2f;
+      memset (tag + 12, i & 0xff, AUDIO_SIZE - 1);
+      AMF_EncodeInt32 ((char *) tag + 11 + AUDIO_SIZE, (char *) tag +
+          audio_tag, 11 + AUDIO_SIZE);
+    }
+    out += video_tag + audio_tag;
+  }
+  *flv_size = out - flv;
+  g_free (tags);
+  return flv;
+}
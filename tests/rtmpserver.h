@@ -0,0 +1,85 @@
+/* GStreamer rtmp unit test helpers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __RTMP_TEST_SERVER_H__
+#define __RTMP_TEST_SERVER_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct _RTMPTestServer RTMPTestServer;
+
+/* what the server saw, over all sessions */
+typedef struct {
+  guint sessions;		/* accepted and handshaked */
+  guint publishes;		/* publish calls answered */
+  guint plays;			/* play calls answered */
+  guint64 tags;			/* media and data messages received */
+  guint64 bytes;		/* their payload */
+  guint64 allocs;		/* pool misses of the receiving side */
+  guint configs;		/* AVC sequence headers among the tags */
+  guint32 config_size;		/* body size of the last one */
+} RTMPTestServerStats;
+
+/* In-process RTMP server on 127.0.0.1, built on librtmp's RTMP_Serve().
+ * Publishers are accepted and their tags counted; players are sent the
+ * FLV set with rtmp_test_server_set_flv () as fast as the socket takes
+ * it. With cert and key it speaks rtmps, which needs librtmp built with
+ * crypto; NULL is returned if that is not available. */
+RTMPTestServer *rtmp_test_server_new (const gchar * cert, const gchar * key);
+void rtmp_test_server_free (RTMPTestServer * server);
+
+/* a location for the elements, path is app/playpath */
+gchar *rtmp_test_server_get_uri (RTMPTestServer * server, const gchar * path);
+
+/* FLV data, with or without the file header, served to players */
+void rtmp_test_server_set_flv (RTMPTestServer * server, const guint8 * data,
+    gsize size);
+
+/* Players only get the first second of the FLV, the rest follows their
+ * seek. It resumes a keyframe before the one asked for, like servers
+ * whose index is coarser than the file's */
+void rtmp_test_server_set_seekable (RTMPTestServer * server,
+    gboolean seekable);
+
+void rtmp_test_server_get_stats (RTMPTestServer * server,
+    RTMPTestServerStats * stats);
+
+/* wait until tags have been received in total, FALSE on timeout */
+gboolean rtmp_test_server_wait_tags (RTMPTestServer * server, guint64 tags,
+    GstClockTime timeout);
+gboolean rtmp_test_server_wait_publishes (RTMPTestServer * server,
+    guint publishes, GstClockTime timeout);
+
+/* cut every open session, like a server restart */
+void rtmp_test_server_drop (RTMPTestServer * server);
+
+/* a synthetic FLV file of n video tags of size bytes each, one keyframe
+ * every 30 tags at 30 fps */
+guint8 *rtmp_test_make_flv (guint n, guint size, gsize * flv_size);
+
+/* the same, led by an onMetaData tag with the duration and the index of
+ * those keyframes. With audio an MP3 tag follows each video tag, at the
+ * same timestamp */
+guint8 *rtmp_test_make_flv_metadata (guint n, guint size, gboolean audio,
+    gsize * flv_size);
+
+G_END_DECLS
+
+#endif /* __RTMP_TEST_SERVER_H__ */